@@ -0,0 +1,281 @@
+#ifndef PNP_ACCRUAL_DETECTOR
+#define PNP_ACCRUAL_DETECTOR "Pick-n-Pack Accrual Failure Detector"
+
+//  The accrual detector tells how suspicious the silence of a resource is,
+//  rather than whether it missed a fixed number of heartbeats. It learns how
+//  late the heartbeats of the resource come, i.e. the mean and deviation of
+//  the times between them, and how many get lost. Its suspicion (phi) after
+//  a silence is -log10 of the chance that the resource is still alive, i.e.
+//  that the heartbeats since were lost and the next one is just late. So a
+//  resource expires early on a steady link and late on a jittery or lossy
+//  one, once its suspicion reaches a threshold.
+//
+//  A resource whose frontend sends steady heartbeats may send its own less
+//  often: its backoff doubles the interval, up to ACCRUAL_BACKOFF times the
+//  interval of its type, and falls back at once when they are no longer
+//  steady. Heartbeats then carry an INTERVAL frame, so the detector of the
+//  frontend expects the new interval right away.
+//
+//  Any message proves the sender is alive, so a link that carries messages
+//  needs no heartbeats. Senders leave out those due within half an interval of
+//  another message, see s_suppress_due, so the link is never silent for more
+//  than one and a half intervals, which the detector allows for with a lost
+//  heartbeat to spare. Heartbeats with news go out anyway, and one at least
+//  every ACCRUAL_SUPPRESS_MAX intervals, so round-trip times and clock offsets
+//  keep coming. The detector learns the times between heartbeats only from
+//  idle stretches, and takes no gap after other messages for lost heartbeats.
+//
+//  Interval frame: PNP_INTERVAL, INTERVAL (uint32, msecs)
+
+#include <math.h>
+#include "protocol.h"
+
+#define ACCRUAL_WEIGHT      16      //  Mean and deviation weigh a new heartbeat 1/16
+//  A lost heartbeat costs 3 of suspicion until we learned better, so a threshold of 8 allows
+//  for two in a row, as a fixed liveness of 3 does. A stronger prior expires live resources
+//  after a double loss, a weaker one learns the bursts of a jittery link as losses.
+#define ACCRUAL_LOSS        1       //  Heartbeats lost out of ACCRUAL_LOSS_PRIOR
+#define ACCRUAL_LOSS_PRIOR  1000
+#define ACCRUAL_LOSS_WINDOW 65536   //  Heartbeats after which a loss is forgotten, by 1/e
+#define ACCRUAL_MIN_LOSS    1e-6
+#define ACCRUAL_MIN_DEVIATION 50    //  msecs, so a steady link does not expire on the least delay
+#define ACCRUAL_CALM        1.0     //  Suspicion below which the frontend counts as steady
+#define ACCRUAL_JITTER      0.1     //  Deviation, relative to the mean, of a steady link
+#define ACCRUAL_STEADY      10      //  Steady heartbeats before the interval backs off
+#define ACCRUAL_BACKOFF     2       //  Backoff of the interval at most
+#define ACCRUAL_FRAME       (1 + sizeof (uint32_t))
+#define ACCRUAL_SUPPRESS_MAX 10     //  Intervals a busy link goes without a heartbeat at most
+
+typedef struct {
+    int64_t heard;              //  Last sign of life, msecs
+    int64_t before;             //  The sign of life before that, msecs
+    int64_t beat;               //  Last heartbeat, msecs, 0 if none yet
+    double mean;                //  Time between heartbeats, not counting lost ones, msecs
+    double variance;
+    double lost;                //  Heartbeats lost, decayed over ACCRUAL_LOSS_WINDOW
+    double sent;                //  Heartbeats sent, likewise
+    size_t interval;            //  Heartbeat interval of the resource, msecs
+} accrual_t;
+
+typedef struct {
+    size_t base;                //  Heartbeat interval of our type, msecs
+    size_t interval;            //  Current heartbeat interval, msecs
+    size_t steady;              //  Steady heartbeats since the interval last changed
+} backoff_t;
+
+typedef struct {
+    int64_t sent;               //  Last message on the link, msecs
+    int64_t beat;               //  Last heartbeat on it, msecs
+    int reported;               //  What that heartbeat reported, e.g. state and signal
+    size_t beats;               //  Heartbeats sent
+    size_t suppressed;          //  Heartbeats left out
+} suppress_t;
+
+//  Start detecting a resource with heartbeats every <interval> msecs, heard of at <now>
+static void
+s_accrual_init (accrual_t *self, size_t interval, int64_t now)
+{
+    self->heard = now;
+    self->before = now;
+    self->beat = 0;
+    self->mean = (double) interval;
+    self->variance = (interval / 4.0) * (interval / 4.0);
+    self->lost = ACCRUAL_LOSS;
+    self->sent = ACCRUAL_LOSS_PRIOR;
+    self->interval = interval;
+}
+
+//  The alive method records a sign of life other than a heartbeat at <now>
+static void
+s_accrual_alive (accrual_t *self, int64_t now)
+{
+    if (now > self->heard) {
+        self->before = self->heard;
+        self->heard = now;
+    }
+}
+
+//  The heartbeat method records a heartbeat at <now>. <interval> is the interval the
+//  resource announced with it, or 0 if it did not. Heartbeats missing in between count
+//  as lost, the time between heartbeats is taken without them. After other signs of life
+//  since the last heartbeat, the resource left out the heartbeats in between, so the gap
+//  tells nothing.
+static void
+s_accrual_heartbeat (accrual_t *self, int64_t now, size_t interval)
+{
+    int64_t other = self->heard < now? self->heard: self->before;
+    if (self->beat && other <= self->beat) {
+        double gap = (double) (now - self->beat);
+        size_t lost = gap > 1.5 * self->interval? (size_t) (gap / self->interval - 0.5): 0;
+        double decay = 1 - (double) (lost + 1) / ACCRUAL_LOSS_WINDOW;
+        self->lost = self->lost * decay + lost;
+        self->sent = self->sent * decay + lost + 1;
+        double delta = gap - (double) (lost * self->interval) - self->mean;
+        self->mean += delta / ACCRUAL_WEIGHT;
+        self->variance = (self->variance + delta * delta / ACCRUAL_WEIGHT) * (ACCRUAL_WEIGHT - 1) / ACCRUAL_WEIGHT;
+    }
+    self->beat = now;
+    s_accrual_alive (self, now);
+    if (interval && interval != self->interval) {
+        //  Heartbeats come at the new interval from now on
+        self->mean = (double) interval;
+        self->interval = interval;
+    }
+}
+
+//  Returns -log10 of the chance a heartbeat is lost
+static double
+s_accrual_lost_phi (accrual_t *self)
+{
+    double loss = self->lost / self->sent;
+    return -log10 (loss > ACCRUAL_MIN_LOSS? loss: ACCRUAL_MIN_LOSS);
+}
+
+static double
+s_accrual_deviation (accrual_t *self)
+{
+    double deviation = sqrt (self->variance);
+    return deviation > ACCRUAL_MIN_DEVIATION? deviation: ACCRUAL_MIN_DEVIATION;
+}
+
+//  Returns -log10 of the chance that a heartbeat is more than <y> deviations late. The
+//  tail of the normal distribution is taken in its logistic approximation.
+static double
+s_accrual_tail_phi (double y)
+{
+    double e = exp (-y * (1.5976 + 0.070566 * y * y));
+    double tail = y > 0? e / (1 + e): 1 - 1 / (1 + e);
+    return tail > 1e-300? -log10 (tail): 300;
+}
+
+//  Returns the deviations a heartbeat must be late for -log10 of its chance to be <phi>
+static double
+s_accrual_tail_deviations (double phi)
+{
+    double tail = pow (10, -phi);
+    double target = log ((1 - tail) / tail);
+    double y = target / 1.5976;
+    int iteration;
+    for (iteration = 0; iteration < 8; iteration++)
+        y -= (0.070566 * y * y * y + 1.5976 * y - target) / (0.211698 * y * y + 1.5976);
+    return y;
+}
+
+//  The phi method returns the suspicion of the resource at <now>, for the likeliest
+//  number of lost heartbeats
+static double
+s_accrual_phi (accrual_t *self, int64_t now)
+{
+    double silence = (double) (now - self->heard);
+    double lost_phi = s_accrual_lost_phi (self);
+    double phi = s_accrual_tail_phi ((silence - self->mean) / s_accrual_deviation (self));
+    size_t lost;
+    for (lost = 1; lost * lost_phi < phi && lost * self->interval < silence; lost++) {
+        double late_phi = s_accrual_tail_phi ((silence - lost * self->interval - self->mean) / s_accrual_deviation (self));
+        if (lost * lost_phi + late_phi < phi)
+            phi = lost * lost_phi + late_phi;
+    }
+    return phi;
+}
+
+//  The expiry method returns the time, msecs, at which the suspicion of the resource
+//  reaches <threshold>. A negative <threshold> stands for a fixed liveness, i.e. the
+//  resource expires once it missed <liveness> heartbeats.
+static int64_t
+s_accrual_expiry (accrual_t *self, double threshold, size_t liveness)
+{
+    if (threshold < 0)
+        return self->heard + (int64_t) (self->interval * liveness);
+    //  The resource expires once no number of lost heartbeats explains the silence
+    double lost_phi = s_accrual_lost_phi (self);
+    double silence = 0;
+    size_t lost;
+    for (lost = 0; lost * lost_phi < threshold; lost++) {
+        double late = lost * self->interval + self->mean
+                    + s_accrual_tail_deviations (threshold - lost * lost_phi) * s_accrual_deviation (self);
+        if (late > silence)
+            silence = late;
+    }
+    return self->heard + (int64_t) silence;
+}
+
+static void
+s_backoff_init (backoff_t *self, size_t interval)
+{
+    self->base = interval;
+    self->interval = interval;
+    self->steady = 0;
+}
+
+//  The next method returns the interval, msecs, to our next heartbeat. It backs off
+//  while heartbeats from our frontend, in <upstream>, come in steady at <now>.
+static size_t
+s_backoff_next (backoff_t *self, accrual_t *upstream, int64_t now)
+{
+    if (upstream->beat && s_accrual_phi (upstream, now) < ACCRUAL_CALM
+    &&  sqrt (upstream->variance) < upstream->mean * ACCRUAL_JITTER) {
+        if (++self->steady >= ACCRUAL_STEADY && self->interval < self->base * ACCRUAL_BACKOFF) {
+            self->interval = self->interval * 2 < self->base * ACCRUAL_BACKOFF?
+                             self->interval * 2: self->base * ACCRUAL_BACKOFF;
+            self->steady = 0;
+        }
+    }
+    else {
+        self->interval = self->base;
+        self->steady = 0;
+    }
+    return self->interval;
+}
+
+//  The sent method records a message on the link at <now>
+static void
+s_suppress_sent (suppress_t *self, int64_t now)
+{
+    self->sent = now;
+}
+
+//  The due method tells whether the heartbeat due at <now> on a link with heartbeats every
+//  <interval> msecs must go out, and counts it as sent or left out. It must unless other
+//  messages went out since the last one and within half the interval, and also if it
+//  carries news, i.e. if <urgent> or if what it reports, <reported>, changed, or if the last
+//  one went out ACCRUAL_SUPPRESS_MAX intervals ago.
+static int
+s_suppress_due (suppress_t *self, int64_t now, size_t interval, int reported, int urgent)
+{
+    if (!urgent && reported == self->reported && self->beat
+    &&  self->sent > self->beat && self->sent > now - (int64_t) interval / 2
+    &&  now - self->beat < (int64_t) (interval * ACCRUAL_SUPPRESS_MAX)) {
+        self->suppressed++;
+        return 0;
+    }
+    self->sent = now;
+    self->beat = now;
+    self->reported = reported;
+    self->beats++;
+    return 1;
+}
+
+//  The interval frame method returns the INTERVAL frame announcing <interval>
+static zframe_t *
+s_interval_frame (size_t interval)
+{
+    zframe_t *frame = zframe_new (NULL, ACCRUAL_FRAME);
+    zframe_data (frame) [0] = (byte) PNP_INTERVAL [0];
+    uint32_t msecs = (uint32_t) interval;
+    memcpy (zframe_data (frame) + 1, &msecs, sizeof (msecs));
+    return frame;
+}
+
+//  The interval decode method returns the interval announced in <frame>, or 0 if
+//  there is no valid INTERVAL frame
+static size_t
+s_interval_decode (zframe_t *frame)
+{
+    if (!frame || zframe_size (frame) != ACCRUAL_FRAME)
+        return 0;
+    uint32_t msecs;
+    memcpy (&msecs, zframe_data (frame) + 1, sizeof (msecs));
+    return msecs;
+}
+
+#endif
@@ -0,0 +1,227 @@
+#ifndef PNP_AFFINITY_PROFILE
+#define PNP_AFFINITY_PROFILE "Pick-n-Pack Thread Placement Profiles"
+
+//  A placement profile pins the threads of a resource to CPU sets, so the
+//  actor that runs its state machine and the ZeroMQ I/O threads that move its
+//  messages keep their cores and caches when other processes on the same
+//  controller get busy. A profile sets a CPU set per role of thread and the
+//  number of ZeroMQ I/O threads; roles without a CPU set run wherever the
+//  process may. Profiles come from AFFINITY_CONFIG, by resource name, or else
+//  the default profile; there is no pinning without one:
+//
+//  affinity
+//      default
+//          io_threads = 1
+//      qas
+//          name = QAS 1            #   Resource name, the section name if not given
+//          main = 0                #   CPU sets: lists and ranges, e.g. 0-3, 6
+//          actor = 2               #   Thread of resource_actor
+//          watchdog = 3            #   Watchdog thread, see watchdog.h
+//          workers = 4-7           #   QAS pool workers, see qas.h
+//          io = 1                  #   ZeroMQ I/O threads
+//          io_threads = 1
+//
+//  Threads inherit the CPU set of the thread that creates them, so main pins
+//  itself only once the actor and the I/O threads exist. At shutdown the
+//  report lists the CPU time and context switches of every thread; many
+//  involuntary switches mean a thread shares its cores with a busy neighbour.
+//  Placement uses Linux thread affinity and /proc, so builds define _GNU_SOURCE.
+
+#include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
+
+#define AFFINITY_CONFIG     "pnp-affinity.cfg"  //  TODO: this should be configured
+#define AFFINITY_IO_THREADS_MAX 16
+
+//  Roles of threads
+#define AFFINITY_MAIN       0
+#define AFFINITY_ACTOR      1
+#define AFFINITY_WATCHDOG   2
+#define AFFINITY_WORKERS    3
+#define AFFINITY_IO         4
+#define AFFINITY_ROLES      5
+
+static const char *s_affinity_roles [AFFINITY_ROLES] = {
+    "main", "actor", "watchdog", "workers", "io"
+};
+
+typedef struct {
+    cpu_set_t cpus [AFFINITY_ROLES];    //  CPU set per role of thread
+    int pinned [AFFINITY_ROLES];        //  1 if the role has a CPU set
+    size_t io_threads;                  //  ZeroMQ I/O threads, 0 for the default
+} affinity_t;
+
+//  Profile of this process, loaded once by main before it starts the actor
+static affinity_t s_affinity;
+
+//  Parses a list of CPUs and ranges, e.g. "0-3, 6", into <set>. Returns the
+//  number of CPUs, or -1 if the list is malformed.
+static int
+s_affinity_parse (cpu_set_t *set, const char *cpus)
+{
+    CPU_ZERO (set);
+    char *next = (char *) cpus;
+    while (*next) {
+        char *end;
+        long first = strtol (next, &end, 10);
+        long last = first;
+        if (end == next || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        next = end;
+        if (*next == '-') {
+            last = strtol (next + 1, &end, 10);
+            if (end == next + 1 || last < first || last >= CPU_SETSIZE)
+                return -1;
+            next = end;
+        }
+        for (; first <= last; first++)
+            CPU_SET ((int) first, set);
+        while (*next == ' ' || *next == ',')
+            next++;
+    }
+    return CPU_COUNT (set)? CPU_COUNT (set): -1;
+}
+
+//  Loads the profile of resource <name> from <filename>, or the default profile,
+//  and applies its I/O settings. Call it before the first socket is created, as
+//  the I/O threads start with it. Returns 1 if a profile was loaded, 0 if there
+//  is none, or -1 if the file or the profile is malformed.
+static int
+s_affinity_load (const char *filename, const char *name)
+{
+    memset (&s_affinity, 0, sizeof (s_affinity));
+    if (!zsys_file_exists (filename))
+        return 0;
+    zconfig_t *root = zconfig_load (filename);
+    if (!root) {
+        printf ("E: cannot load placement profiles from %s\n", filename);
+        return -1;
+    }
+    zconfig_t *profile = NULL;
+    zconfig_t *section = zconfig_locate (root, "affinity");
+    zconfig_t *entry = section? zconfig_child (section): NULL;
+    for (; entry && !profile; entry = zconfig_next (entry))
+        if (streq (zconfig_get (entry, "name", zconfig_name (entry)), name))
+            profile = entry;
+    if (!profile && section)
+        profile = zconfig_locate (section, "default");
+    if (!profile) {
+        zconfig_destroy (&root);
+        return 0;
+    }
+    int rc = 1;
+    int role;
+    for (role = 0; role < AFFINITY_ROLES; role++) {
+        const char *cpus = zconfig_get (profile, s_affinity_roles [role], NULL);
+        if (!cpus)
+            continue;
+        if (s_affinity_parse (&s_affinity.cpus [role], cpus) == -1) {
+            printf ("E: %s CPUs of %s in %s are not valid\n", s_affinity_roles [role], name, filename);
+            rc = -1;
+            continue;
+        }
+        s_affinity.pinned [role] = 1;
+    }
+    long io_threads = atol (zconfig_get (profile, "io_threads", "0"));
+    if (io_threads > 0 && io_threads <= AFFINITY_IO_THREADS_MAX)
+        s_affinity.io_threads = (size_t) io_threads;
+
+    if (s_affinity.io_threads)
+        zsys_set_io_threads (s_affinity.io_threads);
+    if (s_affinity.pinned [AFFINITY_IO]) {
+        int cpu;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+            if (CPU_ISSET (cpu, &s_affinity.cpus [AFFINITY_IO]))
+                zsys_thread_affinity_cpu_add (cpu);
+    }
+    printf ("I: [%s] placement profile %s from %s\n", name, zconfig_name (profile), filename);
+    zconfig_destroy (&root);
+    return rc;
+}
+
+//  The pin method names the calling thread after its <role>, for the report,
+//  and pins it to the CPU set of that role, if the profile has one
+static void
+s_affinity_pin (int role)
+{
+    char name [16];
+    snprintf (name, sizeof (name), "pnp-%s", s_affinity_roles [role]);
+    pthread_setname_np (pthread_self (), name);
+    if (s_affinity.pinned [role]
+    &&  pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &s_affinity.cpus [role]))
+        printf ("W: cannot pin %s thread, running unpinned\n", s_affinity_roles [role]);
+}
+
+//  Returns the value of <key> in the /proc status file <status>, or 0
+static long
+s_affinity_status (const char *status, const char *key)
+{
+    const char *line = strstr (status, key);
+    return line? atol (line + strlen (key)): 0;
+}
+
+//  The report method prints the CPU time, last CPU and context switches of every
+//  thread of the process
+static void
+s_affinity_report (const char *name)
+{
+    DIR *tasks = opendir ("/proc/self/task");
+    if (!tasks)
+        return;
+    long ticks = sysconf (_SC_CLK_TCK);
+    printf ("I: [%s] %-16s %8s %4s %10s %10s %10s %10s\n", name,
+            "thread", "tid", "cpu", "user ms", "system ms", "voluntary", "involunt.");
+    struct dirent *task;
+    while ((task = readdir (tasks))) {
+        if (task->d_name [0] == '.')
+            continue;
+        char path [320], stats [1024], status [4096];
+        snprintf (path, sizeof (path), "/proc/self/task/%s/stat", task->d_name);
+        FILE *file = fopen (path, "r");
+        size_t size = file? fread (stats, 1, sizeof (stats) - 1, file): 0;
+        if (file)
+            fclose (file);
+        stats [size] = 0;
+        snprintf (path, sizeof (path), "/proc/self/task/%s/status", task->d_name);
+        file = fopen (path, "r");
+        size = file? fread (status, 1, sizeof (status) - 1, file): 0;
+        if (file)
+            fclose (file);
+        status [size] = 0;
+
+        //  stat holds: tid (comm) state ..., utime and stime are fields 14 and 15,
+        //  the last CPU field 39; comm may hold spaces, so fields count from ')'
+        char *comm = strchr (stats, '(');
+        char *fields = strrchr (stats, ')');
+        if (!comm || !fields)
+            continue;
+        *fields++ = 0;
+        unsigned long utime = 0, stime = 0;
+        long cpu = -1;
+        int field = 2;
+        char *saved;
+        char *token = strtok_r (fields, " ", &saved);
+        for (; token; token = strtok_r (NULL, " ", &saved)) {
+            field++;
+            if (field == 14)
+                utime = strtoul (token, NULL, 10);
+            else
+            if (field == 15)
+                stime = strtoul (token, NULL, 10);
+            else
+            if (field == 39) {
+                cpu = atol (token);
+                break;
+            }
+        }
+        printf ("I: [%s] %-16s %8s %4ld %10lu %10lu %10ld %10ld\n", name,
+                comm + 1, task->d_name, cpu,
+                utime * 1000 / ticks, stime * 1000 / ticks,
+                s_affinity_status (status, "\nvoluntary_ctxt_switches:"),
+                s_affinity_status (status, "\nnonvoluntary_ctxt_switches:"));
+    }
+    closedir (tasks);
+}
+
+#endif
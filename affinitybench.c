@@ -0,0 +1,219 @@
+//  Pick-n-Pack thread placement benchmark
+//
+//  Measures the jitter a resource sees with and without a placement profile
+//  (affinity.h), while noisy neighbour threads stream through memory on every
+//  core they may use. An actor echoes pings over TCP, as a resource answers
+//  its frontend, and main sends a ping every interval; the bench reports how
+//  late main wakes up for each ping and the round-trip time, then the CPU time
+//  and context switches per thread. Each run is a process of its own, as the
+//  I/O threads are placed when the first socket is created.
+//
+//  Pinned runs keep the upper half of the cores for the resource, i.e. main,
+//  the actor and one I/O thread, and the lower half for the noise.
+//
+//  Usage: affinitybench [-n pings] [-i interval usecs] [-t noise threads]
+
+#include "czmq.h"
+#include "defs.h"
+#include <sys/wait.h>
+
+#define BENCH_PINGS     20000
+#define BENCH_INTERVAL  500         //  usecs between pings
+#define BENCH_NOISE_SIZE (32 * 1024 * 1024)
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+static atomic_int s_noise_stop;
+static cpu_set_t s_noise_cpus;
+static int s_noise_pinned;
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  A noisy neighbour writes through a buffer well beyond the caches
+static void *
+s_noise (void *args)
+{
+    (void) args;
+    pthread_setname_np (pthread_self (), "noise");
+    if (s_noise_pinned)
+        pthread_setaffinity_np (pthread_self (), sizeof (cpu_set_t), &s_noise_cpus);
+    byte *buffer = (byte *) malloc (BENCH_NOISE_SIZE);
+    size_t offset = 0;
+    while (!atomic_load (&s_noise_stop)) {
+        buffer [offset] = (byte) (buffer [offset] + 1);
+        offset = (offset + 64) % BENCH_NOISE_SIZE;
+    }
+    free (buffer);
+    return NULL;
+}
+
+//  The echo actor answers every ping, as a resource answers its frontend
+static void
+s_echo_actor (zsock_t *pipe, void *args)
+{
+    s_affinity_pin (AFFINITY_ACTOR);
+    zsock_t *dealer = zsock_new_dealer ((char *) args);
+    assert (dealer);
+    zstr_send (dealer, "HELLO");
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (dealer), 0, ZMQ_POLLIN, 0 }
+        };
+        if (zmq_poll (items, 2, -1) == -1)
+            break;
+        if (items [0].revents & ZMQ_POLLIN)
+            break;              //  $TERM
+        zmsg_t *msg = zmsg_recv (dealer);
+        if (!msg)
+            break;
+        zmsg_send (&msg, dealer);
+    }
+    zsock_destroy (&dealer);
+}
+
+static void
+s_print_latency (const char *name, int64_t *latencies, size_t count)
+{
+    qsort (latencies, count, sizeof (int64_t), s_compare_latency);
+    printf ("%-10s %10" PRId64 " %10" PRId64 " %10" PRId64 " %10" PRId64 "\n", name,
+            count? latencies [count / 2]: 0, count? latencies [count * 99 / 100]: 0,
+            count? latencies [count * 999 / 1000]: 0, count? latencies [count - 1]: 0);
+}
+
+//  The run method measures one placement, <pinned> or not, in this process
+static int
+s_run (int pinned, size_t pings, int64_t interval, size_t noise_count)
+{
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    long quiet = cores > 1? cores / 2: 0;
+    char name [64];
+    snprintf (name, sizeof (name), "%s", pinned? "pinned": "unpinned");
+    if (pinned) {
+        //  The bench goes through a profile file, as the resources do
+        char cpus [32], path [64];
+        snprintf (cpus, sizeof (cpus), "%ld-%ld", quiet, cores - 1);
+        snprintf (path, sizeof (path), "/tmp/affinitybench-%d.cfg", (int) getpid ());
+        FILE *file = fopen (path, "w");
+        assert (file);
+        fprintf (file, "affinity\n    %s\n        main = %s\n        actor = %s\n"
+                       "        io = %s\n        io_threads = 1\n", name, cpus, cpus, cpus);
+        fclose (file);
+        int rc = s_affinity_load (path, name);
+        remove (path);
+        if (rc != 1)
+            return 1;
+        s_affinity_parse (&s_noise_cpus, "0");
+        if (quiet > 1) {
+            snprintf (cpus, sizeof (cpus), "0-%ld", quiet - 1);
+            s_affinity_parse (&s_noise_cpus, cpus);
+        }
+        s_noise_pinned = 1;
+    }
+    pthread_t *noise = (pthread_t *) zmalloc (noise_count * sizeof (pthread_t));
+    size_t noise_nbr;
+    for (noise_nbr = 0; noise_nbr < noise_count; noise_nbr++)
+        pthread_create (&noise [noise_nbr], NULL, s_noise, NULL);
+
+    zsock_t *router = zsock_new (ZMQ_ROUTER);
+    int port = zsock_bind (router, "tcp://127.0.0.1:*");
+    assert (port > 0);
+    char endpoint [64];
+    snprintf (endpoint, sizeof (endpoint), ">tcp://127.0.0.1:%d", port);
+    zactor_t *actor = zactor_new (s_echo_actor, endpoint);
+    s_affinity_pin (AFFINITY_MAIN);
+    zmsg_t *hello = zmsg_recv (router);
+    zframe_t *identity = hello? zmsg_pop (hello): NULL;
+    zmsg_destroy (&hello);
+    assert (identity);
+
+    int64_t *wakeups = (int64_t *) zmalloc (pings * sizeof (int64_t));
+    int64_t *round_trips = (int64_t *) zmalloc (pings * sizeof (int64_t));
+    size_t count;
+    int64_t ping_at = zclock_usecs () + interval;
+    for (count = 0; count < pings && !zsys_interrupted; count++) {
+        int64_t now = zclock_usecs ();
+        if (ping_at > now)
+            usleep ((useconds_t) (ping_at - now));
+        now = zclock_usecs ();
+        wakeups [count] = now - ping_at;
+        zframe_t *frame = zframe_dup (identity);
+        zframe_send (&frame, router, ZFRAME_MORE);
+        zstr_send (router, "PING");
+        zmsg_t *pong = zmsg_recv (router);
+        if (!pong)
+            break;
+        zmsg_destroy (&pong);
+        round_trips [count] = zclock_usecs () - now;
+        ping_at = (ping_at > now? ping_at: now) + interval;
+    }
+    printf ("%s: %zu pings every %" PRId64 " usecs, %zu noise threads on %ld cores\n",
+            name, count, interval, noise_count, cores);
+    if (pinned && cores < 2)
+        printf ("W: one core, the resource cannot be kept apart from the noise\n");
+    printf ("%-10s %10s %10s %10s %10s\n", "usecs", "p50", "p99", "p99.9", "max");
+    s_print_latency ("wakeup", wakeups, count);
+    s_print_latency ("round trip", round_trips, count);
+    s_affinity_report (name);
+
+    atomic_store (&s_noise_stop, 1);
+    for (noise_nbr = 0; noise_nbr < noise_count; noise_nbr++)
+        pthread_join (noise [noise_nbr], NULL);
+    zactor_destroy (&actor);
+    zframe_destroy (&identity);
+    zsock_destroy (&router);
+    free (wakeups);
+    free (round_trips);
+    free (noise);
+    return 0;
+}
+
+int main (int argc, char *argv [])
+{
+    size_t pings = BENCH_PINGS;
+    int64_t interval = BENCH_INTERVAL;
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    size_t noise_count = cores > 0? (size_t) cores: 1;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            pings = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-i") && argn + 1 < argc)
+            interval = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-t") && argn + 1 < argc)
+            noise_count = atol (argv [++argn]);
+        else {
+            printf ("usage: affinitybench [-n pings] [-i interval usecs] [-t noise threads]\n");
+            return 1;
+        }
+    }
+    //  Each placement runs in a child, so both start with fresh I/O threads
+    int pinned;
+    for (pinned = 0; pinned < 2; pinned++) {
+        fflush (stdout);
+        pid_t child = fork ();
+        if (child == 0)
+            return s_run (pinned, pings, interval, noise_count);
+        int status;
+        if (child < 0 || waitpid (child, &status, 0) != child || !WIFEXITED (status) || WEXITSTATUS (status))
+            return 1;
+        printf ("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,161 @@
+#ifndef PNP_BATCH_FRAME
+#define PNP_BATCH_FRAME "Pick-n-Pack Sample Batching"
+
+//  A batch holds the samples a device produced within a time window, or up
+//  to a number of samples, packed into a single frame with an index, so each
+//  hop up to the line pays the per-message cost once per batch instead of
+//  once per sample. Tiers forward batches as they are, or unpack them into
+//  data messages for receivers that do not know batches.
+//
+//  Batch frame: COUNT (uint32), FIRST (int64 usecs, when the first sample
+//  was added), COUNT + 1 OFFSETS (uint32, relative to the data), DATA. Sample
+//  N is DATA [OFFSETS [N]] up to DATA [OFFSETS [N + 1]].
+
+#define BATCH_SAMPLES   256             //  Samples per batch at most
+#define BATCH_BYTES     (256 * 1024)    //  Sample bytes per batch at most
+#define BATCH_HEADER    (sizeof (uint32_t) + sizeof (int64_t))
+
+typedef struct {
+    size_t window;              //  msecs the first sample may wait
+    size_t samples;             //  Samples per batch at most
+    int64_t first;              //  When the first sample was added, usecs
+    uint32_t *offsets;          //  Offsets of the samples, and the end
+    size_t count;
+    byte *data;
+    size_t size;
+    size_t max;                 //  Bytes allocated for data
+} batch_t;
+
+//  Construct new batch that holds samples for up to <window> msecs or up to
+//  <samples> samples, whichever comes first
+static batch_t *
+s_batch_new (size_t window, size_t samples)
+{
+    batch_t *self = (batch_t *) zmalloc (sizeof (batch_t));
+    self->window = window;
+    self->samples = samples && samples < BATCH_SAMPLES? samples: BATCH_SAMPLES;
+    self->offsets = (uint32_t *) zmalloc ((self->samples + 1) * sizeof (uint32_t));
+    self->max = 4096;
+    self->data = (byte *) zmalloc (self->max);
+    return self;
+}
+
+static void
+s_batch_destroy (batch_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        batch_t *self = *self_p;
+        free (self->offsets);
+        free (self->data);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The add method appends a sample. Returns 1 if the batch is full and must
+//  be sent, else 0. Returns -1 and adds nothing if the sample is too large
+//  for a batch, or the batch is full; the sample must then be sent on its own.
+static int
+s_batch_add (batch_t *self, const void *data, size_t size)
+{
+    if (size > BATCH_BYTES || self->count >= self->samples)
+        return -1;
+    if (self->size + size > self->max) {
+        while (self->size + size > self->max)
+            self->max *= 2;
+        self->data = (byte *) realloc (self->data, self->max);
+        assert (self->data);
+    }
+    if (self->count == 0)
+        self->first = zclock_usecs ();
+    self->offsets [self->count++] = (uint32_t) self->size;
+    memcpy (self->data + self->size, data, size);
+    self->size += size;
+    return self->count >= self->samples || self->size >= BATCH_BYTES;
+}
+
+//  The due method returns 1 if <self> holds samples whose window has passed.
+//  Returns 0 if <self> is NULL, i.e. samples are not batched.
+static int
+s_batch_due (batch_t *self)
+{
+    return self && self->count && zclock_usecs () >= self->first + (int64_t) self->window * 1000;
+}
+
+//  The timeout method returns how many msecs a poll may wait before the batch
+//  is due, at most <timeout>
+static int64_t
+s_batch_timeout (batch_t *self, int64_t timeout)
+{
+    if (!self || !self->count)
+        return timeout;
+    int64_t due = (self->first + (int64_t) self->window * 1000 - zclock_usecs () + 999) / 1000;
+    return due < 0? 0: due < timeout? due: timeout;
+}
+
+//  The encode method returns the batch frame of all samples added and
+//  empties the batch, or returns NULL if it is empty
+static zframe_t *
+s_batch_encode (batch_t *self)
+{
+    if (!self->count)
+        return NULL;
+    size_t index = (self->count + 1) * sizeof (uint32_t);
+    zframe_t *frame = zframe_new (NULL, BATCH_HEADER + index + self->size);
+    byte *data = zframe_data (frame);
+    uint32_t count = (uint32_t) self->count;
+    memcpy (data, &count, sizeof (count));
+    memcpy (data + sizeof (count), &self->first, sizeof (self->first));
+    self->offsets [self->count] = (uint32_t) self->size;
+    memcpy (data + BATCH_HEADER, self->offsets, index);
+    memcpy (data + BATCH_HEADER + index, self->data, self->size);
+    self->count = 0;
+    self->size = 0;
+    return frame;
+}
+
+//  The count method returns the number of samples in batch <frame>, or -1 if
+//  the frame is not a valid batch, i.e. its index does not fit its data
+static int64_t
+s_batch_count (zframe_t *frame)
+{
+    size_t size = zframe_size (frame);
+    if (size < BATCH_HEADER + sizeof (uint32_t))
+        return -1;
+    byte *data = zframe_data (frame);
+    uint32_t count;
+    memcpy (&count, data, sizeof (count));
+    size_t index = ((size_t) count + 1) * sizeof (uint32_t);
+    if (count > BATCH_SAMPLES || BATCH_HEADER + index > size)
+        return -1;
+    uint32_t offset, previous = 0;
+    size_t offset_nbr;
+    for (offset_nbr = 0; offset_nbr <= count; offset_nbr++) {
+        memcpy (&offset, data + BATCH_HEADER + offset_nbr * sizeof (uint32_t), sizeof (offset));
+        if (offset < previous)
+            return -1;
+        previous = offset;
+    }
+    if (BATCH_HEADER + index + offset != size)
+        return -1;
+    return count;
+}
+
+//  The sample method returns sample <sample_nbr> of batch <frame>, which must
+//  have been checked with s_batch_count, and its size in <size_p>. Samples
+//  are read in place.
+static byte *
+s_batch_sample (zframe_t *frame, size_t sample_nbr, size_t *size_p)
+{
+    byte *data = zframe_data (frame);
+    uint32_t count, start, end;
+    memcpy (&count, data, sizeof (count));
+    byte *offsets = data + BATCH_HEADER;
+    memcpy (&start, offsets + sample_nbr * sizeof (uint32_t), sizeof (start));
+    memcpy (&end, offsets + (sample_nbr + 1) * sizeof (uint32_t), sizeof (end));
+    *size_p = end - start;
+    return offsets + ((size_t) count + 1) * sizeof (uint32_t) + start;
+}
+
+#endif
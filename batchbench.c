@@ -0,0 +1,171 @@
+//  Pick-n-Pack batching benchmark
+//
+//  Measures the trade-off between throughput and latency of batching device
+//  samples (batch.h) for a range of windows. A producer thread plays the
+//  device and sends samples over tcp, each sample stamped with the time it
+//  was produced; the consumer plays the module, unpacks batches and records
+//  how long each sample took. Window 0 sends every sample as a data message
+//  of its own, as devices do without PNP_BATCH_WINDOW.
+//
+//  Usage: batchbench [-n samples] [-s size] [-r samples/sec] [window ...]
+//  A rate of 0 produces samples as fast as possible.
+
+#include "czmq.h"
+#include "defs.h"
+
+#define BENCH_SAMPLES   500000
+#define BENCH_SIZE      64
+#define BENCH_TCP       "tcp://127.0.0.1:9098"
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+typedef struct {
+    size_t window;              //  msecs, 0 to send each sample at once
+    size_t count;
+    size_t size;
+    size_t rate;                //  Samples per second, 0 for as fast as possible
+} bench_t;
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The producer thread plays the device, sending through s_sample_send like
+//  device.c does
+static void
+s_producer (zsock_t *pipe, void *args)
+{
+    bench_t *bench = (bench_t *) args;
+    resource_t self = { .name = "bench" };
+    self.frontend = zsock_new_dealer (BENCH_TCP);
+    self.batch = bench->window? s_batch_new (bench->window, BATCH_SAMPLES): NULL;
+    assert (self.frontend);
+    zsock_signal (pipe, 0);
+
+    byte *sample = (byte *) zmalloc (bench->size);
+    int64_t started = zclock_usecs ();
+    size_t sample_nbr;
+    for (sample_nbr = 0; sample_nbr < bench->count && !zsys_interrupted; sample_nbr++) {
+        if (bench->rate) {
+            int64_t due = started + (int64_t) (sample_nbr * 1e6 / bench->rate);
+            while (zclock_usecs () < due) {
+                if (s_batch_due (self.batch))
+                    s_batch_send (&self, PNP_QAS_ID);
+            }
+        }
+        int64_t now = zclock_usecs ();
+        memcpy (sample, &now, sizeof (now));
+        s_sample_send (&self, PNP_QAS_ID, sample, bench->size);
+        if (s_batch_due (self.batch))
+            s_batch_send (&self, PNP_QAS_ID);
+    }
+    s_batch_send (&self, PNP_QAS_ID);
+    free (sample);
+    char *command = zstr_recv (pipe);
+    free (command);
+    s_batch_destroy (&self.batch);
+    zsock_destroy (&self.frontend);
+}
+
+//  The run method plays the module, and reports the throughput and latency
+//  of one window
+static void
+s_bench_run (bench_t *bench)
+{
+    zsock_t *socket = zsock_new_router (BENCH_TCP);
+    assert (socket);
+    int64_t *latencies = (int64_t *) zmalloc (bench->count * sizeof (int64_t));
+    size_t received = 0;
+    size_t messages = 0;
+    int64_t started = zclock_usecs ();
+    zactor_t *producer = zactor_new (s_producer, bench);
+    while (received < bench->count && !zsys_interrupted) {
+        zmsg_t *msg = zmsg_recv (socket);
+        if (!msg)
+            break;
+        messages++;
+        zframe_t *identity = zmsg_pop (msg);
+        zframe_destroy (&identity);
+        zmsg_first (msg);
+        zframe_t *type = zmsg_next (msg);
+        zframe_t *frame = zmsg_last (msg);
+        int64_t now = zclock_usecs ();
+        int64_t sent;
+        if (memcmp (zframe_data (type), PNP_BATCH, 1) == 0) {
+            int64_t count = s_batch_count (frame);
+            int64_t sample_nbr;
+            for (sample_nbr = 0; sample_nbr < count && received < bench->count; sample_nbr++) {
+                size_t size;
+                byte *data = s_batch_sample (frame, sample_nbr, &size);
+                memcpy (&sent, data, sizeof (sent));
+                latencies [received++] = now - sent;
+            }
+        }
+        else {
+            memcpy (&sent, zframe_data (frame), sizeof (sent));
+            latencies [received++] = now - sent;
+        }
+        zmsg_destroy (&msg);
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    zactor_destroy (&producer);
+    zsock_destroy (&socket);
+
+    qsort (latencies, received, sizeof (int64_t), s_compare_latency);
+    printf ("%8zu %12.0f %12.0f %10.3f %10.3f\n", bench->window,
+            elapsed > 0? received * 1e6 / elapsed: 0, elapsed > 0? messages * 1e6 / elapsed: 0,
+            received? latencies [received / 2] / 1e3: 0, received? latencies [received * 99 / 100] / 1e3: 0);
+    free (latencies);
+}
+
+int main (int argc, char *argv [])
+{
+    bench_t bench = { 0, BENCH_SAMPLES, BENCH_SIZE, 0 };
+    size_t windows [16];
+    size_t window_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            bench.count = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-s") && argn + 1 < argc)
+            bench.size = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-r") && argn + 1 < argc)
+            bench.rate = atol (argv [++argn]);
+        else
+        if (isdigit ((unsigned char) argv [argn][0]) && window_count < 16)
+            windows [window_count++] = atol (argv [argn]);
+        else {
+            printf ("usage: batchbench [-n samples] [-s size] [-r samples/sec] [window ...]\n");
+            return 1;
+        }
+    }
+    if (bench.size < sizeof (int64_t))
+        bench.size = sizeof (int64_t);
+    if (!window_count) {
+        size_t defaults [] = { 0, 1, 2, 5, 10, 20 };
+        for (window_count = 0; window_count < 6; window_count++)
+            windows [window_count] = defaults [window_count];
+    }
+    printf ("%zu samples of %zu bytes at %s\n", bench.count, bench.size,
+            bench.rate? "a fixed rate": "maximum rate");
+    printf ("%8s %12s %12s %10s %10s\n", "window", "samples/sec", "msgs/sec", "p50 msecs", "p99 msecs");
+    size_t window_nbr;
+    for (window_nbr = 0; window_nbr < window_count && !zsys_interrupted; window_nbr++) {
+        bench.window = windows [window_nbr];
+        s_bench_run (&bench);
+    }
+    return 0;
+}
@@ -0,0 +1,131 @@
+#ifndef PNP_BSTAR
+#define PNP_BSTAR "Pick-n-Pack Binary Star"
+
+//  Binary Star pairs a primary and a backup Plant, based on ZeroMQ's
+//  Binary Star pattern. Both Plants publish their state to each other at
+//  every heartbeat. The active Plant serves clients and lines, the passive
+//  Plant only keeps a replica of the line registry and the pending requests.
+//  The passive Plant takes over when its peer has gone silent and a client
+//  or line turns up on its own sockets, which proves the peer is gone for
+//  them as well and protects against split-brain.
+//
+//  Failover is not done within one heartbeat interval. The backup takes
+//  over BSTAR_PEER_EXPIRY after the last state of the primary, and only
+//  once a line or client turns up. A line turns up when its detector
+//  expires the primary, i.e. after about HEARTBEAT_LIVENESS intervals, and
+//  a client after a request timeout. With the default one second interval,
+//  sim -P measures the takeover at 2.0-2.2 secs, the first reply from the
+//  backup at 2.5 secs, and lines back at 2.5-3.4 secs, 4.1 secs at most.
+
+//  States of a Plant in a Binary Star pair
+typedef enum {
+    BSTAR_PRIMARY = 1,          //  Primary, waiting for peer to connect
+    BSTAR_BACKUP = 2,           //  Backup, waiting for peer to connect
+    BSTAR_ACTIVE = 3,           //  Active, accepting connections
+    BSTAR_PASSIVE = 4           //  Passive, not accepting connections
+} bstar_state_t;
+
+//  Events, the first four are the peer states
+typedef enum {
+    BSTAR_PEER_PRIMARY = 1,     //  HA peer is pending primary
+    BSTAR_PEER_BACKUP = 2,      //  HA peer is pending backup
+    BSTAR_PEER_ACTIVE = 3,      //  HA peer is active
+    BSTAR_PEER_PASSIVE = 4,     //  HA peer is passive
+    BSTAR_CLIENT_REQUEST = 5    //  Client or line made a request
+} bstar_event_t;
+
+#define BSTAR_PEER_EXPIRY (2 * HEARTBEAT_INTERVAL)  //  Peer is considered dead after this, msecs
+
+typedef struct {
+    bstar_state_t state;        //  Current state
+    bstar_event_t event;        //  Current event
+    int64_t peer_expiry;        //  When peer is considered dead
+    int64_t peer_seen;          //  When peer state was last received
+} bstar_t;
+
+static const char *
+s_bstar_state_name (bstar_state_t state)
+{
+    switch (state) {
+        case BSTAR_PRIMARY: return "PRIMARY";
+        case BSTAR_BACKUP:  return "BACKUP";
+        case BSTAR_ACTIVE:  return "ACTIVE";
+        case BSTAR_PASSIVE: return "PASSIVE";
+    }
+    return "unknown";
+}
+
+//  The execute method is the finite state machine of the pair. It applies
+//  <fsm->event> to the current state. Returns 0 if the event was accepted,
+//  1 if a client request must be rejected and -1 on a fatal split-brain.
+static int
+s_bstar_execute (bstar_t *fsm)
+{
+    int rc = 0;
+    bstar_state_t previous = fsm->state;
+    //  These are the PRIMARY and BACKUP states; we're waiting to become
+    //  ACTIVE or PASSIVE depending on events we get from our peer:
+    if (fsm->state == BSTAR_PRIMARY) {
+        if (fsm->event == BSTAR_PEER_BACKUP)
+            fsm->state = BSTAR_ACTIVE;
+        else
+        if (fsm->event == BSTAR_PEER_ACTIVE)
+            fsm->state = BSTAR_PASSIVE;
+        //  Accept client connections
+    }
+    else
+    if (fsm->state == BSTAR_BACKUP) {
+        if (fsm->event == BSTAR_PEER_ACTIVE)
+            fsm->state = BSTAR_PASSIVE;
+        else
+        //  Reject client connections when acting as backup
+        if (fsm->event == BSTAR_CLIENT_REQUEST)
+            rc = 1;
+    }
+    else
+    //  These are the ACTIVE and PASSIVE states:
+    if (fsm->state == BSTAR_ACTIVE) {
+        if (fsm->event == BSTAR_PEER_ACTIVE) {
+            //  Two actives would mean split-brain
+            printf ("E: fatal error - dual actives, aborting\n");
+            rc = -1;
+        }
+    }
+    else
+    //  Server is passive; CLIENT_REQUEST events can trigger failover if
+    //  peer looks dead
+    if (fsm->state == BSTAR_PASSIVE) {
+        if (fsm->event == BSTAR_PEER_PRIMARY)
+            //  Peer is restarting - become active, peer will go passive
+            fsm->state = BSTAR_ACTIVE;
+        else
+        if (fsm->event == BSTAR_PEER_BACKUP)
+            //  Peer is restarting - become active, peer will go passive
+            fsm->state = BSTAR_ACTIVE;
+        else
+        if (fsm->event == BSTAR_PEER_PASSIVE) {
+            //  Two passives would mean cluster would be non-responsive
+            printf ("E: fatal error - dual passives, aborting\n");
+            rc = -1;
+        }
+        else
+        if (fsm->event == BSTAR_CLIENT_REQUEST) {
+            //  Peer becomes active if timeout has passed
+            //  It's the client request that triggers the failover
+            assert (fsm->peer_expiry > 0);
+            if (zclock_time () >= fsm->peer_expiry) {
+                printf ("I: failover after %" PRId64 " msec without peer\n",
+                        zclock_time () - fsm->peer_seen);
+                fsm->state = BSTAR_ACTIVE;
+            }
+            else
+                //  If peer is alive, reject connections
+                rc = 1;
+        }
+    }
+    if (fsm->state != previous)
+        printf ("I: %s -> %s\n", s_bstar_state_name (previous), s_bstar_state_name (fsm->state));
+    return rc;
+}
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef PNP_CAPTURE
+#define PNP_CAPTURE "Pick-n-Pack Traffic Capture"
+
+//  A capture records every message a broker receives and sends, with the
+//  time since the capture started, so the replay tool can feed the traffic
+//  back into a broker later and compare its performance with a baseline.
+//  Capturing is off unless the PNP_CAPTURE environment variable names a
+//  directory; each broker then writes <name>.capture there. When capturing
+//  is off the capture is NULL and recording a message costs one test.
+//
+//  File: MAGIC, VERSION (uint32), STARTED (int64 usecs), NAME (64 bytes),
+//  then per message SIZE (uint32, whole record), FRAMES (uint16), DIRECTION,
+//  SOCKET, TIME (int64 usecs since STARTED), then per frame SIZE (uint32)
+//  and data.
+
+#include <ctype.h>
+
+#define CAPTURE_MAGIC       0x43504e50  //  "PNPC"
+#define CAPTURE_VERSION     1
+#define CAPTURE_NAME_MAX    64
+
+//  Directions
+#define CAPTURE_IN          'I'
+#define CAPTURE_OUT         'O'
+
+//  Sockets
+#define CAPTURE_FRONTEND    0
+#define CAPTURE_BACKEND     1
+#define CAPTURE_SUBSCRIBER  2
+#define CAPTURE_PUBLISHER   3
+#define CAPTURE_PEER        4           //  Binary Star peer of the Plant
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    int64_t started;
+    char name [CAPTURE_NAME_MAX];
+} capture_header_t;
+
+typedef struct {
+    uint32_t size;
+    uint16_t frames;
+    byte direction;
+    byte socket;
+    int64_t time;
+} capture_record_t;
+
+typedef struct {
+    FILE *file;
+    capture_header_t header;
+    size_t records;
+} capture_t;
+
+//  Construct new capture for the broker called <name>, or NULL if
+//  capturing is off or the file cannot be created
+static capture_t *
+s_capture_new (const char *name)
+{
+    const char *directory = getenv ("PNP_CAPTURE");
+    if (!directory || !*directory)
+        return NULL;
+    char filename [strlen (directory) + strlen (name) + 10];
+    snprintf (filename, sizeof (filename), "%s/%s.capture", directory, name);
+    //  Names like "PnP Plant (primary)" make awkward file names
+    char *c;
+    for (c = filename + strlen (directory) + 1; *c; c++)
+        if (!isalnum ((unsigned char) *c) && *c != '.' && *c != '-')
+            *c = '_';
+    capture_t *self = (capture_t *) zmalloc (sizeof (capture_t));
+    self->file = fopen (filename, "wb");
+    if (!self->file) {
+        printf ("E: cannot create capture %s: %s\n", filename, strerror (errno));
+        free (self);
+        return NULL;
+    }
+    setvbuf (self->file, NULL, _IOFBF, 256 * 1024);
+    self->header.magic = CAPTURE_MAGIC;
+    self->header.version = CAPTURE_VERSION;
+    self->header.started = zclock_usecs ();
+    strncpy (self->header.name, name, CAPTURE_NAME_MAX - 1);
+    fwrite (&self->header, sizeof (self->header), 1, self->file);
+    printf ("I: capturing traffic to %s\n", filename);
+    return self;
+}
+
+//  Open an existing capture file for reading, or return NULL
+static capture_t *
+s_capture_open (const char *filename)
+{
+    capture_t *self = (capture_t *) zmalloc (sizeof (capture_t));
+    self->file = fopen (filename, "rb");
+    if (!self->file
+    ||  fread (&self->header, sizeof (self->header), 1, self->file) != 1
+    ||  self->header.magic != CAPTURE_MAGIC
+    ||  self->header.version != CAPTURE_VERSION) {
+        printf ("E: %s is not a capture file\n", filename);
+        if (self->file)
+            fclose (self->file);
+        free (self);
+        return NULL;
+    }
+    return self;
+}
+
+static void
+s_capture_destroy (capture_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        capture_t *self = *self_p;
+        fclose (self->file);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The message method records <msg>, received or sent on <socket>. Does
+//  nothing if <self> is NULL, i.e. capturing is off.
+static void
+s_capture_msg (capture_t *self, byte direction, byte socket, zmsg_t *msg)
+{
+    if (!self || !msg)
+        return;
+    capture_record_t record;
+    record.size = sizeof (record);
+    record.frames = zmsg_size (msg);
+    record.direction = direction;
+    record.socket = socket;
+    record.time = zclock_usecs () - self->header.started;
+    zframe_t *frame = zmsg_first (msg);
+    while (frame) {
+        record.size += sizeof (uint32_t) + zframe_size (frame);
+        frame = zmsg_next (msg);
+    }
+    fwrite (&record, sizeof (record), 1, self->file);
+    frame = zmsg_first (msg);
+    while (frame) {
+        uint32_t size = zframe_size (frame);
+        fwrite (&size, sizeof (size), 1, self->file);
+        fwrite (zframe_data (frame), 1, size, self->file);
+        frame = zmsg_next (msg);
+    }
+    self->records++;
+}
+
+//  The read method returns the next message of a capture opened with
+//  s_capture_open and fills in <record>, or returns NULL at the end
+static zmsg_t *
+s_capture_read (capture_t *self, capture_record_t *record)
+{
+    if (fread (record, sizeof (*record), 1, self->file) != 1)
+        return NULL;
+    zmsg_t *msg = zmsg_new ();
+    uint16_t frame_nbr;
+    for (frame_nbr = 0; frame_nbr < record->frames; frame_nbr++) {
+        uint32_t size;
+        if (fread (&size, sizeof (size), 1, self->file) != 1) {
+            zmsg_destroy (&msg);
+            return NULL;
+        }
+        zframe_t *frame = zframe_new (NULL, size);
+        if (fread (zframe_data (frame), 1, size, self->file) != size) {
+            zframe_destroy (&frame);
+            zmsg_destroy (&msg);
+            return NULL;
+        }
+        zmsg_append (msg, &frame);
+    }
+    self->records++;
+    return msg;
+}
+
+#endif
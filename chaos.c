@@ -0,0 +1,708 @@
+//  Pick-n-Pack chaos benchmark
+//
+//  Runs a local tree of a Plant, a line, a module and its devices, as the
+//  binaries in the current directory, and injects one fault per round:
+//
+//      module-kill     kill the module and restart it, warm if it left a
+//                      snapshot (snapshot.h)
+//      module-cold     kill the module, remove its snapshot and restart it
+//      device-kill     kill a device and restart it
+//      device-hang     stop a device for CHAOS_HANG msecs
+//      plant-restart   kill the Plant and restart it
+//      link-drop       drop CHAOS_DROP% of the messages between devices and
+//                      module for CHAOS_LINK msecs
+//      link-delay      delay those messages by CHAOS_DELAY msecs instead
+//
+//  The devices reach the module through a proxy in the harness, see
+//  PNP_FRONTEND in device.c. The harness follows the tree in the status cache
+//  of the Plant (clone.h) and measures, from the fault on:
+//
+//      detection       until a resource at the level of the fault is gone
+//      reconnection    until that level has all its resources again
+//      recovery        until every resource is RUNNING again; for faults
+//                      that are not detected, from the end of the fault,
+//                      and for kills, until the restarted resource logged
+//                      RUNNING too, as a warm restart may not be detected
+//
+//  As times are taken at the Plant, they include the time the status takes
+//  to get there. For a Plant restart, detection is the time the harness
+//  takes to notice, as the Plant loses what it knew. Results per fault and
+//  metric go to a results file; given the results of an earlier run, the
+//  harness reports medians that got worse and exits with 1.
+//
+//  Children write their output to chaos-<name>.log.
+//
+//  Comparing module-kill with module-cold gives what warm restarts save.
+//
+//  Usage: chaos [-r rounds] [-d devices] [-o results] [-c baseline] [fault ...]
+
+#include "czmq.h"
+#include "protocol.h"
+#include "rtt.h"
+#include "status.h"
+#include "clone.h"
+#include <stdatomic.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+
+#define CHAOS_ROUNDS    5
+#define CHAOS_DEVICES   2
+#define CHAOS_DEVICES_MAX 16
+#define CHAOS_SETTLE    60000       //  msecs the tree may take to be RUNNING
+#define CHAOS_TIMEOUT   60000       //  msecs a round may take to recover
+#define CHAOS_PAUSE     2000        //  msecs between rounds
+#define CHAOS_HANG      10000       //  msecs a hung device stays stopped
+#define CHAOS_LINK      10000       //  msecs a link fault lasts
+#define CHAOS_DROP      30          //  Percent of messages dropped
+#define CHAOS_DELAY     2000        //  msecs messages are delayed
+#define CHAOS_TOLERANCE 1.2         //  A median 20% worse is a regression,
+#define CHAOS_SLACK     100         //  if also worse by this many msecs
+#define CHAOS_RESULTS   "chaos.results"
+
+#define CHAOS_PROXY_BIND    "tcp://*:9023"              //  TODO: this should be configured
+#define CHAOS_PROXY_CONNECT "tcp://localhost:9023"
+#define CHAOS_MODULE        "tcp://localhost:9003"
+#define CHAOS_SNAPSHOT      "tcp://localhost:9006"
+#define CHAOS_UPDATES       "tcp://localhost:9007"
+#define CHAOS_RESUME        "pnp-%s.snapshot"   //  Snapshot of a resource, as in snapshot.h
+
+#define CHAOS_METRICS   3
+static const char *s_metrics [CHAOS_METRICS] = { "detection", "reconnection", "recovery" };
+
+typedef enum {
+    FAULT_MODULE_KILL,
+    FAULT_MODULE_COLD,
+    FAULT_DEVICE_KILL,
+    FAULT_DEVICE_HANG,
+    FAULT_PLANT_RESTART,
+    FAULT_LINK_DROP,
+    FAULT_LINK_DELAY,
+    FAULTS
+} fault_t;
+
+static const char *s_faults [FAULTS] = {
+    "module-kill", "module-cold", "device-kill", "device-hang", "plant-restart", "link-drop", "link-delay"
+};
+
+//  Level of the status tree a fault hits: 2 for modules, 3 for devices
+static int s_fault_depth [FAULTS] = { 2, 2, 3, 3, 2, 3, 3 };
+
+//  .split child processes
+
+typedef struct {
+    char binary [32];
+    char name [32];
+    pid_t pid;
+    long log_size;              //  Size of its log when it was last started
+} process_t;
+
+static void
+s_process_start (process_t *self)
+{
+    char log [64];
+    snprintf (log, sizeof (log), "chaos-%s.log", self->name);
+    struct stat st;
+    self->log_size = stat (log, &st) == 0? (long) st.st_size: 0;
+    fflush (stdout);
+    self->pid = fork ();
+    if (self->pid == 0) {
+        if (!freopen (log, "a", stdout) || dup2 (fileno (stdout), fileno (stderr)) == -1)
+            _exit (1);
+        setenv ("PNP_FRONTEND", CHAOS_PROXY_CONNECT, 1);
+        char path [64];
+        snprintf (path, sizeof (path), "./%s", self->binary);
+        if (streq (self->binary, "plant"))
+            execl (path, self->binary, (char *) NULL);
+        else
+            execl (path, self->binary, self->name, (char *) NULL);
+        _exit (1);
+    }
+    assert (self->pid > 0);
+}
+
+//  Returns 1 once the process logged that it is RUNNING since it was last
+//  started, as resources do after a cold or a warm start
+static int
+s_process_running (process_t *self)
+{
+    char log [64];
+    snprintf (log, sizeof (log), "chaos-%s.log", self->name);
+    FILE *file = fopen (log, "r");
+    if (!file)
+        return 0;
+    int running = 0;
+    char line [256];
+    if (fseek (file, self->log_size, SEEK_SET) == 0)
+        while (!running && fgets (line, sizeof (line), file))
+            running = strstr (line, "] RUNNING ") != NULL;
+    fclose (file);
+    return running;
+}
+
+//  Removes the snapshot of the process, so it starts cold
+static void
+s_process_forget (process_t *self)
+{
+    char snapshot [64];
+    snprintf (snapshot, sizeof (snapshot), CHAOS_RESUME, self->name);
+    remove (snapshot);
+}
+
+//  Sends <signal> to the process and, for SIGKILL, reaps it
+static void
+s_process_signal (process_t *self, int signal)
+{
+    if (self->pid <= 0)
+        return;
+    kill (self->pid, signal);
+    if (signal == SIGKILL) {
+        waitpid (self->pid, NULL, 0);
+        self->pid = 0;
+    }
+}
+
+//  Stops the process, politely first
+static void
+s_process_stop (process_t *self)
+{
+    if (self->pid <= 0)
+        return;
+    kill (self->pid, SIGCONT);
+    kill (self->pid, SIGINT);
+    int64_t expiry = zclock_time () + 3000;
+    while (zclock_time () < expiry && waitpid (self->pid, NULL, WNOHANG) == 0)
+        zclock_sleep (50);
+    if (waitpid (self->pid, NULL, WNOHANG) == 0)
+        s_process_signal (self, SIGKILL);
+    self->pid = 0;
+}
+
+//  .split proxy
+
+//  The proxy sits between the devices and the module and drops or delays
+//  messages both ways when told to. It gives each device a socket of its own
+//  to the module, so the module still tells devices apart.
+
+typedef struct {
+    atomic_int drop;            //  Percent of messages to drop
+    atomic_int delay;           //  msecs to delay messages
+} proxy_t;
+
+typedef struct {
+    zframe_t *identity;         //  Identity of the device at our frontend
+    zsock_t *dealer;            //  Its socket to the module
+} proxy_peer_t;
+
+typedef struct {
+    int64_t due;                //  msecs
+    zsock_t *socket;
+    zmsg_t *msg;
+} proxy_delayed_t;
+
+static void
+s_proxy_peer_free (void *data)
+{
+    proxy_peer_t *peer = (proxy_peer_t *) data;
+    zframe_destroy (&peer->identity);
+    zsock_destroy (&peer->dealer);
+    free (peer);
+}
+
+//  Sends <msg> to <socket> now, later or never, as the proxy is told
+static void
+s_proxy_forward (proxy_t *self, zlist_t *delayed, zsock_t *socket, zmsg_t *msg)
+{
+    if (random () % 100 < atomic_load (&self->drop)) {
+        zmsg_destroy (&msg);
+        return;
+    }
+    int delay = atomic_load (&self->delay);
+    if (delay || zlist_size (delayed)) {
+        //  Keep the order of messages, also when the delay ends
+        proxy_delayed_t *item = (proxy_delayed_t *) zmalloc (sizeof (proxy_delayed_t));
+        item->due = zclock_time () + delay;
+        item->socket = socket;
+        item->msg = msg;
+        zlist_append (delayed, item);
+    }
+    else
+        zmsg_send (&msg, socket);
+}
+
+static void
+s_proxy_actor (zsock_t *pipe, void *args)
+{
+    proxy_t *self = (proxy_t *) args;
+    zsock_t *frontend = zsock_new_router (CHAOS_PROXY_BIND);
+    assert (frontend);
+    zhash_t *peers = zhash_new ();
+    zlist_t *delayed = zlist_new ();
+    zsock_signal (pipe, 0);
+    while (!zsys_interrupted) {
+        //  Devices that restarted keep their peers, which stay silent
+        zmq_pollitem_t items [2 + zhash_size (peers)];
+        proxy_peer_t *polled [zhash_size (peers) + 1];
+        int item_count = 0;
+        items [item_count++] = (zmq_pollitem_t) { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 };
+        items [item_count++] = (zmq_pollitem_t) { zsock_resolve (frontend), 0, ZMQ_POLLIN, 0 };
+        proxy_peer_t *peer = (proxy_peer_t *) zhash_first (peers);
+        while (peer) {
+            polled [item_count - 2] = peer;
+            items [item_count++] = (zmq_pollitem_t) { zsock_resolve (peer->dealer), 0, ZMQ_POLLIN, 0 };
+            peer = (proxy_peer_t *) zhash_next (peers);
+        }
+        proxy_delayed_t *item = (proxy_delayed_t *) zlist_first (delayed);
+        int64_t timeout = item? item->due - zclock_time (): 100;
+        if (zmq_poll (items, item_count, (timeout > 0? timeout: 0) * ZMQ_POLL_MSEC) == -1)
+            break;              //  Interrupted
+        if (items [0].revents & ZMQ_POLLIN) {
+            char *command = zstr_recv (pipe);
+            int done = !command || streq (command, "$TERM");
+            free (command);
+            if (done)
+                break;
+        }
+        if (items [1].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (frontend);
+            if (!msg)
+                break;
+            zframe_t *identity = zmsg_pop (msg);
+            char *key = zframe_strhex (identity);
+            peer = (proxy_peer_t *) zhash_lookup (peers, key);
+            if (!peer) {
+                //  A new device, or one that restarted cold. The module sees it
+                //  under the identity it chose, if it did, so a warm restart of
+                //  either keeps them known to each other.
+                peer = (proxy_peer_t *) zmalloc (sizeof (proxy_peer_t));
+                peer->identity = zframe_dup (identity);
+                peer->dealer = zsock_new (ZMQ_DEALER);
+                if (zframe_size (identity) && zframe_data (identity) [0])
+                    zmq_setsockopt (zsock_resolve (peer->dealer), ZMQ_IDENTITY,
+                                    zframe_data (identity), zframe_size (identity));
+                zsock_connect (peer->dealer, "%s", CHAOS_MODULE);
+                zhash_insert (peers, key, peer);
+                zhash_freefn (peers, key, s_proxy_peer_free);
+            }
+            s_proxy_forward (self, delayed, peer->dealer, msg);
+            zframe_destroy (&identity);
+            free (key);
+        }
+        int index;
+        for (index = 2; index < item_count; index++) {
+            if (!(items [index].revents & ZMQ_POLLIN))
+                continue;
+            peer = polled [index - 2];
+            zmsg_t *msg = zmsg_recv (peer->dealer);
+            if (!msg)
+                continue;
+            zframe_t *identity = zframe_dup (peer->identity);
+            zmsg_prepend (msg, &identity);
+            s_proxy_forward (self, delayed, frontend, msg);
+        }
+        while ((item = (proxy_delayed_t *) zlist_first (delayed)) && item->due <= zclock_time ()) {
+            zlist_pop (delayed);
+            zmsg_send (&item->msg, item->socket);
+            free (item);
+        }
+    }
+    while (zlist_size (delayed)) {
+        proxy_delayed_t *item = (proxy_delayed_t *) zlist_pop (delayed);
+        zmsg_destroy (&item->msg);
+        free (item);
+    }
+    zlist_destroy (&delayed);
+    zhash_destroy (&peers);
+    zsock_destroy (&frontend);
+}
+
+//  .split measuring
+
+typedef struct {
+    process_t plant;
+    process_t line;
+    process_t module;
+    process_t devices [CHAOS_DEVICES_MAX];
+    size_t device_count;
+    proxy_t proxy;
+    clone_t *clone;             //  Our copy of the status cache of the Plant
+    //  Times per fault, metric and round, msecs, -1 if not seen
+    int64_t *results [FAULTS][CHAOS_METRICS];
+    size_t rounds;
+} chaos_t;
+
+//  Returns the level of the resource at <key> in the status tree
+static int
+s_chaos_depth (const char *key)
+{
+    int depth = 1;
+    for (; *key; key++)
+        depth += *key == '/';
+    return depth;
+}
+
+//  Keeps our copy of the status cache up to date for up to <timeout> msecs,
+//  and takes a new one if the Plant went silent
+static void
+s_chaos_follow (chaos_t *self, int timeout)
+{
+    if (s_clone_receive (self->clone, timeout) == -1 && !zsys_interrupted) {
+        s_clone_destroy (&self->clone);
+        self->clone = s_clone_new (CHAOS_SNAPSHOT, CHAOS_UPDATES);
+    }
+    s_status_commit (self->clone->tree);
+}
+
+//  Returns 1 if the tree has one module and all devices, all RUNNING
+static int
+s_chaos_healthy (chaos_t *self)
+{
+    size_t modules = 0;
+    size_t devices = 0;
+    int running = 1;
+    zlist_t *keys = zhash_keys (self->clone->tree->entries);
+    char *key = (char *) zlist_first (keys);
+    while (key) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (self->clone->tree->entries, key);
+        running &= entry->state == (byte) PNP_RUNNING [0];
+        modules += s_chaos_depth (key) == 2;
+        devices += s_chaos_depth (key) == 3;
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    return self->clone->synced && running && modules == 1 && devices == self->device_count;
+}
+
+//  Returns the resources at <depth> in the tree
+static zlist_t *
+s_chaos_level (chaos_t *self, int depth)
+{
+    zlist_t *keys = zhash_keys (self->clone->tree->entries);
+    zlist_t *level = zlist_new ();
+    zlist_autofree (level);
+    zlist_comparefn (level, (zlist_compare_fn *) strcmp);
+    char *key = (char *) zlist_first (keys);
+    while (key) {
+        if (s_chaos_depth (key) == depth)
+            zlist_append (level, key);
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    return level;
+}
+
+//  Starts <fault>, and returns when it ends, msecs, 0 if it ends right away
+static int64_t
+s_chaos_inject (chaos_t *self, fault_t fault)
+{
+    int64_t now = zclock_time ();
+    switch (fault) {
+        case FAULT_MODULE_KILL:
+            s_process_signal (&self->module, SIGKILL);
+            s_process_start (&self->module);
+            return 0;
+        case FAULT_MODULE_COLD:
+            s_process_signal (&self->module, SIGKILL);
+            s_process_forget (&self->module);
+            s_process_start (&self->module);
+            return 0;
+        case FAULT_DEVICE_KILL:
+            s_process_signal (&self->devices [0], SIGKILL);
+            s_process_start (&self->devices [0]);
+            return 0;
+        case FAULT_DEVICE_HANG:
+            s_process_signal (&self->devices [0], SIGSTOP);
+            return now + CHAOS_HANG;
+        case FAULT_PLANT_RESTART:
+            s_process_signal (&self->plant, SIGKILL);
+            s_process_start (&self->plant);
+            return 0;
+        case FAULT_LINK_DROP:
+            atomic_store (&self->proxy.drop, CHAOS_DROP);
+            return now + CHAOS_LINK;
+        case FAULT_LINK_DELAY:
+            atomic_store (&self->proxy.delay, CHAOS_DELAY);
+            return now + CHAOS_LINK;
+        default:
+            return 0;
+    }
+}
+
+static void
+s_chaos_lift (chaos_t *self, fault_t fault)
+{
+    if (fault == FAULT_DEVICE_HANG)
+        s_process_signal (&self->devices [0], SIGCONT);
+    atomic_store (&self->proxy.drop, 0);
+    atomic_store (&self->proxy.delay, 0);
+}
+
+//  Returns the resource <fault> restarts, or NULL
+static process_t *
+s_chaos_restarted (chaos_t *self, fault_t fault)
+{
+    if (fault == FAULT_MODULE_KILL || fault == FAULT_MODULE_COLD)
+        return &self->module;
+    if (fault == FAULT_DEVICE_KILL)
+        return &self->devices [0];
+    return NULL;
+}
+
+//  The round method injects <fault> into a healthy tree and measures until
+//  it recovered. Returns -1 if it did not recover in time.
+static int
+s_chaos_round (chaos_t *self, fault_t fault, size_t round)
+{
+    int depth = s_fault_depth [fault];
+    zlist_t *before = s_chaos_level (self, depth);
+    size_t expected = zlist_size (before);
+    int64_t detection = -1, reconnection = -1, recovery = -1;
+    int64_t started = zclock_time ();
+    int64_t lift_at = s_chaos_inject (self, fault);
+    int lasting = lift_at != 0;
+    if (!lasting)
+        lift_at = started;
+    int lifted = !lasting;
+    process_t *restarted = s_chaos_restarted (self, fault);
+    while (recovery == -1 && !zsys_interrupted) {
+        int64_t now = zclock_time ();
+        if (now - started > CHAOS_TIMEOUT)
+            break;
+        if (!lifted && now >= lift_at) {
+            s_chaos_lift (self, fault);
+            lifted = 1;
+        }
+        s_chaos_follow (self, 50);
+        now = zclock_time ();
+        if (detection == -1) {
+            char *key = (char *) zlist_first (before);
+            while (key && zhash_lookup (self->clone->tree->entries, key))
+                key = (char *) zlist_next (before);
+            if (key)
+                detection = now - started;
+        }
+        //  A resource restarted cold comes back as a new one, a hung one or
+        //  one restarted warm may come back as itself once it was gone
+        if (reconnection == -1 && self->clone->synced) {
+            zlist_t *level = s_chaos_level (self, depth);
+            char *key = (char *) zlist_first (level);
+            while (key && zlist_exists (before, key))
+                key = (char *) zlist_next (level);
+            if (key || (detection != -1 && zlist_size (level) >= expected))
+                reconnection = now - started;
+            zlist_destroy (&level);
+        }
+        //  A fault that is over at once, e.g. a kill, must have been seen, or
+        //  the resource it restarted must be RUNNING again
+        int over = lasting? lifted: restarted && s_process_running (restarted);
+        if ((detection == -1? over: reconnection != -1) && s_chaos_healthy (self))
+            recovery = now - (detection == -1? lift_at: started);
+    }
+    if (!lifted)
+        s_chaos_lift (self, fault);
+    zlist_destroy (&before);
+    self->results [fault][0][round] = detection;
+    self->results [fault][1][round] = reconnection;
+    self->results [fault][2][round] = recovery;
+    printf ("%-14s %5zu %12" PRId64 " %12" PRId64 " %12" PRId64 "\n",
+            s_faults [fault], round + 1, detection, reconnection, recovery);
+    return recovery == -1? -1: 0;
+}
+
+//  Waits until the tree is healthy, returns -1 if it does not get there
+static int
+s_chaos_settle (chaos_t *self, int64_t timeout)
+{
+    int64_t expiry = zclock_time () + timeout;
+    while (!zsys_interrupted && zclock_time () < expiry) {
+        s_chaos_follow (self, 100);
+        if (s_chaos_healthy (self))
+            return 0;
+    }
+    return -1;
+}
+
+static int
+s_compare_msecs (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The summary method sorts the times seen of <fault> and <metric>, and returns
+//  how many there are, their median and maximum
+static size_t
+s_chaos_summary (chaos_t *self, int fault, int metric, int64_t *median, int64_t *max)
+{
+    int64_t seen [self->rounds];
+    size_t count = 0;
+    size_t round;
+    for (round = 0; round < self->rounds; round++)
+        if (self->results [fault][metric][round] >= 0)
+            seen [count++] = self->results [fault][metric][round];
+    qsort (seen, count, sizeof (int64_t), s_compare_msecs);
+    *median = count? seen [count / 2]: -1;
+    *max = count? seen [count - 1]: -1;
+    return count;
+}
+
+//  The compare method reads the results of an earlier run from <filename>
+//  and reports medians that got worse. Returns the number of regressions.
+static int
+s_chaos_compare (chaos_t *self, const char *filename, int *run)
+{
+    FILE *file = fopen (filename, "r");
+    if (!file) {
+        printf ("E: cannot read baseline %s\n", filename);
+        return 0;
+    }
+    int regressions = 0;
+    char fault_name [32], metric_name [32];
+    size_t seen, rounds;
+    long median, max;
+    while (fscanf (file, "%31s %31s %zu %zu %ld %ld", fault_name, metric_name,
+                   &seen, &rounds, &median, &max) == 6) {
+        int fault, metric;
+        for (fault = 0; fault < FAULTS && !streq (s_faults [fault], fault_name); fault++);
+        for (metric = 0; metric < CHAOS_METRICS && !streq (s_metrics [metric], metric_name); metric++);
+        if (fault == FAULTS || metric == CHAOS_METRICS || !run [fault])
+            continue;
+        int64_t now_median, now_max;
+        size_t now_seen = s_chaos_summary (self, fault, metric, &now_median, &now_max);
+        //  Detection is a regression also when it comes where it did not before
+        if ((seen && now_seen && now_median > median * CHAOS_TOLERANCE && now_median > median + CHAOS_SLACK)
+        ||  (metric == 0 && now_seen * rounds > seen * self->rounds)) {
+            printf ("W: %s %s regressed: %zu of %zu rounds, median %" PRId64 " msecs, was %zu of %zu, %ld msecs\n",
+                    fault_name, metric_name, now_seen, self->rounds, now_median, seen, rounds, median);
+            regressions++;
+        }
+    }
+    fclose (file);
+    return regressions;
+}
+
+int main (int argc, char *argv [])
+{
+    chaos_t self = {
+        .plant = { .binary = "plant", .name = "plant" },
+        .line = { .binary = "line", .name = "line" },
+        .module = { .binary = "module", .name = "module" }
+    };
+    self.rounds = CHAOS_ROUNDS;
+    self.device_count = CHAOS_DEVICES;
+    const char *results = CHAOS_RESULTS;
+    const char *baseline = NULL;
+    int run [FAULTS] = { 0 };
+    int run_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        int fault;
+        for (fault = 0; fault < FAULTS && !streq (s_faults [fault], argv [argn]); fault++);
+        if (fault < FAULTS)
+            run_count += run [fault] = 1;
+        else
+        if (streq (argv [argn], "-r") && argn + 1 < argc)
+            self.rounds = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-d") && argn + 1 < argc)
+            self.device_count = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-o") && argn + 1 < argc)
+            results = argv [++argn];
+        else
+        if (streq (argv [argn], "-c") && argn + 1 < argc)
+            baseline = argv [++argn];
+        else {
+            printf ("usage: chaos [-r rounds] [-d devices] [-o results] [-c baseline] [fault ...]\n");
+            return 1;
+        }
+    }
+    if (!self.rounds || !self.device_count || self.device_count > CHAOS_DEVICES_MAX) {
+        printf ("E: need at least 1 round and 1 to %d devices\n", CHAOS_DEVICES_MAX);
+        return 1;
+    }
+    int fault;
+    for (fault = 0; fault < FAULTS; fault++) {
+        if (!run_count)
+            run [fault] = 1;
+        int metric;
+        for (metric = 0; metric < CHAOS_METRICS; metric++)
+            self.results [fault][metric] = (int64_t *) zmalloc (self.rounds * sizeof (int64_t));
+    }
+    srandom ((unsigned) zclock_usecs ());
+    zactor_t *proxy = zactor_new (s_proxy_actor, &self.proxy);
+    self.clone = s_clone_new (CHAOS_SNAPSHOT, CHAOS_UPDATES);
+
+    //  Start the tree from the top, so everything connects at once, and cold
+    s_process_start (&self.plant);
+    s_process_forget (&self.line);
+    s_process_start (&self.line);
+    s_process_forget (&self.module);
+    s_process_start (&self.module);
+    size_t device_nbr;
+    for (device_nbr = 0; device_nbr < self.device_count; device_nbr++) {
+        process_t *device = &self.devices [device_nbr];
+        snprintf (device->binary, sizeof (device->binary), "device");
+        snprintf (device->name, sizeof (device->name), "device-%zu", device_nbr + 1);
+        s_process_forget (device);
+        s_process_start (device);
+    }
+    int rc = 0;
+    if (s_chaos_settle (&self, CHAOS_SETTLE) == -1) {
+        printf ("E: tree did not come up RUNNING in %d msecs, see chaos-*.log\n", CHAOS_SETTLE);
+        rc = 1;
+    }
+    else {
+        printf ("%-14s %5s %12s %12s %12s\n", "msecs", "round", "detection", "reconnection", "recovery");
+        for (fault = 0; fault < FAULTS && !rc && !zsys_interrupted; fault++) {
+            size_t round;
+            for (round = 0; round < self.rounds && run [fault] && !zsys_interrupted; round++) {
+                if (s_chaos_round (&self, fault, round) == -1
+                ||  s_chaos_settle (&self, CHAOS_TIMEOUT) == -1) {
+                    printf ("E: tree did not recover from %s\n", s_faults [fault]);
+                    rc = 1;
+                    break;
+                }
+                //  Let the tree calm down, e.g. heartbeats back off again
+                int64_t resume_at = zclock_time () + CHAOS_PAUSE;
+                while (zclock_time () < resume_at && !zsys_interrupted)
+                    s_chaos_follow (&self, 100);
+            }
+        }
+    }
+    if (!rc && !zsys_interrupted) {
+        int regressions = baseline? s_chaos_compare (&self, baseline, run): 0;
+        FILE *file = fopen (results, "w");
+        printf ("\n%-14s %-12s %8s %10s %10s\n", "fault", "metric", "seen", "p50 msecs", "max msecs");
+        for (fault = 0; fault < FAULTS; fault++) {
+            int metric;
+            for (metric = 0; metric < CHAOS_METRICS && run [fault]; metric++) {
+                int64_t median, max;
+                size_t seen = s_chaos_summary (&self, fault, metric, &median, &max);
+                printf ("%-14s %-12s %4zu/%-3zu %10" PRId64 " %10" PRId64 "\n",
+                        s_faults [fault], s_metrics [metric], seen, self.rounds, median, max);
+                if (file)
+                    fprintf (file, "%s %s %zu %zu %" PRId64 " %" PRId64 "\n",
+                             s_faults [fault], s_metrics [metric], seen, self.rounds, median, max);
+            }
+        }
+        if (file)
+            fclose (file);
+        if (regressions)
+            rc = 1;
+    }
+    for (device_nbr = 0; device_nbr < self.device_count; device_nbr++)
+        s_process_stop (&self.devices [device_nbr]);
+    s_process_stop (&self.module);
+    s_process_stop (&self.line);
+    s_process_stop (&self.plant);
+    s_clone_destroy (&self.clone);
+    zactor_destroy (&proxy);
+    for (fault = 0; fault < FAULTS; fault++) {
+        int metric;
+        for (metric = 0; metric < CHAOS_METRICS; metric++)
+            free (self.results [fault][metric]);
+    }
+    return rc;
+}
@@ -2,71 +2,106 @@
 //  Use zmq_poll to do a safe request-reply
 
 #include "czmq.h"
+#include "protocol.h"
+#include "trace.h"
+#include "rtt.h"
+#include "hedge.h"
 #define REQUEST_TIMEOUT     2500    //  msecs, (> 1000!)
 #define REQUEST_RETRIES     3       //  Before we abandon
-#define SERVER_ENDPOINT     "tcp://localhost:5555"
 
-int main (void)
+//  Primary and backup Plant by default; requests go to the Plant that
+//  replies fastest and fail over to the other one, as in ZeroMQ's Binary
+//  Star client, see hedge.h. The passive peer drops requests until it takes
+//  over, so a hedge to it can never win and only counts as a failure against
+//  it: we hedge only across Plants named on the command line, which must be
+//  independent active Plants, unless -p asks otherwise.
+static const char *server_endpoints [] = {
+    "tcp://localhost:9000",
+    "tcp://localhost:9010"
+};
+#define SERVER_ENDPOINTS (sizeof (server_endpoints) / sizeof (server_endpoints [0]))
+
+int main (int argc, char *argv [])
 {
-    printf ("I: connecting to line controller...\n");
-    zsock_t *client = zsock_new_dealer (SERVER_ENDPOINT);
-    assert (client);
+    const char **endpoints = server_endpoints;
+    size_t endpoint_count = SERVER_ENDPOINTS;
+    int percentile = -1;
+    int command = -1;
+    int argn = 1;
+    while (argn + 1 < argc && argv [argn][0] == '-') {
+        if (streq (argv [argn], "-p"))
+            percentile = atoi (argv [argn + 1]);
+        else
+        if (streq (argv [argn], "-c"))
+            command = (int) strtol (argv [argn + 1], NULL, 0);
+        else
+            break;
+        argn += 2;
+    }
+    if (argn < argc) {
+        endpoints = (const char **) argv + argn;
+        endpoint_count = argc - argn;
+    }
+    if (percentile == -1)
+        percentile = endpoints == server_endpoints? 0: HEDGE_PERCENTILE;
+    if (percentile < 0 || percentile > 100 || command < -1 || command > 0xFF
+    ||  (argn < argc && argv [argn][0] == '-')) {
+        printf ("Usage: client [-p hedge percentile] [-c signal] [endpoint ...]\n");
+        return 0;
+    }
+    if (percentile)
+        printf ("I: connecting to %zu line controllers, hedging after p%d...\n", endpoint_count, percentile);
+    else
+        printf ("I: connecting to %zu line controllers, failing over only...\n", endpoint_count);
+    hedge_t *client = s_hedge_new (endpoints, endpoint_count, REQUEST_TIMEOUT, percentile);
 
+    srandom ((unsigned) zclock_usecs ());
+    if (command != -1) {
+        //  A lifecycle command, e.g. -c 0113 to stop, goes to all lines of
+        //  the Plant, which replies with the first error reported, or 0
+        byte signal = (byte) command;
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstrf (msg, "%ld", random ());
+        zmsg_addmem (msg, PNP_COMMAND, 1);
+        zmsg_addmem (msg, &signal, 1);
+        zmsg_t *reply = s_hedge_request (client, &msg, REQUEST_RETRIES);
+        if (reply && zmsg_size (reply) == 2)
+            printf ("I: command %o acknowledged, result %o\n", signal, zframe_data (zmsg_last (reply)) [0]);
+        else
+            printf ("E: command %o got no reply\n", signal);
+        zmsg_destroy (&reply);
+        s_hedge_destroy (&client);
+        return 0;
+    }
     int sequence = 0;
-    int retries_left = REQUEST_RETRIES;
-    while (retries_left && !zsys_interrupted) {
-        //  We send a request, then we work to get a reply
+    while (!zsys_interrupted) {
+        //  We send a request, then we work to get a reply. Sampled requests
+        //  carry a trace frame
         char request [10];
         sprintf (request, "%d", ++sequence);
 	printf("Sending request (%s)", request);
-        zstr_send (client, request);
-
-        int expect_reply = 1;
-        while (expect_reply) {
-            //  Poll socket for a reply, with timeout
-            zmq_pollitem_t items [] = { { zsock_resolve(client), 0, ZMQ_POLLIN, 0 } };
-            int rc = zmq_poll (items, 1, REQUEST_TIMEOUT * ZMQ_POLL_MSEC);
-            if (rc == -1)
-                break;          //  Interrupted
-
-            //  .split process server reply
-            //  Here we process a server reply and exit our loop if the
-            //  reply is valid. If we didn't a reply we close the client
-            //  socket and resend the request. We try a number of times
-            //  before finally abandoning:
-            
-            if (items [0].revents & ZMQ_POLLIN) {
-                //  We got a reply from the server, must match sequence
-                char *reply = zstr_recv (client);
-                if (!reply)
-                    break;      //  Interrupted
-                if (atoi (reply) == sequence) {
-                    printf ("I: line controller replied (%s)\n", reply);
-                    retries_left = REQUEST_RETRIES;
-                    expect_reply = 0;
-                }
-                else
-                    printf ("E: malformed reply from line controller: %s\n",
-                        reply);
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addstr (msg, request);
+        if (s_trace_start (msg))
+            s_trace_stamp (msg, TRACE_CLIENT, TRACE_SEND);
 
-                free (reply);
-            }
-            else
-            if (--retries_left == 0) {
-                printf ("E: line controller seems to be offline, abandoning\n");
-                break;
-            }
-            else {
-                printf ("W: no response from line controller, retrying...\n");
-                //  Old socket is confused; close it and open a new one
-                zsock_destroy (&client);
-                printf ("I: reconnecting to line controller...\n");
-                client = zsock_new (ZMQ_DEALER);
-                zsock_connect (client, SERVER_ENDPOINT);
-                //  Send request again, on new socket
-                zstr_send (client, request);
-            }
+        //  The reply echoes our sequence, or there is none after all retries
+        zmsg_t *reply_msg = s_hedge_request (client, &msg, REQUEST_RETRIES);
+        if (!reply_msg) {
+            if (!zsys_interrupted)
+                printf ("E: line controllers seem to be offline, abandoning\n");
+            break;
         }
+        s_trace_stamp (reply_msg, TRACE_CLIENT, TRACE_RECEIVE);
+        s_trace_write (reply_msg);
+        char *reply = zmsg_popstr (reply_msg);
+        zmsg_destroy (&reply_msg);
+        if (!reply)
+            break;
+        printf ("I: line controller replied (%s)\n", reply);
+        free (reply);
     }
+    s_hedge_report (client);
+    s_hedge_destroy (&client);
     return 0;
 }
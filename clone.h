@@ -0,0 +1,179 @@
+#ifndef PNP_STATUS_CACHE
+#define PNP_STATUS_CACHE "Pick-n-Pack Status Cache"
+
+//  The Plant keeps the latest status of every line, module and device in its
+//  status table (status.h), fed by the heartbeats of the lines, and serves it
+//  to any number of clients as in ZeroMQ's Clone pattern. A client subscribes
+//  to the updates first, then asks for a snapshot; it drops updates the
+//  snapshot already holds and applies the rest in sequence. The Plant sends
+//  each change once, to all subscribers, so dashboards cost it one message
+//  per line heartbeat with changes rather than one per client per resource.
+//
+//  Snapshot request: ICANHAZ, reply: KTHXBAI, STATUS where STATUS is a full
+//  status frame with the sequence of the last update.
+//  Update: STATUS, a status frame with the entries that changed and the next
+//  sequence. While nothing changes, the Plant sends an update without entries
+//  and with the current sequence every heartbeat, so clients notice a silent
+//  Plant. A client that misses a sequence takes a new snapshot.
+
+#define CLONE_ICANHAZ       "ICANHAZ?"
+#define CLONE_KTHXBAI       "KTHXBAI"
+#define CLONE_TIMEOUT       3000    //  msecs without updates or snapshot before a client resyncs
+
+//  The publish method sends the changes in <tree> to the subscribers, with the
+//  next sequence, and commits them. Sends an update without entries if nothing
+//  changed and <keepalive> is set. Without <publisher> the changes are only
+//  committed.
+static void
+s_clone_publish (status_t *tree, zsock_t *publisher, int keepalive)
+{
+    zframe_t *frame = publisher? s_status_frame (tree, 0, tree->sequence + 1): NULL;
+    if (frame)
+        tree->sequence++;
+    else
+    if (publisher && keepalive) {
+        frame = zframe_new (NULL, STATUS_HEADER);
+        zframe_data (frame) [0] = PNP_STATUS [0];
+        zframe_data (frame) [1] = 0;
+        memcpy (zframe_data (frame) + 2, &tree->sequence, sizeof (tree->sequence));
+    }
+    if (frame)
+        zframe_send (&frame, publisher, ZFRAME_DONTWAIT);
+    s_status_commit (tree);
+}
+
+//  The snapshot method answers a snapshot request on <snapshot> with all of
+//  <tree>. Changes not yet published are in the snapshot already, and again
+//  in the next update, which does no harm as entries hold the latest values.
+//  Returns -1 if interrupted.
+static int
+s_clone_snapshot (status_t *tree, zsock_t *snapshot)
+{
+    zmsg_t *msg = zmsg_recv (snapshot);
+    if (!msg)
+        return -1;
+    zframe_t *identity = zmsg_pop (msg);
+    char *request = zmsg_popstr (msg);
+    if (identity && request && streq (request, CLONE_ICANHAZ)) {
+        zmsg_t *reply = zmsg_new ();
+        zmsg_append (reply, &identity);
+        zmsg_addstr (reply, CLONE_KTHXBAI);
+        zframe_t *frame = s_status_frame (tree, 1, tree->sequence);
+        zmsg_append (reply, &frame);
+        zmsg_send (&reply, snapshot);
+    }
+    else
+        printf ("E: invalid status snapshot request\n");
+    zframe_destroy (&identity);
+    free (request);
+    zmsg_destroy (&msg);
+    return 0;
+}
+
+//  A client copy of the status table
+
+typedef struct {
+    zsock_t *snapshot;          //  Asks the Plant for snapshots
+    zsock_t *updates;           //  Receives updates from the Plant
+    status_t *tree;             //  Our copy, changed entries flagged until committed
+    uint32_t sequence;          //  Sequence of the last snapshot or update applied
+    int synced;                 //  Snapshot received, updates apply
+    int64_t expiry;             //  Resync if nothing arrives by then
+    size_t snapshots;           //  Snapshots taken
+    size_t updates_applied;     //  Updates applied
+} clone_t;
+
+//  Construct new copy of the status cache of the Plant at <snapshot_endpoint>
+//  and <updates_endpoint>, and ask for a snapshot
+static clone_t *
+s_clone_new (const char *snapshot_endpoint, const char *updates_endpoint)
+{
+    clone_t *self = (clone_t *) zmalloc (sizeof (clone_t));
+    self->tree = s_status_new ();
+    //  Subscribe before the snapshot, so no update falls in between
+    self->updates = zsock_new_sub (updates_endpoint, "");
+    self->snapshot = zsock_new_dealer (snapshot_endpoint);
+    assert (self->updates && self->snapshot);
+    zstr_send (self->snapshot, CLONE_ICANHAZ);
+    self->expiry = zclock_time () + CLONE_TIMEOUT;
+    return self;
+}
+
+static void
+s_clone_destroy (clone_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        clone_t *self = *self_p;
+        zsock_destroy (&self->snapshot);
+        zsock_destroy (&self->updates);
+        s_status_destroy (&self->tree);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Returns the sequence of a status frame
+static uint32_t
+s_clone_sequence (zframe_t *frame)
+{
+    uint32_t sequence;
+    memcpy (&sequence, zframe_data (frame) + 2, sizeof (sequence));
+    return sequence;
+}
+
+//  The receive method handles what arrived on our sockets and returns 1 if
+//  the tree changed, 0 if not, or -1 if nothing arrived in time, after which
+//  the caller may connect another clone to another Plant. Updates wait on
+//  their socket until the snapshot is in.
+static int
+s_clone_receive (clone_t *self, int timeout)
+{
+    zmq_pollitem_t items [] = {
+        { zsock_resolve (self->snapshot), 0, ZMQ_POLLIN, 0 },
+        { zsock_resolve (self->updates), 0, ZMQ_POLLIN, 0 }
+    };
+    if (zmq_poll (items, self->synced? 2: 1, timeout * ZMQ_POLL_MSEC) == -1)
+        return -1;              //  Interrupted
+    int changed = 0;
+    if (items [0].revents & ZMQ_POLLIN) {
+        zmsg_t *msg = zmsg_recv (self->snapshot);
+        char *reply = msg? zmsg_popstr (msg): NULL;
+        zframe_t *frame = msg? zmsg_pop (msg): NULL;
+        if (reply && streq (reply, CLONE_KTHXBAI) && frame && zframe_size (frame) >= STATUS_HEADER
+        &&  s_status_merge (self->tree, "", frame) == 0) {
+            self->sequence = s_clone_sequence (frame);
+            self->synced = 1;
+            self->snapshots++;
+            self->expiry = zclock_time () + CLONE_TIMEOUT;
+            changed = 1;
+        }
+        zframe_destroy (&frame);
+        free (reply);
+        zmsg_destroy (&msg);
+    }
+    if (self->synced && (items [1].revents & ZMQ_POLLIN)) {
+        zframe_t *frame = zframe_recv (self->updates);
+        //  Updates up to our sequence are in the snapshot already; one that
+        //  skips a sequence means we lost some, and take a new snapshot
+        uint32_t sequence = frame && zframe_size (frame) >= STATUS_HEADER? s_clone_sequence (frame): 0;
+        if (sequence == self->sequence + 1 && s_status_merge (self->tree, "", frame) == 0) {
+            self->sequence = sequence;
+            self->updates_applied++;
+            changed = 1;
+        }
+        else
+        if ((int32_t) (sequence - self->sequence) > 1) {
+            printf ("W: status updates %u to %u lost, taking a new snapshot\n",
+                    self->sequence + 1, sequence - 1);
+            self->synced = 0;
+            zstr_send (self->snapshot, CLONE_ICANHAZ);
+        }
+        if ((int32_t) (sequence - self->sequence) >= 0)
+            self->expiry = zclock_time () + CLONE_TIMEOUT;
+        zframe_destroy (&frame);
+    }
+    return zclock_time () >= self->expiry? -1: changed;
+}
+
+#endif
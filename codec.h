@@ -0,0 +1,269 @@
+#ifndef PNP_LINK_CODEC
+#define PNP_LINK_CODEC "Pick-n-Pack Link Codec"
+
+//  Links between buildings, e.g. from a line to the Plant, are slow, while
+//  links between tiers on one controller or in one rack are not. The codec
+//  compresses the large frames a broker sends over a link when that pays
+//  off, and the other end decodes them whether it compresses itself or not.
+//  A compressed frame replaces the frame it holds; decoding checks its size
+//  and the checksum of the stream, so a frame that happens to start with the
+//  tag goes through as is.
+//
+//  Compressing a frame of n bytes costs about n / speed of CPU time to
+//  deflate, and a fraction of that to inflate, and saves n * (1 - ratio) /
+//  bandwidth on the wire. The sender measures its speed and the ratio on the
+//  frames it compresses, and probes every CODEC_PROBE-th frame while it does
+//  not, so it notices when payloads become compressible. The bandwidth is
+//  measured by the receiver: the wire bytes arriving between two heartbeats
+//  while the link is queued, i.e. while the round-trip time is well above
+//  the lowest it has seen. It reports that in a LINK frame on its heartbeats.
+//  On a link that never queues the bandwidth stays unknown, and nothing is
+//  compressed.
+//
+//  Compressed frame: TAG, SIZE (uint32) of the original frame, deflate stream.
+//  Link frame: TAG, BANDWIDTH (uint64) in bytes/sec.
+
+#include <inttypes.h>
+#include <zlib.h>
+#include "protocol.h"
+
+#define PNP_COMPRESSED "\240"   //  Compressed frame, outside the extension tags
+
+#define CODEC_MIN_SIZE      256     //  Bytes, smaller frames are sent as is
+#define CODEC_HEADER        (1 + sizeof (uint32_t))
+#define CODEC_LEVEL         Z_BEST_SPEED
+#define CODEC_INFLATE       4       //  Inflating is about this much faster than deflating
+#define CODEC_PROBE         32      //  Frames sent as is between probes
+#define CODEC_WEIGHT        8       //  A new ratio or speed weighs 1/8
+#define CODEC_QUEUED        2       //  A round-trip time this many times the lowest means a queue,
+#define CODEC_QUEUED_MIN    2000    //  if also this many usecs above it
+#define CODEC_MAX_RATIO     1032    //  Deflate cannot do better
+
+typedef struct {
+    //  Sending
+    uint64_t bandwidth;         //  Bytes/sec of the link as its receiver measured it, 0 if not limited
+    double ratio;               //  Smoothed compressed to original size, 1 until measured
+    double speed;               //  Smoothed bytes/usec we deflate at, 0 until measured
+    size_t skipped;             //  Frames sent as is since the last one we compressed
+    byte *buffer;               //  Scratch space for deflating
+    size_t buffer_size;
+    size_t frames;              //  Frames large enough to compress
+    size_t compressed;          //  Of which sent compressed
+    uint64_t bytes_in;          //  Bytes of those frames before encoding
+    uint64_t bytes_out;         //  and after
+    //  Receiving
+    uint64_t received;          //  Wire bytes received since the last measurement
+    int64_t measured_at;        //  usecs
+    int64_t rtt_min;            //  Lowest round-trip time seen, usecs, 0 if none
+    uint64_t estimate;          //  Bytes/sec we measured, 0 if the link never queued
+} codec_t;
+
+static codec_t *
+s_codec_new (void)
+{
+    codec_t *self = (codec_t *) zmalloc (sizeof (codec_t));
+    self->ratio = 1.0;
+    self->measured_at = zclock_usecs ();
+    return self;
+}
+
+static void
+s_codec_destroy (codec_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        codec_t *self = *self_p;
+        free (self->buffer);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  zhash free function for codecs kept by link
+static void
+s_codec_free (void *data)
+{
+    codec_t *self = (codec_t *) data;
+    s_codec_destroy (&self);
+}
+
+//  Returns the codec of the link <key> in <codecs>, a new one if there is none
+static codec_t *
+s_codec_lookup (zhash_t *codecs, const char *key)
+{
+    codec_t *self = (codec_t *) zhash_lookup (codecs, key);
+    if (!self) {
+        self = s_codec_new ();
+        zhash_insert (codecs, key, self);
+        zhash_freefn (codecs, key, s_codec_free);
+    }
+    return self;
+}
+
+//  Returns 1 if a frame of <size> bytes should go compressed. A frame we
+//  would not compress is compressed anyway every CODEC_PROBE frames.
+static int
+s_codec_worth (codec_t *self, size_t size)
+{
+    if (size < CODEC_MIN_SIZE || !self->bandwidth)
+        return 0;
+    if (!self->speed || ++self->skipped >= CODEC_PROBE)
+        return 1;
+    double saved = size * (1.0 - self->ratio) - CODEC_HEADER;
+    double wire = saved / self->bandwidth * 1e6;
+    double cpu = size / self->speed * (1.0 + 1.0 / CODEC_INFLATE);
+    return saved > 0 && wire > cpu;
+}
+
+//  Returns <frame> compressed, or NULL if it does not get smaller, and
+//  learns the ratio and speed from it either way
+static zframe_t *
+s_codec_deflate (codec_t *self, zframe_t *frame)
+{
+    size_t size = zframe_size (frame);
+    uLongf length = compressBound (size);
+    if (self->buffer_size < CODEC_HEADER + length) {
+        free (self->buffer);
+        self->buffer_size = CODEC_HEADER + length;
+        self->buffer = (byte *) malloc (self->buffer_size);
+    }
+    int64_t started = zclock_usecs ();
+    int rc = compress2 (self->buffer + CODEC_HEADER, &length, zframe_data (frame), size, CODEC_LEVEL);
+    int64_t elapsed = zclock_usecs () - started;
+    self->skipped = 0;
+    if (rc != Z_OK)
+        return NULL;
+    double ratio = (double) (CODEC_HEADER + length) / size;
+    double speed = (double) size / (elapsed > 0? elapsed: 1);
+    self->ratio = self->speed? self->ratio + (ratio - self->ratio) / CODEC_WEIGHT: ratio;
+    self->speed = self->speed? self->speed + (speed - self->speed) / CODEC_WEIGHT: speed;
+    if (CODEC_HEADER + length >= size)
+        return NULL;
+    self->buffer [0] = PNP_COMPRESSED [0];
+    uint32_t original = (uint32_t) size;
+    memcpy (self->buffer + 1, &original, sizeof (original));
+    return zframe_new (self->buffer, CODEC_HEADER + length);
+}
+
+//  Returns <frame> decompressed, or NULL if it is not a compressed frame
+static zframe_t *
+s_codec_inflate (zframe_t *frame)
+{
+    size_t size = zframe_size (frame);
+    byte *data = zframe_data (frame);
+    if (size <= CODEC_HEADER || data [0] != (byte) PNP_COMPRESSED [0])
+        return NULL;
+    uint32_t original;
+    memcpy (&original, data + 1, sizeof (original));
+    if (original > (size - CODEC_HEADER) * CODEC_MAX_RATIO)
+        return NULL;
+    zframe_t *decoded = zframe_new (NULL, original);
+    uLongf length = original;
+    if (uncompress (zframe_data (decoded), &length, data + CODEC_HEADER, size - CODEC_HEADER) != Z_OK
+    ||  length != original) {
+        zframe_destroy (&decoded);
+        return NULL;
+    }
+    return decoded;
+}
+
+//  The encode method compresses the frames of <msg> that are worth it, for
+//  the link of <self>. Does nothing if <self> is NULL.
+static void
+s_codec_encode (codec_t *self, zmsg_t *msg)
+{
+    if (!self)
+        return;
+    size_t count = zmsg_size (msg);
+    while (count--) {
+        zframe_t *frame = zmsg_pop (msg);
+        size_t size = zframe_size (frame);
+        if (size >= CODEC_MIN_SIZE) {
+            self->frames++;
+            self->bytes_in += size;
+            zframe_t *compressed = s_codec_worth (self, size)? s_codec_deflate (self, frame): NULL;
+            if (compressed) {
+                zframe_destroy (&frame);
+                frame = compressed;
+                self->compressed++;
+            }
+            self->bytes_out += zframe_size (frame);
+        }
+        zmsg_append (msg, &frame);
+    }
+}
+
+//  The decode method restores the compressed frames of <msg>, received over
+//  the link of <self>, and counts its wire bytes. <self> may be NULL.
+static void
+s_codec_decode (codec_t *self, zmsg_t *msg)
+{
+    size_t count = zmsg_size (msg);
+    while (count--) {
+        zframe_t *frame = zmsg_pop (msg);
+        if (self)
+            self->received += zframe_size (frame);
+        zframe_t *decoded = s_codec_inflate (frame);
+        if (decoded)
+            zframe_destroy (&frame);
+        zmsg_append (msg, decoded? &decoded: &frame);
+    }
+}
+
+//  The measure method takes a round-trip time over the link, usecs, e.g. at
+//  each heartbeat, and the wire bytes received since the last one. While the
+//  link is queued, their rate is what it carries; while it is not, it
+//  carries at least that.
+static void
+s_codec_measure (codec_t *self, int64_t rtt)
+{
+    int64_t now = zclock_usecs ();
+    int64_t elapsed = now - self->measured_at;
+    if (elapsed <= 0)
+        return;
+    uint64_t rate = (uint64_t) (self->received * 1e6 / elapsed);
+    if (rtt > 0 && (!self->rtt_min || rtt < self->rtt_min))
+        self->rtt_min = rtt;
+    if (self->rtt_min && rtt > self->rtt_min * CODEC_QUEUED && rtt > self->rtt_min + CODEC_QUEUED_MIN)
+        self->estimate = self->estimate? self->estimate + ((int64_t) rate - (int64_t) self->estimate) / CODEC_WEIGHT: rate;
+    else
+    if (self->estimate && rate > self->estimate)
+        self->estimate = rate;
+    self->received = 0;
+    self->measured_at = now;
+}
+
+//  Returns a LINK frame with the bandwidth we measured, or NULL if the link
+//  never queued
+static zframe_t *
+s_codec_link_frame (codec_t *self)
+{
+    if (!self->estimate)
+        return NULL;
+    zframe_t *frame = zframe_new (NULL, 1 + sizeof (uint64_t));
+    zframe_data (frame) [0] = PNP_LINK [0];
+    memcpy (zframe_data (frame) + 1, &self->estimate, sizeof (uint64_t));
+    return frame;
+}
+
+//  The link method takes the bandwidth the receiver reported in <frame>.
+//  Does nothing if <self> is NULL.
+static void
+s_codec_link (codec_t *self, zframe_t *frame)
+{
+    if (self && zframe_size (frame) == 1 + sizeof (uint64_t))
+        memcpy (&self->bandwidth, zframe_data (frame) + 1, sizeof (uint64_t));
+}
+
+//  The report method prints what the codec did on the link to <name>
+static void
+s_codec_report (codec_t *self, const char *name)
+{
+    if (!self)
+        return;
+    printf ("I: link to %s, %" PRIu64 " bytes/sec: %zu of %zu frames compressed, %" PRIu64
+            " to %" PRIu64 " bytes, ratio %.2f, %.0f MB/s\n", name, self->bandwidth, self->compressed,
+            self->frames, self->bytes_in, self->bytes_out, self->ratio, self->speed);
+}
+
+#endif
@@ -0,0 +1,349 @@
+//  Pick-n-Pack link compression benchmark
+//
+//  Measures what the link codec (codec.h) does for the traffic of a line to
+//  the Plant over a slow link, and over a local one. Main plays the line: it
+//  sends payloads through s_resource_send like line.c does, keeping a window
+//  of them unacknowledged, and heartbeats with the echo of the Plant clock.
+//  An actor plays the Plant: it decodes, acknowledges each payload, measures
+//  the link from the heartbeats and reports it in its own. Between them, a
+//  proxy actor throttles what the line sends to a bandwidth, queueing it as
+//  a slow link does; the other way is not throttled.
+//
+//  Every payload kind runs with compression off, always on and adaptive.
+//  Text payloads look like sensor readings and compress well, random ones
+//  like camera frames and do not, mixed ones switch every BENCH_SWITCH.
+//
+//  Usage: compressbench [-n payloads] [-s size] [-b KB/sec of the slow link]
+
+#include "czmq.h"
+#include "defs.h"
+
+#define BENCH_PAYLOADS  400
+#define BENCH_SIZE      (16 * 1024)
+#define BENCH_BANDWIDTH 1024            //  KB/sec
+#define BENCH_WINDOW    16              //  Payloads unacknowledged
+#define BENCH_HEARTBEAT 100             //  msecs
+#define BENCH_WARMUP    3               //  Heartbeats before the payloads, so the Plant knows the idle link
+#define BENCH_SWITCH    50              //  Payloads of one kind in a row for mixed payloads
+#define BENCH_NEAR      "inproc://compressbench-near"
+#define BENCH_FAR       "inproc://compressbench-far"
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+typedef enum { PAYLOAD_TEXT, PAYLOAD_RANDOM, PAYLOAD_MIXED } bench_payload;
+typedef enum { MODE_OFF, MODE_ALWAYS, MODE_ADAPTIVE } bench_mode;
+
+typedef struct {
+    size_t count;
+    size_t size;
+    uint64_t bandwidth;         //  Bytes/sec of the link, 0 if not throttled
+    //  Results from the Plant
+    int64_t *delays;            //  From send to decoded, usecs
+    size_t received;
+    uint64_t wire;              //  Bytes received from the line
+    uint64_t payload;           //  of which payload, decoded
+    uint64_t estimate;          //  Bandwidth it measured at the end
+} bench_t;
+
+typedef struct {
+    zmsg_t *msg;
+    int64_t deliver_at;         //  usecs
+} queued_t;
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The proxy actor is the link. What the line sends takes its size divided
+//  by the bandwidth on the wire, after what was sent before it.
+static void
+s_proxy (zsock_t *pipe, void *args)
+{
+    bench_t *bench = (bench_t *) args;
+    zsock_t *near = zsock_new (ZMQ_DEALER);
+    zsock_t *far = zsock_new (ZMQ_DEALER);
+    assert (near && far);
+    zsock_bind (near, BENCH_NEAR);
+    zsock_connect (far, BENCH_FAR);
+    zlist_t *queue = zlist_new ();
+    int64_t free_at = 0;
+    zsock_signal (pipe, 0);
+
+    while (!zsys_interrupted) {
+        queued_t *head = (queued_t *) zlist_first (queue);
+        int64_t now = zclock_usecs ();
+        while (head && head->deliver_at <= now) {
+            zlist_pop (queue);
+            zmsg_send (&head->msg, far);
+            free (head);
+            head = (queued_t *) zlist_first (queue);
+        }
+        long timeout = head? (long) ((head->deliver_at - now + 999) / 1000): -1;
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (near), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (far), 0, ZMQ_POLLIN, 0 }
+        };
+        if (zmq_poll (items, 3, timeout * ZMQ_POLL_MSEC) == -1 || (items [0].revents & ZMQ_POLLIN))
+            break;              //  Interrupted, or $TERM
+        if (items [1].revents & ZMQ_POLLIN) {
+            queued_t *queued = (queued_t *) zmalloc (sizeof (queued_t));
+            queued->msg = zmsg_recv (near);
+            now = zclock_usecs ();
+            if (bench->bandwidth) {
+                free_at = (free_at > now? free_at: now)
+                        + (int64_t) (zmsg_content_size (queued->msg) * 1e6 / bench->bandwidth);
+                queued->deliver_at = free_at;
+            }
+            else
+                queued->deliver_at = now;
+            zlist_append (queue, queued);
+        }
+        if (items [2].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (far);
+            zmsg_send (&msg, near);
+        }
+    }
+    while (zlist_size (queue)) {
+        queued_t *queued = (queued_t *) zlist_pop (queue);
+        zmsg_destroy (&queued->msg);
+        free (queued);
+    }
+    zlist_destroy (&queue);
+    zsock_destroy (&near);
+    zsock_destroy (&far);
+}
+
+//  The Plant actor decodes and acknowledges payloads, and measures the link
+//  like plant.c does
+static void
+s_plant (zsock_t *pipe, void *args)
+{
+    bench_t *bench = (bench_t *) args;
+    zsock_t *backend = zsock_new (ZMQ_ROUTER);
+    assert (backend);
+    zsock_bind (backend, BENCH_FAR);
+    codec_t *codec = s_codec_new ();
+    rtt_t rtt = { .count = 0 };
+    zframe_t *line = NULL;
+    int64_t heartbeat_at = zclock_time () + BENCH_HEARTBEAT;
+    zsock_signal (pipe, 0);
+
+    while (!zsys_interrupted) {
+        if (zclock_time () >= heartbeat_at && line) {
+            zmsg_t *msg = zmsg_new ();
+            zframe_t *frame = zframe_dup (line);
+            zmsg_append (msg, &frame);
+            zmsg_addmem (msg, PNP_HEARTBEAT, 1);
+            frame = s_rtt_clock_frame (NULL);
+            zmsg_append (msg, &frame);
+            frame = s_codec_link_frame (codec);
+            if (frame)
+                zmsg_append (msg, &frame);
+            zmsg_send (&msg, backend);
+            heartbeat_at = zclock_time () + BENCH_HEARTBEAT;
+        }
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (backend), 0, ZMQ_POLLIN, 0 }
+        };
+        int64_t timeout = heartbeat_at - zclock_time ();
+        if (zmq_poll (items, 2, (timeout > 0? timeout: 0) * ZMQ_POLL_MSEC) == -1
+        ||  (items [0].revents & ZMQ_POLLIN))
+            break;              //  Interrupted, or $TERM
+        if (!(items [1].revents & ZMQ_POLLIN))
+            continue;
+        zmsg_t *msg = zmsg_recv (backend);
+        zframe_t *identity = zmsg_unwrap (msg);
+        bench->wire += zmsg_content_size (msg);
+        s_codec_decode (codec, msg);
+        if (zframe_size (zmsg_first (msg)) == 1
+        &&  memcmp (zframe_data (zmsg_first (msg)), PNP_HEARTBEAT, 1) == 0) {
+            zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+            if (frame && s_rtt_sample (&rtt, frame) == 0)
+                s_codec_measure (codec, rtt.last);
+        }
+        else {
+            //  Payload: SENT (int64), PAYLOAD
+            int64_t sent;
+            memcpy (&sent, zframe_data (zmsg_first (msg)), sizeof (sent));
+            zframe_t *payload = zmsg_next (msg);
+            if (zframe_size (payload) != bench->size)
+                printf ("E: payload of %zu bytes, expected %zu\n", zframe_size (payload), bench->size);
+            if (bench->received < bench->count)
+                bench->delays [bench->received++] = zclock_usecs () - sent;
+            bench->payload += zframe_size (payload);
+            zmsg_t *ack = zmsg_new ();
+            zframe_t *frame = zframe_dup (identity);
+            zmsg_append (ack, &frame);
+            zmsg_addmem (ack, PNP_ACK, 1);
+            zmsg_send (&ack, backend);
+        }
+        zmsg_destroy (&msg);
+        if (!line)
+            line = identity;
+        else
+            zframe_destroy (&identity);
+    }
+    bench->estimate = codec->estimate;
+    zframe_destroy (&line);
+    s_codec_destroy (&codec);
+    zsock_destroy (&backend);
+}
+
+//  Fills <data> with the payload number <payload_nbr> of <kind>
+static void
+s_bench_fill (byte *data, size_t size, bench_payload kind, size_t payload_nbr)
+{
+    if (kind == PAYLOAD_MIXED)
+        kind = (payload_nbr / BENCH_SWITCH) % 2? PAYLOAD_RANDOM: PAYLOAD_TEXT;
+    size_t filled = 0;
+    if (kind == PAYLOAD_TEXT)
+        while (filled < size) {
+            char line [128];
+            int length = snprintf (line, sizeof (line),
+                "station=%zu tray=%zu temp=%.2f weight=%.1f seal=%s\n",
+                filled % 7, payload_nbr, 180 + (rand () % 500) / 100.0, 250 + (rand () % 100) / 10.0,
+                rand () % 50? "ok": "retry");
+            size_t chunk = size - filled < (size_t) length? size - filled: (size_t) length;
+            memcpy (data + filled, line, chunk);
+            filled += chunk;
+        }
+    else
+        for (; filled < size; filled++)
+            data [filled] = (byte) rand ();
+}
+
+//  The run method plays the line for one payload kind and mode, and reports
+//  throughput, delays, and what went compressed
+static void
+s_bench_run (bench_t *bench, const char *link, bench_payload kind, bench_mode mode)
+{
+    const char *kinds [] = { "text", "random", "mixed" };
+    const char *modes [] = { "off", "always", "adaptive" };
+    bench->delays = (int64_t *) zmalloc (bench->count * sizeof (int64_t));
+    bench->received = 0;
+    bench->wire = 0;
+    bench->payload = 0;
+    bench->estimate = 0;
+    zactor_t *plant = zactor_new (s_plant, bench);
+    zactor_t *proxy = zactor_new (s_proxy, bench);
+
+    resource_t self = { .name = "bench" };
+    self.frontend = zsock_new (ZMQ_DEALER);
+    assert (self.frontend);
+    zsock_connect (self.frontend, BENCH_NEAR);
+    self.codec = mode == MODE_OFF? NULL: s_codec_new ();
+    //  Always on is adaptive over a link that carries one byte a second
+    if (mode == MODE_ALWAYS)
+        self.codec->bandwidth = 1;
+    byte *data = (byte *) malloc (bench->size);
+    size_t sent = 0;
+    size_t acked = 0;
+    int64_t heartbeat_at = zclock_time ();
+    int64_t started = zclock_time () + BENCH_WARMUP * BENCH_HEARTBEAT;
+    int64_t finished = started;
+
+    while (acked < bench->count && !zsys_interrupted) {
+        while (zclock_time () >= started && sent < bench->count && sent - acked < BENCH_WINDOW) {
+            zmsg_t *msg = zmsg_new ();
+            s_bench_fill (data, bench->size, kind, sent++);
+            int64_t now = zclock_usecs ();
+            zmsg_addmem (msg, &now, sizeof (now));
+            zmsg_addmem (msg, data, bench->size);
+            s_resource_send (&self, &msg, CAPTURE_FRONTEND);
+        }
+        if (zclock_time () >= heartbeat_at) {
+            zmsg_t *heartbeat = zmsg_new ();
+            zmsg_addmem (heartbeat, PNP_HEARTBEAT, 1);
+            zframe_t *frame = s_rtt_clock_frame (&self.echo);
+            zmsg_append (heartbeat, &frame);
+            s_resource_send (&self, &heartbeat, CAPTURE_FRONTEND);
+            heartbeat_at = zclock_time () + BENCH_HEARTBEAT;
+        }
+        int64_t timeout = heartbeat_at - zclock_time ();
+        if (sent < bench->count && started - zclock_time () < timeout)
+            timeout = started - zclock_time ();
+        zmq_pollitem_t items [] = { { zsock_resolve (self.frontend), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, (timeout > 0? timeout: 0) * ZMQ_POLL_MSEC) == -1)
+            break;              //  Interrupted
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
+        zmsg_t *msg = s_resource_recv (&self, CAPTURE_FRONTEND);
+        if (memcmp (zframe_data (zmsg_first (msg)), PNP_ACK, 1) == 0) {
+            acked++;
+            finished = zclock_time ();
+        }
+        else {
+            zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+            if (frame)
+                s_rtt_stamp (&self.echo, frame);
+            frame = s_msg_extension (msg, PNP_LINK);
+            if (frame && mode == MODE_ADAPTIVE)
+                s_codec_link (self.codec, frame);
+        }
+        zmsg_destroy (&msg);
+    }
+    zactor_destroy (&proxy);
+    zactor_destroy (&plant);
+
+    int64_t elapsed = finished - started;
+    qsort (bench->delays, bench->received, sizeof (int64_t), s_compare_latency);
+    printf ("%-6s %-7s %-9s %10.2f %10.1f %10.1f %8zu/%-5zu %8.2f %10" PRIu64 "\n", link,
+            kinds [kind], modes [mode], elapsed > 0? bench->payload / 1e3 / elapsed: 0,
+            bench->received? bench->delays [bench->received / 2] / 1e3: 0,
+            bench->received? bench->delays [bench->received * 99 / 100] / 1e3: 0,
+            self.codec? self.codec->compressed: 0, self.codec? self.codec->frames: 0,
+            bench->payload? (double) bench->wire / bench->payload: 0, bench->estimate / 1024);
+    free (data);
+    free (bench->delays);
+    s_codec_destroy (&self.codec);
+    zsock_destroy (&self.frontend);
+}
+
+int main (int argc, char *argv [])
+{
+    bench_t bench = { .count = BENCH_PAYLOADS, .size = BENCH_SIZE, .bandwidth = BENCH_BANDWIDTH * 1024 };
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            bench.count = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-s") && argn + 1 < argc)
+            bench.size = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-b") && argn + 1 < argc)
+            bench.bandwidth = atol (argv [++argn]) * 1024;
+        else {
+            printf ("usage: compressbench [-n payloads] [-s size] [-b KB/sec of the slow link]\n");
+            return 1;
+        }
+    }
+    printf ("%zu payloads of %zu bytes, slow link %" PRIu64 " KB/sec\n", bench.count, bench.size,
+            bench.bandwidth / 1024);
+    printf ("%-6s %-7s %-9s %10s %10s %10s %14s %8s %10s\n", "link", "payload", "mode", "MB/sec",
+            "p50 msecs", "p99 msecs", "compressed", "wire", "KB/sec");
+    uint64_t bandwidths [] = { bench.bandwidth, 0 };
+    int link;
+    for (link = 0; link < 2 && !zsys_interrupted; link++) {
+        bench.bandwidth = bandwidths [link];
+        bench_payload kind;
+        for (kind = PAYLOAD_TEXT; kind <= PAYLOAD_MIXED && !zsys_interrupted; kind++) {
+            bench_mode mode;
+            for (mode = MODE_OFF; mode <= MODE_ADAPTIVE && !zsys_interrupted; mode++)
+                s_bench_run (&bench, link? "local": "slow", kind, mode);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,151 @@
+#ifndef PNP_CONFIG
+#define PNP_CONFIG "Pick-n-Pack Versioned Configuration"
+
+//  A resource keeps its configuration as a payload of parameters, with a
+//  version and a digest of the parameters. A CONFIGURE command carries either
+//  the full configuration or a delta, i.e. only the parameters that changed
+//  since a base version, and the version and digest the configuration has once
+//  it is applied. A resource passes on only the parameters that changed for
+//  it, and if none did, it skips the CONFIGURING transition.
+//
+//  A delta for another base version than ours cannot be applied; the resource
+//  answers CONFIG_STALE and its frontend sends it the full configuration.
+//
+//  Version frame: BASE (uint32), VERSION (uint32), DIGEST (uint64), where BASE
+//  is 0 for a full configuration.
+
+#define CONFIG_HEADER       (2 * sizeof (uint32_t) + sizeof (uint64_t))
+#define CONFIG_UNCHANGED    0
+#define CONFIG_CHANGED      1
+#define CONFIG_STALE        2
+
+typedef struct {
+    payload_t *values;          //  Parameters by name
+    uint32_t version;           //  0 until the first configuration
+    uint32_t base;              //  Version before the last update
+    uint64_t digest;            //  Digest of the parameters
+    payload_t *delta;           //  Parameters that changed with the last update
+    payload_t *incoming;        //  Parameters of the command being applied
+    zframe_t *encoded_delta;    //  Encoded delta, once sent
+    zframe_t *encoded_full;     //  Encoded parameters, once sent
+} config_t;
+
+static config_t *
+s_config_new (void)
+{
+    config_t *self = (config_t *) zmalloc (sizeof (config_t));
+    self->values = s_payload_new ();
+    self->delta = s_payload_new ();
+    self->incoming = s_payload_new ();
+    return self;
+}
+
+static void
+s_config_destroy (config_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        config_t *self = *self_p;
+        s_payload_destroy (&self->values);
+        s_payload_destroy (&self->delta);
+        s_payload_destroy (&self->incoming);
+        zframe_destroy (&self->encoded_delta);
+        zframe_destroy (&self->encoded_full);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Makes <version> of the parameters in <incoming> current, keeping those that
+//  changed in the delta. Returns the number of parameters that changed.
+static size_t
+s_config_apply (config_t *self, uint32_t version, int full)
+{
+    s_payload_reset (self->delta);
+    size_t changed = 0;
+    if (full) {
+        //  The full configuration replaces ours, parameters it does not have are gone
+        payload_t *previous = self->values;
+        self->values = self->incoming;
+        self->incoming = previous;
+        size_t item_nbr;
+        for (item_nbr = 0; item_nbr < self->values->size; item_nbr++) {
+            payload_item_t *item = &self->values->items [item_nbr];
+            payload_item_t *old = s_payload_find (previous, (char *) self->values->arena + item->name, item->name_size);
+            if (!old || !s_payload_equal (previous, old, self->values, item)) {
+                s_payload_copy (self->delta, self->values, item);
+                changed++;
+            }
+        }
+    }
+    else
+        changed = s_payload_merge (self->values, self->incoming, self->delta);
+    self->base = self->version;
+    self->version = version;
+    self->digest = s_payload_digest (self->values);
+    zframe_destroy (&self->encoded_delta);
+    zframe_destroy (&self->encoded_full);
+    return changed;
+}
+
+//  The commit method makes a new version of the parameters set in <changes>, as
+//  the origin of a configuration does. Returns the number of parameters that
+//  changed.
+static size_t
+s_config_commit (config_t *self, payload_t *changes)
+{
+    s_payload_reset (self->incoming);
+    s_payload_merge (self->incoming, changes, NULL);
+    return s_config_apply (self, self->version + 1, 0);
+}
+
+//  The update method applies the PAYLOAD and VERSION frames of a CONFIGURE
+//  command. Returns CONFIG_CHANGED, CONFIG_UNCHANGED if we had that configuration
+//  already, CONFIG_STALE if the delta is not for our version, or -1 if the frames
+//  are malformed.
+static int
+s_config_update (config_t *self, zframe_t *payload, zframe_t *header)
+{
+    if (zframe_size (header) != CONFIG_HEADER)
+        return -1;
+    uint32_t base, version;
+    uint64_t digest;
+    memcpy (&base, zframe_data (header), sizeof (base));
+    memcpy (&version, zframe_data (header) + sizeof (base), sizeof (version));
+    memcpy (&digest, zframe_data (header) + 2 * sizeof (base), sizeof (digest));
+    if (self->version && version == self->version && digest == self->digest)
+        return CONFIG_UNCHANGED;
+    if (base && base != self->version)
+        return CONFIG_STALE;
+    s_payload_reset (self->incoming);
+    if (s_payload_decode (self->incoming, payload) == -1)
+        return -1;
+    uint64_t previous = self->digest;
+    s_config_apply (self, version, !base);
+    if (self->digest != digest) {
+        //  We missed a change somewhere, only the full configuration can fix that
+        self->version = 0;
+        return CONFIG_STALE;
+    }
+    return self->digest == previous? CONFIG_UNCHANGED: CONFIG_CHANGED;
+}
+
+//  The append method adds the PAYLOAD and VERSION frames of a CONFIGURE command
+//  to <msg>, with the full configuration or with the delta from our base version
+static void
+s_config_append (config_t *self, zmsg_t *msg, int full)
+{
+    zframe_t **encoded = full? &self->encoded_full: &self->encoded_delta;
+    if (!*encoded)
+        *encoded = s_payload_encode (full? self->values: self->delta);
+    zframe_t *frame = zframe_dup (*encoded);
+    zmsg_append (msg, &frame);
+    byte header [CONFIG_HEADER];
+    uint32_t base = full? 0: self->base;
+    memcpy (header, &base, sizeof (base));
+    memcpy (header + sizeof (base), &self->version, sizeof (self->version));
+    memcpy (header + 2 * sizeof (base), &self->digest, sizeof (self->digest));
+    zmsg_addmem (msg, header, CONFIG_HEADER);
+}
+
+#endif
@@ -0,0 +1,74 @@
+//  Pick-n-Pack dashboard, a client of the status cache of the Plant
+//
+//  Takes a snapshot of the status of every line, module and device from the
+//  Plant, then follows the updates and prints the resources that change.
+//  When the Plant goes silent, the dashboard fails over to the other Plant
+//  of the pair, as the client does.
+//
+//  Usage: dashboard [-q]       -q prints counts only, no resources
+
+#include "czmq.h"
+#include "rtt.h"
+#include "status.h"
+#include "clone.h"
+
+//  Primary and backup Plant, snapshot and update endpoints
+static const char *server_endpoints [][2] = {
+    { "tcp://localhost:9006", "tcp://localhost:9007" },     //  TODO: this should be configured
+    { "tcp://localhost:9016", "tcp://localhost:9017" }
+};
+#define SERVER_ENDPOINTS (sizeof (server_endpoints) / sizeof (server_endpoints [0]))
+
+//  Prints the entries that changed since the last call, and commits them
+static void
+s_dashboard_print (status_t *tree, int quiet)
+{
+    zlist_t *keys = zhash_keys (tree->entries);
+    zlist_sort (keys, NULL);
+    char *key = (char *) zlist_first (keys);
+    while (key && !quiet) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (tree->entries, key);
+        if (entry->changed && entry->state == STATUS_REMOVED)
+            printf ("  %-40s removed\n", key);
+        else
+        if (entry->changed)
+            printf ("  %-40s type %03o state %u signal %u error %03o rtt p50 < %lu p99 < %lu usecs\n",
+                    key, entry->type, entry->state, entry->signal, entry->error,
+                    1UL << (entry->rtt50 + 1), 1UL << (entry->rtt99 + 1));
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    s_status_commit (tree);
+}
+
+int main (int argc, char *argv [])
+{
+    int quiet = argc > 1 && streq (argv [1], "-q");
+    size_t server_nbr = 0;
+    printf ("I: connecting to status cache at %s...\n", server_endpoints [server_nbr][0]);
+    clone_t *clone = s_clone_new (server_endpoints [server_nbr][0], server_endpoints [server_nbr][1]);
+    size_t snapshots = 0;
+    while (!zsys_interrupted) {
+        int rc = s_clone_receive (clone, CLONE_TIMEOUT);
+        if (rc == -1 && !zsys_interrupted) {
+            printf ("W: no status from Plant, failing over...\n");
+            s_clone_destroy (&clone);
+            server_nbr = (server_nbr + 1) % SERVER_ENDPOINTS;
+            printf ("I: connecting to status cache at %s...\n", server_endpoints [server_nbr][0]);
+            clone = s_clone_new (server_endpoints [server_nbr][0], server_endpoints [server_nbr][1]);
+        }
+        else
+        if (rc == 1) {
+            if (clone->snapshots != snapshots)
+                printf ("I: snapshot at sequence %u, %zu resources\n",
+                        clone->sequence, zhash_size (clone->tree->entries));
+            else
+                printf ("I: update %u, %zu resources\n",
+                        clone->sequence, zhash_size (clone->tree->entries));
+            snapshots = clone->snapshots;
+            s_dashboard_print (clone->tree, quiet);
+        }
+    }
+    s_clone_destroy (&clone);
+    return 0;
+}
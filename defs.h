@@ -1,55 +1,7 @@
 #ifndef PNP_DEFS
 #define PNP_DEFS "Pick-n-Pack Definitions"
 
-// Ready message contains 2 frames: ID, READY
-// Heartbeat message contains 3 frames: ID, STATE, SIGNAL/COMMAND
-// Data message contains 4 frames: ID, STATE, SIGNAL/COMMAND, PAYLOAD
-
-//  Pick-n-Pack Protocol constants for signalling
-#define PNP_READY "\001"    //  Signals device is ready
-#define PNP_HEARTBEAT "\002"      //  Signals device heartbeat
-
-
-// IDs
-#define PNP_LINE_ID "\010"
-#define PNP_THERMOFORMER_ID "\011"
-#define PNP_ROBOT_CELL_ID "\012"
-#define PNP_QAS_ID "\013"
-#define PNP_CEILING_ID "\014"
-#define PNP_PRINTING_ID "\015"
-
-// Names
-#define PNP_LINE "Line"
-#define PNP_THERMOFORMER "Thermoformer"
-#define PNP_ROBOT_CELL "Robot Cell"
-#define PNP_QAS "QAS"
-#define PNP_CEILING "Ceiling"
-#define PNP_PRINTING "Printing"
-
-// Status
-#define PNP_CREATING "\100"
-#define PNP_INITIALISING "\101"
-#define PNP_CONFIGURING "\102"
-#define PNP_RUNNING "\103"
-#define PNP_PAUSING "\104"
-#define PNP_FINALISING "\105"
-#define PNP_DELETING "\106"
-
-// Signals/commands
-#define PNP_RUN "\110"
-#define PNP_PAUSE "\111"
-#define PNP_CONFIGURE "\112"
-#define PNP_STOP "\113"
-#define PNP_REBOOT "\114"
-
-// Error codes
-#define PNP_ERR_HEARTBEAT "\121"
-#define PNP_ERR_FPGA "\122"
-#define PNP_ERR_CAMERA "\123"
-#define PNP_ERR_MISSING_PARAMETER "\124"
-#define PNP_ERR_HDF5 "\125"
-#define PNP_ERR_LOG "\126"
-#define PNP_ERR_UNDEFINED "\127"
+#include "protocol.h"
 
 // Resource definitions
 #define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable
@@ -57,10 +9,76 @@
 #define INTERVAL_INIT       1000    //  Initial reconnect
 #define INTERVAL_MAX       32000    //  After exponential backoff
 
+// Broadcast lifecycle commands to all backend resources in a single send on a PUB socket,
+// instead of one send per backend resource on the ROUTER socket. Off by default: a PUB socket
+// drops commands to backend resources whose subscription has not arrived yet, see fanoutbench.c
+#ifndef PNP_BROADCAST
+#define PNP_BROADCAST 0
+#endif
+#define PNP_PUBLISHER_OFFSET 10     //  Port of the PUB socket above that of the ROUTER socket
+
+// Send heartbeats of devices and modules from a watchdog thread, so long operations in the
+// work loop do not make the parent declare them dead
+#ifndef PNP_WATCHDOG
+#define PNP_WATCHDOG 1
+#endif
+
+// Pass samples from a device to a module on the same controller through a shared-memory ring,
+// instead of over the socket
+#ifndef PNP_SHM_RING
+#define PNP_SHM_RING 0
+#endif
+
+// Msecs a device holds samples to send them in one batch message, 0 sends each sample at once
+#ifndef PNP_BATCH_WINDOW
+#define PNP_BATCH_WINDOW 0
+#endif
+
+// Unpack batches into one data message per sample before forwarding them, for frontend
+// processes that do not know batches
+#ifndef PNP_BATCH_UNPACK
+#define PNP_BATCH_UNPACK 0
+#endif
+
+// Inspect camera frames from devices in a pool of worker threads in the QAS module, and
+// forward the results instead of the frames
+#ifndef PNP_QAS_POOL
+#define PNP_QAS_POOL 0
+#endif
+
+// Track trays through the stations of the line, for WIP, throughput and dwell time per station
+#ifndef PNP_TRACKING
+#define PNP_TRACKING 1
+#endif
+
+// Devices, and modules with a watchdog, send heartbeats to their frontend less often, up to
+// ACCRUAL_BACKOFF times the interval of their type, while the heartbeats of their frontend come
+// in steady. This halves heartbeat traffic but doubles the time to detect a dead device
+#ifndef PNP_HEARTBEAT_BACKOFF
+#define PNP_HEARTBEAT_BACKOFF 0
+#endif
+
+// Resources keep a snapshot of their identity, configuration and backend resources, and resume
+// from it at CONFIGURING after a restart instead of initializing again
+#ifndef PNP_WARM_RESTART
+#define PNP_WARM_RESTART 1
+#endif
+
+// Lines compress large frames to the Plant when the link is slow enough for that to pay off,
+// see codec.h; the Plant decodes them either way
+#ifndef PNP_COMPRESSION
+#define PNP_COMPRESSION 1
+#endif
+
+// Any message refreshes the expiry of its sender, and heartbeats are left out on links that
+// carry other messages, unless they carry news, see accrual.h
+#ifndef PNP_HEARTBEAT_SUPPRESSION
+#define PNP_HEARTBEAT_SUPPRESSION 1
+#endif
+
 
 
 #define STACK_MAX 5 // maximum size of transition stack, e.g. running->configuring->initialising->finalising->pausing when configuring cannot proceed without reinit
-#define PAYLOAD_MAX 10 // maximum number of payload items in a single transition. E.g. change 10 configuration parameters.
 
 typedef enum states{
 	STATE_CREATING,
@@ -94,39 +112,53 @@ state transitions[NUM_STATES][NUM_SIGNALS] = {
 	/*STATE_DELETING*/     	{  	NO_STATE,         	NO_STATE,         	NO_STATE,         	NO_STATE,         	NO_STATE}
 };
 
+#include "accrual.h"
+#include "affinity.h"
+#include "types.h"
+#include "rtt.h"
+#include "status.h"
+#include "trace.h"
+#include "capture.h"
+#include "ring.h"
+#include "batch.h"
+#include "qas.h"
+#include "tracking.h"
+#include "transfer.h"
+#include "payload.h"
+#include "config.h"
+#include "codec.h"
+
 typedef struct {
     zframe_t *identity;         //  Identity of resource
-    char *uuid;					//  Pick-n-Pack universal unique identifier
+    byte type;                  //  Resource type, i.e. the ID byte
     char *id_string;            //  Printable identity
     int64_t expiry;             //  Expires at this time
+    rtt_t *rtt;                 //  Round-trip times and clock offset
+    accrual_t accrual;          //  Times between its heartbeats
+    uint32_t config;            //  Version of our configuration it acknowledged, 0 if none
+    suppress_t suppress;        //  Our messages and heartbeats to it
 } backend_resource_t;
 
-static char* uuid_to_name(char* uuid) {
-	if(strncmp(uuid,PNP_LINE_ID,3) == 0)
-		return PNP_LINE;
-	if(strncmp(uuid,PNP_THERMOFORMER_ID,3) == 0)
-		return PNP_THERMOFORMER;
-	if(strncmp(uuid,PNP_QAS_ID,3) == 0)
-		return PNP_QAS;
-	if(strncmp(uuid,PNP_ROBOT_CELL_ID,3) == 0)
-		return PNP_ROBOT_CELL;
-	if(strncmp(uuid,PNP_CEILING_ID,3) == 0)
-		return PNP_CEILING;
-	if(strncmp(uuid,PNP_PRINTING_ID,3) == 0)
-		return PNP_PRINTING;
-	return "unknown";
-}
-
-//  Construct new resource, i.e. new local object representing a resource at the backend
+//  The expiry method returns the time at which the accrual detector of a backend resource
+//  reaches the threshold of its type
+static int64_t
+s_backend_resource_expiry (backend_resource_t *self)
+{
+    return s_accrual_expiry (&self->accrual, s_type (self->type)->threshold, s_type (self->type)->liveness);
+}
+
+//  Construct new resource, i.e. new local object representing a resource at the backend.
+//  Until we heard its heartbeats, it is expected to send them at the interval of its <type>.
 static backend_resource_t *
-s_backend_resource_new (zframe_t *identity, char* uuid)
+s_backend_resource_new (zframe_t *identity, byte type)
 {
     backend_resource_t *self = (backend_resource_t *) zmalloc (sizeof (backend_resource_t));
     self->identity = identity;
-    self->uuid = uuid;
-    self->id_string = uuid_to_name(uuid);//zframe_strhex (identity);
-    self->expiry = zclock_time ()
-                 + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+    self->type = type;
+    self->id_string = strdup (s_type_name (type));//zframe_strhex (identity);
+    self->rtt = s_rtt_new ();
+    s_accrual_init (&self->accrual, s_type (type)->interval, zclock_time ());
+    self->expiry = s_backend_resource_expiry (self);
     return self;
 }
 
@@ -139,18 +171,32 @@ s_backend_resource_destroy (backend_resource_t **self_p)
         backend_resource_t *self = *self_p;
         zframe_destroy (&self->identity);
         free (self->id_string);
+        s_rtt_destroy (&self->rtt);
         free (self);
         *self_p = NULL;
     }
 }
 
-//  The ready method puts a backend_resource to the end of the ready list:
+//  The ready method puts a backend_resource to the end of the ready list. Its heartbeat statistics
+//  carry over from the object it replaces; so do the round-trip times measured so far and the
+//  configuration it acknowledged, unless it announced itself READY, i.e. with its own round-trip
+//  times. Backend resources are matched by identity, since several backend resources may be of
+//  the same type and so share a name:
 static void
 s_backend_resource_ready (backend_resource_t *self, zlist_t *backend_resources)
 {
     backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (backend_resources);
     while (backend_resource) {
-        if (streq (self->id_string, backend_resource->id_string)) {
+        if (zframe_eq (self->identity, backend_resource->identity)) {
+            if (!self->rtt) {
+                self->rtt = backend_resource->rtt;
+                backend_resource->rtt = NULL;
+                self->config = backend_resource->config;
+            }
+            self->accrual = backend_resource->accrual;
+            self->suppress = backend_resource->suppress;
+            s_accrual_alive (&self->accrual, zclock_time ());
+            self->expiry = s_backend_resource_expiry (self);
             zlist_remove (backend_resources, backend_resource);
             s_backend_resource_destroy (&backend_resource);
             break;
@@ -160,6 +206,33 @@ s_backend_resource_ready (backend_resource_t *self, zlist_t *backend_resources)
     zlist_append (backend_resources, self);
 }
 
+//  The beat method records a heartbeat of a backend resource that announced <interval>, or 0
+//  if it did not, and moves its expiry accordingly
+static void
+s_backend_resource_beat (backend_resource_t *self, size_t interval)
+{
+    s_accrual_heartbeat (&self->accrual, zclock_time (), interval);
+    self->expiry = s_backend_resource_expiry (self);
+}
+
+//  The alive method takes any message from the backend resource with <identity> as a sign of
+//  life, and moves its expiry accordingly. Returns the backend resource, or NULL if we do not
+//  know it yet, i.e. until its first heartbeat.
+static backend_resource_t *
+s_backend_resource_alive (zlist_t *backend_resources, zframe_t *identity)
+{
+    backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (backend_resources);
+    while (backend_resource) {
+        if (zframe_eq (identity, backend_resource->identity)) {
+            s_accrual_alive (&backend_resource->accrual, zclock_time ());
+            backend_resource->expiry = s_backend_resource_expiry (backend_resource);
+            return backend_resource;
+        }
+        backend_resource = (backend_resource_t *) zlist_next (backend_resources);
+    }
+    return NULL;
+}
+
 //  The next method returns the next available backend_resource identity:
 //  TODO: Not all backend_resources have the same capabilities so we should not just pick any backend_resource...
 static zframe_t *
@@ -173,23 +246,56 @@ s_backend_resources_next (zlist_t *backend_resources)
     return frame;
 }
 
-//  The purge method looks for and kills expired backend_resources. We hold backend_resources
-//  from oldest to most recent, so we stop at the first alive backend_resource:
+//  The purge method looks for and kills expired backend_resources. Each backend_resource expires
+//  after its own heartbeat statistics, so we check them all. The status of expired
+//  backend_resources and their descendants is removed from <status>:
 //  TODO: if backend_resources expire, it should be checked if this effects the working of the line!
 static void
-s_backend_resources_purge (zlist_t *backend_resources)
+s_backend_resources_purge (zlist_t *backend_resources, status_t *status)
 {
     backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (backend_resources);
     while (backend_resource) {
-        if (zclock_time () < backend_resource->expiry)
-            break;              //  backend_resource is alive, we're done here
+        if (zclock_time () < backend_resource->expiry) {
+            backend_resource = (backend_resource_t *) zlist_next (backend_resources);
+            continue;           //  backend_resource is alive
+        }
 	printf("I: Removing expired backend_resource %s\n", backend_resource->id_string);
+        char *key = zframe_strhex (backend_resource->identity);
+        s_status_remove (status, key);
+        free (key);
         zlist_remove (backend_resources, backend_resource);
         s_backend_resource_destroy (&backend_resource);
         backend_resource = (backend_resource_t *) zlist_first (backend_resources);
     }
 }
 
+//  The dealer method returns a DEALER socket connected to <endpoint> under <identity>, or under
+//  one the peer picks if NULL
+static zsock_t *
+s_dealer_new (const char *endpoint, const char *identity)
+{
+    zsock_t *dealer = zsock_new (ZMQ_DEALER);
+    if (identity)
+        zsock_set_identity (dealer, identity);
+    zsock_attach (dealer, endpoint, false);
+    return dealer;
+}
+
+//  The publisher method returns the endpoint of the PUB socket that broadcasts the lifecycle
+//  commands of the ROUTER socket at <endpoint>: the same address, PNP_PUBLISHER_OFFSET ports up,
+//  e.g. tcp://*:9013 for tcp://*:9003. Returns NULL if <endpoint> has no port; caller frees it.
+static char *
+s_publisher_endpoint (const char *endpoint)
+{
+    const char *port = strrchr (endpoint, ':');
+    if (!port || !isdigit ((byte) port [1]))
+        return NULL;
+    return zsys_sprintf ("%.*s:%d", (int) (port - endpoint), endpoint, atoi (port + 1) + PNP_PUBLISHER_OFFSET);
+}
+
+#include "snapshot.h"
+#include "watchdog.h"
+
 typedef struct {
     char *name;
     zsock_t *frontend; // socket to frontend process, e.g. backend_resource
@@ -200,47 +306,586 @@ typedef struct {
     uint64_t heartbeat_at; // heartbeat_at defines when to send next heartbeat
     zlist_t *backend_resources;
     zlist_t *required_resources;
+    zsock_t *publisher; // socket to broadcast lifecycle commands to backend processes, NULL if not broadcasting
+    zsock_t *subscriber; // socket to receive lifecycle commands broadcast by frontend process
+    zlist_t *gathers; // lifecycle commands waiting for acknowledgements of backend processes
+    uint32_t sequence; // sequence of last lifecycle command sent to backend processes
+    status_t *status; // latest status of all descendants, reported to frontend process with heartbeats
+    rtt_echo_t echo; // timestamps of last heartbeat from frontend process, echoed in our next heartbeat
+    accrual_t upstream; // times between heartbeats from frontend process
+    backoff_t backoff; // interval of our heartbeats to frontend process, base 0 if it does not back off
+    capture_t *capture; // records traffic for replay, NULL if not capturing
+    watchdog_t *watchdog; // sends our heartbeats from a separate thread, NULL if the work loop does
+    ring_t *ring; // shared-memory ring for samples to frontend process, NULL if not co-located
+    zhash_t *rings; // shared-memory rings of backend processes, by name
+    batch_t *batch; // samples waiting to be sent together, NULL if samples are sent at once
+    qas_t *qas; // pool inspecting camera frames of backend processes, NULL if frames are forwarded
+    tracking_t *tracking; // trays flowing through the stations of the line, NULL if not tracking
+    transfer_t *transfer; // blobs sent to backend processes and received from frontend process
+    config_t *config; // configuration received with CONFIGURE commands, NULL until the first
+    snapshot_t *snapshot; // what a warm restart resumes from, NULL without warm restarts
+    int64_t started; // usecs at which the actor started, for the time to RUNNING
+    codec_t *codec; // compresses what we send to our frontend process over a slow link, NULL if not
+    suppress_t suppress; // our messages and heartbeats to frontend process
 } resource_t;
 
-typedef struct {
-	char* name;
-	void* value;
-} payload_item;
+//  The send method sends <msg> on one of our sockets, CAPTURE_FRONTEND to CAPTURE_PUBLISHER,
+//  and records it, as it goes on the wire, if we capture traffic
+static int
+s_resource_send (resource_t *self, zmsg_t **msg_p, byte socket)
+{
+    zsock_t *sockets [] = { self->frontend, self->backend, self->subscriber, self->publisher };
+    if (socket == CAPTURE_FRONTEND) {
+        s_codec_encode (self->codec, *msg_p);
+        s_suppress_sent (&self->suppress, zclock_time ());
+    }
+    s_capture_msg (self->capture, CAPTURE_OUT, socket, *msg_p);
+    return zmsg_send (msg_p, sockets [socket]);
+}
 
-typedef struct{
-	payload_item *items[PAYLOAD_MAX];
-	unsigned int size;//number of payload items
-}payload;
+//  The receive method receives a message from one of our sockets, and records it if we
+//  capture traffic
+static zmsg_t *
+s_resource_recv (resource_t *self, byte socket)
+{
+    zsock_t *sockets [] = { self->frontend, self->backend, self->subscriber, self->publisher };
+    zmsg_t *msg = zmsg_recv (sockets [socket]);
+    s_capture_msg (self->capture, CAPTURE_IN, socket, msg);
+    if (msg && socket == CAPTURE_FRONTEND && self->codec)
+        s_codec_decode (self->codec, msg);
+    return msg;
+}
 
+//  The is heartbeat method tells heartbeats from backend resources apart from data messages,
+//  which have a payload frame instead of extension frames
+static int
+s_msg_is_heartbeat (zmsg_t *msg)
+{
+    if (zmsg_size (msg) < 3)
+        return 0;
+    zframe_t *frame = zmsg_first (msg);
+    frame = zmsg_next (msg);
+    frame = zmsg_next (msg);
+    while ((frame = zmsg_next (msg)))
+        if (zframe_size (frame) == 0 || !PNP_EXTENSION (zframe_data (frame) [0]))
+            return 0;
+    return 1;
+}
 
-typedef struct{
-	state state;
-	payload *payload;
-} transition;
+//  The heartbeat method handles a heartbeat from a backend resource, i.e. ID, STATE, SIGNAL
+//  and optional STATUS, CLOCK and INTERVAL frames. Any sign of life means the backend resource
+//  is ready; its own status, round-trip time and the status of its descendants are kept for our
+//  own heartbeats. Takes ownership of <identity>.
+static void
+s_backend_resource_heartbeat (resource_t *self, zframe_t *identity, zmsg_t *msg)
+{
+    zframe_t *frame = zmsg_first (msg);
+    byte type = s_type_of (frame);
+    zframe_t *state_frame = zmsg_next (msg);
+    zframe_t *signal_frame = zmsg_next (msg);
+    if (zframe_size (state_frame) == 0 || zframe_size (signal_frame) == 0) {
+        char *id_string = zframe_strhex (identity);
+        printf ("E: invalid heartbeat from %s\n", id_string);
+        free (id_string);
+        zframe_destroy (&identity);
+        return;
+    }
+    char *key = zframe_strhex (identity);
+    backend_resource_t *backend_resource = s_backend_resource_new (identity, type);
+    s_rtt_destroy (&backend_resource->rtt);
+    s_backend_resource_ready (backend_resource, self->backend_resources);
+    if (!backend_resource->rtt)
+        backend_resource->rtt = s_rtt_new ();
+    byte state = zframe_data (state_frame) [0];
+    byte signal = zframe_data (signal_frame) [0];
+    frame = s_msg_extension (msg, PNP_CLOCK);
+    if (frame)
+        s_rtt_sample (backend_resource->rtt, frame);
+    frame = s_msg_extension (msg, PNP_ERROR);
+    byte error = frame && zframe_size (frame) > 1? zframe_data (frame) [1]: 0;
+    printf("[%s] RX HB [%s, %o, %o] rtt %" PRId64 " usecs, offset %" PRId64 " usecs\n", self->name,
+           backend_resource->id_string, state, signal, backend_resource->rtt->last, backend_resource->rtt->offset);
+    if (error)
+        printf ("E: %s reports error %o\n", backend_resource->id_string, error);
+    s_status_update (self->status, key, type, state, signal, error, backend_resource->rtt);
+    frame = s_msg_extension (msg, PNP_STATUS);
+    if (frame && s_status_merge (self->status, key, frame) == -1)
+        printf ("E: invalid status from %s\n", backend_resource->id_string);
+    s_backend_resource_beat (backend_resource, s_interval_decode (s_msg_extension (msg, PNP_INTERVAL)));
+    free (key);
+}
 
-transition* new_transition(void) {
-  return calloc(1,sizeof(transition));
+//  The backend heartbeat method sends a heartbeat to every backend resource, i.e. HEARTBEAT
+//  and a CLOCK frame with our send time, unless we sent it other messages just before
+static void
+s_backend_resources_heartbeat (resource_t *self)
+{
+    int64_t now = zclock_time ();
+    backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
+    while (backend_resource) {
+        if (PNP_HEARTBEAT_SUPPRESSION
+        &&  !s_suppress_due (&backend_resource->suppress, now, s_type (backend_resource->type)->interval, 0, 0)) {
+            backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+            continue;
+        }
+        zmsg_t *msg = zmsg_new ();
+        zframe_t *frame = zframe_dup (backend_resource->identity);
+        zmsg_append (msg, &frame);
+        zmsg_addmem (msg, PNP_HEARTBEAT, 1);
+        frame = s_rtt_clock_frame (NULL);
+        zmsg_append (msg, &frame);
+        s_resource_send (self, &msg, CAPTURE_BACKEND);
+        printf("[%s] TX HB BACKEND %s\n", self->name, backend_resource->id_string);
+        backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+    }
 }
 
-payload* new_payload(void) {
-  return calloc(1,sizeof(payload));
+//  The heartbeat interval method returns the msecs to our next heartbeat to the frontend, for
+//  a resource of <type>
+static size_t
+s_heartbeat_interval (resource_t *self, byte type)
+{
+    return self->backoff.base? self->backoff.interval: s_type (type)->interval;
 }
 
-payload_item* new_payload_item(void) {
-  return calloc(1,sizeof(payload_item));
+//  The frontend heartbeat method sends our status as heartbeat to the frontend, i.e. ID,
+//  STATE, SIGNAL, a STATUS frame if any descendant changed, a CLOCK frame echoing the last
+//  heartbeat from the frontend and, if we back off, an INTERVAL frame with the interval to our
+//  next heartbeat. With a watchdog, only the state, signal and STATUS frame are handed to the
+//  watchdog thread, which sends the heartbeats and backs off itself. A heartbeat without news,
+//  i.e. without a STATUS frame and with the state and signal of the last one, is left out if
+//  we sent other messages just before.
+static void
+s_frontend_heartbeat (resource_t *self, const char *uuid, const char *state, const char *signal)
+{
+    zframe_t *frame = self->status? s_status_encode (self->status): NULL;
+    if (self->watchdog) {
+        s_watchdog_heartbeat (self->watchdog, state [0], signal [0], &frame);
+        return;
+    }
+    if (PNP_HEARTBEAT_SUPPRESSION
+    &&  !s_suppress_due (&self->suppress, zclock_time (), s_heartbeat_interval (self, uuid [0]),
+                         (byte) state [0] << 8 | (byte) signal [0], frame != NULL))
+        return;
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, uuid, strlen (uuid) + 1);
+    zmsg_addmem (msg, state, strlen (state) + 1);
+    zmsg_addmem (msg, signal, strlen (signal) + 1);
+    if (frame)
+        zmsg_append (msg, &frame);
+    frame = s_rtt_clock_frame (&self->echo);
+    zmsg_append (msg, &frame);
+    if (self->backoff.base) {
+        frame = s_interval_frame (s_backoff_next (&self->backoff, &self->upstream, zclock_time ()));
+        zmsg_append (msg, &frame);
+    }
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
+    printf("[%s] TX HB [%o, %o, %o] FRONTEND\n", self->name, uuid [0], state [0], signal [0]);
 }
 
-// assumption:
-// <names> and <values> are both of length <size> and smaller than <PAYLOAD_MAX>
-static void payload_init(payload* payload, char* names[], void* values[], int size) {
-	int i;
-	for(i=0;i<size; i++) {
-		payload_item* p_i = new_payload_item();
-		p_i->name = names[i];
-		p_i->value = values[i];
-		payload->items[i] = p_i;
-	}
-	payload->size = size;
+//  The batch send method sends the samples in our batch, if any, to the frontend as ID,
+//  BATCH, SAMPLES
+static void
+s_batch_send (resource_t *self, const char *uuid)
+{
+    zframe_t *frame = self->batch? s_batch_encode (self->batch): NULL;
+    if (!frame)
+        return;
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, uuid, strlen (uuid) + 1);
+    zmsg_addmem (msg, PNP_BATCH, 1);
+    zmsg_append (msg, &frame);
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
+}
+
+//  The sample method passes a sample to the frontend. With a ring, the sample is written
+//  to the ring and the frontend only notified with ID, RING, NAME if it is idle. Else, with
+//  a batch, the sample is added to the batch, which goes out when full or when its window
+//  has passed. Otherwise, or if the ring is full, the sample goes out as data message, i.e.
+//  ID, STATE, SIGNAL, PAYLOAD; it may then overtake samples still in the ring.
+static void
+s_sample_send (resource_t *self, const char *uuid, const void *data, size_t size)
+{
+    int rc = self->ring? s_ring_write (self->ring, data, size): -1;
+    if (rc == 0)
+        return;
+    if (rc == -1 && self->batch) {
+        int full = s_batch_add (self->batch, data, size);
+        if (full == 1)
+            s_batch_send (self, uuid);
+        if (full != -1)
+            return;
+        s_batch_send (self, uuid);      //  Sample too large for a batch, keep samples in order
+    }
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, uuid, strlen (uuid) + 1);
+    if (rc == 1) {
+        zmsg_addmem (msg, PNP_RING, 1);
+        zmsg_addstr (msg, self->ring->name);
+    }
+    else {
+        zmsg_addmem (msg, PNP_RUNNING, sizeof (PNP_RUNNING));
+        zmsg_addmem (msg, PNP_RUN, sizeof (PNP_RUN));
+        zmsg_addmem (msg, data, size);
+    }
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
+}
+
+//  The tray send method reports that <tray> entered or left our station, <kind> is
+//  TRACKING_ENTER or TRACKING_LEAVE
+static void
+s_tray_send (resource_t *self, const char *uuid, uint32_t tray, byte kind)
+{
+    byte event [TRACKING_EVENT];
+    memcpy (event, &tray, sizeof (tray));
+    event [sizeof (tray)] = kind;
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, uuid, strlen (uuid) + 1);
+    zmsg_addmem (msg, PNP_TRAY, 1);
+    zmsg_addmem (msg, event, sizeof (event));
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
+}
+
+//  The sample forward method passes a sample of the backend resource with ID <id> on to
+//  our frontend as data message, or to the QAS pool if we inspect camera frames
+static void
+s_sample_forward (resource_t *self, zframe_t *id, const byte *data, size_t size)
+{
+    if (self->qas) {
+        //  Each camera frame shows one tray, which stays at our station until inspected
+        if (s_qas_submit (self->qas, id, data, size) == 0 && PNP_TRACKING)
+            s_tray_send (self, PNP_QAS_ID, (uint32_t) (self->qas->submitted - 1), TRACKING_ENTER);
+        return;
+    }
+    zmsg_t *sample = zmsg_new ();
+    zmsg_addmem (sample, zframe_data (id), zframe_size (id));
+    zmsg_addmem (sample, PNP_RUNNING, sizeof (PNP_RUNNING));
+    zmsg_addmem (sample, PNP_RUN, sizeof (PNP_RUN));
+    zmsg_addmem (sample, data, size);
+    s_resource_send (self, &sample, CAPTURE_FRONTEND);
+}
+
+//  The QAS send method sends the results of the camera frames the QAS pool inspected to
+//  our frontend, in the order the frames arrived, as data messages ID, RUNNING, RUN, RESULT
+static void
+s_qas_send (resource_t *self)
+{
+    qas_job_t *job;
+    while ((job = s_qas_next (self->qas))) {
+        byte result [QAS_RESULT];
+        uint32_t latency = (uint32_t) (job->done - job->received);
+        memcpy (result, &job->sequence, sizeof (job->sequence));
+        memcpy (result + sizeof (uint64_t), &job->defects, sizeof (job->defects));
+        memcpy (result + sizeof (uint64_t) + sizeof (uint32_t), &latency, sizeof (latency));
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addmem (msg, zframe_data (job->id), zframe_size (job->id));
+        zmsg_addmem (msg, PNP_RUNNING, sizeof (PNP_RUNNING));
+        zmsg_addmem (msg, PNP_RUN, sizeof (PNP_RUN));
+        zmsg_addmem (msg, result, sizeof (result));
+        s_resource_send (self, &msg, CAPTURE_FRONTEND);
+        if (PNP_TRACKING)
+            s_tray_send (self, PNP_QAS_ID, (uint32_t) job->sequence, TRACKING_LEAVE);
+        s_qas_job_destroy (&job);
+    }
+}
+
+//  The rings drain method handles a RING message from a backend resource, i.e. ID, RING,
+//  NAME. It attaches to the ring on first use, forwards every waiting sample and asks for
+//  a notification once the ring is empty.
+static void
+s_rings_drain (resource_t *self, zmsg_t *msg)
+{
+    zframe_t *id = zmsg_first (msg);
+    zmsg_next (msg);
+    zframe_t *frame = zmsg_next (msg);
+    if (!frame || !self->rings)
+        return;
+    char *name = zframe_strdup (frame);
+    ring_t *ring = (ring_t *) zhash_lookup (self->rings, name);
+    if (!ring && (ring = s_ring_attach (name))) {
+        zhash_insert (self->rings, name, ring);
+        zhash_freefn (self->rings, name, s_ring_free);
+    }
+    free (name);
+    if (!ring)
+        return;
+    do {
+        byte *data;
+        int64_t size;
+        while ((size = s_ring_read (ring, &data)) >= 0) {
+            s_sample_forward (self, id, data, size);
+            s_ring_advance (ring);
+        }
+    } while (s_ring_idle (ring) == -1);
+}
+
+//  The batch forward method passes a BATCH message from a backend resource on to our
+//  frontend, as it is or, with PNP_BATCH_UNPACK or the QAS pool, sample by sample
+static void
+s_batch_forward (resource_t *self, zmsg_t **msg_p)
+{
+    if (!PNP_BATCH_UNPACK && !self->qas) {
+        s_resource_send (self, msg_p, CAPTURE_FRONTEND);
+        return;
+    }
+    zmsg_t *msg = *msg_p;
+    zframe_t *id = zmsg_first (msg);
+    zmsg_next (msg);
+    zframe_t *frame = zmsg_next (msg);
+    int64_t count = s_batch_count (frame);
+    if (count == -1)
+        printf ("E: invalid batch from %s\n", s_type_name (s_type_of (id)));
+    int64_t sample_nbr;
+    for (sample_nbr = 0; sample_nbr < count; sample_nbr++) {
+        size_t size;
+        byte *data = s_batch_sample (frame, sample_nbr, &size);
+        s_sample_forward (self, id, data, size);
+    }
+    zmsg_destroy (msg_p);
+}
+
+static void
+s_transfer_backend_send (void *args, zmsg_t **msg_p)
+{
+    s_resource_send ((resource_t *) args, msg_p, CAPTURE_BACKEND);
+}
+
+static void
+s_transfer_frontend_send (void *args, zmsg_t **msg_p)
+{
+    s_resource_send ((resource_t *) args, msg_p, CAPTURE_FRONTEND);
+}
+
+//  The transfers offer method offers our blobs to every backend resource, and forgets
+//  the transfers to backend resources that are gone
+static void
+s_transfers_offer (resource_t *self)
+{
+    if (!self->transfer)
+        return;
+    backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
+    while (backend_resource) {
+        s_transfer_offer (self->transfer, backend_resource->identity, s_transfer_backend_send, self);
+        backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+    }
+    s_transfer_sweep (self->transfer);
+}
+
+//  The transfers send method sends the next chunks to backend resources with credit
+static void
+s_transfers_send (resource_t *self)
+{
+    if (self->transfer)
+        s_transfer_pump (self->transfer, s_transfer_backend_send, self);
+}
+
+//  The transfers receive method handles an offer or chunk from our frontend. A complete
+//  blob is saved and, if we have a backend, passed on to our backend resources.
+static void
+s_transfers_receive (resource_t *self, zmsg_t *msg, const char *uuid)
+{
+    if (!self->transfer)
+        return;
+    transfer_incoming_t *incoming = s_transfer_receive (self->transfer, msg, uuid, s_transfer_frontend_send, self);
+    if (!incoming)
+        return;
+    printf ("[%s] received %s, %" PRIu64 " bytes\n", self->name, incoming->name, incoming->size);
+    s_watchdog_busy (self->watchdog, 1000 + incoming->size / WATCHDOG_BUSY_SAVE_RATE);
+    s_transfer_save (incoming);
+    if (self->backend)
+        s_transfer_add (self->transfer, incoming->name, incoming->data, incoming->size);
+    s_watchdog_busy (self->watchdog, 0);
+}
+
+#include "gather.h"
+
+//  The command method sends a lifecycle command to one backend resource. A
+//  CONFIGURE command with our <config> carries the delta from our base version
+//  if the backend resource has that version, and the full configuration if not.
+static void
+s_backend_resource_command (resource_t *self, backend_resource_t *backend_resource,
+                            uint32_t sequence, byte signal, config_t *config)
+{
+    zmsg_t *msg = zmsg_new ();
+    zframe_t *identity = zframe_dup (backend_resource->identity);
+    zmsg_append (msg, &identity);
+    zmsg_addmem (msg, PNP_COMMAND, 1);
+    zmsg_addmem (msg, &sequence, sizeof (sequence));
+    zmsg_addmem (msg, &signal, 1);
+    if (config)
+        s_config_append (config, msg, backend_resource->config != config->base);
+    s_suppress_sent (&backend_resource->suppress, zclock_time ());
+    s_resource_send (self, &msg, CAPTURE_BACKEND);
+}
+
+//  The command method sends a lifecycle command to all backend resources, in
+//  a single broadcast if we have a publisher and one by one otherwise, and
+//  starts gathering their acknowledgements. <origin> is the sequence of the
+//  command we got from our frontend, to be echoed in our aggregate result.
+//  A CONFIGURE command that came with a configuration passes on our <config>,
+//  and only to backend resources that do not have its version yet:
+static void
+s_backend_resources_command (resource_t *self, byte signal, zframe_t *origin, config_t *config)
+{
+    uint32_t sequence = ++self->sequence;
+    size_t expected = 0;
+    backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
+    if (self->publisher) {
+        while (backend_resource && config && backend_resource->config == config->version)
+            backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+        if (backend_resource) {
+            //  Those that are behind more than the delta ask for the full configuration
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addmem (msg, PNP_COMMAND, 1);
+            zmsg_addmem (msg, &sequence, sizeof (sequence));
+            zmsg_addmem (msg, &signal, 1);
+            if (config)
+                s_config_append (config, msg, 0);
+            s_resource_send (self, &msg, CAPTURE_PUBLISHER);
+            expected = zlist_size (self->backend_resources);
+        }
+    }
+    else {
+        while (backend_resource) {
+            if (!config || backend_resource->config != config->version) {
+                s_backend_resource_command (self, backend_resource, sequence, signal, config);
+                expected++;
+            }
+            backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+        }
+    }
+    gather_t *gather = s_gather_new (sequence, origin, signal, expected);
+    gather->config = config? config->version: 0;
+    gather->broadcast = self->publisher != NULL;
+    zlist_append (self->gathers, gather);
+}
+
+int configuring (resource_t *self);
+
+//  The command receive method handles a lifecycle command from our frontend,
+//  i.e. COMMAND, SEQUENCE, SIGNAL [, PAYLOAD, VERSION], and passes it on to our
+//  backend resources. A CONFIGURE command that changes our configuration runs
+//  configuring (), one that does not skips it. The command is acknowledged once
+//  our backend resources have all acknowledged it.
+static void
+s_command_receive (resource_t *self, zmsg_t *msg)
+{
+    if (zmsg_size (msg) != 3 && zmsg_size (msg) != 5) {
+        printf ("E: invalid command\n");
+        zmsg_dump (msg);
+        return;
+    }
+    zframe_t *frame = zmsg_pop (msg);
+    zframe_destroy (&frame);
+    zframe_t *origin = zmsg_pop (msg);
+    byte signal = zframe_data (zmsg_first (msg)) [0];
+    zframe_t *payload = zmsg_next (msg);
+    printf ("[%s] RX COMMAND %o\n", self->name, signal);
+    if (payload) {
+        if (!self->config)
+            self->config = s_config_new ();
+        int rc = s_config_update (self->config, payload, zmsg_next (msg));
+        if (rc == -1 || rc == CONFIG_STALE) {
+            printf ("[%s] configuration %s, version %" PRIu32 "\n", self->name,
+                    rc == -1? "invalid": "stale", self->config->version);
+            gather_t *gather = s_gather_new (++self->sequence, origin, signal, 0);
+            gather->result = rc == -1? PNP_ERR_UNDEFINED [0]: PNP_ERR_CONFIG [0];
+            zlist_append (self->gathers, gather);
+            return;
+        }
+        if (rc == CONFIG_CHANGED) {
+            printf ("[%s] configuration %" PRIu32 ", %zu of %zu parameters changed\n", self->name,
+                    self->config->version, s_payload_size (self->config->delta),
+                    s_payload_size (self->config->values));
+            s_watchdog_busy (self->watchdog, WATCHDOG_BUSY_CONFIGURE);
+            configuring (self);
+            s_watchdog_busy (self->watchdog, 0);
+            //  Keep the new configuration for a warm restart right away
+            if (self->snapshot)
+                self->snapshot->save_at = 0;
+        }
+        else
+            printf ("[%s] configuration %" PRIu32 " unchanged, CONFIGURING skipped\n", self->name,
+                    self->config->version);
+    }
+    s_backend_resources_command (self, signal, origin, payload? self->config: NULL);
+}
+
+//  The ack method records an acknowledgement from a backend resource, i.e.
+//  ACK, SEQUENCE, RESULT after the identity and ID frames:
+static void
+s_backend_resource_ack (resource_t *self, zframe_t *identity, zmsg_t *msg)
+{
+    zframe_t *frame = zmsg_next (msg);
+    uint32_t sequence = 0;
+    if (frame && zframe_size (frame) == sizeof (sequence))
+        memcpy (&sequence, zframe_data (frame), sizeof (sequence));
+    frame = zmsg_next (msg);
+    gather_t *gather = s_gathers_lookup (self->gathers, sequence);
+    if (gather && frame) {
+        backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
+        while (backend_resource && !zframe_eq (backend_resource->identity, identity))
+            backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+        if (backend_resource && gather->config) {
+            if (zframe_data (frame) [0] == PNP_ERR_CONFIG [0]
+            &&  self->config && self->config->version == gather->config) {
+                //  It missed a delta, send it the full configuration under the same sequence
+                backend_resource->config = 0;
+                s_backend_resource_command (self, backend_resource, sequence, gather->signal, self->config);
+                return;
+            }
+            if (zframe_data (frame) [0] == 0)
+                backend_resource->config = gather->config;
+        }
+        char *id_string = zframe_strhex (identity);
+        s_gather_ack (gather, id_string, zframe_data (frame) [0]);
+        free (id_string);
+    }
+}
+
+//  The gathers check method reports completed and timed out commands to our
+//  frontend as ID, ACK, SEQUENCE, RESULT. Returns -1 once a STOP command
+//  has been acknowledged, so the resource stops:
+static int
+s_gathers_check (resource_t *self, const char *uuid)
+{
+    int rc = 0;
+    gather_t *gather = (gather_t *) zlist_first (self->gathers);
+    while (gather) {
+        if (!s_gather_done (gather)) {
+            gather = (gather_t *) zlist_next (self->gathers);
+            continue;
+        }
+        zlist_remove (self->gathers, gather);
+        printf ("[%s] command %o gathered %zu/%zu acks in %" PRId64 " usecs, result %o\n",
+                self->name, gather->signal, zhash_size (gather->acks), gather->expected,
+                zclock_usecs () - gather->started, gather->result);
+        if (gather->origin) {
+            zmsg_t *msg = zmsg_new ();
+            zmsg_addmem (msg, uuid, 1);
+            zmsg_addmem (msg, PNP_ACK, 1);
+            zmsg_append (msg, &gather->origin);
+            zmsg_addmem (msg, &gather->result, 1);
+            s_resource_send (self, &msg, CAPTURE_FRONTEND);
+        }
+        if (gather->signal == PNP_STOP [0]) {
+            //  A resource stopped by command starts cold
+            s_snapshot_invalidate (self->snapshot);
+            rc = -1;
+        }
+        s_gather_destroy (&gather);
+        gather = (gather_t *) zlist_first (self->gathers);
+    }
+    return rc;
+}
+
+typedef struct{
+	state state;
+	payload_t *payload;
+} transition;
+
+transition* new_transition(void) {
+  return calloc(1,sizeof(transition));
 }
 
 typedef struct {
@@ -277,15 +922,15 @@ static void transition_stack_pop(transition_stack *S){
     }
 }
 
-typedef int (*state_fnc)(resource_t* self, payload *payload);
+typedef int (*state_fnc)(resource_t* self, payload_t *payload);
 
-int creating_fnc(resource_t* self, payload *payload);
-int initializing_fnc(resource_t* self, payload *payload);
-int configuring_fnc(resource_t* self, payload *payload);
-int running_fnc(resource_t* self, payload *payload);
-int pausing_fnc(resource_t* self, payload *payload);
-int finalizing_fnc(resource_t* self, payload *payload);
-int deleting_fnc(resource_t* self, payload *payload);
+int creating_fnc(resource_t* self, payload_t *payload);
+int initializing_fnc(resource_t* self, payload_t *payload);
+int configuring_fnc(resource_t* self, payload_t *payload);
+int running_fnc(resource_t* self, payload_t *payload);
+int pausing_fnc(resource_t* self, payload_t *payload);
+int finalizing_fnc(resource_t* self, payload_t *payload);
+int deleting_fnc(resource_t* self, payload_t *payload);
 
 state_fnc state_functions[NUM_STATES] = {
 	/*STATE_CREATING*/     	 	creating_fnc,
@@ -306,22 +951,71 @@ int pausing(resource_t *self);
 int finalizing(resource_t *self);
 int deleting(resource_t *self);
 
-int creating_fnc(resource_t* self,payload *payload){
-	self = creating(self, (*payload->items[0]).value, (*payload->items[1]).value);
+//  The snapshot method keeps our configuration and backend resources for a warm restart,
+//  having reached <state>
+static void
+s_resource_snapshot (resource_t *self, state state)
+{
+    if (self->snapshot) {
+        s_snapshot_save (self->snapshot, state, self->config, self->backend_resources);
+        self->snapshot->save_at = zclock_time () + SNAPSHOT_INTERVAL;
+    }
+}
+
+//  The restore method resumes a warm restart from our snapshot: it takes our configuration and
+//  backend resources back, and acknowledges the start on the pipe as INITIALIZING would. Our
+//  parent still knows our identity, so we send no READY; our next heartbeat tells it we are
+//  back, without a full status frame, so the status of our descendants holds until they
+//  heartbeat again. A snapshot that cannot be resumed falls back to INITIALIZING.
+static int
+s_resource_restore (resource_t *self)
+{
+    if (s_snapshot_restore (self->snapshot, &self->config, self->backend_resources) == -1) {
+        printf ("E: snapshot %s is corrupt, starting cold\n", self->snapshot->filename);
+        self->snapshot->valid = 0;
+        return initializing (self);
+    }
+    if (self->status)
+        self->status->heartbeats = 0;
+    zsock_signal (self->pipe, 0);
+    printf ("[%s] resumed from snapshot, configuration %" PRIu32 ", %zu backend resources\n", self->name,
+            self->config? self->config->version: 0, zlist_size (self->backend_resources));
+    return 0;
+}
+
+int creating_fnc(resource_t* self,payload_t *payload){
+	self = creating(self, (zsock_t *) s_payload_pointer(payload, "pipe"), (char *) s_payload_pointer(payload, "name"));
     assert(self);
+    //  A warm restart skips INITIALIZING
+    if (self->snapshot && self->snapshot->valid)
+        return s_resource_restore (self);
     return 0;
 }
 
-int initializing_fnc(resource_t* self, payload *payload) {
+int initializing_fnc(resource_t* self, payload_t *payload) {
+	(void) payload;
 	return initializing(self);
 }
 
-int configuring_fnc(resource_t* self, payload *payload) {
-	return configuring(self);
+int configuring_fnc(resource_t* self, payload_t *payload) {
+	(void) payload;
+	s_watchdog_busy (self->watchdog, WATCHDOG_BUSY_CONFIGURE);
+	int rc = configuring(self);
+	s_watchdog_busy (self->watchdog, 0);
+	if (rc == 0)
+		s_resource_snapshot (self, STATE_CONFIGURING);
+	return rc;
 }
 
-int running_fnc(resource_t* self, payload *payload) {
+int running_fnc(resource_t* self, payload_t *payload) {
+	(void) payload;
+	printf ("[%s] RUNNING %" PRId64 " usecs after a %s start\n", self->name, zclock_usecs () - self->started,
+	        self->snapshot && self->snapshot->valid? "warm": "cold");
+	fflush (stdout);
 	while(!zsys_interrupted){
+	  s_watchdog_progress (self->watchdog);
+	  if (self->snapshot && zclock_time () >= self->snapshot->save_at)
+		  s_resource_snapshot (self, STATE_RUNNING);
 
 	  if(running(self) < 0){
 		  return -1;
@@ -333,10 +1027,10 @@ int running_fnc(resource_t* self, payload *payload) {
 	return -1;
 }
 
-int pausing_fnc(resource_t* self, payload *payload) {
-
+int pausing_fnc(resource_t* self, payload_t *payload) {
+	(void) payload;
 	while(!zsys_interrupted){
-
+	  s_watchdog_progress (self->watchdog);
 	  if(pausing(self) < 0){
 		  return -1;
 	  }
@@ -346,11 +1040,13 @@ int pausing_fnc(resource_t* self, payload *payload) {
 	return -1;
 }
 
-int finalizing_fnc(resource_t* self,payload *payload) {
+int finalizing_fnc(resource_t* self,payload_t *payload) {
+	(void) payload;
 	return finalizing(self);
 }
 
-int deleting_fnc(resource_t* self, payload *payload) {
+int deleting_fnc(resource_t* self, payload_t *payload) {
+	(void) payload;
 	return deleting(self);
 }
 
@@ -368,7 +1064,7 @@ static void generate_stack(transition_stack *s, state state, signl signal){
 		printf("%d \n", state);
 		temp = new_transition();
 		temp->state = state;
-		temp->payload = new_payload();
+		temp->payload = s_payload_new();
 		transition_stack_push(&t,temp);
 		state = transitions[state][signal];
 	}
@@ -384,9 +1080,12 @@ static void generate_stack(transition_stack *s, state state, signl signal){
 
 static void resource_actor(zsock_t *pipe, void *args){
     char* name = (char*) args;
+    s_affinity_pin (AFFINITY_ACTOR);
     printf("[%s] actor started.\n", name);
 
     resource_t *self = (resource_t *) zmalloc (sizeof (resource_t));
+    self->started = zclock_usecs ();
+    self->snapshot = PNP_WARM_RESTART? s_snapshot_new (name): NULL;
 
     transition_stack s;
     transition_stack_init(&s);
@@ -399,13 +1098,12 @@ static void resource_actor(zsock_t *pipe, void *args){
     //NOTE: use of initial_state as variables questionable
     transition *t = new_transition();
     t->state = initial_state;
-    t->payload = malloc(sizeof(payload));
-    char* names[] = {"pipe","name"};
-    void* values[] = {pipe,name};
-    payload_init(t->payload,names,values,2);
+    t->payload = s_payload_new();
+    s_payload_set_pointer(t->payload, "pipe", pipe);
+    s_payload_set_pointer(t->payload, "name", name);
 
-    //generate path for initial state and signal
-    generate_stack(&s,initial_state,initial_signal);
+    //generate path for initial state and signal, from CONFIGURING on for a warm restart
+    generate_stack(&s,self->snapshot && self->snapshot->valid? STATE_INITIALIZING: initial_state,initial_signal);
     transition_stack_push(&s,t);//add transition to initial state last, since we have a stack
 
     transition *transition = transition_stack_top(&s);
@@ -419,8 +1117,10 @@ static void resource_actor(zsock_t *pipe, void *args){
     		pausing(self);
     		finalizing(self);
     		deleting(self);
+    		s_snapshot_destroy(&self->snapshot);
     		break;
     	}
+    	s_payload_destroy(&transition->payload);
     	free(transition);
 
     	//TODO:: check communication lines for signals
@@ -2,15 +2,39 @@
 #include "czmq.h"
 #include "defs.h"
 
+//  Endpoint of the module; PNP_FRONTEND overrides it, e.g. to put the proxy of
+//  the chaos harness between device and module
+static const char *
+s_frontend_endpoint (void)
+{
+    const char *endpoint = getenv ("PNP_FRONTEND");
+    return endpoint && *endpoint? endpoint: "tcp://localhost:9003";
+}
 
 resource_t* creating(resource_t *self, zsock_t *pipe, char *name) {
     printf("[%s] creating...", name);
     self->name = name;
-    self->frontend = zsock_new_dealer("tcp://localhost:9003");
+    //  Our identity survives warm restarts, so the module keeps knowing us
+    const char *identity = s_snapshot_identity (self->snapshot);
+    self->watchdog = PNP_WATCHDOG? s_watchdog_new (PNP_QAS_ID [0], s_frontend_endpoint (), identity): NULL;
+    self->frontend = self->watchdog? zsock_new_pair (self->watchdog->pipe): s_dealer_new (s_frontend_endpoint (), identity);
     self->backend = NULL;
+    char *publisher = s_publisher_endpoint (s_frontend_endpoint ());
+    self->subscriber = zsock_new_sub (publisher, PNP_COMMAND);
+    zstr_free (&publisher);
     self->pipe = pipe;
     self->backend_resources = zlist_new ();
     self->required_resources = zlist_new();
+    self->gathers = zlist_new ();
+    if (PNP_SHM_RING) {
+        //  Samples to the module go through shared memory, named after our process
+        char ring_name [32];
+        snprintf (ring_name, sizeof (ring_name), "/pnp-ring-%d", (int) getpid ());
+        self->ring = s_ring_new (ring_name);
+    }
+    self->transfer = s_transfer_new ();
+    self->batch = PNP_BATCH_WINDOW? s_batch_new (PNP_BATCH_WINDOW, BATCH_SAMPLES): NULL;
+    self->capture = s_capture_new (name);
     printf("...done.\n");
     return self;
 }
@@ -21,10 +45,10 @@ int initializing(resource_t* self) {
     zsock_signal (self->pipe, 0);
 
     //  Tell frontend we're ready for work
-	zframe_t *frame = zframe_new (PNP_QAS_ID, sizeof(PNP_QAS_ID));
-	zframe_send (&frame, self->frontend, ZFRAME_MORE);
-	frame = zframe_new(READY, sizeof(READY));
-	zframe_send (&frame, self->frontend, 0);
+	zmsg_t *msg = zmsg_new ();
+	zmsg_addmem (msg, PNP_QAS_ID, sizeof(PNP_QAS_ID));
+	zmsg_addmem (msg, PNP_READY, sizeof(PNP_READY));
+	s_resource_send (self, &msg, CAPTURE_FRONTEND);
     printf("done.\n");
 
     return 0;
@@ -33,11 +57,15 @@ int initializing(resource_t* self) {
 int configuring (resource_t* self) {
     printf("[%s] configuring...", self->name);
     //  If liveness hits zero, queue is considered disconnected
-    self->liveness = HEARTBEAT_LIVENESS;
+    self->liveness = s_type (PNP_QAS_ID [0])->liveness;
     self->interval = INTERVAL_INIT;
 
     //  Send out heartbeats at regular intervals
-    self->heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+    self->heartbeat_at = zclock_time () + s_type (PNP_QAS_ID [0])->interval;
+    //  and back off while those of the module come in steady, unless the watchdog sends them
+    s_accrual_init (&self->upstream, s_type (PNP_QAS_ID [0])->interval, zclock_time ());
+    if (PNP_HEARTBEAT_BACKOFF && !self->watchdog)
+        s_backoff_init (&self->backoff, s_type (PNP_QAS_ID [0])->interval);
 
     srandom ((unsigned) time (NULL));
     printf("done.\n");
@@ -46,27 +74,40 @@ int configuring (resource_t* self) {
 
 
 int running(resource_t* self) {
-	uint64_t heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
-
-	zmq_pollitem_t items [] = { { zsock_resolve(self->frontend),  0, ZMQ_POLLIN, 0 } };
-	int rc = zmq_poll (items, 1, self->interval * ZMQ_POLL_MSEC);
+	zmq_pollitem_t items [] = {
+		{ zsock_resolve(self->frontend),  0, ZMQ_POLLIN, 0 },
+		{ zsock_resolve(self->subscriber),  0, ZMQ_POLLIN, 0 }
+	};
+	//  Wake up in time to send a batch whose window passes
+	int rc = zmq_poll (items, 2, s_batch_timeout (self->batch, self->interval) * ZMQ_POLL_MSEC);
 	if (rc == -1)
 		return -1; //  Interrupted
 
 	if (items [0].revents & ZMQ_POLLIN) {
 		//  Poll frontend
-		zmsg_t *msg = zmsg_recv (self->frontend);
+		zmsg_t *msg = s_resource_recv (self, CAPTURE_FRONTEND);
 		if (!msg)
 			return -1;          //  Interrupted
+		//  Any message from the frontend is a sign of life
+		s_accrual_alive (&self->upstream, zclock_time ());
 		//  Validate control message, or return reply to client
-		if (zmsg_size (msg) == 1)  {
+		if (memcmp (zframe_data (zmsg_first (msg)), PNP_COMMAND, 1) == 0) {
+			s_command_receive (self, msg);
+			zmsg_destroy (&msg);
+		}
+		else if (memcmp (zframe_data (zmsg_first (msg)), PNP_TRANSFER, 1) == 0) {
+			//  Recipe or firmware
+			s_transfers_receive (self, msg, PNP_QAS_ID);
+			zmsg_destroy (&msg);
+		}
+		else if (memcmp (zframe_data (zmsg_first (msg)), PNP_READY, 1) == 0
+		||  memcmp (zframe_data (zmsg_first (msg)), PNP_HEARTBEAT, 1) == 0)  {
 			printf("[%s] RX HB FRONTEND\n", self->name);
-			zframe_t *frame = zmsg_first (msg);
-			if (memcmp (zframe_data (frame), READY, 1)
-			&&  memcmp (zframe_data (frame), PPP_HEARTBEAT, 1)) {
-				printf ("E: invalid message from module\n");
-				zmsg_dump (msg);
-			}
+			//  Keep the parent timestamp, to echo it in our next heartbeat
+			zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+			if (frame)
+				s_rtt_stamp (&self->echo, frame);
+			s_accrual_heartbeat (&self->upstream, zclock_time (), 0);
 			zmsg_destroy (&msg);
 		}
 		else
@@ -81,30 +122,39 @@ int running(resource_t* self) {
 
 				if (self->interval < INTERVAL_MAX)
 					self->interval *= 2;
-				zsock_destroy(&self->frontend);
-				self->frontend = zsock_new_dealer("tcp://localhost:9003"); // TODO: this should be configured.
-				self->liveness = HEARTBEAT_LIVENESS;
+				if (self->watchdog)
+					s_watchdog_reconnect (self->watchdog);
+				else {
+					zsock_destroy(&self->frontend);
+					self->frontend = s_dealer_new (s_frontend_endpoint (), s_snapshot_identity (self->snapshot));
+				}
+				self->liveness = s_type (PNP_QAS_ID [0])->liveness;
 			}
 		//zframe_t *identity = s_modules_next (self->modules);
 		//zmsg_prepend (msg, &identity);
 		//zmsg_send (&msg, backend);
 	}
+	if (items [1].revents & ZMQ_POLLIN) {
+		//  Lifecycle command broadcast by the module
+		zmsg_t *msg = s_resource_recv (self, CAPTURE_SUBSCRIBER);
+		if (!msg)
+			return -1;          //  Interrupted
+		s_command_receive (self, msg);
+		zmsg_destroy (&msg);
+	}
 	//  .split handle heartbeating
 	//  We handle heartbeating after any socket activity. First, we send
 	//  heartbeats to any idle modules if it's time. Then, we purge any
 	//  dead modules:
-	if (zclock_time () >= heartbeat_at) {
+	if ((uint64_t) zclock_time () >= self->heartbeat_at) {
 		// Send status as heartbeat to frontend
-		zframe_t *frame = zframe_new (PNP_QAS_ID, sizeof(PNP_QAS_ID));
-		zframe_send (&frame, self->frontend, ZFRAME_MORE);
-		frame = zframe_new(RUNNING, sizeof(RUNNING));
-		zframe_send (&frame, self->frontend, ZFRAME_MORE);
-		frame = zframe_new(RUN, sizeof(RUN));
-		zframe_send (&frame, self->frontend, 0);
-		printf("[%s] TX HB FRONTEND\n", self->name);
-		heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+		s_frontend_heartbeat (self, PNP_QAS_ID, PNP_RUNNING, PNP_RUN);
+		self->heartbeat_at = zclock_time () + s_heartbeat_interval (self, PNP_QAS_ID [0]);
 	}
-	return 0;
+	if (s_batch_due (self->batch))
+		s_batch_send (self, PNP_QAS_ID);
+	//  A device has no backend resources, so commands are acknowledged at once
+	return s_gathers_check (self, PNP_QAS_ID);
 }
 
 int pausing(resource_t *self) {
@@ -115,8 +165,21 @@ int pausing(resource_t *self) {
 
 int finalizing(resource_t *self) {
     printf("[%s] finalizing...", self->name);
+    while (zlist_size (self->gathers)) {
+        gather_t *gather = (gather_t *) zlist_pop (self->gathers);
+        s_gather_destroy (&gather);
+    }
+    zlist_destroy (&self->gathers);
+    s_ring_destroy (&self->ring);
+    s_batch_send (self, PNP_QAS_ID);
+    s_batch_destroy (&self->batch);
+    s_transfer_destroy (&self->transfer);
+    s_config_destroy (&self->config);
+    s_capture_destroy (&self->capture);
     zsock_destroy(&self->frontend);
+    s_watchdog_destroy (&self->watchdog);
     zsock_destroy(&self->backend);
+    zsock_destroy(&self->subscriber);
     printf("done.\n");
     return 0;
 }
@@ -141,11 +204,15 @@ int main(int argc, char** args)
     }
 	assert(name);
 
+    s_types_load (TYPES_CONFIG);
+    s_affinity_load (AFFINITY_CONFIG, name);
     // incoming data is handled by the actor thread
     zactor_t *actor = zactor_new (resource_actor, (void*)name);
     assert(actor);
+    s_affinity_pin (AFFINITY_MAIN);
     while(!zsys_interrupted) { sleep(1);};
     printf("[%s] main loop interrupted!\n", name);
+    s_affinity_report (name);
     zactor_destroy(&actor);
 
     return 0;
@@ -0,0 +1,268 @@
+//  Pick-n-Pack fan-out benchmark
+//
+//  Measures how long a resource takes to send a lifecycle command to all of
+//  its backend resources and gather their acknowledgements (gather.h): from
+//  the send to the last ack, and the time the send itself takes. Commands go
+//  out in one broadcast on a PUB socket, as lines and modules built with
+//  PNP_BROADCAST=1 send them, or one by one on the ROUTER socket, as the Plant
+//  and resources do by default. A child thread plays the backend resources; each has
+//  a DEALER socket and a SUB socket, and acknowledges every command at once.
+//
+//  Usage: fanoutbench [-n commands] [children ...]
+//  Commands default to 1,000 per run, children to 10, 100 and 1,000.
+
+#include "czmq.h"
+#include "defs.h"
+
+#define BENCH_COMMANDS  1000
+
+typedef struct {
+    size_t children;
+    char router [64];           //  Endpoints the children connect to
+    char publisher [64];
+} bench_t;
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The children thread plays <children> backend resources, which announce
+//  themselves with READY and acknowledge every command as ID, ACK, SEQUENCE,
+//  RESULT, like s_gathers_check does
+static void
+s_children (zsock_t *pipe, void *args)
+{
+    bench_t *bench = (bench_t *) args;
+    size_t children = bench->children;
+    zsock_t **dealers = (zsock_t **) zmalloc (children * sizeof (zsock_t *));
+    zsock_t **subscribers = (zsock_t **) zmalloc (children * sizeof (zsock_t *));
+    zmq_pollitem_t *items = (zmq_pollitem_t *) zmalloc ((2 * children + 1) * sizeof (zmq_pollitem_t));
+    items [0] = (zmq_pollitem_t) { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 };
+    size_t child;
+    for (child = 0; child < children; child++) {
+        dealers [child] = zsock_new_dealer (bench->router);
+        subscribers [child] = zsock_new_sub (bench->publisher, PNP_COMMAND);
+        assert (dealers [child] && subscribers [child]);
+        items [1 + child] = (zmq_pollitem_t) { zsock_resolve (dealers [child]), 0, ZMQ_POLLIN, 0 };
+        items [1 + children + child] = (zmq_pollitem_t) { zsock_resolve (subscribers [child]), 0, ZMQ_POLLIN, 0 };
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addmem (msg, PNP_READY, 1);
+        zmsg_send (&msg, dealers [child]);
+    }
+    zsock_signal (pipe, 0);
+
+    while (!zsys_interrupted) {
+        if (zmq_poll (items, (int) (2 * children + 1), -1) == -1)
+            break;              //  Interrupted
+        if (items [0].revents & ZMQ_POLLIN)
+            break;              //  Bench is done
+        size_t index;
+        for (index = 1; index < 2 * children + 1; index++) {
+            if (!(items [index].revents & ZMQ_POLLIN))
+                continue;
+            child = (index - 1) % children;
+            zmsg_t *msg = zmsg_recv (index <= children? dealers [child]: subscribers [child]);
+            if (!msg)
+                break;
+            //  COMMAND, SEQUENCE, SIGNAL
+            zmsg_first (msg);
+            zframe_t *sequence = zmsg_next (msg);
+            zmsg_t *ack = zmsg_new ();
+            zmsg_addmem (ack, PNP_QAS_ID, 1);
+            zmsg_addmem (ack, PNP_ACK, 1);
+            zmsg_addmem (ack, zframe_data (sequence), zframe_size (sequence));
+            byte result = 0;
+            zmsg_addmem (ack, &result, 1);
+            zmsg_send (&ack, dealers [child]);
+            zmsg_destroy (&msg);
+        }
+    }
+    for (child = 0; child < children; child++) {
+        zsock_destroy (&dealers [child]);
+        zsock_destroy (&subscribers [child]);
+    }
+    free (dealers);
+    free (subscribers);
+    free (items);
+}
+
+//  The command method sends command <sequence> to all children, by broadcast
+//  or one by one, gathers their acks and returns the usecs that took, or -1
+//  if the gather timed out. Stores the usecs the send took in <send>.
+static int64_t
+s_bench_command (zsock_t *router, zsock_t *publisher, zlist_t *identities,
+                 uint32_t sequence, int64_t *send)
+{
+    byte signal = PNP_RUN [0];
+    int64_t started = zclock_usecs ();
+    if (publisher) {
+        zmsg_t *msg = zmsg_new ();
+        zmsg_addmem (msg, PNP_COMMAND, 1);
+        zmsg_addmem (msg, &sequence, sizeof (sequence));
+        zmsg_addmem (msg, &signal, 1);
+        zmsg_send (&msg, publisher);
+    }
+    else {
+        zframe_t *identity = (zframe_t *) zlist_first (identities);
+        while (identity) {
+            zmsg_t *msg = zmsg_new ();
+            zframe_t *frame = zframe_dup (identity);
+            zmsg_append (msg, &frame);
+            zmsg_addmem (msg, PNP_COMMAND, 1);
+            zmsg_addmem (msg, &sequence, sizeof (sequence));
+            zmsg_addmem (msg, &signal, 1);
+            zmsg_send (&msg, router);
+            identity = (zframe_t *) zlist_next (identities);
+        }
+    }
+    *send = zclock_usecs () - started;
+
+    gather_t *gather = s_gather_new (sequence, NULL, signal, zlist_size (identities));
+    while (!s_gather_done (gather) && !zsys_interrupted) {
+        zmq_pollitem_t items [] = { { zsock_resolve (router), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, GATHER_TIMEOUT * ZMQ_POLL_MSEC) == -1)
+            break;              //  Interrupted
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
+        //  Identity, ID, ACK, SEQUENCE, RESULT
+        zmsg_t *msg = zmsg_recv (router);
+        if (!msg)
+            break;
+        zframe_t *identity = zmsg_pop (msg);
+        zmsg_first (msg);
+        zmsg_next (msg);
+        zframe_t *frame = zmsg_next (msg);
+        uint32_t acked = 0;
+        if (frame && zframe_size (frame) == sizeof (acked))
+            memcpy (&acked, zframe_data (frame), sizeof (acked));
+        frame = zmsg_next (msg);
+        if (acked == sequence && frame) {
+            char *id_string = zframe_strhex (identity);
+            s_gather_ack (gather, id_string, zframe_data (frame) [0]);
+            free (id_string);
+        }
+        zframe_destroy (&identity);
+        zmsg_destroy (&msg);
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    int complete = zhash_size (gather->acks) == gather->expected;
+    s_gather_destroy (&gather);
+    return complete? elapsed: -1;
+}
+
+//  The run method starts <children> backend resources and sends them
+//  <commands> commands each way, printing a line per way
+static void
+s_bench_run (size_t children, size_t commands)
+{
+    bench_t bench = { .children = children };
+    zsock_t *router = zsock_new (ZMQ_ROUTER);
+    int port = zsock_bind (router, "tcp://127.0.0.1:*");
+    assert (port > 0);
+    snprintf (bench.router, sizeof (bench.router), ">tcp://127.0.0.1:%d", port);
+    zsock_t *publisher = zsock_new (ZMQ_PUB);
+    port = zsock_bind (publisher, "tcp://127.0.0.1:*");
+    assert (port > 0);
+    snprintf (bench.publisher, sizeof (bench.publisher), ">tcp://127.0.0.1:%d", port);
+    zactor_t *actor = zactor_new (s_children, &bench);
+
+    //  The identities of all children, from their READY
+    zlist_t *identities = zlist_new ();
+    while (zlist_size (identities) < children && !zsys_interrupted) {
+        zmsg_t *msg = zmsg_recv (router);
+        if (!msg)
+            break;
+        zframe_t *identity = zmsg_pop (msg);
+        zlist_append (identities, identity);
+        zmsg_destroy (&msg);
+    }
+    //  Subscriptions take a while to arrive, so broadcast until all children
+    //  have acknowledged one command
+    uint32_t sequence = 0;
+    int64_t send;
+    while (!zsys_interrupted && s_bench_command (router, publisher, identities, ++sequence, &send) == -1)
+        ;
+
+    int way;
+    for (way = 0; way < 2 && !zsys_interrupted; way++) {
+        int64_t *latencies = (int64_t *) zmalloc (commands * sizeof (int64_t));
+        int64_t sends = 0;
+        size_t completed = 0;
+        size_t timeouts = 0;
+        size_t command;
+        for (command = 0; command < commands && !zsys_interrupted; command++) {
+            int64_t elapsed = s_bench_command (router, way == 0? publisher: NULL,
+                                               identities, ++sequence, &send);
+            sends += send;
+            if (elapsed == -1)
+                timeouts++;
+            else
+                latencies [completed++] = elapsed;
+        }
+        qsort (latencies, completed, sizeof (int64_t), s_compare_latency);
+        printf ("%-10s %10zu %10zu %12.1f %12" PRId64 " %12" PRId64 " %10zu\n",
+                way == 0? "broadcast": "router", children, command,
+                command? (double) sends / command: 0,
+                completed? latencies [completed / 2]: 0,
+                completed? latencies [completed * 99 / 100]: 0, timeouts);
+        free (latencies);
+    }
+    zactor_destroy (&actor);
+    while (zlist_size (identities)) {
+        zframe_t *identity = (zframe_t *) zlist_pop (identities);
+        zframe_destroy (&identity);
+    }
+    zlist_destroy (&identities);
+    zsock_destroy (&publisher);
+    zsock_destroy (&router);
+}
+
+int main (int argc, char *argv [])
+{
+    size_t commands = BENCH_COMMANDS;
+    size_t children [16];
+    size_t run_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            commands = atol (argv [++argn]);
+        else
+        if (atol (argv [argn]) > 0 && run_count < 16)
+            children [run_count++] = atol (argv [argn]);
+        else {
+            printf ("usage: fanoutbench [-n commands] [children ...]\n");
+            return 1;
+        }
+    }
+    if (!run_count) {
+        size_t defaults [] = { 10, 100, 1000 };
+        for (run_count = 0; run_count < 3; run_count++)
+            children [run_count] = defaults [run_count];
+    }
+    //  Each child has two sockets
+    size_t most = 0;
+    size_t run;
+    for (run = 0; run < run_count; run++)
+        if (children [run] > most)
+            most = children [run];
+    zsys_set_max_sockets (2 * most + 16);
+
+    printf ("%-10s %10s %10s %12s %12s %12s %10s\n",
+            "send", "children", "commands", "send usecs", "p50 usecs", "p99 usecs", "timeouts");
+    for (run = 0; run < run_count && !zsys_interrupted; run++)
+        s_bench_run (children [run], commands);
+    return 0;
+}
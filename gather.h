@@ -0,0 +1,98 @@
+#ifndef PNP_GATHER
+#define PNP_GATHER "Pick-n-Pack Scatter-Gather"
+
+//  A gather tracks one lifecycle command that a resource has sent to all of
+//  its backend resources at once. It collects the acknowledgement of every
+//  backend resource until all have answered or the command times out, so the
+//  resource can report a single aggregate result to its own frontend.
+
+#include <inttypes.h>
+#include "protocol.h"
+
+#define GATHER_TIMEOUT  HEARTBEAT_INTERVAL  //  msecs to wait for acknowledgements
+
+typedef struct {
+    uint32_t sequence;          //  Sequence of the command we sent
+    zframe_t *origin;           //  Sequence of the command we received, if any
+    zframe_t *client;           //  Identity of the client that sent it, at the Plant
+    byte signal;                //  Command signal
+    uint32_t config;            //  Version of the configuration the command passes on, 0 if none
+    int broadcast;              //  Command went out on the PUB socket
+    size_t expected;            //  Number of backend resources commanded
+    zhash_t *acks;              //  Result per acknowledging resource identity
+    byte result;                //  0, or first error reported
+    int64_t started;            //  Time command was sent, in usecs
+    int64_t deadline;           //  Give up waiting at this time
+} gather_t;
+
+//  Construct new gather for <expected> acknowledgements; takes ownership of
+//  <origin>, which may be NULL for commands the resource issued itself
+static gather_t *
+s_gather_new (uint32_t sequence, zframe_t *origin, byte signal, size_t expected)
+{
+    gather_t *self = (gather_t *) zmalloc (sizeof (gather_t));
+    self->sequence = sequence;
+    self->origin = origin;
+    self->signal = signal;
+    self->expected = expected;
+    self->acks = zhash_new ();
+    self->started = zclock_usecs ();
+    self->deadline = zclock_time () + GATHER_TIMEOUT;
+    return self;
+}
+
+//  Destroy specified gather object, including origin and client frames
+static void
+s_gather_destroy (gather_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        gather_t *self = *self_p;
+        zframe_destroy (&self->origin);
+        zframe_destroy (&self->client);
+        zhash_destroy (&self->acks);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The ack method records the result of one backend resource. Duplicate
+//  acknowledgements, e.g. after a resend, are only counted once.
+static void
+s_gather_ack (gather_t *self, const char *identity, byte result)
+{
+    if (zhash_lookup (self->acks, identity))
+        return;
+    zhash_insert (self->acks, identity, (void *) self);
+    if (result && !self->result)
+        self->result = result;
+}
+
+//  The done method returns true once all acknowledgements are in, or the
+//  command has timed out. Missing acknowledgements count as a heartbeat
+//  error in the aggregate result, or for a broadcast as a broadcast error:
+//  a PUB socket drops commands to subscribers that joined too late, which
+//  says nothing about their liveness.
+static int
+s_gather_done (gather_t *self)
+{
+    if (zhash_size (self->acks) >= self->expected)
+        return 1;
+    if (zclock_time () < self->deadline)
+        return 0;
+    if (!self->result)
+        self->result = self->broadcast? PNP_ERR_BROADCAST [0]: PNP_ERR_HEARTBEAT [0];
+    return 1;
+}
+
+//  The lookup method finds the gather for an acknowledged sequence
+static gather_t *
+s_gathers_lookup (zlist_t *gathers, uint32_t sequence)
+{
+    gather_t *gather = (gather_t *) zlist_first (gathers);
+    while (gather && gather->sequence != sequence)
+        gather = (gather_t *) zlist_next (gathers);
+    return gather;
+}
+
+#endif
@@ -0,0 +1,249 @@
+#ifndef PNP_HEDGED_CLIENT
+#define PNP_HEDGED_CLIENT "Pick-n-Pack Hedged Client"
+
+//  The hedged client sends requests to a list of Plant endpoints. It keeps
+//  the reply times of each endpoint in a decaying histogram (rtt.h) and the
+//  rate of its requests that got no reply, and sends each request to the
+//  endpoint with the lowest expected cost, i.e. its median reply time plus
+//  its failure rate times the request timeout. When the reply takes longer
+//  than a percentile of the reply times of that endpoint, the request goes
+//  to the next best endpoint too, and the first reply wins. So a degraded
+//  Plant adds at most the hedge delay to a request, and it soon stops being
+//  picked at all. Hedging at the 95th percentile sends about 5% of requests
+//  twice.
+//
+//  Replies echo the first frame of their request, as the lines do; replies
+//  to an earlier request, e.g. the slower of a hedged pair, still count for
+//  the reply times of their endpoint and are dropped. A request that gets no
+//  reply in time counts as failed for every endpoint it went to, which get
+//  fresh sockets, and is sent again, up to a number of retries.
+//
+//  Hedging only pays across Plants that all serve requests. The passive peer
+//  of a Binary Star pair (bstar.h) drops them until it takes over, so with a
+//  pair a hedge never wins, loads nothing but the failure rate of the backup,
+//  and adds nothing to failing over. Clients of a pair set the percentile to
+//  0 and fail over only; reads from the passive peer are not served yet.
+
+#define HEDGE_PERCENTILE    95      //  Reply time percentile after which a request is hedged, 0 never
+#define HEDGE_MIN_DELAY     2       //  msecs, hedge no earlier
+#define HEDGE_FAILURE_WEIGHT 8      //  Failure rate weighs a new outcome 1/8
+
+typedef struct {
+    char *endpoint;
+    zsock_t *socket;
+    rtt_t replies;              //  Reply times, usecs
+    double failures;            //  Decayed rate of requests without a reply
+    zframe_t *outstanding;      //  First frame of the last request sent, until replied
+    int64_t sent_at;            //  When it was sent, usecs
+    size_t sent;
+    size_t replied;
+    size_t won;                 //  Replies that were first
+} hedge_endpoint_t;
+
+typedef struct {
+    hedge_endpoint_t *endpoints;
+    size_t count;
+    int percentile;             //  Hedge after this percentile of reply times, 0 never
+    int timeout;                //  msecs before a request counts as failed
+    size_t requests;
+    size_t hedged;              //  Requests sent to a second endpoint
+    size_t hedges_won;          //  Of which the second endpoint replied first
+} hedge_t;
+
+//  Construct new client for the <count> <endpoints>, failing requests after
+//  <timeout> msecs and hedging them after the reply time <percentile>
+static hedge_t *
+s_hedge_new (const char **endpoints, size_t count, int timeout, int percentile)
+{
+    assert (count);
+    hedge_t *self = (hedge_t *) zmalloc (sizeof (hedge_t));
+    self->endpoints = (hedge_endpoint_t *) zmalloc (count * sizeof (hedge_endpoint_t));
+    self->count = count;
+    self->timeout = timeout;
+    self->percentile = percentile;
+    size_t index;
+    for (index = 0; index < count; index++) {
+        self->endpoints [index].endpoint = strdup (endpoints [index]);
+        self->endpoints [index].socket = zsock_new_dealer (endpoints [index]);
+        assert (self->endpoints [index].socket);
+    }
+    return self;
+}
+
+static void
+s_hedge_destroy (hedge_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        hedge_t *self = *self_p;
+        size_t index;
+        for (index = 0; index < self->count; index++) {
+            zsock_destroy (&self->endpoints [index].socket);
+            zframe_destroy (&self->endpoints [index].outstanding);
+            free (self->endpoints [index].endpoint);
+        }
+        free (self->endpoints);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Records the outcome of a request to <endpoint>
+static void
+s_hedge_outcome (hedge_endpoint_t *endpoint, int failed)
+{
+    endpoint->failures += ((failed? 1.0: 0.0) - endpoint->failures) / HEDGE_FAILURE_WEIGHT;
+}
+
+//  Returns the expected cost of a request to <endpoint>, usecs. Endpoints we
+//  have no reply times of yet rank behind those replying within half the
+//  timeout.
+static double
+s_hedge_cost (hedge_t *self, hedge_endpoint_t *endpoint)
+{
+    double median = endpoint->replies.count? (double) s_rtt_percentile_usecs (&endpoint->replies, 50)
+                                           : self->timeout * 500.0;
+    return median + endpoint->failures * self->timeout * 1000.0;
+}
+
+//  Returns the index of the cheapest endpoint other than <except>, or -1
+static int
+s_hedge_best (hedge_t *self, int except)
+{
+    int best = -1;
+    size_t index;
+    for (index = 0; index < self->count; index++)
+        if ((int) index != except
+        &&  (best == -1 || s_hedge_cost (self, &self->endpoints [index])
+                         < s_hedge_cost (self, &self->endpoints [best])))
+            best = (int) index;
+    return best;
+}
+
+//  Sends a copy of <request> to endpoint <index>. A request still outstanding
+//  there for longer than the timeout has failed.
+static void
+s_hedge_send (hedge_t *self, int index, zmsg_t *request)
+{
+    hedge_endpoint_t *endpoint = &self->endpoints [index];
+    if (endpoint->outstanding
+    &&  zclock_usecs () - endpoint->sent_at > self->timeout * 1000LL)
+        s_hedge_outcome (endpoint, 1);
+    zframe_destroy (&endpoint->outstanding);
+    endpoint->outstanding = zframe_dup (zmsg_first (request));
+    endpoint->sent_at = zclock_usecs ();
+    endpoint->sent++;
+    zmsg_t *copy = zmsg_dup (request);
+    zmsg_send (&copy, endpoint->socket);
+}
+
+//  Receives a reply on endpoint <index>, records its reply time if it answers
+//  the request outstanding there, and returns it, or NULL if interrupted
+static zmsg_t *
+s_hedge_receive (hedge_t *self, int index)
+{
+    hedge_endpoint_t *endpoint = &self->endpoints [index];
+    zmsg_t *reply = zmsg_recv (endpoint->socket);
+    if (reply && endpoint->outstanding && zframe_eq (zmsg_first (reply), endpoint->outstanding)) {
+        s_rtt_add (&endpoint->replies, zclock_usecs () - endpoint->sent_at);
+        s_hedge_outcome (endpoint, 0);
+        endpoint->replied++;
+        zframe_destroy (&endpoint->outstanding);
+    }
+    return reply;
+}
+
+//  The request method sends <request> and returns the first reply that echoes
+//  its first frame, or NULL if no endpoint replied within <retries> attempts.
+//  Takes ownership of the request.
+static zmsg_t *
+s_hedge_request (hedge_t *self, zmsg_t **request_p, int retries)
+{
+    assert (request_p && *request_p);
+    zmsg_t *request = *request_p;
+    zframe_t *key = zmsg_first (request);
+    zmsg_t *reply = NULL;
+    self->requests++;
+    while (retries-- > 0 && !reply && !zsys_interrupted) {
+        int primary = s_hedge_best (self, -1);
+        int secondary = -1;
+        s_hedge_send (self, primary, request);
+        int64_t sent_at = zclock_time ();
+        int64_t expiry = sent_at + self->timeout;
+        int64_t hedge_at = expiry;
+        if (self->percentile && self->count > 1) {
+            int64_t delay = s_rtt_percentile_usecs (&self->endpoints [primary].replies, self->percentile) / 1000;
+            if (!self->endpoints [primary].replies.count)
+                delay = self->timeout / 4;
+            hedge_at = sent_at + (delay > HEDGE_MIN_DELAY? delay: HEDGE_MIN_DELAY);
+        }
+        while (!reply && !zsys_interrupted) {
+            int64_t now = zclock_time ();
+            if (now >= expiry)
+                break;
+            if (secondary == -1 && now >= hedge_at) {
+                secondary = s_hedge_best (self, primary);
+                if (secondary != -1) {
+                    s_hedge_send (self, secondary, request);
+                    self->hedged++;
+                }
+                hedge_at = expiry;
+            }
+            zmq_pollitem_t items [self->count];
+            size_t index;
+            for (index = 0; index < self->count; index++)
+                items [index] = (zmq_pollitem_t) { zsock_resolve (self->endpoints [index].socket), 0, ZMQ_POLLIN, 0 };
+            int64_t wait = (hedge_at < expiry? hedge_at: expiry) - now;
+            if (zmq_poll (items, (int) self->count, wait * ZMQ_POLL_MSEC) == -1)
+                break;          //  Interrupted
+            for (index = 0; index < self->count && !reply; index++) {
+                if (!(items [index].revents & ZMQ_POLLIN))
+                    continue;
+                zmsg_t *msg = s_hedge_receive (self, (int) index);
+                if (msg && zframe_eq (zmsg_first (msg), key)) {
+                    reply = msg;
+                    self->endpoints [index].won++;
+                    if ((int) index == secondary)
+                        self->hedges_won++;
+                }
+                else
+                    zmsg_destroy (&msg);    //  Reply to an earlier request
+            }
+        }
+        if (!reply && !zsys_interrupted) {
+            //  Old sockets are confused; close them and open new ones
+            int tried [2] = { primary, secondary };
+            int nbr;
+            for (nbr = 0; nbr < 2; nbr++) {
+                if (tried [nbr] == -1)
+                    continue;
+                hedge_endpoint_t *endpoint = &self->endpoints [tried [nbr]];
+                printf ("W: no response from %s\n", endpoint->endpoint);
+                s_hedge_outcome (endpoint, 1);
+                zframe_destroy (&endpoint->outstanding);
+                zsock_destroy (&endpoint->socket);
+                endpoint->socket = zsock_new_dealer (endpoint->endpoint);
+            }
+        }
+    }
+    zmsg_destroy (request_p);
+    return reply;
+}
+
+//  The report method prints the reply times and failure rate per endpoint
+static void
+s_hedge_report (hedge_t *self)
+{
+    printf ("I: %zu requests, %zu hedged, %zu hedges replied first\n",
+            self->requests, self->hedged, self->hedges_won);
+    size_t index;
+    for (index = 0; index < self->count; index++) {
+        hedge_endpoint_t *endpoint = &self->endpoints [index];
+        printf ("I: %-24s sent %6zu replied %6zu first %6zu p50 %8" PRId64 " p99 %8" PRId64
+                " usecs, failures %.3f\n", endpoint->endpoint, endpoint->sent, endpoint->replied,
+                endpoint->won, s_rtt_percentile_usecs (&endpoint->replies, 50),
+                s_rtt_percentile_usecs (&endpoint->replies, 99), endpoint->failures);
+    }
+}
+
+#endif
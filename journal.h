@@ -0,0 +1,352 @@
+#ifndef PNP_JOURNAL
+#define PNP_JOURNAL "Pick-n-Pack Request Journal"
+
+//  The journal is an append-only, memory-mapped log of the requests the Plant
+//  has accepted, dispatched and completed. Records are written straight into
+//  the mapped file, so they survive a crash of the Plant process without any
+//  write() or fsync() on the request path. On restart the Plant replays the
+//  journal to rebuild its pending and in-flight requests, and compaction
+//  periodically drops the records of completed requests.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <inttypes.h>
+
+//  Record types
+#define JOURNAL_ACCEPTED    'A'     //  Request received from a client
+#define JOURNAL_DISPATCHED  'D'     //  Request sent to a line
+#define JOURNAL_COMPLETED   'C'     //  Reply sent back to the client
+
+#define JOURNAL_MAGIC       0x4a504e50  //  "PNPJ"
+#define JOURNAL_VERSION     1
+#define JOURNAL_SIZE_INIT   (16 * 1024 * 1024)  //  Initial size of the journal file
+#define JOURNAL_COMPACT_INTERVAL 60000      //  msecs
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t tail;              //  Offset of first free byte
+    uint64_t sequence;          //  Highest request sequence written
+} journal_header_t;
+
+//  A record is followed by its body: for ACCEPTED records the request
+//  message, encoded as <frames> times <uint32 size><data>. Records are
+//  padded to 8 bytes so headers stay aligned in the mapping.
+typedef struct {
+    uint32_t size;              //  Size of the record including padding
+    uint16_t type;
+    uint16_t frames;            //  Number of frames in the body
+    uint64_t sequence;
+    int64_t timestamp;
+} journal_record_t;
+
+#define JOURNAL_ALIGN(n) (((n) + 7) & ~((size_t) 7))
+
+typedef struct {
+    char *filename;
+    int fd;
+    byte *data;                 //  Mapped journal file
+    size_t capacity;            //  Size of the mapping
+    journal_header_t *header;
+    int64_t compact_at;         //  Next periodic compaction
+} journal_t;
+
+//  Callback invoked for every record during replay, with the time it was
+//  written, msecs. The callback takes over ownership of <msg>, which is NULL
+//  for records without a body.
+typedef void (journal_replay_fn) (int type, uint64_t sequence, int64_t timestamp, zmsg_t *msg, void *arg);
+
+//  Map <filename> into memory, creating and initialising it if needed
+static int
+s_journal_map (journal_t *self, const char *filename)
+{
+    self->fd = open (filename, O_RDWR | O_CREAT, 0644);
+    if (self->fd == -1)
+        return -1;
+    struct stat st;
+    if (fstat (self->fd, &st) == -1)
+        return -1;
+    int fresh = st.st_size < (off_t) sizeof (journal_header_t);
+    if (fresh) {
+        if (ftruncate (self->fd, JOURNAL_SIZE_INIT) == -1)
+            return -1;
+        st.st_size = JOURNAL_SIZE_INIT;
+    }
+    self->capacity = st.st_size;
+    self->data = mmap (NULL, self->capacity, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED) {
+        self->data = NULL;
+        return -1;
+    }
+    self->header = (journal_header_t *) self->data;
+    if (!fresh
+    && (self->header->magic != JOURNAL_MAGIC
+    ||  self->header->version != JOURNAL_VERSION
+    ||  self->header->tail > self->capacity)) {
+        printf ("E: journal %s is corrupt, starting empty\n", filename);
+        fresh = 1;
+    }
+    if (fresh) {
+        self->header->magic = JOURNAL_MAGIC;
+        self->header->version = JOURNAL_VERSION;
+        self->header->tail = JOURNAL_ALIGN (sizeof (journal_header_t));
+        self->header->sequence = 0;
+    }
+    return 0;
+}
+
+static void
+s_journal_unmap (journal_t *self)
+{
+    if (self->data) {
+        msync (self->data, self->capacity, MS_ASYNC);
+        munmap (self->data, self->capacity);
+    }
+    if (self->fd != -1)
+        close (self->fd);
+    self->data = NULL;
+    self->header = NULL;
+    self->fd = -1;
+}
+
+//  Construct new journal backed by <filename>
+static journal_t *
+s_journal_new (const char *filename)
+{
+    journal_t *self = (journal_t *) zmalloc (sizeof (journal_t));
+    self->filename = strdup (filename);
+    self->fd = -1;
+    if (s_journal_map (self, filename) == -1) {
+        printf ("E: cannot map journal %s: %s\n", filename, strerror (errno));
+        s_journal_unmap (self);
+        free (self->filename);
+        free (self);
+        return NULL;
+    }
+    self->compact_at = zclock_time () + JOURNAL_COMPACT_INTERVAL;
+    return self;
+}
+
+//  Destroy specified journal, the file itself is kept for recovery
+static void
+s_journal_destroy (journal_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        journal_t *self = *self_p;
+        s_journal_unmap (self);
+        free (self->filename);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Grow the journal file so at least <needed> bytes fit behind the tail. The
+//  old mapping is only dropped once the new one is in place, so the journal
+//  stays usable if growing fails.
+static int
+s_journal_grow (journal_t *self, size_t needed)
+{
+    size_t capacity = self->capacity;
+    while (capacity < self->header->tail + needed)
+        capacity *= 2;
+    if (ftruncate (self->fd, capacity) == -1)
+        return -1;
+    byte *data = mmap (NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (data == MAP_FAILED)
+        return -1;
+    munmap (self->data, self->capacity);
+    self->data = data;
+    self->header = (journal_header_t *) self->data;
+    self->capacity = capacity;
+    return 0;
+}
+
+static size_t
+s_journal_body_size (zmsg_t *msg)
+{
+    size_t size = 0;
+    zframe_t *frame = msg? zmsg_first (msg): NULL;
+    while (frame) {
+        size += sizeof (uint32_t) + zframe_size (frame);
+        frame = zmsg_next (msg);
+    }
+    return size;
+}
+
+static int s_journal_compact (journal_t *self);
+
+//  Append a record for request <sequence>; <msg> is only stored, never
+//  destroyed, and may be NULL. The tail is moved last so a record torn by
+//  a crash is never replayed. Returns -1 if the record could not be written.
+static int
+s_journal_append (journal_t *self, int type, uint64_t sequence, zmsg_t *msg)
+{
+    if (!self->data)
+        return -1;
+    size_t size = JOURNAL_ALIGN (sizeof (journal_record_t) + s_journal_body_size (msg));
+    if (self->header->tail + size > self->capacity) {
+        s_journal_compact (self);
+        if (!self->data)
+            return -1;          //  Compaction lost the mapping
+        if (self->header->tail + size > self->capacity
+        &&  s_journal_grow (self, size) == -1) {
+            printf ("E: cannot grow journal %s: %s\n", self->filename, strerror (errno));
+            return -1;
+        }
+    }
+    journal_record_t *record = (journal_record_t *) (self->data + self->header->tail);
+    record->size = size;
+    record->type = type;
+    record->frames = msg? zmsg_size (msg): 0;
+    record->sequence = sequence;
+    record->timestamp = zclock_time ();
+
+    byte *body = (byte *) (record + 1);
+    zframe_t *frame = msg? zmsg_first (msg): NULL;
+    while (frame) {
+        uint32_t frame_size = zframe_size (frame);
+        memcpy (body, &frame_size, sizeof (frame_size));
+        memcpy (body + sizeof (frame_size), zframe_data (frame), frame_size);
+        body += sizeof (frame_size) + frame_size;
+        frame = zmsg_next (msg);
+    }
+    if (sequence > self->header->sequence)
+        self->header->sequence = sequence;
+    self->header->tail += size;
+    return 0;
+}
+
+//  Decode the request message stored in a record, or NULL if it has none
+static zmsg_t *
+s_journal_record_msg (journal_record_t *record)
+{
+    if (record->frames == 0)
+        return NULL;
+    byte *body = (byte *) (record + 1);
+    byte *end = (byte *) record + record->size;
+    zmsg_t *msg = zmsg_new ();
+    int frame_nbr;
+    for (frame_nbr = 0; frame_nbr < record->frames; frame_nbr++) {
+        uint32_t frame_size;
+        if (body + sizeof (frame_size) > end) {
+            zmsg_destroy (&msg);
+            break;
+        }
+        memcpy (&frame_size, body, sizeof (frame_size));
+        body += sizeof (frame_size);
+        if (frame_size > (size_t) (end - body)) {
+            zmsg_destroy (&msg);
+            break;
+        }
+        zmsg_addmem (msg, body, frame_size);
+        body += frame_size;
+    }
+    return msg;
+}
+
+//  Returns true if <record> at <offset> is whole and of a known type
+static int
+s_journal_record_valid (journal_t *self, journal_record_t *record, size_t offset)
+{
+    return record->size >= sizeof (journal_record_t)
+        && offset + record->size <= self->header->tail
+        && (record->type == JOURNAL_ACCEPTED
+        ||  record->type == JOURNAL_DISPATCHED
+        ||  record->type == JOURNAL_COMPLETED);
+}
+
+//  Call <fn> for every record in the journal, oldest first. A record torn by
+//  a crash, or otherwise invalid, ends the journal; the tail is moved back to
+//  it, so it is written over and compaction does not trip on it. Returns the
+//  number of records replayed.
+static size_t
+s_journal_replay (journal_t *self, journal_replay_fn *fn, void *arg)
+{
+    size_t records = 0;
+    size_t offset = JOURNAL_ALIGN (sizeof (journal_header_t));
+    while (offset + sizeof (journal_record_t) <= self->header->tail) {
+        journal_record_t *record = (journal_record_t *) (self->data + offset);
+        if (!s_journal_record_valid (self, record, offset)) {
+            printf ("E: journal %s truncated at offset %zu\n", self->filename, offset);
+            self->header->tail = offset;
+            break;
+        }
+        zmsg_t *msg = record->type == JOURNAL_ACCEPTED? s_journal_record_msg (record): NULL;
+        fn (record->type, record->sequence, record->timestamp, msg, arg);
+        offset += record->size;
+        records++;
+    }
+    return records;
+}
+
+//  The compact method rewrites the journal without the records of completed
+//  requests. The new journal is written next to the old one and renamed over
+//  it, so a crash during compaction leaves one of both intact. Its mapping
+//  then replaces ours, so compaction never leaves the journal unmapped.
+static int
+s_journal_compact (journal_t *self)
+{
+    self->compact_at = zclock_time () + JOURNAL_COMPACT_INTERVAL;
+    //  Collect sequences of completed requests
+    zhash_t *completed = zhash_new ();
+    size_t offset = JOURNAL_ALIGN (sizeof (journal_header_t));
+    while (offset + sizeof (journal_record_t) <= self->header->tail) {
+        journal_record_t *record = (journal_record_t *) (self->data + offset);
+        if (!s_journal_record_valid (self, record, offset)) {
+            self->header->tail = offset;
+            break;              //  Torn record, the journal ends here
+        }
+        if (record->type == JOURNAL_COMPLETED) {
+            char key [21];
+            snprintf (key, sizeof (key), "%" PRIu64, record->sequence);
+            zhash_insert (completed, key, record);
+        }
+        offset += record->size;
+    }
+    char tmpname [strlen (self->filename) + 5];
+    snprintf (tmpname, sizeof (tmpname), "%s.tmp", self->filename);
+    journal_t compacted = { NULL, -1, NULL, 0, NULL, 0 };
+    unlink (tmpname);
+    int rc = s_journal_map (&compacted, tmpname);
+    if (rc == 0 && compacted.capacity < self->capacity)
+        rc = s_journal_grow (&compacted, self->capacity - compacted.header->tail);
+    if (rc == -1) {
+        printf ("E: cannot compact journal %s: %s\n", self->filename, strerror (errno));
+        s_journal_unmap (&compacted);
+        zhash_destroy (&completed);
+        return -1;
+    }
+    offset = JOURNAL_ALIGN (sizeof (journal_header_t));
+    while (offset + sizeof (journal_record_t) <= self->header->tail) {
+        journal_record_t *record = (journal_record_t *) (self->data + offset);
+        char key [21];
+        snprintf (key, sizeof (key), "%" PRIu64, record->sequence);
+        if (!zhash_lookup (completed, key)) {
+            memcpy (compacted.data + compacted.header->tail, record, record->size);
+            compacted.header->tail += record->size;
+        }
+        offset += record->size;
+    }
+    compacted.header->sequence = self->header->sequence;
+    size_t before = self->header->tail;
+    size_t after = compacted.header->tail;
+    zhash_destroy (&completed);
+
+    if (rename (tmpname, self->filename) == -1) {
+        printf ("E: cannot replace journal %s: %s\n", self->filename, strerror (errno));
+        s_journal_unmap (&compacted);
+        return -1;
+    }
+    //  The renamed file is the one we have mapped
+    s_journal_unmap (self);
+    self->fd = compacted.fd;
+    self->data = compacted.data;
+    self->capacity = compacted.capacity;
+    self->header = compacted.header;
+    printf ("I: compacted journal %s from %zu to %zu bytes\n", self->filename, before, after);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,138 @@
+//  Pick-n-Pack journal benchmark
+//
+//  Measures what the request journal (journal.h) costs the Plant: the time
+//  it adds to every request, which journals ACCEPTED, DISPATCHED and
+//  COMPLETED records, compactions included; and the time a restarted Plant
+//  takes to recover from a journal of pending requests, as plant.c does.
+//
+//  Usage: journalbench [-n requests] [-r records] [size]
+//  Requests default to 1,000,000, recovered records to 1,000,000 and the
+//  request body to 64 bytes.
+
+#include "czmq.h"
+#include "journal.h"
+
+#define BENCH_REQUESTS  1000000
+#define BENCH_RECORDS   1000000
+#define BENCH_SIZE      64
+#define BENCH_JOURNAL   "/tmp/pnp-journalbench.journal"
+
+//  A request as the Plant journals it: client identity, empty delimiter, body
+static zmsg_t *
+s_bench_request (size_t size)
+{
+    zmsg_t *msg = zmsg_new ();
+    byte identity [5] = { 0, 0x6b, 0x8b, 0x45, 0x67 };
+    zmsg_addmem (msg, identity, sizeof (identity));
+    zmsg_addmem (msg, NULL, 0);
+    byte *body = (byte *) zmalloc (size);
+    zmsg_addmem (msg, body, size);
+    free (body);
+    return msg;
+}
+
+//  The append method journals <count> requests and returns usecs per request
+static double
+s_bench_append (size_t count, size_t size, int completed)
+{
+    unlink (BENCH_JOURNAL);
+    journal_t *journal = s_journal_new (BENCH_JOURNAL);
+    assert (journal);
+    zmsg_t *msg = s_bench_request (size);
+    int64_t started = zclock_usecs ();
+    uint64_t sequence;
+    for (sequence = 1; sequence <= count && !zsys_interrupted; sequence++) {
+        s_journal_append (journal, JOURNAL_ACCEPTED, sequence, msg);
+        s_journal_append (journal, JOURNAL_DISPATCHED, sequence, NULL);
+        if (completed)
+            s_journal_append (journal, JOURNAL_COMPLETED, sequence, NULL);
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    zmsg_destroy (&msg);
+    s_journal_destroy (&journal);
+    return count? (double) elapsed / count: 0;
+}
+
+static void
+s_bench_msg_free (void *data)
+{
+    zmsg_t *msg = (zmsg_t *) data;
+    zmsg_destroy (&msg);
+}
+
+//  Replay callback that keeps pending requests by sequence, as plant.c does
+static void
+s_bench_recover (int type, uint64_t sequence, int64_t timestamp, zmsg_t *msg, void *arg)
+{
+    zhash_t *requests = (zhash_t *) arg;
+    (void) timestamp;
+    char key [21];
+    snprintf (key, sizeof (key), "%" PRIu64, sequence);
+    if (type == JOURNAL_ACCEPTED && msg) {
+        zhash_update (requests, key, msg);
+        zhash_freefn (requests, key, s_bench_msg_free);
+        msg = NULL;
+    }
+    else
+    if (type == JOURNAL_COMPLETED)
+        zhash_delete (requests, key);
+    zmsg_destroy (&msg);
+}
+
+//  The recover method replays a journal of <count> pending requests and
+//  returns the msecs it took, opening the journal included
+static double
+s_bench_recover_run (size_t count, size_t size, size_t *recovered, size_t *bytes)
+{
+    s_bench_append (count, size, 0);
+    int64_t started = zclock_usecs ();
+    journal_t *journal = s_journal_new (BENCH_JOURNAL);
+    assert (journal);
+    zhash_t *requests = zhash_new ();
+    s_journal_replay (journal, s_bench_recover, requests);
+    int64_t elapsed = zclock_usecs () - started;
+    *recovered = zhash_size (requests);
+    *bytes = journal->header->tail;
+    zhash_destroy (&requests);
+    s_journal_destroy (&journal);
+    unlink (BENCH_JOURNAL);
+    return elapsed / 1000.0;
+}
+
+int main (int argc, char *argv [])
+{
+    size_t requests = BENCH_REQUESTS;
+    size_t records = BENCH_RECORDS;
+    size_t size = BENCH_SIZE;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            requests = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-r") && argn + 1 < argc)
+            records = atol (argv [++argn]);
+        else
+        if (atol (argv [argn]) > 0)
+            size = atol (argv [argn]);
+        else {
+            printf ("usage: journalbench [-n requests] [-r records] [size]\n");
+            return 1;
+        }
+    }
+    //  Compactions log as they happen, so results are printed at the end
+    double pending = s_bench_append (requests, size, 0);
+    double completed = s_bench_append (requests, size, 1);
+    size_t recovered, bytes;
+    double recovery = s_bench_recover_run (records, size, &recovered, &bytes);
+    unlink (BENCH_JOURNAL);
+
+    printf ("%-12s %10s %10s %14s %14s\n", "journal", "size", "requests", "usecs/request", "requests/sec");
+    printf ("%-12s %10zu %10zu %14.3f %14.0f\n", "A+D", size, requests,
+            pending, pending > 0? 1e6 / pending: 0);
+    printf ("%-12s %10zu %10zu %14.3f %14.0f\n", "A+D+C", size, requests,
+            completed, completed > 0? 1e6 / completed: 0);
+    printf ("%-12s %10s %10s %14s %14s\n", "recovery", "size", "records", "msecs", "MB");
+    printf ("%-12s %10zu %10zu %14.1f %14.1f\n", "replay", size, recovered,
+            recovery, bytes / (1024.0 * 1024));
+    return 0;
+}
@@ -2,14 +2,65 @@
 #include "czmq.h"
 #include "defs.h"
 
+#define LINE_BIND       "tcp://*:9002"      //  Modules connect here, TODO: this should be configured
+
+//  Plant endpoints, primary first. A line fails over to the next Plant when
+//  it loses heartbeats, and only backs off once it has tried all of them.
+static const char *plant_endpoints [] = {
+    "tcp://localhost:9001",     //  TODO: this should be configured
+    "tcp://localhost:9011"
+};
+#define PLANT_ENDPOINTS (sizeof (plant_endpoints) / sizeof (plant_endpoints [0]))
+static size_t plant_endpoint = 0;
+
+//  Our identity at the Plant: our name and the identity of our snapshot, so
+//  two lines of the same name never share one, while a warm restart keeps it
+static char line_identity [64];
+
+//  Files pushed down to all modules and devices, from the command line
+static char **transfer_files = NULL;
+static int transfer_file_count = 0;
+
+//  Connect frontend to the current Plant. The line keeps its identity across
+//  Plants, so a backup Plant recognises it from the replicated line registry.
+static zsock_t *
+s_frontend_connect (resource_t *self)
+{
+    (void) self;
+    zsock_t *frontend = zsock_new (ZMQ_DEALER);
+    zsock_set_identity (frontend, line_identity);
+    zsock_connect (frontend, "%s", plant_endpoints [plant_endpoint]);
+    return frontend;
+}
+
 resource_t* creating(resource_t *self, zsock_t *pipe, char *name) {
     printf("[%s] creating...", name);
     self->name = name;
-    self->frontend = zsock_new_dealer("tcp://localhost:9001"); // TODO: this should be configured
-    self->backend =  zsock_new_router ("tcp://*:9002"); // TODO: this should be configured
+    //  Without a snapshot, a process identity unique on this host stands in for it
+    char process [16];
+    snprintf (process, sizeof (process), "%08x", (uint32_t) zclock_usecs () ^ ((uint32_t) getpid () << 16));
+    const char *snapshot = s_snapshot_identity (self->snapshot);
+    snprintf (line_identity, sizeof (line_identity), "%s-%s", name, snapshot? snapshot: process);
+    self->frontend = s_frontend_connect (self);
+    self->backend =  zsock_new_router (LINE_BIND);
+    //  A module back under its identity takes over from its old connection
+    zsock_set_router_handover (self->backend, 1);
+    //  Lifecycle commands go out next to our ROUTER socket, where modules look for them
+    char *endpoint = s_publisher_endpoint (LINE_BIND);
+    self->publisher = PNP_BROADCAST? zsock_new_pub (endpoint): NULL;
+    zstr_free (&endpoint);
     self->pipe = pipe;
     self->backend_resources = zlist_new ();
     self->required_resources = zlist_new();
+    self->gathers = zlist_new ();
+    self->status = s_status_new ();
+    self->transfer = s_transfer_new ();
+    int file_nbr;
+    for (file_nbr = 0; file_nbr < transfer_file_count; file_nbr++)
+        s_transfer_load (self->transfer, transfer_files [file_nbr]);
+    self->tracking = PNP_TRACKING? s_tracking_new ((byte *) TRACKING_SEQUENCE, strlen (TRACKING_SEQUENCE)): NULL;
+    self->capture = s_capture_new (name);
+    self->codec = PNP_COMPRESSION? s_codec_new (): NULL;
     printf("...done.\n");
     return self;
 }
@@ -18,11 +69,13 @@ int initializing(resource_t* self) {
     printf("[%s] initializing...", self->name);
     // send signal on pipe socket to acknowledge initialization
     zsock_signal (self->pipe, 0);
-    zlist_push(self->required_resources, PNP_QAS_ID);
-    zlist_push(self->required_resources, PNP_PRINTING_ID);
+    byte *child = s_type (PNP_LINE_ID [0])->children;
+    for (; *child; child++)
+        zlist_append (self->required_resources, child);
 
-    zframe_t *frame = zframe_new (PNP_READY, 1);
-    zframe_send (&frame, self->frontend, 0);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, PNP_READY, 1);
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
 
     printf("done.\n");
 
@@ -32,11 +85,12 @@ int initializing(resource_t* self) {
 int configuring (resource_t* self) {
     printf("[%s] configuring...", self->name);
     //  If liveness hits zero, queue is considered disconnected
-    self->liveness = HEARTBEAT_LIVENESS;
+    self->liveness = s_type (PNP_LINE_ID [0])->liveness;
     self->interval = INTERVAL_INIT;
 
-    //  Send out heartbeats at regular intervals
-    self->heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+    //  Send out heartbeats at regular intervals, and expect the Plant's at the same
+    self->heartbeat_at = zclock_time () + s_type (PNP_LINE_ID [0])->interval;
+    s_accrual_init (&self->upstream, s_type (PNP_LINE_ID [0])->interval, zclock_time ());
 
     srandom ((unsigned) time (NULL));
     printf("done.\n");
@@ -44,16 +98,13 @@ int configuring (resource_t* self) {
 }
 
 int running(resource_t *self) {
-    //  Send out heartbeats at regular intervals
-    uint64_t heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
-
 	zmq_pollitem_t items [] = {
 		{ zsock_resolve(self->backend),  0, ZMQ_POLLIN, 0 },
 		{ zsock_resolve(self->frontend), 0, ZMQ_POLLIN, 0 }
 	};
-	//  Poll frontend only if we have available backend_resources
-	int rc = zmq_poll (items, zlist_size (self->backend_resources)? 2: 1,
-		HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+	//  Always poll frontend, Plant heartbeats keep the line alive. Do not wait
+	//  while modules have credit for transfers.
+	int rc = zmq_poll (items, 2, s_transfer_timeout (self->transfer, s_type (PNP_LINE_ID [0])->interval) * ZMQ_POLL_MSEC);
 	if (rc == -1) {
 		printf("E: Line Controller failed to poll sockets\n");
 		return -1;              //  Interrupted
@@ -61,103 +112,155 @@ int running(resource_t *self) {
 	//  Handle backend_resource activity on backend
 	if (items [0].revents & ZMQ_POLLIN) {
 		//  Use backend_resource identity for identify resource location
-		zmsg_t *msg = zmsg_recv (self->backend);
+		zmsg_t *msg = s_resource_recv (self, CAPTURE_BACKEND);
 		if (!msg)
 			return -1;          //  Interrupted
 
 		//  Any sign of life from backend_resource means it's ready
 		zframe_t *identity = zmsg_unwrap (msg);
-		
-		//backend_resource_t *backend_resource = s_backend_resource_new (identity);
-		//s_backend_resource_ready (backend_resource, self->backend_resources);
+		s_backend_resource_alive (self->backend_resources, identity);
 
 		//  Validate control message, or return reply to client
-		if (zmsg_size (msg) == 2) {
+		zmsg_first (msg);
+		zframe_t *type = zmsg_next (msg);
+		if (type && zmsg_size (msg) == 4 && memcmp (zframe_data (type), PNP_ACK, 1) == 0) {
+			s_backend_resource_ack (self, identity, msg);
+			zframe_destroy (&identity);
+			zmsg_destroy (&msg);
+		}
+		else if (zmsg_size (msg) == 2) {
 			// ID
 			zframe_t *frame = zmsg_first (msg);
-			printf("[%s] RX MSG FROM %s\n", self->name, uuid_to_name(zframe_data(frame)));
-			backend_resource_t *backend_resource = s_backend_resource_new (identity, zframe_data(frame));
+			printf("[%s] RX MSG FROM %s\n", self->name, s_type_name (s_type_of (frame)));
+			backend_resource_t *backend_resource = s_backend_resource_new (identity, s_type_of (frame));
 			frame = zmsg_next(msg);
-			if (memcmp (zframe_data (frame), PNP_READY, 0)) {
+			if (memcmp (zframe_data (frame), PNP_READY, 1) == 0) {
 				printf("[%s] RX READY BACKEND %s\n", self->name, backend_resource->id_string);
 				s_backend_resource_ready (backend_resource, self->backend_resources);
 			}
+			else
+				s_backend_resource_destroy (&backend_resource);
 			
 			zmsg_destroy (&msg);
 		}
-		else if (zmsg_size (msg) == 3) {
-			// ID
-			zframe_t *frame = zmsg_first (msg);
-			char* name = zframe_data(frame);
-			frame = zmsg_next(msg);
-			char* state = zframe_data(frame);
-			frame = zmsg_next(msg);
-			char* signal = zframe_data(frame);
-			printf("[%s] RX HB [%s, %o, %o]\n", self->name, uuid_to_name(name), state[0], signal[0]);
-
+		else if (type && zmsg_size (msg) == 3 && memcmp (zframe_data (type), PNP_BATCH, 1) == 0) {
+			s_batch_forward (self, &msg);
+			zframe_destroy (&identity);
+		}
+		else if (type && zmsg_size (msg) == 4 && memcmp (zframe_data (type), PNP_TRANSFER, 1) == 0) {
+			s_transfer_credit (self->transfer, identity, msg);
+			zframe_destroy (&identity);
+			zmsg_destroy (&msg);
+		}
+		else if (type && zmsg_size (msg) == 3 && memcmp (zframe_data (type), PNP_TRAY, 1) == 0) {
+			if (self->tracking)
+				s_tracking_event (self->tracking, msg);
+			zframe_destroy (&identity);
 			zmsg_destroy (&msg);
-		} else
+		}
+		else if (s_msg_is_heartbeat (msg)) {
+			s_backend_resource_heartbeat (self, identity, msg);
+			zmsg_destroy (&msg);
+		} else {
 			// we assume here all other messages are replies which need to be sent to the clients
-			zmsg_send (&msg, self->frontend);
+			s_trace_stamp (msg, PNP_LINE_ID [0], TRACE_FORWARD);
+			s_resource_send (self, &msg, CAPTURE_FRONTEND);
+		}
 	}
 	if (items [1].revents & ZMQ_POLLIN) {
 		//  Poll frontend
-		zmsg_t *msg = zmsg_recv (self->frontend);
+		zmsg_t *msg = s_resource_recv (self, CAPTURE_FRONTEND);
 		if (!msg)
 			return -1;          //  Interrupted
+		//  Any message from the Plant proves it is alive
+		s_accrual_alive (&self->upstream, zclock_time ());
+		self->interval = INTERVAL_INIT;
 		//  Validate control message, or return reply to client
-		if (zmsg_size (msg) == 1)  {
+		if (memcmp (zframe_data (zmsg_first (msg)), PNP_COMMAND, 1) == 0)
+			s_command_receive (self, msg);
+		else if (memcmp (zframe_data (zmsg_first (msg)), PNP_READY, 1) == 0
+		||  memcmp (zframe_data (zmsg_first (msg)), PNP_HEARTBEAT, 1) == 0)  {
 			printf("[%s] RX HB FRONTEND\n", self->name);
-			zframe_t *frame = zmsg_first (msg);
-			if (memcmp (zframe_data (frame), PNP_READY, 1)
-			&&  memcmp (zframe_data (frame), PNP_HEARTBEAT, 1)) {
-				printf ("E: invalid message from backend_resource\n");
-				zmsg_dump (msg);
-			}
-			zmsg_destroy (&msg);
+			//  Keep the Plant timestamp, to echo it in our next heartbeat
+			zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+			if (frame)
+				s_rtt_stamp (&self->echo, frame);
+			//  And the bandwidth of our link, if the Plant found it slow
+			frame = s_msg_extension (msg, PNP_LINK);
+			if (frame)
+				s_codec_link (self->codec, frame);
+			s_accrual_heartbeat (&self->upstream, zclock_time (), 0);
 		}
-		else
-			//  .split detecting a dead queue
-			//  If the queue hasn't sent us heartbeats in a while, destroy the
-			//  socket and reconnect. This is the simplest most brutal way of
-			//  discarding any messages we might have sent in the meantime:
-			if (--self->liveness == 0) {
-				printf ("[%s] heartbeat failure, can't reach frontend\n", self->name);
-				printf ("[%s] reconnecting in %zd msec...\n", self->name, self->interval);
-				zclock_sleep (self->interval);
-
-				if (self->interval < INTERVAL_MAX)
-					self->interval *= 2;
-				zsock_destroy(&self->frontend);
-				self->frontend = zsock_new_dealer("tcp://localhost:9001"); // TODO: this should be configured.
-				self->liveness = HEARTBEAT_LIVENESS;
-			}
+		else {
+			//  Client request, i.e. client identity and request frames. Requests
+			//  are not routed to modules yet, so their traces end here
+			s_trace_stamp (msg, PNP_LINE_ID [0], TRACE_RECEIVE);
+			s_trace_write (msg);
+		}
+		zmsg_destroy (&msg);
 		//zframe_t *identity = s_backend_resources_next (self->backend_resources);
 		//zmsg_prepend (msg, &identity);
 		//zmsg_send (&msg, backend);
 	}
+	s_transfers_send (self);
 	//  .split handle heartbeating
 	//  We handle heartbeating after any socket activity. First, we send
 	//  heartbeats to any idle backend_resources if it's time. Then, we purge any
 	//  dead backend_resources:
-	if (zclock_time () >= heartbeat_at) {
-		backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
-		while (backend_resource) {
-			zframe_send (&backend_resource->identity, self->backend,	ZFRAME_REUSE + ZFRAME_MORE);
-			zframe_t *frame = zframe_new (PNP_HEARTBEAT, 1);
-			zframe_send (&frame, self->backend, 0);
-			printf("[%s] TX HB BACKEND %s\n", self->name, backend_resource->id_string);
-			backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
+	if ((uint64_t) zclock_time () >= self->heartbeat_at) {
+		//  .split detecting a dead Plant
+		//  If the Plant has been silent for longer than the threshold of our
+		//  type allows, destroy the socket and connect to the next Plant right
+		//  away, so a backup Plant sees us as soon as we give up on the primary,
+		//  about three heartbeat intervals after it went silent, see bstar.h.
+		//  We only back off once every Plant has been tried:
+		if (zclock_time () >= s_accrual_expiry (&self->upstream, s_type (PNP_LINE_ID [0])->threshold,
+		                                        s_type (PNP_LINE_ID [0])->liveness)) {
+			printf ("[%s] heartbeat failure, can't reach frontend\n", self->name);
+			plant_endpoint = (plant_endpoint + 1) % PLANT_ENDPOINTS;
+			if (plant_endpoint == 0) {
+				printf ("[%s] reconnecting in %zd msec...\n", self->name, self->interval);
+				zclock_sleep (self->interval);
+				if (self->interval < INTERVAL_MAX)
+					self->interval *= 2;
+			}
+			printf ("[%s] failing over to %s\n", self->name, plant_endpoints [plant_endpoint]);
+			zsock_destroy(&self->frontend);
+			self->frontend = s_frontend_connect (self);
+			//  The link to the next Plant is another, it reports its own bandwidth
+			if (self->codec)
+				self->codec->bandwidth = 0;
+			zmsg_t *msg = zmsg_new ();
+			zmsg_addmem (msg, PNP_READY, 1);
+			s_resource_send (self, &msg, CAPTURE_FRONTEND);
+			s_accrual_init (&self->upstream, s_type (PNP_LINE_ID [0])->interval, zclock_time ());
 		}
-		// Send heartbeat to frontend
-		zframe_t *frame = zframe_new (PNP_HEARTBEAT, 1);
-		zframe_send (&frame, self->frontend, 0);
-		printf("[%s] TX HB FRONTEND\n", self->name);
-		heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+		s_backend_resources_heartbeat (self);
+		s_transfers_offer (self);
+		// Send heartbeat to frontend, with the status of modules and devices that changed
+		// and the echo of the last Plant timestamp, unless the Plant just heard from us and
+		// nothing changed
+		zframe_t *frame = s_status_encode (self->status);
+		if (!PNP_HEARTBEAT_SUPPRESSION
+		||  s_suppress_due (&self->suppress, zclock_time (), s_type (PNP_LINE_ID [0])->interval, 0, frame != NULL)) {
+			zmsg_t *heartbeat = zmsg_new ();
+			zmsg_addmem (heartbeat, PNP_HEARTBEAT, 1);
+			if (frame)
+				zmsg_append (heartbeat, &frame);
+			frame = s_rtt_clock_frame (&self->echo);
+			zmsg_append (heartbeat, &frame);
+			s_resource_send (self, &heartbeat, CAPTURE_FRONTEND);
+			printf("[%s] TX HB FRONTEND\n", self->name);
+		}
+		if (self->tracking)
+			s_tracking_expire (self->tracking, zclock_usecs ());
+		s_tracking_report (self->tracking, self->name);
+		self->heartbeat_at = zclock_time () + s_type (PNP_LINE_ID [0])->interval;
 	}
-	s_backend_resources_purge (self->backend_resources);
+	s_backend_resources_purge (self->backend_resources, self->status);
 
-    return 0;
+	//  Report lifecycle commands all modules have acknowledged to the Plant
+	return s_gathers_check (self, PNP_LINE_ID);
 }
 
 int pausing(resource_t *self) {
@@ -174,9 +277,22 @@ int finalizing(resource_t *self) {
         s_backend_resource_destroy (&backend_resource);
     }
     zlist_destroy (&self->backend_resources);
+    while (zlist_size (self->gathers)) {
+    	gather_t *gather = (gather_t *) zlist_pop (self->gathers);
+    	s_gather_destroy (&gather);
+    }
+    zlist_destroy (&self->gathers);
+    s_status_destroy (&self->status);
+    s_tracking_destroy (&self->tracking);
+    s_transfer_destroy (&self->transfer);
+    s_config_destroy (&self->config);
+    s_capture_destroy (&self->capture);
+    s_codec_report (self->codec, plant_endpoints [plant_endpoint]);
+    s_codec_destroy (&self->codec);
 
     zsock_destroy(&self->frontend);
     zsock_destroy(&self->backend);
+    zsock_destroy(&self->publisher);
     printf("done.\n");
     return 0;
 }
@@ -329,12 +445,20 @@ int main(int argc, char** args)
         name = "PnP Line";
     }
 	assert(name);
+    if (argc > 2) {
+        transfer_files = args + 2;
+        transfer_file_count = argc - 2;
+    }
 
+    s_types_load (TYPES_CONFIG);
+    s_affinity_load (AFFINITY_CONFIG, name);
     // incoming data is handled by the actor thread
     zactor_t *actor = zactor_new (resource_actor, (void*)name);
     assert(actor);
+    s_affinity_pin (AFFINITY_MAIN);
     while(!zsys_interrupted) { sleep(1);};
     printf("[%s] main loop interrupted!\n", name);
+    s_affinity_report (name);
     zactor_destroy(&actor);
 
     return 0;
@@ -0,0 +1,120 @@
+#ifndef PNP_LINES
+#define PNP_LINES "Pick-n-Pack Line Registry"
+
+//  The line registry of the Plant. It is kept apart from plant.c so the
+//  simulator runs the same registry, routing and purge code; the includer
+//  defines HEARTBEAT_LIVENESS and HEARTBEAT_INTERVAL and includes status.h
+//  and accrual.h. A line expires once the suspicion of its accrual detector
+//  reaches HEARTBEAT_THRESHOLD, or if that is negative, once it missed
+//  HEARTBEAT_LIVENESS heartbeats, see types.h.
+
+#ifndef HEARTBEAT_THRESHOLD
+#define HEARTBEAT_THRESHOLD TYPE_THRESHOLD
+#endif
+
+//  Here we define the line class; a structure and a set of functions that
+//  act as constructor, destructor, and methods on line objects:
+
+typedef struct {
+    zframe_t *identity;         //  Identity of line
+    char *id_string;            //  Printable identity
+    int64_t expiry;             //  Expires at this time
+    accrual_t accrual;          //  Times between its heartbeats
+} line_t;
+
+//  Construct new line, i.e. new local object for Plant representing a line
+static line_t *
+s_line_new (zframe_t *identity)
+{
+    line_t *self = (line_t *) zmalloc (sizeof (line_t));
+    self->identity = identity;
+    self->id_string = zframe_strhex (identity);
+    s_accrual_init (&self->accrual, HEARTBEAT_INTERVAL, zclock_time ());
+    self->expiry = s_accrual_expiry (&self->accrual, HEARTBEAT_THRESHOLD, HEARTBEAT_LIVENESS);
+    return self;
+}
+
+//  Destroy specified line object, including identity frame.
+static void
+s_line_destroy (line_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        line_t *self = *self_p;
+        zframe_destroy (&self->identity);
+        free (self->id_string);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The ready method puts a line to the end of the ready list. Its heartbeat
+//  statistics carry over from the object it replaces:
+
+static void
+s_line_ready (line_t *self, zlist_t *lines)
+{
+    line_t *line = (line_t *) zlist_first (lines);
+    while (line) {
+        if (streq (self->id_string, line->id_string)) {
+            self->accrual = line->accrual;
+            s_accrual_alive (&self->accrual, zclock_time ());
+            self->expiry = s_accrual_expiry (&self->accrual, HEARTBEAT_THRESHOLD, HEARTBEAT_LIVENESS);
+            zlist_remove (lines, line);
+            s_line_destroy (&line);
+            break;
+        }
+        line = (line_t *) zlist_next (lines);
+    }
+    zlist_append (lines, self);
+}
+
+//  The heartbeat method records a heartbeat of a line that announced <interval>,
+//  or 0 if it did not, and moves its expiry accordingly:
+
+static void
+s_line_heartbeat (line_t *self, size_t interval)
+{
+    s_accrual_heartbeat (&self->accrual, zclock_time (), interval);
+    self->expiry = s_accrual_expiry (&self->accrual, HEARTBEAT_THRESHOLD, HEARTBEAT_LIVENESS);
+}
+
+//  The next method returns the next available line identity:
+//  TODO: Not all lines have the same capabilities so we should not just pick any line...
+
+static zframe_t *
+s_lines_next (zlist_t *lines)
+{
+    line_t *line = zlist_pop (lines);
+    assert (line);
+    zframe_t *frame = line->identity;
+    line->identity = NULL;
+    s_line_destroy (&line);
+    return frame;
+}
+
+//  The purge method looks for and kills expired lines. Each line expires
+//  after its own heartbeat statistics, so we check them all. The
+//  status and round-trip times of expired lines and everything below them
+//  are removed from <tree> and <rtts>:
+//  TODO: if lines expire, it should be checked if this effects the working of the line!
+
+static void
+s_lines_purge (zlist_t *lines, status_t *tree, zhash_t *rtts)
+{
+    line_t *line = (line_t *) zlist_first (lines);
+    while (line) {
+        if (zclock_time () < line->expiry) {
+            line = (line_t *) zlist_next (lines);
+            continue;           //  line is alive
+        }
+	printf("I: Removing expired line %s\n", line->id_string);
+        s_status_remove (tree, line->id_string);
+        zhash_delete (rtts, line->id_string);
+        zlist_remove (lines, line);
+        s_line_destroy (&line);
+        line = (line_t *) zlist_first (lines);
+    }
+}
+
+#endif
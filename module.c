@@ -3,14 +3,35 @@
 #include "czmq.h"
 #include "defs.h"
 
+#define LINE_ENDPOINT   "tcp://localhost:9002"  //  TODO: this should be configured
+#define MODULE_BIND     "tcp://*:9003"          //  Devices connect here, TODO: this should be configured
+
 resource_t* creating(resource_t *self, zsock_t *pipe, char *name) {
     printf("[%s] creating...", name);
     self->name = name;
-    self->frontend = zsock_new_dealer("tcp://localhost:9002"); // TODO: this should be configured
-    self->backend =  zsock_new_router ("tcp://*:9003"); // TODO: this should be configured
+    //  Our identity survives warm restarts, so the line keeps knowing us
+    const char *identity = s_snapshot_identity (self->snapshot);
+    self->watchdog = PNP_WATCHDOG? s_watchdog_new (PNP_QAS_ID [0], LINE_ENDPOINT, identity): NULL;
+    self->frontend = self->watchdog? zsock_new_pair (self->watchdog->pipe): s_dealer_new (LINE_ENDPOINT, identity);
+    self->backend =  zsock_new_router (MODULE_BIND);
+    //  A device back under its identity takes over from its old connection
+    zsock_set_router_handover (self->backend, 1);
+    //  Lifecycle commands go out next to the ROUTER sockets of the line and of us
+    char *endpoint = s_publisher_endpoint (MODULE_BIND);
+    self->publisher = PNP_BROADCAST? zsock_new_pub (endpoint): NULL;
+    zstr_free (&endpoint);
+    endpoint = s_publisher_endpoint (LINE_ENDPOINT);
+    self->subscriber = zsock_new_sub (endpoint, PNP_COMMAND);
+    zstr_free (&endpoint);
     self->pipe = pipe;
     self->backend_resources = zlist_new ();
     self->required_resources = zlist_new();
+    self->gathers = zlist_new ();
+    self->status = s_status_new ();
+    self->rings = zhash_new ();
+    self->transfer = s_transfer_new ();
+    self->qas = PNP_QAS_POOL? s_qas_new (0, s_qas_defects, (void *) (uintptr_t) QAS_THRESHOLD): NULL;
+    self->capture = s_capture_new (name);
     printf("...done.\n");
     return self;
 }
@@ -21,10 +42,10 @@ int initializing(resource_t* self) {
     zsock_signal (self->pipe, 0);
 
     //  Tell frontend we're ready for work
-    zframe_t *frame = zframe_new (PNP_QAS_ID, sizeof(PNP_QAS_ID));
-    zframe_send (&frame, self->frontend, ZFRAME_MORE);
-    frame = zframe_new(PNP_READY, sizeof(PNP_READY));
-    zframe_send (&frame, self->frontend, 0);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, PNP_QAS_ID, sizeof(PNP_QAS_ID));
+    zmsg_addmem (msg, PNP_READY, sizeof(PNP_READY));
+    s_resource_send (self, &msg, CAPTURE_FRONTEND);
     printf("done.\n");
 
     return 0;
@@ -34,11 +55,11 @@ int initializing(resource_t* self) {
 int configuring (resource_t* self) {
 	printf("[%s] configuring...", self->name);
     //  If liveness hits zero, queue is considered disconnected
-    self->liveness = HEARTBEAT_LIVENESS;
+    self->liveness = s_type (PNP_QAS_ID [0])->liveness;
     self->interval = INTERVAL_INIT;
 
     //  Send out heartbeats at regular intervals
-    self->heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+    self->heartbeat_at = zclock_time () + s_type (PNP_QAS_ID [0])->interval;
 
     srandom ((unsigned) time (NULL));
 
@@ -48,17 +69,16 @@ int configuring (resource_t* self) {
 };
 
 int running(resource_t* self) {
-	//  Send out heartbeats at regular intervals
-	    uint64_t heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
-
 		zmq_pollitem_t items [] = {
 			{ zsock_resolve(self->backend), 0, ZMQ_POLLIN, 0 },
-			{ zsock_resolve(self->frontend),  0, ZMQ_POLLIN, 0 }
+			{ zsock_resolve(self->frontend),  0, ZMQ_POLLIN, 0 },
+			{ zsock_resolve(self->subscriber),  0, ZMQ_POLLIN, 0 },
+			{ self->qas? zsock_resolve (self->qas->results): NULL, 0, ZMQ_POLLIN, 0 }
 		};
 
-		//  Poll backend only if we have available resources
-		int rc = zmq_poll (items, zlist_size (self->backend_resources)? 2: 1,
-			HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+		//  Always poll frontend and subscriber, the line may command us any time
+		//  Do not wait while devices have credit for transfers
+		int rc = zmq_poll (items, self->qas? 4: 3, s_transfer_timeout (self->transfer, s_type (PNP_QAS_ID [0])->interval) * ZMQ_POLL_MSEC);
 		if (rc == -1) {
 			printf("E: Line Controller failed to poll sockets\n");
 			return -1;              //  Interrupted
@@ -67,61 +87,97 @@ int running(resource_t* self) {
 		//  Handle activity on backend
 		if (items [0].revents & ZMQ_POLLIN) {
 				//  Use backend_resource identity for identify resource location
-				zmsg_t *msg = zmsg_recv (self->backend);
+				zmsg_t *msg = s_resource_recv (self, CAPTURE_BACKEND);
 				if (!msg)
 					return -1;          //  Interrupted
 
 				//  Any sign of life from backend_resource means it's ready
 				zframe_t *identity = zmsg_unwrap (msg);
-
-				//backend_resource_t *backend_resource = s_backend_resource_new (identity);
-				//s_backend_resource_ready (backend_resource, self->backend_resources);
+				s_backend_resource_alive (self->backend_resources, identity);
 				printf("here!");
 				//  Validate control message, or return reply to client
-				if (zmsg_size (msg) == 2) {
+				zmsg_first (msg);
+				zframe_t *type = zmsg_next (msg);
+				if (type && zmsg_size (msg) == 4 && memcmp (zframe_data (type), PNP_ACK, 1) == 0) {
+					s_backend_resource_ack (self, identity, msg);
+					zframe_destroy (&identity);
+					zmsg_destroy (&msg);
+				}
+				else if (zmsg_size (msg) == 2) {
 					// ID
 					zframe_t *frame = zmsg_first (msg);
-					printf("[%s] RX MSG FROM %s\n", self->name, uuid_to_name(zframe_data(frame)));
-					backend_resource_t *backend_resource = s_backend_resource_new (identity, zframe_data(frame));
+					printf("[%s] RX MSG FROM %s\n", self->name, s_type_name (s_type_of (frame)));
+					backend_resource_t *backend_resource = s_backend_resource_new (identity, s_type_of (frame));
 					frame = zmsg_next(msg);
-					if (memcmp (zframe_data (frame), READY, 0)) {
+					if (memcmp (zframe_data (frame), PNP_READY, 1) == 0) {
 						printf("[%s] RX READY BACKEND %s\n", self->name, backend_resource->id_string);
 						s_backend_resource_ready (backend_resource, self->backend_resources);
 					}
+					else
+						s_backend_resource_destroy (&backend_resource);
 
 					zmsg_destroy (&msg);
 				}
-				else if (zmsg_size (msg) == 3) {
-					// ID
-					zframe_t *frame = zmsg_first (msg);
-					char* name = zframe_data(frame);
-					frame = zmsg_next(msg);
-					char* state = zframe_data(frame);
-					frame = zmsg_next(msg);
-					char* signal = zframe_data(frame);
-					printf("[%s] RX HB [%s, %s, %s]\n", self->name, uuid_to_name(name), state, signal);
-
+				else if (type && zmsg_size (msg) == 3 && memcmp (zframe_data (type), PNP_RING, 1) == 0) {
+					//  Samples waiting in the shared-memory ring of a device
+					s_rings_drain (self, msg);
+					zframe_destroy (&identity);
+					zmsg_destroy (&msg);
+				}
+				else if (type && zmsg_size (msg) == 3 && memcmp (zframe_data (type), PNP_BATCH, 1) == 0) {
+					s_batch_forward (self, &msg);
+					zframe_destroy (&identity);
+				}
+				else if (type && zmsg_size (msg) == 4 && memcmp (zframe_data (type), PNP_TRANSFER, 1) == 0) {
+					s_transfer_credit (self->transfer, identity, msg);
+					zframe_destroy (&identity);
+					zmsg_destroy (&msg);
+				}
+				else if (type && zmsg_size (msg) == 3 && memcmp (zframe_data (type), PNP_TRAY, 1) == 0) {
+					//  Trays are tracked by the line
+					s_resource_send (self, &msg, CAPTURE_FRONTEND);
+					zframe_destroy (&identity);
+				}
+				else if (s_msg_is_heartbeat (msg)) {
+					s_backend_resource_heartbeat (self, identity, msg);
+					zmsg_destroy (&msg);
+				}
+				else if (self->qas && zmsg_size (msg) == 4 && memcmp (zframe_data (type), PNP_RUNNING, 1) == 0) {
+					//  Camera frame, inspected by the QAS pool
+					zframe_t *id = zmsg_first (msg);
+					zframe_t *frame = zmsg_last (msg);
+					s_sample_forward (self, id, zframe_data (frame), zframe_size (frame));
+					zframe_destroy (&identity);
 					zmsg_destroy (&msg);
 				} else{
 					printf("here!");
 					// we assume here all other messages are replies which need to be sent to the clients
-					zmsg_send (&msg, self->frontend);
+					s_trace_stamp (msg, PNP_QAS_ID [0], TRACE_FORWARD);
+					s_resource_send (self, &msg, CAPTURE_FRONTEND);
 				}
 			}
 		if (items [1].revents & ZMQ_POLLIN) {
 			//  Poll frontend
-			zmsg_t *msg = zmsg_recv (self->frontend);
+			zmsg_t *msg = s_resource_recv (self, CAPTURE_FRONTEND);
 			if (!msg)
 				return -1;          //  Interrupted
 			//  Validate control message, or return reply to client
-			if (zmsg_size (msg) == 1)  {
+			if (memcmp (zframe_data (zmsg_first (msg)), PNP_COMMAND, 1) == 0) {
+				s_command_receive (self, msg);
+				zmsg_destroy (&msg);
+			}
+			else if (memcmp (zframe_data (zmsg_first (msg)), PNP_TRANSFER, 1) == 0) {
+				//  Blob for us and our devices
+				s_transfers_receive (self, msg, PNP_QAS_ID);
+				zmsg_destroy (&msg);
+			}
+			else if (memcmp (zframe_data (zmsg_first (msg)), PNP_READY, 1) == 0
+			||  memcmp (zframe_data (zmsg_first (msg)), PNP_HEARTBEAT, 1) == 0)  {
 				printf("[%s] RX HB FRONTEND\n", self->name);
-				zframe_t *frame = zmsg_first (msg);
-				if (memcmp (zframe_data (frame), PNP_READY, 1)
-				&&  memcmp (zframe_data (frame), PNP_HEARTBEAT, 1)) {
-					printf ("E: invalid message from module\n");
-					zmsg_dump (msg);
-				}
+				//  Keep the parent timestamp, to echo it in our next heartbeat
+				zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+				if (frame)
+					s_rtt_stamp (&self->echo, frame);
 				zmsg_destroy (&msg);
 			}
 			else
@@ -136,40 +192,46 @@ int running(resource_t* self) {
 
 					if (self->interval < INTERVAL_MAX)
 						self->interval *= 2;
-					zsock_destroy(&self->frontend);
-					self->frontend = zsock_new_dealer("tcp://localhost:9002"); // TODO: this should be configured.
-					self->liveness = HEARTBEAT_LIVENESS;
+					if (self->watchdog)
+						s_watchdog_reconnect (self->watchdog);
+					else {
+						zsock_destroy(&self->frontend);
+						self->frontend = s_dealer_new (LINE_ENDPOINT, s_snapshot_identity (self->snapshot));
+					}
+					self->liveness = s_type (PNP_QAS_ID [0])->liveness;
 				}
 			//zframe_t *identity = s_modules_next (self->modules);
 			//zmsg_prepend (msg, &identity);
 			//zmsg_send (&msg, backend);
 		}
+		if (items [2].revents & ZMQ_POLLIN) {
+			//  Lifecycle command broadcast by the line
+			zmsg_t *msg = s_resource_recv (self, CAPTURE_SUBSCRIBER);
+			if (!msg)
+				return -1;          //  Interrupted
+			s_command_receive (self, msg);
+			zmsg_destroy (&msg);
+		}
+		s_transfers_send (self);
+		if (self->qas && (items [3].revents & ZMQ_POLLIN))
+			//  Results of inspected camera frames, in frame order
+			s_qas_send (self);
 		//  .split handle heartbeating
 		//  We handle heartbeating after any socket activity. First, we send
 		//  heartbeats to any idle modules if it's time. Then, we purge any
 		//  dead modules:
-		if (zclock_time () >= heartbeat_at) {
-			backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (self->backend_resources);
-			while (backend_resource) {
-				zframe_send (&backend_resource->identity, self->backend,	ZFRAME_REUSE + ZFRAME_MORE);
-				zframe_t *frame = zframe_new (PNP_HEARTBEAT, 1);
-				zframe_send (&frame, self->backend, 0);
-				printf("[%s] TX HB BACKEND %s\n", self->name, backend_resource->id_string);
-				backend_resource = (backend_resource_t *) zlist_next (self->backend_resources);
-			}
-			// Send status as heartbeat to frontend
-			zframe_t *frame = zframe_new (PNP_QAS_ID, sizeof(PNP_QAS_ID));
-			zframe_send (&frame, self->frontend, ZFRAME_MORE);
-			frame = zframe_new(PNP_RUNNING, sizeof(PNP_RUNNING));
-			zframe_send (&frame, self->frontend, ZFRAME_MORE);
-			frame = zframe_new(PNP_RUN, sizeof(PNP_RUN));
-			zframe_send (&frame, self->frontend, 0);
-			printf("[%s] TX HB [%o, %o, %o] FRONTEND\n", self->name, PNP_QAS_ID[0], PNP_RUNNING[0], PNP_RUN[0]);
-			heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
+		if ((uint64_t) zclock_time () >= self->heartbeat_at) {
+			s_backend_resources_heartbeat (self);
+			s_transfers_offer (self);
+			// Send status as heartbeat to frontend, with the status of devices that changed
+			s_frontend_heartbeat (self, PNP_QAS_ID, PNP_RUNNING, PNP_RUN);
+			s_qas_report (self->qas, self->name);
+			self->heartbeat_at = zclock_time () + s_type (PNP_QAS_ID [0])->interval;
 		}
-		s_backend_resources_purge (self->backend_resources);
+		s_backend_resources_purge (self->backend_resources, self->status);
 
-	    return 0;
+		//  Report lifecycle commands all devices have acknowledged to the line
+	    return s_gathers_check (self, PNP_QAS_ID);
 }
 
 int pausing(resource_t *self) {
@@ -185,9 +247,23 @@ int finalizing(resource_t *self) {
 		s_backend_resource_destroy (&backend_resource);
 	}
 	zlist_destroy (&self->backend_resources);
+	while (zlist_size (self->gathers)) {
+		gather_t *gather = (gather_t *) zlist_pop (self->gathers);
+		s_gather_destroy (&gather);
+	}
+	zlist_destroy (&self->gathers);
+	s_status_destroy (&self->status);
+	zhash_destroy (&self->rings);
+	s_qas_destroy (&self->qas);
+	s_transfer_destroy (&self->transfer);
+	s_config_destroy (&self->config);
+	s_capture_destroy (&self->capture);
 
 	zsock_destroy(&self->frontend);
+	s_watchdog_destroy (&self->watchdog);
 	zsock_destroy(&self->backend);
+	zsock_destroy(&self->publisher);
+	zsock_destroy(&self->subscriber);
 	printf("done.\n");
 	return 0;
 }
@@ -210,11 +286,15 @@ int main(int argc, char** args)
         name = "R2D2";
     assert(name);
 
+    s_types_load (TYPES_CONFIG);
+    s_affinity_load (AFFINITY_CONFIG, name);
     // incoming data is handled by the actor thread
     zactor_t *actor = zactor_new (resource_actor, (void*)name);
     assert(actor);
+    s_affinity_pin (AFFINITY_MAIN);
     while(!zsys_interrupted) { sleep(1);};
     printf("[MODULE %s] main loop interrupted!\n", name);
+    s_affinity_report (name);
     zactor_destroy(&actor);
 
     return 0;
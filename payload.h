@@ -0,0 +1,537 @@
+#ifndef PNP_PAYLOAD
+#define PNP_PAYLOAD "Pick-n-Pack Typed Payload"
+
+//  A payload holds named, typed values, e.g. the parameters of a CONFIGURE
+//  command. Items sit in one growing array and are found through a hash
+//  index; names and values that do not fit in an item sit in one growing
+//  arena. So adding or updating an item allocates nothing once the payload
+//  has grown to its working size, and a payload can be reset and refilled,
+//  e.g. for every command, without freeing anything.
+//
+//  Pointers returned for string and bytes values are valid until the next
+//  change to the payload.
+//
+//  Encoded payload, one frame: COUNT (uint32), then per item TYPE (byte),
+//  NAME SIZE (byte), NAME and VALUE. An integer or real VALUE is 8 bytes, a
+//  string or bytes VALUE is SIZE (uint32) and data. Pointers are local to the
+//  process and are not encoded.
+
+#define PAYLOAD_INTEGER     'i'
+#define PAYLOAD_REAL        'r'
+#define PAYLOAD_STRING      's'
+#define PAYLOAD_BYTES       'b'
+#define PAYLOAD_POINTER     'p'
+#define PAYLOAD_INLINE      16      //  Value bytes kept in the item itself
+#define PAYLOAD_NAME_MAX    255
+
+typedef struct {
+    uint32_t hash;
+    uint32_t name;              //  Offset of the name in the arena
+    byte name_size;
+    byte type;
+    uint32_t size;              //  Bytes of a string, without its null, or bytes value
+    union {
+        int64_t integer;
+        double real;
+        void *pointer;
+        uint32_t offset;        //  Offset in the arena of a value larger than PAYLOAD_INLINE
+        byte data [PAYLOAD_INLINE];
+    } value;
+} payload_item_t;
+
+typedef struct {
+    payload_item_t *items;
+    size_t size;
+    size_t max;
+    uint32_t *index;            //  Item number plus 1 by hash, 0 if empty
+    size_t index_max;           //  A power of two, at least twice max
+    byte *arena;                //  Names and large values
+    size_t arena_size;
+    size_t arena_max;
+    size_t arena_free;          //  Bytes of values that were replaced
+} payload_t;
+
+static payload_t *
+s_payload_new (void)
+{
+    payload_t *self = (payload_t *) zmalloc (sizeof (payload_t));
+    self->max = 16;
+    self->items = (payload_item_t *) malloc (self->max * sizeof (payload_item_t));
+    self->index_max = 32;
+    self->index = (uint32_t *) zmalloc (self->index_max * sizeof (uint32_t));
+    self->arena_max = 1024;
+    self->arena = (byte *) malloc (self->arena_max);
+    return self;
+}
+
+static void
+s_payload_destroy (payload_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        payload_t *self = *self_p;
+        free (self->items);
+        free (self->index);
+        free (self->arena);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The reset method removes all items, and keeps the memory for the next ones
+static void
+s_payload_reset (payload_t *self)
+{
+    memset (self->index, 0, self->index_max * sizeof (uint32_t));
+    self->size = 0;
+    self->arena_size = 0;
+    self->arena_free = 0;
+}
+
+static size_t
+s_payload_size (payload_t *self)
+{
+    return self->size;
+}
+
+//  FNV-1a
+static uint32_t
+s_payload_hash (const char *name, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    while (size--)
+        hash = (hash ^ (byte) *name++) * 16777619u;
+    return hash;
+}
+
+static uint32_t *
+s_payload_bucket (payload_t *self, const char *name, size_t size, uint32_t hash)
+{
+    size_t bucket = hash & (self->index_max - 1);
+    while (self->index [bucket]) {
+        payload_item_t *item = &self->items [self->index [bucket] - 1];
+        if (item->hash == hash && item->name_size == size
+        &&  memcmp (self->arena + item->name, name, size) == 0)
+            break;
+        bucket = (bucket + 1) & (self->index_max - 1);
+    }
+    return &self->index [bucket];
+}
+
+static payload_item_t *
+s_payload_find (payload_t *self, const char *name, size_t size)
+{
+    uint32_t *bucket = s_payload_bucket (self, name, size, s_payload_hash (name, size));
+    return *bucket? &self->items [*bucket - 1]: NULL;
+}
+
+//  The lookup method returns the item called <name>, or NULL if there is none
+static payload_item_t *
+s_payload_lookup (payload_t *self, const char *name)
+{
+    return s_payload_find (self, name, strlen (name));
+}
+
+static int
+s_payload_large (payload_item_t *item)
+{
+    return (item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES) && item->size + 1 > PAYLOAD_INLINE;
+}
+
+//  Moves names and large values to a new arena, leaving out the values that
+//  were replaced
+static void
+s_payload_compact (payload_t *self)
+{
+    byte *arena = (byte *) malloc (self->arena_max);
+    assert (arena);
+    size_t size = 0;
+    size_t item_nbr;
+    for (item_nbr = 0; item_nbr < self->size; item_nbr++) {
+        payload_item_t *item = &self->items [item_nbr];
+        memcpy (arena + size, self->arena + item->name, item->name_size);
+        item->name = (uint32_t) size;
+        size += item->name_size;
+        if (s_payload_large (item)) {
+            memcpy (arena + size, self->arena + item->value.offset, item->size + 1);
+            item->value.offset = (uint32_t) size;
+            size += item->size + 1;
+        }
+    }
+    free (self->arena);
+    self->arena = arena;
+    self->arena_size = size;
+    self->arena_free = 0;
+}
+
+//  Returns the offset of <size> new bytes in the arena
+static uint32_t
+s_payload_arena_alloc (payload_t *self, size_t size)
+{
+    if (self->arena_size + size > self->arena_max && self->arena_free > self->arena_size / 2)
+        s_payload_compact (self);
+    if (self->arena_size + size > self->arena_max) {
+        while (self->arena_size + size > self->arena_max)
+            self->arena_max *= 2;
+        self->arena = (byte *) realloc (self->arena, self->arena_max);
+        assert (self->arena);
+    }
+    uint32_t offset = (uint32_t) self->arena_size;
+    self->arena_size += size;
+    return offset;
+}
+
+//  Returns the item called <name> of <size> bytes, added if it is new
+static payload_item_t *
+s_payload_slot (payload_t *self, const char *name, size_t size)
+{
+    if (size > PAYLOAD_NAME_MAX)
+        return NULL;
+    uint32_t hash = s_payload_hash (name, size);
+    uint32_t *bucket = s_payload_bucket (self, name, size, hash);
+    if (*bucket)
+        return &self->items [*bucket - 1];
+    if (self->size == self->max) {
+        self->max *= 2;
+        self->items = (payload_item_t *) realloc (self->items, self->max * sizeof (payload_item_t));
+        assert (self->items);
+    }
+    if (self->size * 2 >= self->index_max) {
+        //  Grow and rebuild the index
+        self->index_max *= 2;
+        self->index = (uint32_t *) realloc (self->index, self->index_max * sizeof (uint32_t));
+        assert (self->index);
+        memset (self->index, 0, self->index_max * sizeof (uint32_t));
+        size_t item_nbr;
+        for (item_nbr = 0; item_nbr < self->size; item_nbr++) {
+            payload_item_t *item = &self->items [item_nbr];
+            *s_payload_bucket (self, (char *) self->arena + item->name, item->name_size, item->hash) = (uint32_t) item_nbr + 1;
+        }
+        bucket = s_payload_bucket (self, name, size, hash);
+    }
+    payload_item_t *item = &self->items [self->size];
+    item->hash = hash;
+    item->name_size = (byte) size;
+    item->name = s_payload_arena_alloc (self, size);
+    memcpy (self->arena + item->name, name, size);
+    item->type = 0;
+    item->size = 0;
+    *bucket = (uint32_t) ++self->size;
+    return item;
+}
+
+//  Returns where the value of <item> goes, <size> bytes inline or in the arena
+static byte *
+s_payload_value (payload_t *self, payload_item_t *item, byte type, size_t size)
+{
+    if (s_payload_large (item)) {
+        if (size > PAYLOAD_INLINE && size <= item->size + 1) {
+            //  Fits where the old value was
+            self->arena_free += item->size + 1 - size;
+            item->type = type;
+            return self->arena + item->value.offset;
+        }
+        self->arena_free += item->size + 1;
+    }
+    //  Not a large value while we make room, so compacting leaves it out
+    item->type = 0;
+    item->size = 0;
+    if (size > PAYLOAD_INLINE)
+        item->value.offset = s_payload_arena_alloc (self, size);
+    item->type = type;
+    return size > PAYLOAD_INLINE? self->arena + item->value.offset: item->value.data;
+}
+
+static int
+s_payload_set_integer (payload_t *self, const char *name, int64_t value)
+{
+    payload_item_t *item = s_payload_slot (self, name, strlen (name));
+    if (!item)
+        return -1;
+    s_payload_value (self, item, PAYLOAD_INTEGER, 0);
+    item->value.integer = value;
+    return 0;
+}
+
+static int
+s_payload_set_real (payload_t *self, const char *name, double value)
+{
+    payload_item_t *item = s_payload_slot (self, name, strlen (name));
+    if (!item)
+        return -1;
+    s_payload_value (self, item, PAYLOAD_REAL, 0);
+    item->value.real = value;
+    return 0;
+}
+
+static int
+s_payload_set_pointer (payload_t *self, const char *name, void *value)
+{
+    payload_item_t *item = s_payload_slot (self, name, strlen (name));
+    if (!item)
+        return -1;
+    s_payload_value (self, item, PAYLOAD_POINTER, 0);
+    item->value.pointer = value;
+    return 0;
+}
+
+//  Strings and bytes are stored with a null after them, so a string can be read
+//  in place. <data> must not point into the payload.
+static int
+s_payload_set_data (payload_t *self, const char *name, size_t name_size, byte type,
+                    const void *data, size_t size)
+{
+    if (size >= UINT32_MAX)
+        return -1;
+    payload_item_t *item = s_payload_slot (self, name, name_size);
+    if (!item)
+        return -1;
+    byte *value = s_payload_value (self, item, type, size + 1);
+    memcpy (value, data, size);
+    value [size] = 0;
+    item->size = (uint32_t) size;
+    return 0;
+}
+
+static int
+s_payload_set_string (payload_t *self, const char *name, const char *value)
+{
+    return s_payload_set_data (self, name, strlen (name), PAYLOAD_STRING, value, strlen (value));
+}
+
+static int
+s_payload_set_bytes (payload_t *self, const char *name, const void *data, size_t size)
+{
+    return s_payload_set_data (self, name, strlen (name), PAYLOAD_BYTES, data, size);
+}
+
+static int64_t
+s_payload_integer (payload_t *self, const char *name, int64_t otherwise)
+{
+    payload_item_t *item = s_payload_lookup (self, name);
+    return item && item->type == PAYLOAD_INTEGER? item->value.integer: otherwise;
+}
+
+static double
+s_payload_real (payload_t *self, const char *name, double otherwise)
+{
+    payload_item_t *item = s_payload_lookup (self, name);
+    return item && item->type == PAYLOAD_REAL? item->value.real: otherwise;
+}
+
+static void *
+s_payload_pointer (payload_t *self, const char *name)
+{
+    payload_item_t *item = s_payload_lookup (self, name);
+    return item && item->type == PAYLOAD_POINTER? item->value.pointer: NULL;
+}
+
+static byte *
+s_payload_data (payload_t *self, payload_item_t *item)
+{
+    return s_payload_large (item)? self->arena + item->value.offset: item->value.data;
+}
+
+static const char *
+s_payload_string (payload_t *self, const char *name, const char *otherwise)
+{
+    payload_item_t *item = s_payload_lookup (self, name);
+    return item && item->type == PAYLOAD_STRING? (char *) s_payload_data (self, item): otherwise;
+}
+
+//  The bytes method returns the bytes value called <name> and its size in <size_p>,
+//  or NULL if there is none
+static const byte *
+s_payload_bytes (payload_t *self, const char *name, size_t *size_p)
+{
+    payload_item_t *item = s_payload_lookup (self, name);
+    if (!item || item->type != PAYLOAD_BYTES)
+        return NULL;
+    *size_p = item->size;
+    return s_payload_data (self, item);
+}
+
+//  Sets <item> of <other> in <self>
+static void
+s_payload_copy (payload_t *self, payload_t *other, payload_item_t *item)
+{
+    const char *name = (char *) other->arena + item->name;
+    if (item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES)
+        s_payload_set_data (self, name, item->name_size, item->type, s_payload_data (other, item), item->size);
+    else {
+        payload_item_t *copy = s_payload_slot (self, name, item->name_size);
+        s_payload_value (self, copy, item->type, 0);
+        copy->value = item->value;
+    }
+}
+
+static int
+s_payload_equal (payload_t *self, payload_item_t *item, payload_t *other, payload_item_t *other_item)
+{
+    if (item->type != other_item->type)
+        return 0;
+    if (item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES)
+        return item->size == other_item->size
+            && memcmp (s_payload_data (self, item), s_payload_data (other, other_item), item->size) == 0;
+    return memcmp (&item->value, &other_item->value, sizeof (int64_t)) == 0;
+}
+
+//  The merge method sets all items of <other> in <self>, and those whose value
+//  was different also in <changes>, if not NULL. Returns the number of items that
+//  changed.
+static size_t
+s_payload_merge (payload_t *self, payload_t *other, payload_t *changes)
+{
+    size_t changed = 0;
+    size_t item_nbr;
+    for (item_nbr = 0; item_nbr < other->size; item_nbr++) {
+        payload_item_t *item = &other->items [item_nbr];
+        payload_item_t *mine = s_payload_find (self, (char *) other->arena + item->name, item->name_size);
+        if (mine && s_payload_equal (self, mine, other, item))
+            continue;
+        s_payload_copy (self, other, item);
+        if (changes)
+            s_payload_copy (changes, other, item);
+        changed++;
+    }
+    return changed;
+}
+
+static uint64_t
+s_payload_hash64 (uint64_t hash, const void *data, size_t size)
+{
+    const byte *bytes = (const byte *) data;
+    while (size--)
+        hash = (hash ^ *bytes++) * 1099511628211ULL;
+    return hash;
+}
+
+//  The digest method returns a hash of all items but pointers, which does not
+//  depend on the order the items were set in
+static uint64_t
+s_payload_digest (payload_t *self)
+{
+    uint64_t digest = 0;
+    size_t item_nbr;
+    for (item_nbr = 0; item_nbr < self->size; item_nbr++) {
+        payload_item_t *item = &self->items [item_nbr];
+        if (item->type == PAYLOAD_POINTER)
+            continue;
+        uint64_t hash = s_payload_hash64 (14695981039346656037ULL, &item->type, 1);
+        hash = s_payload_hash64 (hash, &item->name_size, 1);
+        hash = s_payload_hash64 (hash, self->arena + item->name, item->name_size);
+        if (item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES)
+            hash = s_payload_hash64 (hash, s_payload_data (self, item), item->size);
+        else
+            hash = s_payload_hash64 (hash, &item->value, sizeof (int64_t));
+        //  Mix, so items do not cancel out in the sum
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 33;
+        digest += hash;
+    }
+    return digest;
+}
+
+//  The encode method returns all items but pointers in a single frame
+static zframe_t *
+s_payload_encode (payload_t *self)
+{
+    size_t size = sizeof (uint32_t);
+    uint32_t count = 0;
+    size_t item_nbr;
+    for (item_nbr = 0; item_nbr < self->size; item_nbr++) {
+        payload_item_t *item = &self->items [item_nbr];
+        if (item->type == PAYLOAD_POINTER)
+            continue;
+        size += 2 + item->name_size;
+        size += item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES?
+                sizeof (uint32_t) + item->size: sizeof (int64_t);
+        count++;
+    }
+    zframe_t *frame = zframe_new (NULL, size);
+    byte *data = zframe_data (frame);
+    memcpy (data, &count, sizeof (count));
+    data += sizeof (count);
+    for (item_nbr = 0; item_nbr < self->size; item_nbr++) {
+        payload_item_t *item = &self->items [item_nbr];
+        if (item->type == PAYLOAD_POINTER)
+            continue;
+        *data++ = item->type;
+        *data++ = item->name_size;
+        memcpy (data, self->arena + item->name, item->name_size);
+        data += item->name_size;
+        if (item->type == PAYLOAD_STRING || item->type == PAYLOAD_BYTES) {
+            memcpy (data, &item->size, sizeof (item->size));
+            data += sizeof (item->size);
+            memcpy (data, s_payload_data (self, item), item->size);
+            data += item->size;
+        }
+        else {
+            memcpy (data, &item->value.integer, sizeof (int64_t));
+            data += sizeof (int64_t);
+        }
+    }
+    return frame;
+}
+
+//  Checks the encoded payload <data> of <size> bytes, and applies it to <self> if
+//  <apply>. Returns the number of items, or -1 if it is malformed.
+static int64_t
+s_payload_walk (payload_t *self, const byte *data, size_t size, int apply)
+{
+    uint32_t count;
+    if (size < sizeof (count))
+        return -1;
+    memcpy (&count, data, sizeof (count));
+    const byte *end = data + size;
+    data += sizeof (count);
+    uint32_t item_nbr;
+    for (item_nbr = 0; item_nbr < count; item_nbr++) {
+        if (end - data < 2 || end - data - 2 < data [1])
+            return -1;
+        byte type = data [0];
+        const char *name = (const char *) data + 2;
+        size_t name_size = data [1];
+        data += 2 + name_size;
+        if (type == PAYLOAD_STRING || type == PAYLOAD_BYTES) {
+            uint32_t value_size;
+            if ((size_t) (end - data) < sizeof (value_size))
+                return -1;
+            memcpy (&value_size, data, sizeof (value_size));
+            data += sizeof (value_size);
+            if ((size_t) (end - data) < value_size)
+                return -1;
+            if (apply)
+                s_payload_set_data (self, name, name_size, type, data, value_size);
+            data += value_size;
+        }
+        else
+        if (type == PAYLOAD_INTEGER || type == PAYLOAD_REAL) {
+            if ((size_t) (end - data) < sizeof (int64_t))
+                return -1;
+            if (apply) {
+                payload_item_t *item = s_payload_slot (self, name, name_size);
+                s_payload_value (self, item, type, 0);
+                memcpy (&item->value.integer, data, sizeof (int64_t));
+            }
+            data += sizeof (int64_t);
+        }
+        else
+            return -1;
+    }
+    return data == end? (int64_t) count: -1;
+}
+
+//  The decode method applies the encoded payload in <frame> to <self>, adding new
+//  items and updating the ones it has. Returns the number of items, or -1 if the
+//  frame is malformed, in which case <self> is left as it was.
+static int64_t
+s_payload_decode (payload_t *self, zframe_t *frame)
+{
+    if (s_payload_walk (self, zframe_data (frame), zframe_size (frame), 0) == -1)
+        return -1;
+    return s_payload_walk (self, zframe_data (frame), zframe_size (frame), 1);
+}
+
+#endif
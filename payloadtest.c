@@ -0,0 +1,78 @@
+//  Pick-n-Pack payload test
+//
+//  Checks that encoded payloads (payload.h) decode to what was encoded, and
+//  that malformed frames are refused without changing the payload they were
+//  decoded into, since config.h and snapshot.h apply them to live state.
+//
+//  Usage: payloadtest
+
+#include "czmq.h"
+#include "payload.h"
+
+//  Returns a copy of <frame> with <extra> more bytes, or <extra> fewer if negative
+static zframe_t *
+s_test_resize (zframe_t *frame, int extra)
+{
+    size_t size = zframe_size (frame) + extra;
+    zframe_t *resized = zframe_new (NULL, size);
+    memset (zframe_data (resized), 0xAA, size);
+    memcpy (zframe_data (resized), zframe_data (frame),
+            extra < 0? size: zframe_size (frame));
+    return resized;
+}
+
+int main (void)
+{
+    payload_t *payload = s_payload_new ();
+    s_payload_set_integer (payload, "speed", 1200);
+    s_payload_set_real (payload, "gain", 0.75);
+    s_payload_set_string (payload, "recipe", "eggs-large-30");
+    s_payload_set_bytes (payload, "mask", "\x01\x02\x03", 3);
+    zframe_t *frame = s_payload_encode (payload);
+
+    //  A well-formed frame decodes to the items encoded
+    payload_t *decoded = s_payload_new ();
+    assert (s_payload_decode (decoded, frame) == 4);
+    assert (s_payload_integer (decoded, "speed", 0) == 1200);
+    assert (s_payload_real (decoded, "gain", 0) == 0.75);
+    assert (streq (s_payload_string (decoded, "recipe", ""), "eggs-large-30"));
+    size_t size;
+    const byte *mask = s_payload_bytes (decoded, "mask", &size);
+    assert (mask && size == 3 && memcmp (mask, "\x01\x02\x03", 3) == 0);
+    assert (s_payload_digest (decoded) == s_payload_digest (payload));
+
+    //  Malformed frames are refused and leave the payload as it was
+    s_payload_set_integer (payload, "speed", 900);
+    zframe_t *changed = s_payload_encode (payload);
+    uint64_t digest = s_payload_digest (decoded);
+    zframe_t *garbage = s_test_resize (changed, 1);
+    assert (s_payload_decode (decoded, garbage) == -1);
+    assert (s_payload_digest (decoded) == digest);
+    zframe_destroy (&garbage);
+    garbage = s_test_resize (changed, 64);
+    assert (s_payload_decode (decoded, garbage) == -1);
+    zframe_destroy (&garbage);
+    zframe_t *truncated = s_test_resize (changed, -1);
+    assert (s_payload_decode (decoded, truncated) == -1);
+    zframe_destroy (&truncated);
+    truncated = s_test_resize (changed, -(int) zframe_size (changed) + 2);
+    assert (s_payload_decode (decoded, truncated) == -1);
+    zframe_destroy (&truncated);
+    zframe_t *corrupt = zframe_dup (changed);
+    zframe_data (corrupt) [sizeof (uint32_t)] = '?';
+    assert (s_payload_decode (decoded, corrupt) == -1);
+    zframe_destroy (&corrupt);
+    assert (s_payload_digest (decoded) == digest);
+    assert (s_payload_integer (decoded, "speed", 0) == 1200);
+
+    //  And the change itself applies
+    assert (s_payload_decode (decoded, changed) == 4);
+    assert (s_payload_integer (decoded, "speed", 0) == 900);
+
+    zframe_destroy (&changed);
+    zframe_destroy (&frame);
+    s_payload_destroy (&decoded);
+    s_payload_destroy (&payload);
+    printf ("payloadtest: OK\n");
+    return 0;
+}
@@ -1,179 +1,707 @@
 //  Pick-n-Pack Plant Controller, based on ZeroMQ's Paranoid Pirate queue
 
 #include "czmq.h"
-#define HEARTBEAT_LIVENESS  3       //  3-5 is reasonable. This determines when to decide a line has gone offline
-#define HEARTBEAT_INTERVAL  1000    //  msecs
+#include "protocol.h"
+#include "journal.h"
+#include "bstar.h"
+#include "rtt.h"
+#include "status.h"
+#include "trace.h"
+#include "capture.h"
+#include "accrual.h"
+#include "clone.h"
+#include "codec.h"
+#include "types.h"
+
+//  Lines expire after the heartbeat parameters of the line type, so a type
+//  configured in TYPES_CONFIG applies to the Plant too
+#define HEARTBEAT_LIVENESS  (s_type (PNP_LINE_ID [0])->liveness)
+#define HEARTBEAT_INTERVAL  (s_type (PNP_LINE_ID [0])->interval)      //  msecs
+#define HEARTBEAT_THRESHOLD (s_type (PNP_LINE_ID [0])->threshold)
 
 //  Pick-n-Pack Protocol constants for signalling
 #define PPP_READY       "\001"      //  Signal used when line has come online
 #define PPP_HEARTBEAT   "\002"      //  Signals used for heartbeats between Plant and lines
 
-//  Here we define the line class; a structure and a set of functions that
-//  act as constructor, destructor, and methods on line objects:
+//  Binary Star messages between primary and backup Plant
+#define PEER_STATE      "\021"      //  State of the peer, followed by its lines
+#define PEER_ACCEPTED   "\022"      //  Request accepted by the active peer
+#define PEER_COMPLETED  "\023"      //  Request completed by the active peer
+
+#define JOURNAL_FILE    "plant.journal"     //  TODO: this should be configured
+#define REQUEST_EXPIRY  10000   //  msecs after which a client gave up on its request, see client.c
+
+//  Lines that do not acknowledge a command in time count as failed, see
+//  gather.h. A line waits for its modules, which wait for their devices.
+#define COMMAND_TIMEOUT     (HEARTBEAT_INTERVAL * 2)    //  msecs, within the client timeout
+
+#include "lines.h"
+#include "gather.h"
+
+//  Here we define the request class. The Plant keeps every request it has
+//  accepted from a client until the reply has been sent back, so that it can
+//  be recovered from the journal after a crash. Clients use Lazy Pirate
+//  request-reply, so a client has at most one request outstanding and the
+//  client identity is enough to match a reply with its request. A client
+//  that gets no reply retries under a new identity, so a request without a
+//  reply after REQUEST_EXPIRY is abandoned, and journaled as completed.
 
 typedef struct {
-    zframe_t *identity;         //  Identity of line
-    char *id_string;            //  Printable identity
-    int64_t expiry;             //  Expires at this time
-} line_t;
-
-//  Construct new line, i.e. new local object for Plant representing a line
-static line_t *
-s_line_new (zframe_t *identity)
+    uint64_t sequence;          //  Sequence number given by the Plant
+    zmsg_t *msg;                //  Client identity and request frames
+    char *client;               //  Printable client identity
+    int dispatched;             //  Request has been sent to a line
+    int64_t accepted;           //  msecs, when we accepted it
+} request_t;
+
+//  Construct new request, takes a copy of <msg>
+static request_t *
+s_request_new (uint64_t sequence, zmsg_t *msg)
 {
-    line_t *self = (line_t *) zmalloc (sizeof (line_t));
-    self->identity = identity;
-    self->id_string = zframe_strhex (identity);
-    self->expiry = zclock_time ()
-                 + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+    request_t *self = (request_t *) zmalloc (sizeof (request_t));
+    self->sequence = sequence;
+    self->msg = zmsg_dup (msg);
+    self->client = zframe_strhex (zmsg_first (msg));
+    self->accepted = zclock_time ();
     return self;
 }
 
-//  Destroy specified line object, including identity frame.
+//  Destroy specified request object
 static void
-s_line_destroy (line_t **self_p)
+s_request_destroy (request_t **self_p)
 {
     assert (self_p);
     if (*self_p) {
-        line_t *self = *self_p;
-        zframe_destroy (&self->identity);
-        free (self->id_string);
+        request_t *self = *self_p;
+        zmsg_destroy (&self->msg);
+        free (self->client);
         free (self);
         *self_p = NULL;
     }
 }
 
-//  The ready method puts a line to the end of the ready list:
+static void
+s_request_free (void *data)
+{
+    request_t *request = (request_t *) data;
+    s_request_destroy (&request);
+}
+
+//  The recover method rebuilds the pending requests from journal records.
+//  Requests without a COMPLETED record are pending again after recovery;
+//  requests that were in flight are dispatched again, since the line that
+//  had them may not reply to a Plant it no longer knows. Recovered requests
+//  age from the restart, not from when they were first accepted: we cannot
+//  tell how long a client waits across our downtime, so each one gets a full
+//  REQUEST_EXPIRY to be replied to before it is abandoned.
+
+typedef struct {
+    zhash_t *requests;          //  Pending requests by client identity
+    zhash_t *sequences;         //  Same requests by sequence
+} recovery_t;
 
 static void
-s_line_ready (line_t *self, zlist_t *lines)
+s_request_recover (int type, uint64_t sequence, int64_t timestamp, zmsg_t *msg, void *arg)
 {
+    recovery_t *recovery = (recovery_t *) arg;
+    (void) timestamp;           //  Recovered requests age from the restart
+    char key [21];
+    snprintf (key, sizeof (key), "%" PRIu64, sequence);
+    request_t *request = (request_t *) zhash_lookup (recovery->sequences, key);
+    if (type == JOURNAL_ACCEPTED && msg) {
+        request = s_request_new (sequence, msg);
+        zhash_update (recovery->sequences, key, request);
+        //  A newer request from the same client supersedes the older one
+        request_t *previous = (request_t *) zhash_lookup (recovery->requests, request->client);
+        if (previous) {
+            char previous_key [21];
+            snprintf (previous_key, sizeof (previous_key), "%" PRIu64, previous->sequence);
+            zhash_delete (recovery->sequences, previous_key);
+        }
+        zhash_update (recovery->requests, request->client, request);
+        zhash_freefn (recovery->requests, request->client, s_request_free);
+    }
+    else
+    if (type == JOURNAL_DISPATCHED && request)
+        request->dispatched = 1;
+    else
+    if (type == JOURNAL_COMPLETED && request) {
+        zhash_delete (recovery->sequences, key);
+        if (zhash_lookup (recovery->requests, request->client) == request)
+            zhash_delete (recovery->requests, request->client);
+    }
+    zmsg_destroy (&msg);
+}
+
+//  The dispatch method sends a pending request to the next available line.
+//  The backend refuses to route to lines that are not connected, e.g. lines
+//  replicated from the peer Plant that have not failed over yet, in which
+//  case the request stays pending. Only requests actually sent are captured:
+static int
+s_request_dispatch (request_t *request, zlist_t *lines, zsock_t *backend, journal_t *journal,
+                    capture_t *capture)
+{
+    zmsg_t *msg = zmsg_dup (request->msg);
+    s_trace_stamp (msg, TRACE_PLANT, TRACE_DEQUEUE);
+    zframe_t *identity = s_lines_next (lines);
+    zmsg_prepend (msg, &identity);
+    s_trace_stamp (msg, TRACE_PLANT, TRACE_FORWARD);
+    zmsg_t *sent = capture? zmsg_dup (msg): NULL;
+    if (zmsg_send (&msg, backend) == -1) {
+        zmsg_destroy (&msg);
+        zmsg_destroy (&sent);
+        return -1;
+    }
+    s_capture_msg (capture, CAPTURE_OUT, CAPTURE_BACKEND, sent);
+    zmsg_destroy (&sent);
+    s_journal_append (journal, JOURNAL_DISPATCHED, request->sequence, NULL);
+    request->dispatched = 1;
+    return 0;
+}
+
+//  Returns true if <msg> from a client is a lifecycle command, i.e. identity,
+//  key, COMMAND, SIGNAL, rather than a request for a line
+static int
+s_command_request (zmsg_t *msg)
+{
+    if (zmsg_size (msg) != 4)
+        return 0;
+    zmsg_first (msg);
+    zmsg_next (msg);
+    zframe_t *command = zmsg_next (msg);
+    zframe_t *signal = zmsg_next (msg);
+    return zframe_size (command) == 1 && memcmp (zframe_data (command), PNP_COMMAND, 1) == 0
+        && zframe_size (signal) == 1;
+}
+
+//  The command method broadcasts a lifecycle command from a client, i.e. its
+//  identity, request key, COMMAND, SIGNAL, to all available lines as COMMAND,
+//  SEQUENCE, SIGNAL and starts gathering their aggregate results, which the
+//  lines gather from their modules in turn. Like heartbeats, it misses lines
+//  with a request in flight. Commands are not journaled; a client whose Plant
+//  fails gets no reply and sends the command again.
+static void
+s_command_broadcast (zmsg_t *msg, zlist_t *lines, zsock_t *backend, zlist_t *commands,
+                     uint32_t *sequence, capture_t *capture)
+{
+    zframe_t *client = zmsg_pop (msg);
+    zframe_t *key = zmsg_pop (msg);
+    byte signal = zframe_data (zmsg_last (msg)) [0];
+    uint32_t command = ++*sequence;
+    size_t expected = 0;
     line_t *line = (line_t *) zlist_first (lines);
     while (line) {
-        if (streq (self->id_string, line->id_string)) {
-            zlist_remove (lines, line);
-            s_line_destroy (&line);
-            break;
-        }
+        zmsg_t *command_msg = zmsg_new ();
+        zframe_t *identity = zframe_dup (line->identity);
+        zmsg_append (command_msg, &identity);
+        zmsg_addmem (command_msg, PNP_COMMAND, 1);
+        zmsg_addmem (command_msg, &command, sizeof (command));
+        zmsg_addmem (command_msg, &signal, 1);
+        s_capture_msg (capture, CAPTURE_OUT, CAPTURE_BACKEND, command_msg);
+        if (zmsg_send (&command_msg, backend) == 0)
+            expected++;
+        zmsg_destroy (&command_msg);        //  Line is not connected here
         line = (line_t *) zlist_next (lines);
     }
-    zlist_append (lines, self);
+    gather_t *gather = s_gather_new (command, key, signal, expected);
+    gather->client = client;
+    gather->deadline = zclock_time () + COMMAND_TIMEOUT;
+    zlist_append (commands, gather);
 }
 
-//  The next method returns the next available line identity:
-//  TODO: Not all lines have the same capabilities so we should not just pick any line...
+//  The commands check method replies to the clients of commands that all
+//  lines have acknowledged, or that timed out, with the request key and the
+//  first error reported, or 0:
+static void
+s_commands_check (zlist_t *commands, zsock_t *frontend, capture_t *capture)
+{
+    gather_t *gather = (gather_t *) zlist_first (commands);
+    while (gather) {
+        if (!s_gather_done (gather)) {
+            gather = (gather_t *) zlist_next (commands);
+            continue;
+        }
+        zlist_remove (commands, gather);
+        printf ("I: command %o gathered %zu/%zu line acks in %" PRId64 " usecs, result %o\n",
+                gather->signal, zhash_size (gather->acks), gather->expected,
+                zclock_usecs () - gather->started, gather->result);
+        zmsg_t *msg = zmsg_new ();
+        zmsg_append (msg, &gather->client);
+        zmsg_append (msg, &gather->origin);
+        zmsg_addmem (msg, &gather->result, 1);
+        s_capture_msg (capture, CAPTURE_OUT, CAPTURE_FRONTEND, msg);
+        zmsg_send (&msg, frontend);
+        s_gather_destroy (&gather);
+        gather = (gather_t *) zlist_first (commands);
+    }
+}
 
-static zframe_t *
-s_lines_next (zlist_t *lines)
+//  The replicate method publishes an accepted or completed request to the
+//  peer Plant, so it can take over pending requests:
+static void
+s_request_replicate (request_t *request, const char *type, zsock_t *statepub, capture_t *capture)
 {
-    line_t *line = zlist_pop (lines);
-    assert (line);
-    zframe_t *frame = line->identity;
-    line->identity = NULL;
-    s_line_destroy (&line);
-    return frame;
+    if (!statepub)
+        return;
+    zmsg_t *msg;
+    if (memcmp (type, PEER_ACCEPTED, 1) == 0)
+        msg = zmsg_dup (request->msg);
+    else {
+        //  Completed requests only need the client identity
+        msg = zmsg_new ();
+        zframe_t *client = zframe_dup (zmsg_first (request->msg));
+        zmsg_append (msg, &client);
+    }
+    zmsg_pushmem (msg, &request->sequence, sizeof (request->sequence));
+    zmsg_pushmem (msg, type, 1);
+    s_capture_msg (capture, CAPTURE_OUT, CAPTURE_PEER, msg);
+    zmsg_send (&msg, statepub);
 }
 
-//  The purge method looks for and kills expired lines. We hold lines
-//  from oldest to most recent, so we stop at the first alive line:
-//  TODO: if lines expire, it should be checked if this effects the working of the line!
+//  The abandon method journals requests that got no reply within REQUEST_EXPIRY as completed,
+//  and drops them, so they are not dispatched again after every recovery. Their clients gave
+//  up on them, or retried them under a new identity, i.e. as another request.
+static void
+s_requests_abandon (zhash_t *requests, zlist_t *backlog, journal_t *journal, zsock_t *statepub,
+                    capture_t *capture)
+{
+    zlist_t *abandoned = zlist_new ();
+    request_t *request = (request_t *) zhash_first (requests);
+    while (request) {
+        if (zclock_time () - request->accepted > REQUEST_EXPIRY)
+            zlist_append (abandoned, request);
+        request = (request_t *) zhash_next (requests);
+    }
+    while ((request = (request_t *) zlist_pop (abandoned))) {
+        printf ("W: abandoning request %" PRIu64 " of client %s\n", request->sequence, request->client);
+        s_journal_append (journal, JOURNAL_COMPLETED, request->sequence, NULL);
+        s_request_replicate (request, PEER_COMPLETED, statepub, capture);
+        zlist_remove (backlog, request);
+        zhash_delete (requests, request->client);
+    }
+    zlist_destroy (&abandoned);
+}
 
+//  The publish method sends our state to the peer Plant. The active Plant
+//  adds the identities of its lines, so the passive Plant knows the line
+//  registry when it has to take over.
 static void
-s_lines_purge (zlist_t *lines)
+s_peer_publish (bstar_t *fsm, zlist_t *lines, zsock_t *statepub, capture_t *capture)
 {
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, PEER_STATE, 1);
+    byte state = fsm->state;
+    zmsg_addmem (msg, &state, 1);
     line_t *line = (line_t *) zlist_first (lines);
-    while (line) {
-        if (zclock_time () < line->expiry)
-            break;              //  line is alive, we're done here
-	printf("I: Removing expired line %s\n", line->id_string);
-        zlist_remove (lines, line);
-        s_line_destroy (&line);
-        line = (line_t *) zlist_first (lines);
+    while (fsm->state == BSTAR_ACTIVE && line) {
+        zframe_t *identity = zframe_dup (line->identity);
+        zmsg_append (msg, &identity);
+        line = (line_t *) zlist_next (lines);
+    }
+    s_capture_msg (capture, CAPTURE_OUT, CAPTURE_PEER, msg);
+    zmsg_send (&msg, statepub);
+}
+
+//  The receive method handles a message from the peer Plant: its state,
+//  which drives our Binary Star state machine, or a request it accepted or
+//  completed, which a passive Plant replicates. Returns -1 on split-brain.
+static int
+s_peer_receive (bstar_t *fsm, zmsg_t *msg, zlist_t *lines, zhash_t *requests,
+                zlist_t *backlog, journal_t *journal, uint64_t *sequence)
+{
+    //  STATE is one byte, a request SEQUENCE a uint64_t
+    zframe_t *type = zmsg_pop (msg);
+    zframe_t *frame = zmsg_pop (msg);
+    if (!frame || zframe_size (type) != 1
+    ||  zframe_size (frame) != (memcmp (zframe_data (type), PEER_STATE, 1) == 0? 1: sizeof (uint64_t))) {
+        printf ("E: invalid message from peer\n");
+        zframe_destroy (&type);
+        zframe_destroy (&frame);
+        zmsg_destroy (&msg);
+        return 0;
     }
+    int rc = 0;
+    if (memcmp (zframe_data (type), PEER_STATE, 1) == 0) {
+        fsm->event = (bstar_event_t) zframe_data (frame) [0];
+        rc = s_bstar_execute (fsm);
+        fsm->peer_seen = zclock_time ();
+        fsm->peer_expiry = fsm->peer_seen + BSTAR_PEER_EXPIRY;
+        //  Replace our line registry with that of the active peer, so lines
+        //  it expired are gone here too; lines it still has keep their
+        //  heartbeat statistics
+        if (rc == 0 && fsm->state == BSTAR_PASSIVE) {
+            zlist_t *replica = zlist_new ();
+            while (zmsg_size (msg)) {
+                line_t *line = s_line_new (zmsg_pop (msg));
+                s_line_ready (line, lines);
+                zlist_remove (lines, line);
+                zlist_append (replica, line);
+            }
+            line_t *line;
+            while ((line = (line_t *) zlist_pop (lines)))
+                s_line_destroy (&line);
+            while ((line = (line_t *) zlist_pop (replica)))
+                zlist_append (lines, line);
+            zlist_destroy (&replica);
+        }
+    }
+    else
+    if (fsm->state == BSTAR_PASSIVE && zmsg_size (msg)) {
+        uint64_t peer_sequence;
+        memcpy (&peer_sequence, zframe_data (frame), sizeof (peer_sequence));
+        if (*sequence < peer_sequence)
+            *sequence = peer_sequence;
+        char *client = zframe_strhex (zmsg_first (msg));
+        request_t *previous = (request_t *) zhash_lookup (requests, client);
+        if (memcmp (zframe_data (type), PEER_ACCEPTED, 1) == 0) {
+            if (previous)
+                zlist_remove (backlog, previous);
+            request_t *request = s_request_new (peer_sequence, msg);
+            s_journal_append (journal, JOURNAL_ACCEPTED, request->sequence, request->msg);
+            zhash_update (requests, request->client, request);
+            zhash_freefn (requests, request->client, s_request_free);
+            zlist_append (backlog, request);
+        }
+        else
+        if (previous && previous->sequence == peer_sequence) {
+            s_journal_append (journal, JOURNAL_COMPLETED, previous->sequence, NULL);
+            zlist_remove (backlog, previous);
+            zhash_delete (requests, client);
+        }
+        free (client);
+    }
+    zframe_destroy (&type);
+    zframe_destroy (&frame);
+    zmsg_destroy (&msg);
+    return rc;
+}
+
+//  The takeover method is called when a client or line turns up at a Plant
+//  that is not serving. Returns 0 if we may serve it, e.g. because the peer
+//  has gone silent and we just became active.
+static int
+s_peer_takeover (bstar_t *fsm, zlist_t *lines)
+{
+    int was_passive = fsm->state == BSTAR_PASSIVE;
+    fsm->event = BSTAR_CLIENT_REQUEST;
+    if (s_bstar_execute (fsm) != 0)
+        return -1;
+    if (was_passive) {
+        //  Give replicated lines a full liveness period to fail over
+        line_t *line = (line_t *) zlist_first (lines);
+        while (line) {
+            line->expiry = zclock_time () + HEARTBEAT_INTERVAL * HEARTBEAT_LIVENESS;
+            line = (line_t *) zlist_next (lines);
+        }
+    }
+    return 0;
 }
 
 //  The main task of the Plant is to send tasks to the lines and exchange heartbeats with lines so we
-//  can detect crashed or blocked line tasks:
+//  can detect crashed or blocked line tasks. It serves the status of the tree to clients from its
+//  status cache, see clone.h. Started with -p or -b, the Plant runs as primary or backup of a
+//  Binary Star pair:
 
-int main (void)
+int main (int argc, char *argv [])
 {
 	char* name = "PnP Plant";
-    zsock_t *frontend = zsock_new_router ("tcp://*:9000");  //  TODO: this should be configured
-    zsock_t *backend = zsock_new_router ("tcp://*:9001");   //  TODO: this should be configured
+    bstar_t fsm = { 0 };
+    const char *frontend_endpoint = "tcp://*:9000";     //  TODO: this should be configured
+    const char *backend_endpoint = "tcp://*:9001";      //  TODO: this should be configured
+    const char *snapshot_endpoint = "tcp://*:9006";     //  TODO: this should be configured
+    const char *updates_endpoint = "tcp://*:9007";
+    const char *statepub_endpoint = NULL;
+    const char *statesub_endpoint = NULL;
+    const char *journal_file = JOURNAL_FILE;
+    if (argc == 2 && streq (argv [1], "-p")) {
+        name = "PnP Plant (primary)";
+        statepub_endpoint = "tcp://*:9004";             //  TODO: this should be configured
+        statesub_endpoint = "tcp://localhost:9005";
+        journal_file = "plant-primary.journal";
+        fsm.state = BSTAR_PRIMARY;
+    }
+    else
+    if (argc == 2 && streq (argv [1], "-b")) {
+        name = "PnP Plant (backup)";
+        frontend_endpoint = "tcp://*:9010";             //  TODO: this should be configured
+        backend_endpoint = "tcp://*:9011";
+        snapshot_endpoint = "tcp://*:9016";
+        updates_endpoint = "tcp://*:9017";
+        statepub_endpoint = "tcp://*:9005";
+        statesub_endpoint = "tcp://localhost:9004";
+        journal_file = "plant-backup.journal";
+        fsm.state = BSTAR_BACKUP;
+    }
+    else
+    if (argc > 1) {
+        printf ("Usage: plant [ -p | -b ]\n");
+        return 0;
+    }
+    s_types_load (TYPES_CONFIG);
+    zsock_t *frontend = zsock_new_router (frontend_endpoint);
+    zsock_t *backend = zsock_new_router (backend_endpoint);
+    zsock_set_router_mandatory (backend, 1);
+    zsock_t *snapshot = zsock_new_router (snapshot_endpoint);
+    zsock_t *updates = zsock_new_pub (updates_endpoint);
+    zsock_t *statepub = statepub_endpoint? zsock_new_pub (statepub_endpoint): NULL;
+    zsock_t *statesub = statesub_endpoint? zsock_new_sub (statesub_endpoint, ""): NULL;
+
+    //  Record all traffic for the replay tool, if capturing is on
+    capture_t *capture = s_capture_new (name);
 
     //  List of available lines
     zlist_t *lines = zlist_new ();
 
+    //  Latest status of every line, module and device, as reported by lines,
+    //  published to clients as it changes
+    status_t *tree = s_status_new ();
+
+    //  Round-trip times to every line by identity; kept apart from the line
+    //  objects, which come and go with every request dispatched
+    zhash_t *rtts = zhash_new ();
+
+    //  Bandwidth of the link from every line by identity, which we measure and
+    //  report to the line, so it compresses what it sends when that pays off.
+    //  Kept while the line is gone too, as its link stays the same
+    zhash_t *codecs = zhash_new ();
+
+    //  Lifecycle commands from clients, until all lines acknowledged them
+    zlist_t *commands = zlist_new ();
+    uint32_t command_sequence = 0;
+
+    //  Pending requests by client identity, recovered from the journal
+    journal_t *journal = s_journal_new (journal_file);
+    assert (journal);
+    recovery_t recovery = { zhash_new (), zhash_new () };
+    int64_t recovery_start = zclock_usecs ();
+    size_t records = s_journal_replay (journal, s_request_recover, &recovery);
+    zhash_destroy (&recovery.sequences);
+    zhash_t *requests = recovery.requests;
+    uint64_t sequence = journal->header->sequence;
+    printf ("I: recovered %zu pending requests from %zu journal records in %" PRId64 " usecs\n",
+            zhash_size (requests), records, zclock_usecs () - recovery_start);
+
+    //  Recovered requests wait here until a line is available
+    zlist_t *backlog = zlist_new ();
+    request_t *request = (request_t *) zhash_first (requests);
+    while (request) {
+        zlist_append (backlog, request);
+        request = (request_t *) zhash_next (requests);
+    }
+
     //  Send out heartbeats at regular intervals
     uint64_t heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
     
     printf("[%s] started\n", name);
     while (!zsys_interrupted) {
-        zmq_pollitem_t items [] = {
-            { zsock_resolve(backend),  0, ZMQ_POLLIN, 0 },
-            { zsock_resolve(frontend), 0, ZMQ_POLLIN, 0 }
-        };
-        //  Poll frontend only if we have available lines
-        int rc = zmq_poll (items, zlist_size (lines)? 2: 1,
-            HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
+        //  A paired Plant only serves clients and lines while it is active,
+        //  or while it is the primary waiting for its backup
+        int serving = !statesub || fsm.state == BSTAR_ACTIVE || fsm.state == BSTAR_PRIMARY;
+        zmq_pollitem_t items [4];
+        int item_count = 0;
+        int backend_nbr = item_count;
+        items [item_count++] = (zmq_pollitem_t) { zsock_resolve(backend), 0, ZMQ_POLLIN, 0 };
+        //  Poll frontend only if we have available lines. A passive Plant
+        //  polls it regardless, to notice clients that failed over.
+        int frontend_nbr = -1;
+        if (zlist_size (lines) || !serving) {
+            frontend_nbr = item_count;
+            items [item_count++] = (zmq_pollitem_t) { zsock_resolve(frontend), 0, ZMQ_POLLIN, 0 };
+        }
+        //  Only the serving Plant has the status of the tree
+        int snapshot_nbr = -1;
+        if (serving) {
+            snapshot_nbr = item_count;
+            items [item_count++] = (zmq_pollitem_t) { zsock_resolve(snapshot), 0, ZMQ_POLLIN, 0 };
+        }
+        int statesub_nbr = -1;
+        if (statesub) {
+            statesub_nbr = item_count;
+            items [item_count++] = (zmq_pollitem_t) { zsock_resolve(statesub), 0, ZMQ_POLLIN, 0 };
+        }
+        int rc = zmq_poll (items, item_count, HEARTBEAT_INTERVAL * ZMQ_POLL_MSEC);
         if (rc == -1) {
             printf("E: Plant failed to poll sockets\n");
 	    break;              //  Interrupted
 	}
+        //  Handle state and replicated requests from the peer Plant
+        if (statesub_nbr != -1 && (items [statesub_nbr].revents & ZMQ_POLLIN)) {
+            zmsg_t *msg = zmsg_recv (statesub);
+            s_capture_msg (capture, CAPTURE_IN, CAPTURE_PEER, msg);
+            if (!msg)
+                break;          //  Interrupted
+            if (s_peer_receive (&fsm, msg, lines, requests, backlog, journal, &sequence) == -1)
+                break;          //  Split-brain, give up
+        }
         //  Handle line activity on backend
-        if (items [0].revents & ZMQ_POLLIN) {
+        if (items [backend_nbr].revents & ZMQ_POLLIN) {
             //  Use line identity for load-balancing
             zmsg_t *msg = zmsg_recv (backend);
+            s_capture_msg (capture, CAPTURE_IN, CAPTURE_BACKEND, msg);
             if (!msg)
                 break;          //  Interrupted
 
-            //  Any sign of life from line means it's ready
-            zframe_t *identity = zmsg_unwrap (msg);
-            line_t *line = s_line_new (identity);
-            s_line_ready (line, lines);
-	    
-            //  Validate control message, or return reply to client
-            if (zmsg_size (msg) == 1) {
-                zframe_t *frame = zmsg_first (msg);
-                if (memcmp (zframe_data (frame), PPP_READY, 1)
-                &&  memcmp (zframe_data (frame), PPP_HEARTBEAT, 1)) {
-                    printf ("E: invalid message from line\n");
-                    zmsg_dump (msg);
-                } else {
-                	printf("[%s] RX HB BACKEND %s\n", name, line->id_string);
-                }
+            //  A line turning up at a passive Plant may trigger failover
+            if (!serving && s_peer_takeover (&fsm, lines) != 0)
                 zmsg_destroy (&msg);
+            else {
+                //  Any sign of life from line means it's ready
+                zframe_t *identity = zmsg_unwrap (msg);
+                line_t *line = s_line_new (identity);
+                s_line_ready (line, lines);
+                codec_t *codec = s_codec_lookup (codecs, line->id_string);
+                s_codec_decode (codec, msg);
+
+                //  Validate control message, or return reply to client
+                zmsg_first (msg);
+                zframe_t *type = zmsg_next (msg);
+                if (zframe_size (zmsg_first (msg)) == 1
+                &&  memcmp (zframe_data (zmsg_first (msg)), PPP_READY, 1) == 0) {
+                    printf("[%s] RX READY BACKEND %s\n", name, line->id_string);
+                    zmsg_destroy (&msg);
+                }
+                else
+                if (zframe_size (zmsg_first (msg)) == 1
+                &&  memcmp (zframe_data (zmsg_first (msg)), PPP_HEARTBEAT, 1) == 0) {
+                    //  Heartbeat with the echo of our timestamp, and the status
+                    //  of modules and devices that changed
+                    s_line_heartbeat (line, s_interval_decode (s_msg_extension (msg, PNP_INTERVAL)));
+                    rtt_t *rtt = (rtt_t *) zhash_lookup (rtts, line->id_string);
+                    if (!rtt) {
+                        rtt = s_rtt_new ();
+                        zhash_insert (rtts, line->id_string, rtt);
+                        zhash_freefn (rtts, line->id_string, free);
+                    }
+                    zframe_t *frame = s_msg_extension (msg, PNP_CLOCK);
+                    if (frame && s_rtt_sample (rtt, frame) == 0)
+                        s_codec_measure (codec, rtt->last);
+                    frame = s_msg_extension (msg, PNP_STATUS);
+                    if (frame && s_status_merge (tree, line->id_string, frame) == -1)
+                        printf ("E: invalid status from line %s\n", line->id_string);
+                    s_clone_publish (tree, updates, 0);
+                    printf("[%s] RX HB BACKEND %s, rtt p50 < %lu p99 < %lu usecs, offset %" PRId64
+                           " usecs, %zu resources known\n", name, line->id_string,
+                           1UL << (s_rtt_percentile (rtt, 50) + 1), 1UL << (s_rtt_percentile (rtt, 99) + 1),
+                           rtt->offset, zhash_size (tree->entries));
+                    zmsg_destroy (&msg);
+                }
+                else
+                if (zmsg_size (msg) == 4 && zframe_size (type) == 1
+                &&  memcmp (zframe_data (type), PNP_ACK, 1) == 0) {
+                    //  Aggregate result of a lifecycle command: ID, ACK, SEQUENCE, RESULT
+                    zframe_t *frame = zmsg_next (msg);
+                    uint32_t command = 0;
+                    if (zframe_size (frame) == sizeof (command))
+                        memcpy (&command, zframe_data (frame), sizeof (command));
+                    zframe_t *result = zmsg_last (msg);
+                    if (zframe_size (result) == 1) {
+                        printf ("[%s] RX ACK BACKEND %s, result %o\n", name, line->id_string,
+                                zframe_data (result) [0]);
+                        gather_t *gather = s_gathers_lookup (commands, command);
+                        if (gather)
+                            s_gather_ack (gather, line->id_string, zframe_data (result) [0]);
+                    }
+                    else
+                        printf ("E: invalid ACK from line %s\n", line->id_string);
+                    zmsg_destroy (&msg);
+                }
+                else { // we assume here all other messages are replies which need to be sent to the clients
+                    char *client = zframe_strhex (zmsg_first (msg));
+                    request_t *request = (request_t *) zhash_lookup (requests, client);
+                    if (request) {
+                        s_journal_append (journal, JOURNAL_COMPLETED, request->sequence, NULL);
+                        s_request_replicate (request, PEER_COMPLETED, statepub, capture);
+                        zlist_remove (backlog, request);
+                        zhash_delete (requests, client);
+                    }
+                    free (client);
+                    s_trace_stamp (msg, TRACE_PLANT, TRACE_FORWARD);
+                    s_capture_msg (capture, CAPTURE_OUT, CAPTURE_FRONTEND, msg);
+                    zmsg_send (&msg, frontend);
+                }
             }
-            else // we assume here all other messages are replies which need to be sent to the clients
-                zmsg_send (&msg, frontend);
         }
-        if (items [1].revents & ZMQ_POLLIN) {
-            //  Now get next client request, route to next line
+        if (snapshot_nbr != -1 && (items [snapshot_nbr].revents & ZMQ_POLLIN)) {
+            if (s_clone_snapshot (tree, snapshot) == -1)
+                break;          //  Interrupted
+        }
+        if (frontend_nbr != -1 && (items [frontend_nbr].revents & ZMQ_POLLIN)) {
+            //  Now get next client request, journal it and route to next line
             zmsg_t *msg = zmsg_recv (frontend);
+            s_capture_msg (capture, CAPTURE_IN, CAPTURE_FRONTEND, msg);
             if (!msg)
                 break;          //  Interrupted
-            zframe_t *identity = s_lines_next (lines); 
-            zmsg_prepend (msg, &identity);
-            zmsg_send (&msg, backend);
+            //  A client turning up at a passive Plant may trigger failover,
+            //  otherwise the client times out and fails over back to the peer
+            if (!serving && s_peer_takeover (&fsm, lines) != 0)
+                zmsg_destroy (&msg);
+            else
+            if (s_command_request (msg)) {
+                s_command_broadcast (msg, lines, backend, commands, &command_sequence, capture);
+                zmsg_destroy (&msg);
+            }
+            else {
+                s_trace_stamp (msg, TRACE_PLANT, TRACE_ENQUEUE);
+                request_t *request = s_request_new (++sequence, msg);
+                zmsg_destroy (&msg);
+                s_journal_append (journal, JOURNAL_ACCEPTED, request->sequence, request->msg);
+                s_request_replicate (request, PEER_ACCEPTED, statepub, capture);
+                request_t *previous = (request_t *) zhash_lookup (requests, request->client);
+                if (previous)
+                    zlist_remove (backlog, previous);
+                zhash_update (requests, request->client, request);
+                zhash_freefn (requests, request->client, s_request_free);
+                zlist_append (backlog, request);
+            }
         }
+        serving = !statesub || fsm.state == BSTAR_ACTIVE || fsm.state == BSTAR_PRIMARY;
+
+        //  Dispatch new and recovered requests as long as lines are available
+        while (serving && zlist_size (backlog) && zlist_size (lines)) {
+            request_t *request = (request_t *) zlist_pop (backlog);
+            if (s_request_dispatch (request, lines, backend, journal, capture) == -1) {
+                zlist_push (backlog, request);
+                break;
+            }
+        }
+        s_commands_check (commands, frontend, capture);
+        if (zclock_time () >= journal->compact_at)
+            s_journal_compact (journal);
         //  .split handle heartbeating
         //  We handle heartbeating after any socket activity. First, we send
         //  heartbeats to any idle lines if it's time. Then, we purge any
-        //  dead lines:
-        if (zclock_time () >= heartbeat_at) {
+        //  dead lines. A passive Plant only publishes its state to the peer:
+        if ((uint64_t) zclock_time () >= heartbeat_at) {
             line_t *line = (line_t *) zlist_first (lines);
-            while (line) {
-                zframe_send (&line->identity, backend,
-                             ZFRAME_REUSE + ZFRAME_MORE);
-                zframe_t *frame = zframe_new (PPP_HEARTBEAT, 1);
-                zframe_send (&frame, backend, 0);
+            while (serving && line) {
+                zmsg_t *msg = zmsg_new ();
+                zframe_t *frame = zframe_dup (line->identity);
+                zmsg_append (msg, &frame);
+                zmsg_addmem (msg, PPP_HEARTBEAT, 1);
+                frame = s_rtt_clock_frame (NULL);
+                zmsg_append (msg, &frame);
+                frame = s_codec_link_frame (s_codec_lookup (codecs, line->id_string));
+                if (frame)
+                    zmsg_append (msg, &frame);
+                s_capture_msg (capture, CAPTURE_OUT, CAPTURE_BACKEND, msg);
+                zmsg_send (&msg, backend);
+                zmsg_destroy (&msg);        //  Line is not connected here
                 printf("[%s] TX HB BACKEND %s\n", name, line->id_string);
                 line = (line_t *) zlist_next (lines);
             }
-	    
+            if (serving)
+                s_requests_abandon (requests, backlog, journal, statepub, capture);
+            if (statepub)
+                s_peer_publish (&fsm, lines, statepub, capture);
+            //  Changes since, e.g. from expired lines, go out to clients now;
+            //  a passive Plant stays silent, so its clients fail over
+            s_clone_publish (tree, serving? updates: NULL, 1);
+
             heartbeat_at = zclock_time () + HEARTBEAT_INTERVAL;
         }
-        s_lines_purge (lines);
+        //  Replicated lines are kept until the passive Plant takes over
+        if (serving)
+            s_lines_purge (lines, tree, rtts);
     }
     printf("I: Plant interrupted\n");
     //  When we're done, clean up properly
@@ -182,5 +710,23 @@ int main (void)
         s_line_destroy (&line);
     }
     zlist_destroy (&lines);
+    while (zlist_size (commands)) {
+        gather_t *gather = (gather_t *) zlist_pop (commands);
+        s_gather_destroy (&gather);
+    }
+    zlist_destroy (&commands);
+    zlist_destroy (&backlog);
+    zhash_destroy (&requests);
+    s_status_destroy (&tree);
+    zhash_destroy (&rtts);
+    zhash_destroy (&codecs);
+    s_journal_destroy (&journal);
+    s_capture_destroy (&capture);
+    zsock_destroy (&statepub);
+    zsock_destroy (&statesub);
+    zsock_destroy (&snapshot);
+    zsock_destroy (&updates);
+    zsock_destroy (&frontend);
+    zsock_destroy (&backend);
     return 0;
 }
@@ -0,0 +1,89 @@
+#ifndef PNP_PROTOCOL
+#define PNP_PROTOCOL "Pick-n-Pack Protocol"
+
+//  Messages, signals and error codes shared by the Plant and the resources.
+//  The Plant includes this instead of defs.h, which builds the resources.
+
+// Ready message contains 2 frames: ID, READY
+// Heartbeat message contains 3 frames: ID, STATE, SIGNAL/COMMAND, followed by extension frames
+// Heartbeat message to backend resources contains 1 frame: HEARTBEAT, followed by extension frames
+// Data message contains 4 frames: ID, STATE, SIGNAL/COMMAND, PAYLOAD
+// Command message contains 3 frames: COMMAND, SEQUENCE, SIGNAL, a CONFIGURE command 2 more: PAYLOAD, VERSION
+// Acknowledgement message contains 4 frames: ID, ACK, SEQUENCE, RESULT
+// Ring message contains 3 frames: ID, RING, NAME
+// Batch message contains 3 frames: ID, BATCH, SAMPLES
+// Tray message contains 3 frames: ID, TRAY, EVENT
+// Transfer offer contains 3 frames: TRANSFER, NAME, HEADER, a chunk a 4th frame: DATA
+// Transfer credit contains 4 frames: ID, TRANSFER, NAME, CREDIT
+
+//  Pick-n-Pack Protocol constants for signalling
+#define PNP_READY "\001"    //  Signals device is ready
+#define PNP_HEARTBEAT "\002"      //  Signals device heartbeat
+#define PNP_COMMAND "\003"    //  Lifecycle command to backend resources
+#define PNP_ACK "\004"    //  Acknowledges a lifecycle command, RESULT is 0 or an error code
+#define PNP_RING "\005"    //  Samples are waiting in the shared-memory ring NAME
+#define PNP_BATCH "\006"    //  Samples packed into a single frame, see batch.h
+#define PNP_TRAY "\007"    //  A tray entered or left the station ID, see tracking.h
+#define PNP_TRANSFER "\020"    //  Chunk of a blob sent to backend resources, or credit for it, see transfer.h
+
+//  Extension frames are appended to heartbeats, the first byte of the frame tells what they hold.
+//  Tags are kept out of the ASCII range, so a text payload is never taken for an extension.
+#define PNP_STATUS "\200"    //  Status of all descendants
+#define PNP_CLOCK "\201"    //  Timestamps to measure round-trip time and clock offset
+#define PNP_TRACE "\202"    //  Hops of a sampled request, appended to requests and replies instead
+#define PNP_ERROR "\203"    //  Error code of the sender, e.g. PNP_ERR_HEARTBEAT if its work loop is stuck
+#define PNP_INTERVAL "\204"    //  Heartbeat interval of the sender, if it backs off, see accrual.h
+#define PNP_LINK "\205"    //  Bandwidth of the link, as the receiver of what we send measured it, see codec.h
+#define PNP_EXTENSION(tag) ((tag) >= 0200 && (tag) < 0240)
+
+
+// IDs, names and other properties of each type are kept in the registry in types.h
+#define PNP_LINE_ID "\010"
+#define PNP_THERMOFORMER_ID "\011"
+#define PNP_ROBOT_CELL_ID "\012"
+#define PNP_QAS_ID "\013"
+#define PNP_CEILING_ID "\014"
+#define PNP_PRINTING_ID "\015"
+
+// Status
+#define PNP_CREATING "\100"
+#define PNP_INITIALISING "\101"
+#define PNP_CONFIGURING "\102"
+#define PNP_RUNNING "\103"
+#define PNP_PAUSING "\104"
+#define PNP_FINALISING "\105"
+#define PNP_DELETING "\106"
+#define PNP_BUSY "\107"    //  Running a long operation, heartbeats come from the watchdog thread
+
+// Signals/commands
+#define PNP_RUN "\110"
+#define PNP_PAUSE "\111"
+#define PNP_CONFIGURE "\112"
+#define PNP_STOP "\113"
+#define PNP_REBOOT "\114"
+
+// Error codes
+#define PNP_ERR_HEARTBEAT "\121"
+#define PNP_ERR_FPGA "\122"
+#define PNP_ERR_CAMERA "\123"
+#define PNP_ERR_MISSING_PARAMETER "\124"
+#define PNP_ERR_HDF5 "\125"
+#define PNP_ERR_LOG "\126"
+#define PNP_ERR_UNDEFINED "\127"
+#define PNP_ERR_CONFIG "\130"    //  Configuration delta is not for our version, send the full configuration
+#define PNP_ERR_BROADCAST "\131"    //  Broadcast command not acknowledged, e.g. sent before the subscription arrived
+
+//  The extension method returns the extension frame with <tag> of a heartbeat, or NULL
+static zframe_t *
+s_msg_extension (zmsg_t *msg, const char *tag)
+{
+    zframe_t *frame = zmsg_first (msg);
+    while (frame) {
+        if (zframe_size (frame) > 0 && zframe_data (frame) [0] == (byte) tag [0])
+            return frame;
+        frame = zmsg_next (msg);
+    }
+    return NULL;
+}
+
+#endif
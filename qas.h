@@ -0,0 +1,322 @@
+#ifndef PNP_QAS_POOL_H
+#define PNP_QAS_POOL_H "Pick-n-Pack QAS Inspection Pool"
+
+//  The QAS pool inspects camera frames on all cores, so image inspection
+//  neither serialises on the module thread nor stalls its heartbeats. The
+//  module submits each frame it receives from a device; frames go round
+//  robin onto per-worker queues, and an idle worker steals from the queues
+//  of busy ones, oldest frame first. Workers hand finished frames back over
+//  an inproc socket, and the module sends the results upstream in the order
+//  the frames arrived, holding early results until the ones before them are
+//  done.
+//
+//  The inspection kernel is a function pointer. s_qas_defects is the
+//  reference kernel: it counts the pixels brighter than a threshold, sixteen
+//  at a time with SSE2 where available.
+//
+//  Result: SEQUENCE (uint64), DEFECTS (uint32), LATENCY (uint32 usecs, from
+//  submitting the frame until a worker finished it).
+
+#include "rtt.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#if defined (__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define QAS_INFLIGHT    256         //  Frames submitted but not yet reported, at most
+#define QAS_THRESHOLD   200         //  Pixel value above which the reference kernel sees a defect
+#define QAS_WINDOW      4096        //  Latencies after which their histogram decays by half
+#define QAS_RESULT      (sizeof (uint64_t) + 2 * sizeof (uint32_t))
+
+//  Inspection kernel, returns the number of defects in <image>
+typedef uint32_t (qas_kernel_fn) (const byte *image, size_t size, void *args);
+
+typedef struct {
+    uint64_t sequence;          //  Order the frame arrived in
+    zframe_t *id;               //  ID of the device that sent it
+    byte *image;
+    size_t size;
+    int64_t received;           //  usecs
+    int64_t done;               //  usecs
+    uint32_t defects;
+} qas_job_t;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    qas_job_t *jobs [QAS_INFLIGHT];
+    size_t head;
+    size_t count;
+} qas_queue_t;
+
+typedef struct {
+    qas_kernel_fn *kernel;
+    void *args;
+    size_t workers;
+    pthread_t *threads;
+    qas_queue_t *queues;        //  One per worker
+    atomic_size_t queued;       //  Jobs on all queues
+    atomic_size_t steals;       //  Jobs taken from another worker's queue
+    pthread_mutex_t mutex;      //  Idle workers wait on cond
+    pthread_cond_t cond;
+    int stopping;
+    char endpoint [64];         //  Workers push finished jobs here
+    zsock_t *results;
+    uint64_t submitted;         //  Sequence of next frame
+    uint64_t reported;          //  Sequence of next result to report
+    qas_job_t *finished [QAS_INFLIGHT];
+    size_t dropped;             //  Frames refused, too many in flight
+    rtt_t latencies;            //  Decaying histogram of latencies, usecs
+    size_t frames;              //  Frames reported since last report
+    int64_t report_at;          //  Time of last report, usecs
+} qas_t;
+
+//  Reference kernel: counts the pixels brighter than (uintptr_t) <args>
+static uint32_t
+s_qas_defects (const byte *image, size_t size, void *args)
+{
+    byte threshold = (byte) (uintptr_t) args;
+    uint64_t count = 0;
+    size_t pixel = 0;
+#if defined (__SSE2__)
+    //  SSE2 only compares signed bytes, so flip the sign bits of both sides
+    __m128i bias = _mm_set1_epi8 ((char) 0x80);
+    __m128i limit = _mm_set1_epi8 ((char) (threshold ^ 0x80));
+    __m128i ones = _mm_set1_epi8 (1);
+    __m128i zero = _mm_setzero_si128 ();
+    __m128i total = zero;
+    for (; pixel + 16 <= size; pixel += 16) {
+        __m128i pixels = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) (image + pixel)), bias);
+        __m128i over = _mm_and_si128 (_mm_cmpgt_epi8 (pixels, limit), ones);
+        total = _mm_add_epi64 (total, _mm_sad_epu8 (over, zero));
+    }
+    uint64_t lanes [2];
+    _mm_storeu_si128 ((__m128i *) lanes, total);
+    count = lanes [0] + lanes [1];
+#endif
+    for (; pixel < size; pixel++)
+        count += image [pixel] > threshold;
+    return (uint32_t) count;
+}
+
+static void
+s_qas_job_destroy (qas_job_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        qas_job_t *self = *self_p;
+        zframe_destroy (&self->id);
+        free (self->image);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The take method returns the next job for worker <index>, from its own
+//  queue or else stolen from another one, and waits if there is none.
+//  Returns NULL once the pool is stopping.
+static qas_job_t *
+s_qas_take (qas_t *self, size_t index)
+{
+    while (1) {
+        size_t offset;
+        for (offset = 0; offset < self->workers; offset++) {
+            qas_queue_t *queue = &self->queues [(index + offset) % self->workers];
+            qas_job_t *job = NULL;
+            pthread_mutex_lock (&queue->mutex);
+            if (queue->count) {
+                job = queue->jobs [queue->head];
+                queue->head = (queue->head + 1) % QAS_INFLIGHT;
+                queue->count--;
+            }
+            pthread_mutex_unlock (&queue->mutex);
+            if (job) {
+                atomic_fetch_sub (&self->queued, 1);
+                if (offset)
+                    atomic_fetch_add (&self->steals, 1);
+                return job;
+            }
+        }
+        pthread_mutex_lock (&self->mutex);
+        while (!self->stopping && atomic_load (&self->queued) == 0)
+            pthread_cond_wait (&self->cond, &self->mutex);
+        int stopping = self->stopping;
+        pthread_mutex_unlock (&self->mutex);
+        if (stopping)
+            return NULL;
+    }
+}
+
+typedef struct {
+    qas_t *pool;
+    size_t index;
+} qas_worker_t;
+
+static void *
+s_qas_worker (void *args)
+{
+    qas_worker_t *worker = (qas_worker_t *) args;
+    qas_t *self = worker->pool;
+    size_t index = worker->index;
+    free (worker);
+    s_affinity_pin (AFFINITY_WORKERS);
+    char endpoint [sizeof (self->endpoint)];
+    snprintf (endpoint, sizeof (endpoint), ">%s", self->endpoint);
+    zsock_t *results = zsock_new_push (endpoint);
+    assert (results);
+    qas_job_t *job;
+    while ((job = s_qas_take (self, index))) {
+        job->defects = self->kernel (job->image, job->size, self->args);
+        job->done = zclock_usecs ();
+        zsock_send (results, "p", job);
+    }
+    zsock_destroy (&results);
+    return NULL;
+}
+
+//  Construct new pool of <workers> threads running <kernel> with <args>, or
+//  of one thread per core if <workers> is 0
+static qas_t *
+s_qas_new (size_t workers, qas_kernel_fn *kernel, void *args)
+{
+    qas_t *self = (qas_t *) zmalloc (sizeof (qas_t));
+    self->kernel = kernel;
+    self->args = args;
+    long cores = sysconf (_SC_NPROCESSORS_ONLN);
+    self->workers = workers? workers: cores > 0? (size_t) cores: 1;
+    self->latencies.window = QAS_WINDOW;
+    snprintf (self->endpoint, sizeof (self->endpoint), "inproc://qas-%p", (void *) self);
+    char endpoint [sizeof (self->endpoint) + 1];
+    snprintf (endpoint, sizeof (endpoint), "@%s", self->endpoint);
+    self->results = zsock_new_pull (endpoint);
+    assert (self->results);
+    pthread_mutex_init (&self->mutex, NULL);
+    pthread_cond_init (&self->cond, NULL);
+    self->queues = (qas_queue_t *) zmalloc (self->workers * sizeof (qas_queue_t));
+    self->threads = (pthread_t *) zmalloc (self->workers * sizeof (pthread_t));
+    size_t index;
+    for (index = 0; index < self->workers; index++)
+        pthread_mutex_init (&self->queues [index].mutex, NULL);
+    for (index = 0; index < self->workers; index++) {
+        qas_worker_t *worker = (qas_worker_t *) zmalloc (sizeof (qas_worker_t));
+        worker->pool = self;
+        worker->index = index;
+        pthread_create (&self->threads [index], NULL, s_qas_worker, worker);
+    }
+    self->report_at = zclock_usecs ();
+    return self;
+}
+
+static void
+s_qas_destroy (qas_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        qas_t *self = *self_p;
+        pthread_mutex_lock (&self->mutex);
+        self->stopping = 1;
+        pthread_cond_broadcast (&self->cond);
+        pthread_mutex_unlock (&self->mutex);
+        size_t index;
+        for (index = 0; index < self->workers; index++)
+            pthread_join (self->threads [index], NULL);
+        //  Jobs still queued, finished or on their way back
+        for (index = 0; index < self->workers; index++) {
+            qas_queue_t *queue = &self->queues [index];
+            while (queue->count) {
+                s_qas_job_destroy (&queue->jobs [queue->head]);
+                queue->head = (queue->head + 1) % QAS_INFLIGHT;
+                queue->count--;
+            }
+            pthread_mutex_destroy (&queue->mutex);
+        }
+        for (index = 0; index < QAS_INFLIGHT; index++)
+            s_qas_job_destroy (&self->finished [index]);
+        while (zsock_events (self->results) & ZMQ_POLLIN) {
+            qas_job_t *job;
+            if (zsock_recv (self->results, "p", &job) == 0)
+                s_qas_job_destroy (&job);
+        }
+        zsock_destroy (&self->results);
+        pthread_mutex_destroy (&self->mutex);
+        pthread_cond_destroy (&self->cond);
+        free (self->queues);
+        free (self->threads);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The submit method queues a copy of <image> from the device with ID <id>
+//  for inspection. Returns -1 and drops the frame if QAS_INFLIGHT frames are
+//  still waiting for their results.
+static int
+s_qas_submit (qas_t *self, zframe_t *id, const byte *image, size_t size)
+{
+    if (self->submitted - self->reported >= QAS_INFLIGHT) {
+        if (self->dropped++ == 0)
+            printf ("W: QAS pool is behind, dropping frames\n");
+        return -1;
+    }
+    qas_job_t *job = (qas_job_t *) zmalloc (sizeof (qas_job_t));
+    job->sequence = self->submitted++;
+    job->id = zframe_dup (id);
+    job->image = (byte *) malloc (size);
+    memcpy (job->image, image, size);
+    job->size = size;
+    job->received = zclock_usecs ();
+    qas_queue_t *queue = &self->queues [job->sequence % self->workers];
+    pthread_mutex_lock (&queue->mutex);
+    queue->jobs [(queue->head + queue->count) % QAS_INFLIGHT] = job;
+    queue->count++;
+    pthread_mutex_unlock (&queue->mutex);
+    atomic_fetch_add (&self->queued, 1);
+    pthread_mutex_lock (&self->mutex);
+    pthread_cond_signal (&self->cond);
+    pthread_mutex_unlock (&self->mutex);
+    return 0;
+}
+
+//  The next method collects the jobs workers have finished, and returns the
+//  next one in frame order, or NULL if it is not finished yet. The caller
+//  destroys the job. Call it until it returns NULL whenever the results
+//  socket is readable.
+static qas_job_t *
+s_qas_next (qas_t *self)
+{
+    while (zsock_events (self->results) & ZMQ_POLLIN) {
+        qas_job_t *job;
+        if (zsock_recv (self->results, "p", &job) == 0)
+            self->finished [job->sequence % QAS_INFLIGHT] = job;
+    }
+    qas_job_t *job = self->finished [self->reported % QAS_INFLIGHT];
+    if (!job)
+        return NULL;
+    self->finished [self->reported % QAS_INFLIGHT] = NULL;
+    self->reported++;
+    self->frames++;
+    s_rtt_add (&self->latencies, job->done - job->received);
+    return job;
+}
+
+//  The report method prints frames/sec since the previous report, and the
+//  inspection latency of the last few thousand frames, every frame counted.
+//  Percentiles come from the decaying histogram of rtt.h, so they are
+//  interpolated within power-of-two buckets.
+static void
+s_qas_report (qas_t *self, const char *name)
+{
+    if (!self)
+        return;
+    int64_t now = zclock_usecs ();
+    double frames = now > self->report_at? self->frames * 1e6 / (now - self->report_at): 0;
+    printf ("[%s] QAS %.1f frames/sec, latency p50 %" PRId64 " p99 %" PRId64 " usecs, "
+            "%zu workers, %zu steals, %zu dropped\n", name, frames,
+            s_rtt_percentile_usecs (&self->latencies, 50), s_rtt_percentile_usecs (&self->latencies, 99),
+            self->workers, atomic_load (&self->steals), self->dropped);
+    self->frames = 0;
+    self->report_at = now;
+}
+
+#endif
@@ -0,0 +1,154 @@
+//  Pick-n-Pack QAS inspection benchmark
+//
+//  Measures the QAS pool (qas.h) the QAS module runs with PNP_QAS_POOL. First
+//  the reference kernel is timed on one core, with SSE2 and as plain C; then
+//  the pool inspects synthetic camera frames with 1, 2, 4... workers up to one
+//  per core, and reports frames/sec and the latency from submitting a frame
+//  until a worker finished it. Results must come out in frame order.
+//
+//  Usage: qasbench [-n frames] [-w width] [-h height] [workers ...]
+
+#include "czmq.h"
+#include "defs.h"
+
+#define BENCH_FRAMES    2000
+#define BENCH_WIDTH     1280
+#define BENCH_HEIGHT    1024
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+//  Plain C kernel, to compare with s_qas_defects
+static uint32_t
+s_defects_scalar (const byte *image, size_t size, void *args)
+{
+    byte threshold = (byte) (uintptr_t) args;
+    uint32_t count = 0;
+    size_t pixel;
+    for (pixel = 0; pixel < size; pixel++)
+        count += image [pixel] > threshold;
+    return count;
+}
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The kernel run method reports the MB/sec of <kernel> on one core
+static uint32_t
+s_kernel_run (const char *name, qas_kernel_fn *kernel, byte *image, size_t size)
+{
+    uint32_t defects = 0;
+    size_t rounds = 0;
+    int64_t started = zclock_usecs ();
+    int64_t elapsed;
+    do {
+        defects = kernel (image, size, (void *) (uintptr_t) QAS_THRESHOLD);
+        rounds++;
+    } while ((elapsed = zclock_usecs () - started) < 1000000);
+    printf ("%-8s %10.1f MB/sec %10u defects\n", name,
+            rounds * size / (elapsed / 1e6) / (1024 * 1024), defects);
+    return defects;
+}
+
+//  The pool run method inspects <count> frames with <workers> workers, keeping
+//  the pool as full as it lets us
+static void
+s_pool_run (size_t workers, byte *image, size_t size, size_t count)
+{
+    qas_t *qas = s_qas_new (workers, s_qas_defects, (void *) (uintptr_t) QAS_THRESHOLD);
+    zframe_t *id = zframe_new (PNP_QAS_ID, sizeof (PNP_QAS_ID));
+    int64_t *latencies = (int64_t *) zmalloc (count * sizeof (int64_t));
+    size_t submitted = 0;
+    size_t received = 0;
+    uint64_t expected = 0;
+    int64_t started = zclock_usecs ();
+    while (received < count && !zsys_interrupted) {
+        while (submitted < count && submitted - received < QAS_INFLIGHT) {
+            s_qas_submit (qas, id, image, size);
+            submitted++;
+        }
+        zmq_pollitem_t items [] = { { zsock_resolve (qas->results), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, 1000 * ZMQ_POLL_MSEC) == -1)
+            break;
+        qas_job_t *job;
+        while ((job = s_qas_next (qas))) {
+            assert (job->sequence == expected++);
+            latencies [received++] = job->done - job->received;
+            s_qas_job_destroy (&job);
+        }
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    qsort (latencies, received, sizeof (int64_t), s_compare_latency);
+    printf ("%8zu %12.1f %10.3f %10.3f %10zu\n", qas->workers,
+            elapsed > 0? received * 1e6 / elapsed: 0,
+            received? latencies [received / 2] / 1e3: 0, received? latencies [received * 99 / 100] / 1e3: 0,
+            atomic_load (&qas->steals));
+    free (latencies);
+    zframe_destroy (&id);
+    s_qas_destroy (&qas);
+}
+
+int main (int argc, char *argv [])
+{
+    size_t frames = BENCH_FRAMES;
+    size_t width = BENCH_WIDTH;
+    size_t height = BENCH_HEIGHT;
+    size_t workers [16];
+    size_t worker_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            frames = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-w") && argn + 1 < argc)
+            width = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-h") && argn + 1 < argc)
+            height = atol (argv [++argn]);
+        else
+        if (atol (argv [argn]) > 0 && worker_count < 16)
+            workers [worker_count++] = atol (argv [argn]);
+        else {
+            printf ("usage: qasbench [-n frames] [-w width] [-h height] [workers ...]\n");
+            return 1;
+        }
+    }
+    if (!worker_count) {
+        long cores = sysconf (_SC_NPROCESSORS_ONLN);
+        size_t count;
+        for (count = 1; count < (size_t) cores && worker_count < 15; count *= 2)
+            workers [worker_count++] = count;
+        workers [worker_count++] = cores > 0? (size_t) cores: 1;
+    }
+    //  Grey frame with some bright spots
+    size_t size = width * height;
+    byte *image = (byte *) malloc (size);
+    size_t pixel;
+    for (pixel = 0; pixel < size; pixel++)
+        image [pixel] = random () % 100 == 0? 255: (byte) (random () % QAS_THRESHOLD);
+
+    printf ("%zu frames of %zux%zu pixels\n", frames, width, height);
+    uint32_t simd = s_kernel_run ("kernel", s_qas_defects, image, size);
+    uint32_t scalar = s_kernel_run ("scalar", s_defects_scalar, image, size);
+    if (simd != scalar) {
+        printf ("E: kernels disagree\n");
+        return 1;
+    }
+    printf ("%8s %12s %10s %10s %10s\n", "workers", "frames/sec", "p50 msecs", "p99 msecs", "steals");
+    size_t worker_nbr;
+    for (worker_nbr = 0; worker_nbr < worker_count && !zsys_interrupted; worker_nbr++)
+        s_pool_run (workers [worker_nbr], image, size, frames);
+    free (image);
+    return 0;
+}
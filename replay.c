@@ -0,0 +1,256 @@
+//  Pick-n-Pack replay tool
+//
+//  Feeds the messages a broker received on one socket, as recorded in a
+//  capture file, back into a broker at the recorded pace, N times faster or
+//  as fast as possible, and reports throughput and latency. Results can be
+//  stored as a baseline and later runs compared against it.
+//
+//  A plain endpoint is connected with a DEALER socket, to replay into a
+//  ROUTER socket such as the frontend of the Plant; the identity frame the
+//  ROUTER added when capturing is stripped. An endpoint starting with '@' is
+//  bound with a ROUTER socket, to replay into the frontend of a line, module
+//  or device, which connects to us in place of its parent. Latency is the
+//  time from a request to the next reply, oldest request first; it is only
+//  measured against a ROUTER, since a broker connected to us also sends its
+//  own heartbeats.
+//
+//  Usage: replay [-x speed | -m] [-s socket] [-b baseline] [-w baseline]
+//                capture endpoint
+
+#include "czmq.h"
+#include "capture.h"
+
+#define REPLAY_LINGER       2500    //  msecs to wait for outstanding replies
+#define REPLAY_CONNECT      10000   //  msecs to wait for a broker to connect
+#define REPLAY_TOLERANCE    0.10    //  Worse than baseline by this is a regression
+
+typedef struct {
+    zsock_t *socket;
+    int router;                 //  We bound a ROUTER socket
+    zframe_t *peer;             //  Identity of the broker, when we are the ROUTER
+    size_t received;            //  Messages received from the broker
+    int64_t *sent;              //  Send times of unanswered requests, usecs
+    size_t sent_head;
+    size_t sent_tail;
+    int64_t *latencies;         //  usecs
+    size_t replies;
+    size_t max;                 //  Size of both arrays
+} replay_t;
+
+typedef struct {
+    double throughput;          //  Messages per second
+    double p50;                 //  msecs
+    double p99;                 //  msecs
+} replay_result_t;
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+//  The drain method receives replies for up to <timeout> msecs, or only
+//  those already waiting if <timeout> is 0
+static void
+s_replay_drain (replay_t *self, int64_t timeout)
+{
+    int64_t until = zclock_time () + timeout;
+    do {
+        zmq_pollitem_t items [] = { { zsock_resolve (self->socket), 0, ZMQ_POLLIN, 0 } };
+        int64_t wait = until - zclock_time ();
+        if (zmq_poll (items, 1, (wait > 0? wait: 0) * ZMQ_POLL_MSEC) == -1)
+            return;             //  Interrupted
+        if (!(items [0].revents & ZMQ_POLLIN))
+            continue;
+        zmsg_t *msg = zmsg_recv (self->socket);
+        if (!msg)
+            return;
+        self->received++;
+        if (self->router) {
+            zframe_destroy (&self->peer);
+            self->peer = zmsg_pop (msg);
+        }
+        else
+        if (self->sent_head < self->sent_tail)
+            self->latencies [self->replies++] = zclock_usecs () - self->sent [self->sent_head++];
+        zmsg_destroy (&msg);
+    } while (zclock_time () < until && !zsys_interrupted);
+}
+
+static int
+s_baseline_load (const char *filename, replay_result_t *result)
+{
+    FILE *file = fopen (filename, "r");
+    if (!file)
+        return -1;
+    int rc = fscanf (file, "throughput %lf\np50 %lf\np99 %lf\n",
+                     &result->throughput, &result->p50, &result->p99) == 3? 0: -1;
+    fclose (file);
+    return rc;
+}
+
+static int
+s_baseline_save (const char *filename, replay_result_t *result)
+{
+    FILE *file = fopen (filename, "w");
+    if (!file)
+        return -1;
+    fprintf (file, "throughput %f\np50 %f\np99 %f\n", result->throughput, result->p50, result->p99);
+    fclose (file);
+    return 0;
+}
+
+static void
+s_replay_usage (void)
+{
+    printf ("usage: replay [-x speed | -m] [-s socket] [-b baseline] [-w baseline] capture endpoint\n"
+            "       socket is 0 frontend (default), 1 backend, 2 subscriber or 4 peer\n");
+}
+
+int main (int argc, char *argv [])
+{
+    double speed = 1;
+    int max_speed = 0;
+    int socket = CAPTURE_FRONTEND;
+    const char *baseline = NULL;
+    const char *save = NULL;
+    int argn;
+    for (argn = 1; argn < argc - 2; argn++) {
+        if (streq (argv [argn], "-m"))
+            max_speed = 1;
+        else
+        if (streq (argv [argn], "-x") && argn + 1 < argc - 2)
+            speed = atof (argv [++argn]);
+        else
+        if (streq (argv [argn], "-s") && argn + 1 < argc - 2)
+            socket = atoi (argv [++argn]);
+        else
+        if (streq (argv [argn], "-b") && argn + 1 < argc - 2)
+            baseline = argv [++argn];
+        else
+        if (streq (argv [argn], "-w") && argn + 1 < argc - 2)
+            save = argv [++argn];
+        else
+            break;
+    }
+    if (argn != argc - 2 || speed <= 0) {
+        s_replay_usage ();
+        return 1;
+    }
+    const char *endpoint = argv [argc - 1];
+    capture_t *capture = s_capture_open (argv [argc - 2]);
+    if (!capture)
+        return 1;
+
+    //  Count messages to replay, so the result arrays need no resizing
+    replay_t replay = { NULL };
+    capture_record_t record;
+    zmsg_t *msg;
+    while ((msg = s_capture_read (capture, &record))) {
+        if (record.direction == CAPTURE_IN && record.socket == socket)
+            replay.max++;
+        zmsg_destroy (&msg);
+    }
+    s_capture_destroy (&capture);
+    capture = s_capture_open (argv [argc - 2]);
+    printf ("I: replaying %zu messages received by %s at %s\n", replay.max, capture->header.name,
+            max_speed? "maximum speed": "recorded pace");
+    replay.sent = (int64_t *) zmalloc ((replay.max + 1) * sizeof (int64_t));
+    replay.latencies = (int64_t *) zmalloc ((replay.max + 1) * sizeof (int64_t));
+
+    if (*endpoint == '@') {
+        //  Wait for the broker to connect and tell us its identity
+        replay.socket = zsock_new_router (endpoint);
+        replay.router = 1;
+        int64_t until = zclock_time () + REPLAY_CONNECT;
+        while (!replay.peer && !zsys_interrupted && zclock_time () < until)
+            s_replay_drain (&replay, 100);
+        if (!replay.peer) {
+            printf ("E: no broker connected to %s\n", endpoint + 1);
+            return 1;
+        }
+        replay.received = 0;
+    }
+    else
+        replay.socket = zsock_new_dealer (endpoint);
+    assert (replay.socket);
+
+    int64_t first = -1;
+    int64_t started = zclock_usecs ();
+    size_t sent = 0;
+    while (!zsys_interrupted && (msg = s_capture_read (capture, &record))) {
+        if (record.direction != CAPTURE_IN || record.socket != socket) {
+            zmsg_destroy (&msg);
+            continue;
+        }
+        if (first < 0)
+            first = record.time;
+        //  Keep to the recorded pace, receiving replies meanwhile
+        if (!max_speed) {
+            int64_t due = started + (int64_t) ((record.time - first) / speed);
+            if (due > zclock_usecs ())
+                s_replay_drain (&replay, (due - zclock_usecs ()) / 1000);
+        }
+        if (replay.peer) {
+            zframe_t *peer = zframe_dup (replay.peer);
+            zmsg_prepend (msg, &peer);
+        }
+        else {
+            zframe_t *identity = zmsg_pop (msg);
+            zframe_destroy (&identity);
+        }
+        replay.sent [replay.sent_tail++] = zclock_usecs ();
+        zmsg_send (&msg, replay.socket);
+        sent++;
+        s_replay_drain (&replay, 0);
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    //  Wait for outstanding replies
+    while (!replay.router && !zsys_interrupted && replay.sent_head < replay.sent_tail) {
+        size_t replies = replay.replies;
+        s_replay_drain (&replay, REPLAY_LINGER);
+        if (replay.replies == replies)
+            break;
+    }
+
+    replay_result_t result = { 0 };
+    result.throughput = elapsed > 0? sent * 1e6 / elapsed: 0;
+    qsort (replay.latencies, replay.replies, sizeof (int64_t), s_compare_latency);
+    if (replay.replies) {
+        result.p50 = replay.latencies [replay.replies / 2] / 1e3;
+        result.p99 = replay.latencies [replay.replies * 99 / 100] / 1e3;
+    }
+    printf ("I: sent %zu messages in %.2f secs, %.1f msgs/sec\n", sent, elapsed / 1e6, result.throughput);
+    if (replay.router)
+        printf ("I: %zu messages received from broker\n", replay.received);
+    else
+        printf ("I: %zu replies, latency p50 %.3f p99 %.3f msecs\n", replay.replies, result.p50, result.p99);
+
+    int rc = 0;
+    replay_result_t reference;
+    if (baseline && s_baseline_load (baseline, &reference) == 0) {
+        printf ("I: against baseline: throughput %+.1f%%, p50 %+.1f%%, p99 %+.1f%%\n",
+                reference.throughput > 0? (result.throughput / reference.throughput - 1) * 100: 0,
+                reference.p50 > 0? (result.p50 / reference.p50 - 1) * 100: 0,
+                reference.p99 > 0? (result.p99 / reference.p99 - 1) * 100: 0);
+        if (result.throughput < reference.throughput * (1 - REPLAY_TOLERANCE)
+        ||  result.p99 > reference.p99 * (1 + REPLAY_TOLERANCE)) {
+            printf ("E: performance regression against %s\n", baseline);
+            rc = 1;
+        }
+    }
+    else
+    if (baseline)
+        printf ("W: cannot read baseline %s\n", baseline);
+    if (save && s_baseline_save (save, &result) == -1)
+        printf ("E: cannot write baseline %s\n", save);
+
+    zframe_destroy (&replay.peer);
+    zsock_destroy (&replay.socket);
+    s_capture_destroy (&capture);
+    free (replay.sent);
+    free (replay.latencies);
+    return rc;
+}
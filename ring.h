@@ -0,0 +1,217 @@
+#ifndef PNP_RING_BUFFER
+#define PNP_RING_BUFFER "Pick-n-Pack Shared-Memory Ring"
+
+//  A ring is a single-producer, single-consumer buffer in POSIX shared
+//  memory, which carries high-rate samples from a device to the module on
+//  the same controller without a trip through the loopback TCP stack. The
+//  device writes samples into the ring; the module reads them in place.
+//
+//  Notifications go over the existing device to module socket, and only
+//  when the module is idle: once the module has drained the ring it sets the
+//  waiting flag and polls its sockets. The next write clears the flag and
+//  the device sends one RING message; writes while the module is draining
+//  need no notification at all.
+//
+//  Record: SIZE (uint32) and data, padded to RING_ALIGN bytes. A SIZE of
+//  RING_PAD skips to the start of the ring.
+
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+
+#define RING_MAGIC      0x474e5250          //  "PRNG"
+#define RING_SIZE       (4 * 1024 * 1024)   //  Data bytes, a power of two
+#define RING_ALIGN      8
+#define RING_PAD        0xffffffff
+#define RING_RECORD(size) (((sizeof (uint32_t) + (size)) + RING_ALIGN - 1) & ~(size_t) (RING_ALIGN - 1))
+
+//  Producer and consumer indices are on cache lines of their own, so the
+//  device and the module do not keep stealing each other's line
+typedef struct {
+    uint32_t magic;
+    uint32_t size;                              //  Data bytes
+    _Alignas (64) atomic_uint_fast64_t head;    //  Bytes written, by the producer
+    _Alignas (64) atomic_uint_fast64_t tail;    //  Bytes read, by the consumer
+    _Alignas (64) atomic_int waiting;           //  Consumer is idle and wants a notification
+    _Alignas (64) byte data [];
+} ring_shared_t;
+
+typedef struct {
+    char *name;                 //  Shared memory object name
+    ring_shared_t *shared;
+    size_t mapped;              //  Bytes mapped
+    size_t record;              //  Bytes of the record being read
+    int owner;                  //  We created the ring and unlink it
+} ring_t;
+
+static ring_t *
+s_ring_map (const char *name, int flags, size_t size)
+{
+    int fd = shm_open (name, flags, 0600);
+    if (fd == -1)
+        return NULL;
+    size_t mapped = sizeof (ring_shared_t) + size;
+    if ((flags & O_CREAT) && ftruncate (fd, mapped) == -1) {
+        close (fd);
+        return NULL;
+    }
+    if (!(flags & O_CREAT)) {
+        struct stat stat;
+        if (fstat (fd, &stat) == -1 || (size_t) stat.st_size < sizeof (ring_shared_t)) {
+            close (fd);
+            return NULL;
+        }
+        mapped = stat.st_size;
+    }
+    void *shared = mmap (NULL, mapped, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (shared == MAP_FAILED)
+        return NULL;
+    ring_t *self = (ring_t *) zmalloc (sizeof (ring_t));
+    self->name = strdup (name);
+    self->shared = (ring_shared_t *) shared;
+    self->mapped = mapped;
+    return self;
+}
+
+//  Create a new ring called <name> with RING_SIZE data bytes, as producer.
+//  Returns NULL if shared memory is not available.
+static ring_t *
+s_ring_new (const char *name)
+{
+    shm_unlink (name);          //  Left over by a crashed device
+    ring_t *self = s_ring_map (name, O_CREAT | O_EXCL | O_RDWR, RING_SIZE);
+    if (!self) {
+        printf ("E: cannot create ring %s: %s\n", name, strerror (errno));
+        return NULL;
+    }
+    self->owner = 1;
+    self->shared->size = RING_SIZE;
+    atomic_init (&self->shared->head, 0);
+    atomic_init (&self->shared->tail, 0);
+    atomic_init (&self->shared->waiting, 1);
+    self->shared->magic = RING_MAGIC;
+    return self;
+}
+
+//  Attach to the ring called <name> created by a producer, as consumer.
+//  Returns NULL if there is no such ring.
+static ring_t *
+s_ring_attach (const char *name)
+{
+    ring_t *self = s_ring_map (name, O_RDWR, 0);
+    if (self && (self->shared->magic != RING_MAGIC
+             ||  sizeof (ring_shared_t) + self->shared->size > self->mapped)) {
+        munmap (self->shared, self->mapped);
+        free (self->name);
+        free (self);
+        self = NULL;
+    }
+    if (!self)
+        printf ("E: cannot attach to ring %s\n", name);
+    return self;
+}
+
+static void
+s_ring_destroy (ring_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        ring_t *self = *self_p;
+        munmap (self->shared, self->mapped);
+        if (self->owner)
+            shm_unlink (self->name);
+        free (self->name);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Destructor for zhash_freefn
+static void
+s_ring_free (void *data)
+{
+    ring_t *self = (ring_t *) data;
+    s_ring_destroy (&self);
+}
+
+//  The write method appends a sample of <size> bytes. Returns 1 if the
+//  consumer is idle and must be notified, 0 if not, or -1 if the ring is full
+//  or the sample too large, in which case the caller sends it on the socket.
+static int
+s_ring_write (ring_t *self, const void *data, size_t size)
+{
+    ring_shared_t *shared = self->shared;
+    size_t record = RING_RECORD (size);
+    if (record > shared->size / 2)
+        return -1;
+    uint64_t head = atomic_load_explicit (&shared->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit (&shared->tail, memory_order_acquire);
+    size_t offset = head & (shared->size - 1);
+    size_t pad = offset + record > shared->size? shared->size - offset: 0;
+    if (head + pad + record - tail > shared->size)
+        return -1;
+    if (pad) {
+        *(uint32_t *) (shared->data + offset) = RING_PAD;
+        head += pad;
+        offset = 0;
+    }
+    uint32_t length = (uint32_t) size;
+    memcpy (shared->data + offset, &length, sizeof (length));
+    memcpy (shared->data + offset + sizeof (length), data, size);
+    //  Sequentially consistent, so we cannot miss a consumer going idle
+    atomic_store (&shared->head, head + record);
+    return atomic_load (&shared->waiting) && atomic_exchange (&shared->waiting, 0);
+}
+
+//  The read method returns the size of the oldest sample and points <data_p>
+//  at it, or returns -1 if the ring is empty. The sample stays valid until
+//  s_ring_advance.
+static int64_t
+s_ring_read (ring_t *self, byte **data_p)
+{
+    ring_shared_t *shared = self->shared;
+    uint64_t tail = atomic_load_explicit (&shared->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit (&shared->head, memory_order_acquire);
+    while (tail != head) {
+        size_t offset = tail & (shared->size - 1);
+        uint32_t length;
+        memcpy (&length, shared->data + offset, sizeof (length));
+        if (length == RING_PAD) {
+            tail += shared->size - offset;
+            atomic_store_explicit (&shared->tail, tail, memory_order_release);
+            continue;
+        }
+        *data_p = shared->data + offset + sizeof (length);
+        self->record = RING_RECORD (length);
+        return length;
+    }
+    return -1;
+}
+
+//  The advance method releases the sample returned by s_ring_read
+static void
+s_ring_advance (ring_t *self)
+{
+    ring_shared_t *shared = self->shared;
+    uint64_t tail = atomic_load_explicit (&shared->tail, memory_order_relaxed);
+    atomic_store_explicit (&shared->tail, tail + self->record, memory_order_release);
+    self->record = 0;
+}
+
+//  The idle method asks for a notification with the next write. Returns 0, or
+//  -1 if a sample arrived meanwhile and the consumer should keep reading.
+static int
+s_ring_idle (ring_t *self)
+{
+    ring_shared_t *shared = self->shared;
+    atomic_store (&shared->waiting, 1);
+    if (atomic_load (&shared->head) != atomic_load_explicit (&shared->tail, memory_order_relaxed)) {
+        atomic_store (&shared->waiting, 0);
+        return -1;
+    }
+    return 0;
+}
+
+#endif
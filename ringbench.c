@@ -0,0 +1,152 @@
+//  Pick-n-Pack ring benchmark
+//
+//  Measures how fast a device passes samples to a module on the same host:
+//  over tcp, over ipc, and through a shared-memory ring (ring.h) with
+//  notifications over tcp, as device.c and module.c do with PNP_SHM_RING.
+//  The producer runs in a thread of its own and the consumer reads every
+//  sample, so each transport pays for copying the data once.
+//
+//  Usage: ringbench [-n samples] [size ...]
+//  Sizes default to 64 and 65536 bytes; large samples are capped at
+//  BENCH_BYTES per run.
+
+#include "czmq.h"
+#include <sched.h>
+#include "ring.h"
+
+#define BENCH_SAMPLES   200000
+#define BENCH_BYTES     (1024 * 1024 * 1024)
+#define BENCH_TCP       "tcp://127.0.0.1:9099"
+#define BENCH_IPC       "ipc:///tmp/pnp-ringbench.ipc"
+#define BENCH_RING      "/pnp-ringbench"
+
+typedef struct {
+    const char *endpoint;       //  Socket to the consumer
+    ring_t *ring;               //  Ring to write to, NULL to send samples on the socket
+    size_t size;
+    size_t count;
+} bench_t;
+
+//  The producer thread plays the device
+static void
+s_producer (zsock_t *pipe, void *args)
+{
+    bench_t *self = (bench_t *) args;
+    zsock_t *socket = zsock_new_dealer (self->endpoint);
+    assert (socket);
+    zsock_signal (pipe, 0);
+    byte *sample = (byte *) zmalloc (self->size);
+    size_t sample_nbr = 0;
+    while (sample_nbr < self->count && !zsys_interrupted) {
+        sample [0] = (byte) sample_nbr;
+        if (self->ring) {
+            int rc = s_ring_write (self->ring, sample, self->size);
+            if (rc == -1) {
+                sched_yield ();     //  Full, let the consumer catch up
+                continue;
+            }
+            if (rc == 1)
+                zstr_send (socket, "RING");
+        }
+        else
+            zmq_send (zsock_resolve (socket), sample, self->size, 0);
+        sample_nbr++;
+    }
+    free (sample);
+    char *command = zstr_recv (pipe);
+    free (command);
+    zsock_destroy (&socket);
+}
+
+//  The run method plays the module and returns samples per second
+static double
+s_bench_run (const char *endpoint, int use_ring, size_t size, size_t count)
+{
+    if (use_ring && RING_RECORD (size) > RING_SIZE / 2)
+        return 0;               //  Too large for the ring, the device sends it on the socket
+    zsock_t *socket = zsock_new_router (endpoint);
+    assert (socket);
+    bench_t bench = { endpoint, NULL, size, count };
+    ring_t *ring = NULL;
+    if (use_ring) {
+        bench.ring = s_ring_new (BENCH_RING);
+        ring = bench.ring? s_ring_attach (BENCH_RING): NULL;
+        if (!ring) {
+            s_ring_destroy (&bench.ring);
+            zsock_destroy (&socket);
+            return 0;
+        }
+    }
+    int64_t started = zclock_usecs ();
+    zactor_t *producer = zactor_new (s_producer, &bench);
+    size_t received = 0;
+    size_t check = 0;
+    while (received < count && !zsys_interrupted) {
+        zmsg_t *msg = zmsg_recv (socket);
+        if (!msg)
+            break;
+        if (ring) {
+            do {
+                byte *data;
+                while (s_ring_read (ring, &data) >= 0) {
+                    check += data [0];
+                    s_ring_advance (ring);
+                    received++;
+                }
+            } while (s_ring_idle (ring) == -1);
+        }
+        else {
+            check += zframe_data (zmsg_last (msg)) [0];
+            received++;
+        }
+        zmsg_destroy (&msg);
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    zactor_destroy (&producer);
+    s_ring_destroy (&ring);
+    s_ring_destroy (&bench.ring);
+    zsock_destroy (&socket);
+    if (check == (size_t) -1)
+        printf (" ");           //  Keeps the reads from being optimised away
+    return elapsed > 0? received * 1e6 / elapsed: 0;
+}
+
+int main (int argc, char *argv [])
+{
+    size_t samples = BENCH_SAMPLES;
+    size_t sizes [16] = { 0 };
+    size_t size_count = 0;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            samples = atol (argv [++argn]);
+        else
+        if (atol (argv [argn]) > 0 && size_count < 16)
+            sizes [size_count++] = atol (argv [argn]);
+        else {
+            printf ("usage: ringbench [-n samples] [size ...]\n");
+            return 1;
+        }
+    }
+    if (!size_count) {
+        sizes [size_count++] = 64;
+        sizes [size_count++] = 65536;
+    }
+    printf ("%-10s %10s %10s %14s %10s\n", "transport", "size", "samples", "samples/sec", "MB/sec");
+    size_t size_nbr;
+    for (size_nbr = 0; size_nbr < size_count && !zsys_interrupted; size_nbr++) {
+        size_t size = sizes [size_nbr];
+        size_t count = samples;
+        if (count * size > BENCH_BYTES)
+            count = BENCH_BYTES / size;
+        const char *names [] = { "tcp", "ipc", "ring" };
+        const char *endpoints [] = { BENCH_TCP, BENCH_IPC, BENCH_TCP };
+        int transport;
+        for (transport = 0; transport < 3; transport++) {
+            double rate = s_bench_run (endpoints [transport], transport == 2, size, count);
+            printf ("%-10s %10zu %10zu %14.0f %10.1f\n", names [transport], size, count,
+                    rate, rate * size / (1024 * 1024));
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,190 @@
+#ifndef PNP_RTT
+#define PNP_RTT "Pick-n-Pack Round-Trip Times"
+
+//  Heartbeats carry timestamps so every broker can measure the round-trip
+//  time to each of its backend resources and estimate their clock offset,
+//  the same way NTP does. A parent stamps each heartbeat with its send time
+//  T1. The child remembers T1 and its arrival time T2, and echoes both with
+//  its own send time T3 on its next heartbeat. The parent receives that at
+//  T4, so:
+//
+//      rtt    = (T4 - T1) - (T3 - T2)
+//      offset = ((T2 - T1) + (T3 - T4)) / 2    child clock minus ours
+//
+//  The time the child holds the echo until its next heartbeat drops out of
+//  both. Round-trip times go into a log2 histogram that decays, so the
+//  percentiles follow a link that is degrading.
+//
+//  Clock frame: TAG, T1 from parent; TAG, T1, T2, T3 from child. Times are
+//  int64 usecs of the wall clock: the monotonic clock counts from boot, so
+//  offsets taken from it would only tell how far apart the hosts booted.
+
+#include <inttypes.h>
+#include <time.h>
+#include "protocol.h"
+
+#define RTT_BUCKETS 32      //  Bucket n holds round-trip times of [2^n, 2^(n+1)) usecs
+#define RTT_WINDOW  64      //  Samples after which the histogram decays by half
+
+typedef struct {
+    uint32_t buckets [RTT_BUCKETS];
+    uint32_t count;             //  Samples in histogram
+    int64_t last;               //  Last round-trip time, usecs
+    int64_t offset;             //  Smoothed clock offset, usecs
+    int samples;                //  Samples taken so far
+    uint32_t window;            //  Samples after which it decays by half, 0 for RTT_WINDOW
+} rtt_t;
+
+//  Timestamps a child echoes back to its parent
+typedef struct {
+    int64_t sent;               //  T1, parent send time
+    int64_t received;           //  T2, our arrival time
+} rtt_echo_t;
+
+static rtt_t *
+s_rtt_new (void)
+{
+    return (rtt_t *) zmalloc (sizeof (rtt_t));
+}
+
+static void
+s_rtt_destroy (rtt_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+static byte
+s_rtt_bucket (int64_t usecs)
+{
+    byte bucket = 0;
+    while (usecs > 1 && bucket < RTT_BUCKETS - 1) {
+        usecs >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+//  The percentile method returns the histogram bucket holding the <percent>
+//  percentile, e.g. 12 means 4 to 8 msecs
+static byte
+s_rtt_percentile (rtt_t *self, int percent)
+{
+    uint32_t wanted = (self->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    byte bucket;
+    for (bucket = 0; bucket < RTT_BUCKETS; bucket++) {
+        seen += self->buckets [bucket];
+        if (seen >= wanted && seen > 0)
+            return bucket;
+    }
+    return 0;
+}
+
+//  The percentile usecs method returns the <percent> percentile in usecs,
+//  interpolated within its bucket, or 0 if there are no samples
+static int64_t
+s_rtt_percentile_usecs (rtt_t *self, int percent)
+{
+    uint32_t wanted = (self->count * percent + 99) / 100;
+    uint32_t seen = 0;
+    int bucket;
+    for (bucket = 0; bucket < RTT_BUCKETS && self->count; bucket++) {
+        if (self->buckets [bucket] && seen + self->buckets [bucket] >= wanted) {
+            int64_t low = (int64_t) 1 << bucket;
+            return low + low * (wanted - seen) / self->buckets [bucket];
+        }
+        seen += self->buckets [bucket];
+    }
+    return 0;
+}
+
+//  The clock method returns the wall clock time in usecs, for timestamps
+//  compared across hosts. Local intervals use zclock_usecs
+static int64_t
+s_rtt_clock (void)
+{
+    struct timespec now;
+    clock_gettime (CLOCK_REALTIME, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+//  The offset byte is the log2 bucket of the clock offset, with the sign in
+//  the high bit
+static byte
+s_rtt_offset_byte (rtt_t *self)
+{
+    if (self->offset < 0)
+        return 0x80 | s_rtt_bucket (-self->offset);
+    return s_rtt_bucket (self->offset);
+}
+
+//  The clock frame method returns a frame with our send time for a
+//  heartbeat to a child, or the echo to our parent if <echo> is given
+static zframe_t *
+s_rtt_clock_frame (rtt_echo_t *echo)
+{
+    int64_t times [3];
+    size_t count = 0;
+    if (echo && echo->sent) {
+        times [count++] = echo->sent;
+        times [count++] = echo->received;
+    }
+    times [count++] = s_rtt_clock ();
+    zframe_t *frame = zframe_new (NULL, 1 + count * sizeof (int64_t));
+    zframe_data (frame) [0] = PNP_CLOCK [0];
+    memcpy (zframe_data (frame) + 1, times, count * sizeof (int64_t));
+    return frame;
+}
+
+//  The stamp method records the parent timestamp of a received clock frame
+static void
+s_rtt_stamp (rtt_echo_t *echo, zframe_t *frame)
+{
+    if (zframe_size (frame) == 1 + sizeof (int64_t)) {
+        memcpy (&echo->sent, zframe_data (frame) + 1, sizeof (int64_t));
+        echo->received = s_rtt_clock ();
+    }
+}
+
+//  The add method adds a round-trip time of <rtt> usecs to the histogram,
+//  e.g. one measured from a request to its reply
+static void
+s_rtt_add (rtt_t *self, int64_t rtt)
+{
+    if (rtt < 0)
+        rtt = 0;
+    self->last = rtt;
+    self->samples++;
+    self->buckets [s_rtt_bucket (rtt)]++;
+    if (++self->count >= (self->window? self->window: RTT_WINDOW)) {
+        int bucket;
+        self->count = 0;
+        for (bucket = 0; bucket < RTT_BUCKETS; bucket++) {
+            self->buckets [bucket] /= 2;
+            self->count += self->buckets [bucket];
+        }
+    }
+}
+
+//  The sample method takes an echo clock frame from a child and adds its
+//  round-trip time to the histogram. Returns -1 if the frame holds no echo.
+static int
+s_rtt_sample (rtt_t *self, zframe_t *frame)
+{
+    if (zframe_size (frame) != 1 + 3 * sizeof (int64_t))
+        return -1;
+    int64_t received = s_rtt_clock ();
+    int64_t times [3];
+    memcpy (times, zframe_data (frame) + 1, sizeof (times));
+    int64_t rtt = (received - times [0]) - (times [2] - times [1]);
+    int64_t offset = ((times [1] - times [0]) + (times [2] - received)) / 2;
+    self->offset = self->samples? self->offset + (offset - self->offset) / 8: offset;
+    s_rtt_add (self, rtt);
+    return 0;
+}
+
+#endif
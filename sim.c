@@ -0,0 +1,978 @@
+//  Pick-n-Pack discrete-event simulator
+//
+//  Runs the line registry of the Plant (lines.h), the backend resource
+//  registry of defs.h and the transition table of the state machine against
+//  virtual time and simulated sockets, so heartbeating and routing can be
+//  studied at plant scale without starting a process per resource. Messages
+//  between client, Plant, lines and devices are events with a configurable
+//  latency, jitter and loss. Runs are deterministic for a given seed.
+//
+//  Lines, devices and the Plant detect failures with the accrual detector of
+//  accrual.h at threshold -a, TYPE_THRESHOLD by default, or with a fixed
+//  liveness if -a is negative, and devices back off their heartbeats if -b
+//  is 1. With -f, that many devices crash at random times during the run and
+//  restart SIM_DOWNTIME later; the simulator reports how long their lines took
+//  to purge them. Every other simulated resource stays alive for the whole run,
+//  so any other expiry and failover it reports is a false one.
+//
+//  With -c the Plant reconfigures the plant every so many seconds, changing
+//  -k random parameters. Each line and device has SIM_PARAMETERS of its own,
+//  and a line holds those of its devices too. With deltas (-D 1) the Plant
+//  sends a line only the parameters that changed for it, through config.h,
+//  and only lines and devices whose parameters changed go through the
+//  CONFIGURING transition; without (-D 0) every line gets its full
+//  configuration and every line and device reconfigures. A line serves no
+//  requests while it reconfigures.
+//
+//  With -R each device sends that many samples per second, which its line
+//  forwards to the Plant. Any message refreshes the expiry of its sender, and
+//  with suppression (-H 1) devices and lines leave out heartbeats on links
+//  that carry samples; the simulator reports the share of heartbeats in the
+//  messages sent.
+//
+//  With -P the primary Plant of a Binary Star pair (bstar.h) crashes that many
+//  seconds into the run. Its backup has the replicated line registry and
+//  pending requests, and takes over once the primary has been silent for
+//  BSTAR_PEER_EXPIRY and a line or client turns up, as plant.c does. Lines
+//  fail over when their detector expires the primary, clients after a
+//  request timeout. The simulator reports how long the takeover took, when
+//  each line was back and when the first reply came from the backup.
+//
+//  Usage: sim [-l lines] [-d devices] [-t seconds] [-r requests/sec]
+//             [-L latency msec] [-J jitter msec] [-p loss] [-S service msec]
+//             [-c reconfigure secs] [-k parameters] [-D deltas]
+//             [-a threshold] [-b backoff] [-f failures] [-s seed]
+//             [-R samples/sec] [-H suppression] [-P plant crash secs]
+
+#include "czmq.h"
+#include <math.h>
+
+//  Virtual time in usecs. All code included below reads the virtual clock
+//  instead of the system clock.
+static int64_t sim_now;
+#define zclock_time() (sim_now / 1000)
+#define zclock_usecs() (sim_now)
+
+#include "defs.h"
+//  The Plant detects lines at the threshold of the line type, so -a applies to it too
+#define HEARTBEAT_THRESHOLD (s_type (PNP_LINE_ID [0])->threshold)
+#include "lines.h"
+#include "bstar.h"
+
+#define REQUEST_TIMEOUT     2500    //  msecs, as in client.c
+#define REQUEST_RETRIES     3       //  Before the client abandons a request
+#define TRANSITION_TIME     100     //  msecs a resource spends in each transition
+#define SIM_PARAMETERS      8       //  Configuration parameters of each line and device
+#define SIM_DOWNTIME        60      //  secs a crashed device takes to restart
+
+//  The simulator drives the transition table itself, the state functions of
+//  a resource process are not used
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+typedef struct {
+    int lines;                  //  Number of lines
+    int devices;                //  Number of devices, spread over the lines
+    int64_t duration;           //  usecs of plant operation to simulate
+    double rate;                //  Client requests per second
+    int64_t latency;            //  One-way latency of a message, usecs
+    int64_t jitter;             //  Mean of exponential extra latency, usecs
+    double loss;                //  Probability a message is lost
+    int64_t service;            //  Mean time a line takes for a request, usecs
+    int64_t reconfigure;        //  Interval of reconfigurations, usecs, 0 if none
+    int parameters;             //  Parameters changed by a reconfiguration
+    int deltas;                 //  Send only changed parameters
+    double threshold;           //  Suspicion at which resources expire, < 0 for a fixed liveness
+    int backoff;                //  Devices back off their heartbeats
+    int failures;               //  Devices that crash during the run
+    uint64_t seed;
+    double samples;             //  Samples per second of each device, 0 if none
+    int suppress;               //  Heartbeats are left out on busy links
+    int64_t crash;              //  Time the primary Plant crashes, usecs, 0 if it does not
+} sim_config_t;
+
+//  Events
+enum {
+    EV_REQUEST,                 //  Client issues a new request
+    EV_CLIENT_TIMEOUT,          //  Client gives up waiting for a reply
+    EV_PLANT_TICK,              //  Plant heartbeat interval
+    EV_PLANT_RECV,              //  Message arrives at the Plant
+    EV_LINE_START,              //  Line process starts
+    EV_LINE_TICK,               //  Line heartbeat interval
+    EV_LINE_RECV,               //  Message arrives at a line
+    EV_LINE_DONE,               //  Line finished a request
+    EV_DEVICE_TICK,             //  Device heartbeat interval
+    EV_DEVICE_RECV,             //  Message arrives at a device
+    EV_DEVICE_CRASH,            //  Device crashes
+    EV_DEVICE_SAMPLE,           //  Device sends a sample
+    EV_RECONFIGURE,             //  Plant changes the configuration
+    EV_PLANT_CRASH              //  Primary Plant crashes
+};
+
+//  Messages
+enum {
+    MSG_READY,
+    MSG_HEARTBEAT,
+    MSG_REQUEST,
+    MSG_REPLY,
+    MSG_DEVICE_HEARTBEAT,
+    MSG_CONFIGURE,              //  PAYLOAD and VERSION frames, the request is the message
+    MSG_CONFIG_STALE,           //  Line needs its full configuration
+    MSG_SAMPLE                  //  Sample of a device, forwarded by its line
+};
+
+typedef struct {
+    int64_t time;
+    uint64_t order;             //  Tie breaker, keeps runs deterministic
+    int type;
+    int line;
+    int device;
+    int msg;
+    size_t request;
+} event_t;
+
+typedef struct {
+    int64_t issued;             //  Time the client first sent the request
+    int plant;                  //  Plant the client sends to, 1 is the backup
+    int attempts;
+    int done;
+} sim_request_t;
+
+//  First-in first-out queue of request numbers
+typedef struct {
+    size_t *items;
+    size_t head;
+    size_t tail;
+    size_t max;
+} sim_queue_t;
+
+typedef struct {
+    int up;                     //  Finished starting up
+    accrual_t upstream;         //  Heartbeats of the Plant
+    zlist_t *devices;           //  Backend resource registry of the line
+    status_t *status;
+    sim_queue_t queue;          //  Requests waiting for the line
+    int busy;
+    config_t *config;           //  Configuration of the line and its devices
+    config_t *view;             //  Configuration the Plant has for the line
+    payload_t *changes;         //  Parameters the Plant changes for the line
+    int64_t configuring;        //  Reconfiguring until this time, usecs
+    suppress_t suppress;        //  Messages and heartbeats to the Plant
+    int plant;                  //  Plant the line is connected to, 1 is the backup
+    int64_t back;               //  Time the backup first heard from the line, usecs
+} sim_line_t;
+
+typedef struct {
+    accrual_t upstream;         //  Heartbeats of the line
+    backoff_t backoff;
+    int64_t crashed;            //  Time of the last crash, usecs
+    int64_t restart;            //  Down until this time, usecs
+    int down;                   //  Crashed and not restarted yet, 2 once purged
+    int listed;                 //  In the registry of its line, 2 while checking
+    suppress_t suppress;        //  Samples and heartbeats to the line
+} sim_device_t;
+
+typedef struct {
+    size_t events;
+    size_t sent;
+    size_t lost;
+    size_t requests;
+    size_t completed;
+    size_t retries;
+    size_t abandoned;
+    size_t line_expiries;       //  Lines purged by the Plant
+    size_t device_expiries;     //  Live devices purged by their line
+    size_t line_failovers;      //  Lines that gave up on the Plant
+    int64_t *latencies;         //  Request latencies, usecs
+    int64_t startup;            //  Time the last line was up
+    size_t reconfigurations;
+    size_t line_configurings;   //  Lines that went through CONFIGURING
+    size_t line_skips;          //  Lines that skipped it, their configuration was unchanged
+    size_t device_configurings;
+    size_t stale;               //  Lines that needed their full configuration
+    size_t config_bytes;        //  Bytes of configuration sent to lines
+    int64_t line_downtime;      //  usecs lines spent reconfiguring
+    size_t heartbeats;          //  Heartbeats sent by devices
+    size_t line_heartbeats;     //  Heartbeats sent by lines to the Plant
+    size_t down_heartbeats;     //  Heartbeats sent by the Plant and lines to their backend
+    size_t suppressed;          //  Heartbeats left out
+    size_t samples;             //  Samples sent by devices
+    size_t crashes;
+    size_t detected;            //  Crashed devices purged before they restarted
+    int64_t *detections;        //  Times from crash to purge, usecs
+    int64_t takeover;           //  Time the backup Plant took over, usecs
+    int64_t first_reply;        //  Time the backup sent its first reply, usecs
+    size_t lines_back;          //  Lines the backup heard from
+    int64_t *failovers;         //  Times from Plant crash until each line was back, usecs
+} sim_stats_t;
+
+static sim_config_t config = {
+    50, 5000, 3600 * 1000000LL, 20.0, 500, 200, 0.001, 50000, 0, 10, 1,
+    TYPE_THRESHOLD, PNP_HEARTBEAT_BACKOFF, 0, 1, 0, PNP_HEARTBEAT_SUPPRESSION, 0
+};
+static sim_stats_t stats;
+
+static event_t *heap;
+static size_t heap_size;
+static size_t heap_max;
+static uint64_t heap_order;
+
+//  xorshift64* generator, so a seed gives the same run on every platform
+static uint64_t
+s_sim_random (void)
+{
+    config.seed ^= config.seed >> 12;
+    config.seed ^= config.seed << 25;
+    config.seed ^= config.seed >> 27;
+    return config.seed * 2685821657736338717ULL;
+}
+
+static double
+s_sim_uniform (void)
+{
+    return (s_sim_random () >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static int64_t
+s_sim_exponential (double mean)
+{
+    return mean > 0? (int64_t) (-log (1.0 - s_sim_uniform ()) * mean): 0;
+}
+
+static int
+s_event_before (event_t *a, event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->order < b->order);
+}
+
+//  The schedule method puts an event on the heap
+static void
+s_sim_schedule (int64_t time, int type, int line, int device, int msg, size_t request)
+{
+    if (heap_size == heap_max) {
+        heap_max = heap_max? heap_max * 2: 1024;
+        heap = (event_t *) realloc (heap, heap_max * sizeof (event_t));
+        assert (heap);
+    }
+    event_t event = { time, heap_order++, type, line, device, msg, request };
+    size_t child = heap_size++;
+    while (child > 0) {
+        size_t parent = (child - 1) / 2;
+        if (!s_event_before (&event, &heap [parent]))
+            break;
+        heap [child] = heap [parent];
+        child = parent;
+    }
+    heap [child] = event;
+}
+
+//  The next method takes the earliest event off the heap
+static event_t
+s_sim_next (void)
+{
+    event_t event = heap [0];
+    event_t last = heap [--heap_size];
+    size_t parent = 0;
+    while (1) {
+        size_t child = parent * 2 + 1;
+        if (child >= heap_size)
+            break;
+        if (child + 1 < heap_size && s_event_before (&heap [child + 1], &heap [child]))
+            child++;
+        if (!s_event_before (&heap [child], &last))
+            break;
+        heap [parent] = heap [child];
+        parent = child;
+    }
+    if (heap_size)
+        heap [parent] = last;
+    return event;
+}
+
+//  The send method delivers a message as event <type> after the network
+//  latency, unless the network loses it. Returns 0, or -1 if lost.
+static int
+s_sim_send (int type, int line, int device, int msg, size_t request)
+{
+    stats.sent++;
+    if (s_sim_uniform () < config.loss) {
+        stats.lost++;
+        return -1;
+    }
+    s_sim_schedule (sim_now + config.latency + s_sim_exponential (config.jitter),
+                    type, line, device, msg, request);
+    return 0;
+}
+
+//  The transitions method returns the usecs a resource in <state> takes to get
+//  through the transitions that <signal> leads to
+static int64_t
+s_sim_transitions (state state, signl signal)
+{
+    transition_stack stack;
+    transition_stack_init (&stack);
+    generate_stack (&stack, state, signal);
+    int64_t time = 0;
+    transition *next = transition_stack_top (&stack);
+    while (next) {
+        transition_stack_pop (&stack);
+        time += TRANSITION_TIME * 1000;
+        s_payload_destroy (&next->payload);
+        free (next);
+        next = transition_stack_top (&stack);
+    }
+    return time;
+}
+
+//  The configure method sends the Plant's configuration of <line_nbr>, in full
+//  or the delta of its last change
+static void
+s_sim_configure (sim_line_t *line, int line_nbr, int full)
+{
+    zmsg_t *msg = zmsg_new ();
+    s_config_append (line->view, msg, full);
+    stats.config_bytes += zmsg_content_size (msg);
+    if (s_sim_send (EV_LINE_RECV, line_nbr, 0, MSG_CONFIGURE, (size_t) msg) == -1)
+        zmsg_destroy (&msg);
+}
+
+//  The purged method finds the devices of <line_nbr> that its line purged, a crashed
+//  one is detected, any other a false expiry
+static void
+s_sim_purged (sim_line_t *line, int line_nbr, sim_device_t *devices)
+{
+    backend_resource_t *listed = (backend_resource_t *) zlist_first (line->devices);
+    while (listed) {
+        int device_nbr;
+        memcpy (&device_nbr, zframe_data (listed->identity), sizeof (device_nbr));
+        devices [device_nbr].listed = 2;
+        listed = (backend_resource_t *) zlist_next (line->devices);
+    }
+    int device_nbr;
+    for (device_nbr = line_nbr; device_nbr < config.devices; device_nbr += config.lines) {
+        sim_device_t *device = &devices [device_nbr];
+        if (device->listed == 1) {
+            if (!device->down)
+                stats.device_expiries++;
+            else
+            if (device->down == 1) {
+                stats.detections [stats.detected++] = sim_now - device->crashed;
+                device->down = 2;
+            }
+        }
+        device->listed = device->listed == 2;
+    }
+}
+
+static void
+s_queue_push (sim_queue_t *self, size_t item)
+{
+    if (self->tail == self->max) {
+        if (self->head) {
+            memmove (self->items, self->items + self->head, (self->tail - self->head) * sizeof (size_t));
+            self->tail -= self->head;
+            self->head = 0;
+        }
+        if (self->tail == self->max) {
+            self->max = self->max? self->max * 2: 64;
+            self->items = (size_t *) realloc (self->items, self->max * sizeof (size_t));
+            assert (self->items);
+        }
+    }
+    self->items [self->tail++] = item;
+}
+
+static int
+s_queue_pop (sim_queue_t *self, size_t *item)
+{
+    if (self->head == self->tail)
+        return -1;
+    *item = self->items [self->head++];
+    return 0;
+}
+
+static int
+s_compare_latency (const void *a, const void *b)
+{
+    int64_t left = *(const int64_t *) a;
+    int64_t right = *(const int64_t *) b;
+    return (left > right) - (left < right);
+}
+
+static void
+s_sim_usage (void)
+{
+    printf ("usage: sim [-l lines] [-d devices] [-t seconds] [-r requests/sec]\n"
+            "           [-L latency msec] [-J jitter msec] [-p loss] [-S service msec]\n"
+            "           [-c reconfigure secs] [-k parameters] [-D deltas]\n"
+            "           [-a threshold] [-b backoff] [-f failures] [-s seed]\n"
+            "           [-R samples/sec] [-H suppression] [-P plant crash secs]\n");
+}
+
+int main (int argc, char *argv [])
+{
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (argv [argn][0] != '-' || argv [argn][1] == 0 || argv [argn][2] != 0 || argn + 1 >= argc) {
+            s_sim_usage ();
+            return 1;
+        }
+        char *value = argv [++argn];
+        switch (argv [argn - 1][1]) {
+            case 'l': config.lines = atoi (value); break;
+            case 'd': config.devices = atoi (value); break;
+            case 't': config.duration = (int64_t) (atof (value) * 1000000); break;
+            case 'r': config.rate = atof (value); break;
+            case 'L': config.latency = (int64_t) (atof (value) * 1000); break;
+            case 'J': config.jitter = (int64_t) (atof (value) * 1000); break;
+            case 'p': config.loss = atof (value); break;
+            case 'S': config.service = (int64_t) (atof (value) * 1000); break;
+            case 'c': config.reconfigure = (int64_t) (atof (value) * 1000000); break;
+            case 'k': config.parameters = atoi (value); break;
+            case 'D': config.deltas = atoi (value); break;
+            case 'a': config.threshold = atof (value); break;
+            case 'b': config.backoff = atoi (value); break;
+            case 'f': config.failures = atoi (value); break;
+            case 's': config.seed = strtoull (value, NULL, 10); break;
+            case 'R': config.samples = atof (value); break;
+            case 'H': config.suppress = atoi (value); break;
+            case 'P': config.crash = (int64_t) (atof (value) * 1000000); break;
+            default: s_sim_usage (); return 1;
+        }
+    }
+    if (config.lines < 1 || config.devices < 0 || config.failures < 0 || config.seed == 0) {
+        s_sim_usage ();
+        return 1;
+    }
+    s_types_init ();
+    s_type (PNP_LINE_ID [0])->threshold = config.threshold;
+    s_type (PNP_QAS_ID [0])->threshold = config.threshold;
+    printf ("I: simulating %.0f secs of %d lines and %d devices, %.1f requests/sec, "
+            "latency %" PRId64 "+%" PRId64 " usecs, loss %.4f\n",
+            config.duration / 1e6, config.lines, config.devices, config.rate,
+            config.latency, config.jitter, config.loss);
+    clock_t started = clock ();
+
+    //  The Plant, with the same registries as plant.c
+    zlist_t *lines = zlist_new ();
+    status_t *tree = s_status_new ();
+    zhash_t *rtts = zhash_new ();
+    sim_queue_t backlog = { NULL, 0, 0, 0 };
+    size_t request_max = (size_t) (config.rate * config.duration / 1e6) + 1024;
+    sim_request_t *requests = (sim_request_t *) zmalloc (request_max * sizeof (sim_request_t));
+    stats.latencies = (int64_t *) zmalloc (request_max * sizeof (int64_t));
+    stats.detections = (int64_t *) zmalloc ((config.failures + 1) * sizeof (int64_t));
+    stats.failovers = (int64_t *) zmalloc (config.lines * sizeof (int64_t));
+    //  The primary Plant is up until it crashes; the backup sees its state at every heartbeat
+    int plant_down = 0;
+    int64_t peer_seen = 0;
+    int client_plant = 0;           //  Plant the client sends new requests to
+
+    sim_line_t *sim_lines = (sim_line_t *) zmalloc (config.lines * sizeof (sim_line_t));
+    int line_nbr;
+    for (line_nbr = 0; line_nbr < config.lines; line_nbr++) {
+        sim_lines [line_nbr].devices = zlist_new ();
+        sim_lines [line_nbr].status = s_status_new ();
+        sim_lines [line_nbr].config = s_config_new ();
+        sim_lines [line_nbr].view = s_config_new ();
+        sim_lines [line_nbr].changes = s_payload_new ();
+        s_sim_schedule ((int64_t) (s_sim_uniform () * HEARTBEAT_INTERVAL * 1000),
+                        EV_LINE_START, line_nbr, 0, 0, 0);
+    }
+    //  Initial configuration, which lines get as they start
+    char name [32];
+    int parameter;
+    for (line_nbr = 0; line_nbr < config.lines; line_nbr++)
+        for (parameter = 0; parameter < SIM_PARAMETERS; parameter++) {
+            snprintf (name, sizeof (name), "line.%d.%d", line_nbr, parameter);
+            s_payload_set_integer (sim_lines [line_nbr].changes, name, 0);
+        }
+    int device_nbr;
+    for (device_nbr = 0; device_nbr < config.devices; device_nbr++)
+        for (parameter = 0; parameter < SIM_PARAMETERS; parameter++) {
+            snprintf (name, sizeof (name), "device.%d.%d", device_nbr, parameter);
+            s_payload_set_integer (sim_lines [device_nbr % config.lines].changes, name, 0);
+        }
+    for (line_nbr = 0; line_nbr < config.lines; line_nbr++) {
+        s_config_commit (sim_lines [line_nbr].view, sim_lines [line_nbr].changes);
+        s_payload_reset (sim_lines [line_nbr].changes);
+    }
+    int64_t *devices_configuring = (int64_t *) zmalloc ((config.devices + 1) * sizeof (int64_t));
+    int64_t reconfiguring = s_sim_transitions (STATE_RUNNING, SIGNAL_CONFIGURE)
+                          + s_sim_transitions (STATE_CONFIGURING, SIGNAL_RUN);
+    sim_device_t *devices = (sim_device_t *) zmalloc ((config.devices + 1) * sizeof (sim_device_t));
+    for (device_nbr = 0; device_nbr < config.devices; device_nbr++) {
+        s_accrual_init (&devices [device_nbr].upstream, HEARTBEAT_INTERVAL, 0);
+        s_backoff_init (&devices [device_nbr].backoff, HEARTBEAT_INTERVAL);
+        s_sim_schedule ((int64_t) (s_sim_uniform () * HEARTBEAT_INTERVAL * 1000),
+                        EV_DEVICE_TICK, device_nbr % config.lines, device_nbr, 0, 0);
+        if (config.samples > 0)
+            s_sim_schedule (s_sim_exponential (1e6 / config.samples),
+                            EV_DEVICE_SAMPLE, device_nbr % config.lines, device_nbr, 0, 0);
+    }
+    int failure;
+    for (failure = 0; config.devices && failure < config.failures; failure++)
+        s_sim_schedule ((int64_t) (s_sim_uniform () * config.duration), EV_DEVICE_CRASH, 0, 0, 0, 0);
+    s_sim_schedule (HEARTBEAT_INTERVAL * 1000, EV_PLANT_TICK, 0, 0, 0, 0);
+    if (config.rate > 0)
+        s_sim_schedule (s_sim_exponential (1e6 / config.rate), EV_REQUEST, 0, 0, 0, 0);
+    if (config.reconfigure > 0)
+        s_sim_schedule (config.reconfigure, EV_RECONFIGURE, 0, 0, 0, 0);
+    if (config.crash > 0)
+        s_sim_schedule (config.crash, EV_PLANT_CRASH, 0, 0, 0, 0);
+
+    while (heap_size && heap [0].time <= config.duration && !zsys_interrupted) {
+        event_t event = s_sim_next ();
+        sim_now = event.time;
+        stats.events++;
+        sim_line_t *line = &sim_lines [event.line];
+
+        switch (event.type) {
+            case EV_REQUEST:
+                if (stats.requests < request_max) {
+                    sim_request_t *request = &requests [stats.requests];
+                    request->issued = sim_now;
+                    request->attempts = 1;
+                    request->plant = client_plant;
+                    s_sim_send (EV_PLANT_RECV, 0, request->plant, MSG_REQUEST, stats.requests);
+                    s_sim_schedule (sim_now + REQUEST_TIMEOUT * 1000, EV_CLIENT_TIMEOUT,
+                                    0, 0, 0, stats.requests);
+                    stats.requests++;
+                }
+                s_sim_schedule (sim_now + s_sim_exponential (1e6 / config.rate), EV_REQUEST, 0, 0, 0, 0);
+                break;
+
+            case EV_CLIENT_TIMEOUT: {
+                //  Lazy Pirate: resend the request, or abandon it
+                sim_request_t *request = &requests [event.request];
+                if (request->done)
+                    break;
+                if (request->attempts == REQUEST_RETRIES) {
+                    request->done = 1;
+                    stats.abandoned++;
+                    break;
+                }
+                request->attempts++;
+                stats.retries++;
+                //  The client switches Plant on a timeout
+                if (config.crash && request->plant == client_plant)
+                    client_plant = !client_plant;
+                request->plant = client_plant;
+                s_sim_send (EV_PLANT_RECV, 0, request->plant, MSG_REQUEST, event.request);
+                s_sim_schedule (sim_now + REQUEST_TIMEOUT * 1000, EV_CLIENT_TIMEOUT, 0, 0, 0, event.request);
+                break;
+            }
+            case EV_PLANT_TICK: {
+                s_sim_schedule (sim_now + HEARTBEAT_INTERVAL * 1000, EV_PLANT_TICK, 0, 0, 0, 0);
+                if (!plant_down)
+                    peer_seen = sim_now + config.latency;
+                else
+                if (!stats.takeover)
+                    break;              //  Neither Plant serves
+                line_t *ready = (line_t *) zlist_first (lines);
+                while (ready) {
+                    int target;
+                    memcpy (&target, zframe_data (ready->identity), sizeof (target));
+                    s_sim_send (EV_LINE_RECV, target, 0, MSG_HEARTBEAT, 0);
+                    stats.down_heartbeats++;
+                    ready = (line_t *) zlist_next (lines);
+                }
+                break;
+            }
+            case EV_PLANT_RECV:
+                if (event.device != plant_down)
+                    break;              //  Sent to the Plant that crashed, or to the passive one
+                if (plant_down && !stats.takeover) {
+                    //  The backup takes over once the peer expired, and rejects until then
+                    if (sim_now < peer_seen + BSTAR_PEER_EXPIRY * 1000)
+                        break;
+                    stats.takeover = sim_now;
+                    //  Only lines that turn up at the backup are routed to
+                    while (zlist_size (lines)) {
+                        line_t *replica = (line_t *) zlist_pop (lines);
+                        s_line_destroy (&replica);
+                    }
+                }
+                if (plant_down && event.msg != MSG_REQUEST && !line->back) {
+                    line->back = sim_now;
+                    stats.failovers [stats.lines_back++] = sim_now - config.crash;
+                }
+                if (event.msg == MSG_REQUEST)
+                    s_queue_push (&backlog, event.request);
+                else
+                if (event.msg == MSG_CONFIG_STALE)
+                    s_sim_configure (line, event.line, 1);
+                else {
+                    //  Any sign of life from line means it's ready
+                    line_t *ready = s_line_new (zframe_new (&event.line, sizeof (event.line)));
+                    s_line_ready (ready, lines);
+                    if (event.msg == MSG_HEARTBEAT)
+                        s_line_heartbeat (ready, 0);
+                    if (event.msg == MSG_REPLY) {
+                        sim_request_t *request = &requests [event.request];
+                        if (!request->done) {
+                            if (plant_down && !stats.first_reply)
+                                stats.first_reply = sim_now;
+                            request->done = 1;
+                            stats.latencies [stats.completed++] = sim_now - request->issued;
+                        }
+                    }
+                }
+                break;
+
+            case EV_LINE_START: {
+                //  Walk the transition table from CREATING to RUNNING
+                int64_t startup = TRANSITION_TIME * 1000 + s_sim_transitions (STATE_CREATING, SIGNAL_RUN);
+                s_sim_schedule (sim_now + startup, EV_LINE_TICK, event.line, 0, MSG_READY, 0);
+                //  The line is configured as it starts, so it takes no extra time
+                zmsg_t *msg = zmsg_new ();
+                s_config_append (line->view, msg, 1);
+                zframe_t *payload = zmsg_first (msg);
+                s_config_update (line->config, payload, zmsg_next (msg));
+                zmsg_destroy (&msg);
+                break;
+            }
+            case EV_LINE_TICK:
+                if (!line->up) {
+                    line->up = 1;
+                    s_accrual_init (&line->upstream, HEARTBEAT_INTERVAL, zclock_time ());
+                    if (sim_now > stats.startup)
+                        stats.startup = sim_now;
+                    s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_READY, 0);
+                }
+                else {
+                    //  Line fails over to another Plant once it is silent for too long
+                    if (zclock_time () >= s_accrual_expiry (&line->upstream, s_type (PNP_LINE_ID [0])->threshold,
+                                                            s_type (PNP_LINE_ID [0])->liveness)) {
+                        stats.line_failovers++;
+                        if (config.crash)
+                            line->plant = !line->plant;
+                        s_accrual_init (&line->upstream, HEARTBEAT_INTERVAL, zclock_time ());
+                        s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_READY, 0);
+                    }
+                    if (!config.suppress || s_suppress_due (&line->suppress, zclock_time (), HEARTBEAT_INTERVAL, 0, 0)) {
+                        s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_HEARTBEAT, 0);
+                        stats.line_heartbeats++;
+                    }
+                    else
+                        stats.suppressed++;
+                    //  and to its devices
+                    backend_resource_t *listed = (backend_resource_t *) zlist_first (line->devices);
+                    while (listed) {
+                        memcpy (&device_nbr, zframe_data (listed->identity), sizeof (device_nbr));
+                        if (!config.suppress || s_suppress_due (&listed->suppress, zclock_time (), HEARTBEAT_INTERVAL, 0, 0)) {
+                            s_sim_send (EV_DEVICE_RECV, event.line, device_nbr, MSG_HEARTBEAT, 0);
+                            stats.down_heartbeats++;
+                        }
+                        else
+                            stats.suppressed++;
+                        listed = (backend_resource_t *) zlist_next (line->devices);
+                    }
+                }
+                s_sim_schedule (sim_now + HEARTBEAT_INTERVAL * 1000, EV_LINE_TICK, event.line, 0, 0, 0);
+                break;
+
+            case EV_LINE_RECV:
+                if (event.msg == MSG_DEVICE_HEARTBEAT) {
+                    //  Any sign of life from device means it's ready, the interval it
+                    //  announced is the request
+                    zframe_t *identity = zframe_new (&event.device, sizeof (event.device));
+                    backend_resource_t *device = s_backend_resource_new (identity, PNP_QAS_ID [0]);
+                    s_backend_resource_ready (device, line->devices);
+                    s_backend_resource_beat (device, event.request);
+                    devices [event.device].listed = 1;
+                    break;
+                }
+                if (event.msg == MSG_SAMPLE) {
+                    //  Any message from a device proves it is alive; the line forwards its samples
+                    zframe_t *identity = zframe_new (&event.device, sizeof (event.device));
+                    s_backend_resource_alive (line->devices, identity);
+                    zframe_destroy (&identity);
+                    s_suppress_sent (&line->suppress, zclock_time ());
+                    s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_SAMPLE, 0);
+                    break;
+                }
+                //  Any message from the Plant proves it is alive
+                if (event.msg == MSG_HEARTBEAT)
+                    s_accrual_heartbeat (&line->upstream, zclock_time (), 0);
+                else
+                    s_accrual_alive (&line->upstream, zclock_time ());
+                if (event.msg == MSG_CONFIGURE) {
+                    zmsg_t *msg = (zmsg_t *) event.request;
+                    zframe_t *payload = zmsg_first (msg);
+                    int rc = s_config_update (line->config, payload, zmsg_next (msg));
+                    zmsg_destroy (&msg);
+                    if (rc == CONFIG_STALE) {
+                        stats.stale++;
+                        s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_CONFIG_STALE, 0);
+                        break;
+                    }
+                    if (rc == CONFIG_UNCHANGED && config.deltas) {
+                        stats.line_skips++;
+                        break;
+                    }
+                    //  CONFIGURING and back to RUNNING, for the line and its devices
+                    int64_t until = sim_now + reconfiguring;
+                    stats.line_configurings++;
+                    stats.line_downtime += until - (line->configuring > sim_now? line->configuring: sim_now);
+                    line->configuring = until;
+                    if (config.deltas) {
+                        size_t item_nbr;
+                        for (item_nbr = 0; item_nbr < s_payload_size (line->config->delta); item_nbr++) {
+                            payload_item_t *item = &line->config->delta->items [item_nbr];
+                            snprintf (name, sizeof (name), "%.*s", item->name_size,
+                                      (char *) line->config->delta->arena + item->name);
+                            if (sscanf (name, "device.%d.", &device_nbr) == 1
+                            &&  devices_configuring [device_nbr] < until) {
+                                devices_configuring [device_nbr] = until;
+                                stats.device_configurings++;
+                            }
+                        }
+                    }
+                    else
+                        for (device_nbr = event.line; device_nbr < config.devices; device_nbr += config.lines)
+                            stats.device_configurings++;
+                    break;
+                }
+                if (event.msg == MSG_REQUEST) {
+                    s_queue_push (&line->queue, event.request);
+                    if (!line->busy) {
+                        line->busy = 1;
+                        s_sim_schedule (sim_now + s_sim_exponential (config.service),
+                                        EV_LINE_DONE, event.line, 0, 0, 0);
+                    }
+                }
+                break;
+
+            case EV_LINE_DONE: {
+                if (sim_now < line->configuring) {
+                    //  No requests are served while reconfiguring
+                    s_sim_schedule (line->configuring, EV_LINE_DONE, event.line, 0, 0, 0);
+                    break;
+                }
+                size_t request;
+                if (s_queue_pop (&line->queue, &request) == 0) {
+                    s_suppress_sent (&line->suppress, zclock_time ());
+                    s_sim_send (EV_PLANT_RECV, event.line, line->plant, MSG_REPLY, request);
+                }
+                line->busy = line->queue.head != line->queue.tail;
+                if (line->busy)
+                    s_sim_schedule (sim_now + s_sim_exponential (config.service),
+                                    EV_LINE_DONE, event.line, 0, 0, 0);
+                break;
+            }
+            case EV_DEVICE_TICK: {
+                sim_device_t *device = &devices [event.device];
+                if (sim_now < device->restart)
+                    break;              //  Crashed, restarts with a new tick
+                if (device->down) {
+                    device->down = 0;
+                    s_accrual_init (&device->upstream, HEARTBEAT_INTERVAL, zclock_time ());
+                    s_backoff_init (&device->backoff, HEARTBEAT_INTERVAL);
+                    memset (&device->suppress, 0, sizeof (device->suppress));
+                }
+                //  The interval only changes with a heartbeat that announces it
+                size_t interval = config.backoff? device->backoff.interval: 0;
+                if (!config.suppress
+                ||  s_suppress_due (&device->suppress, zclock_time (), interval? interval: HEARTBEAT_INTERVAL, 0, 0)) {
+                    interval = config.backoff? s_backoff_next (&device->backoff, &device->upstream, zclock_time ()): 0;
+                    stats.heartbeats++;
+                    s_sim_send (EV_LINE_RECV, event.line, event.device, MSG_DEVICE_HEARTBEAT, interval);
+                }
+                else
+                    stats.suppressed++;
+                s_sim_schedule (sim_now + (interval? interval: HEARTBEAT_INTERVAL) * 1000, EV_DEVICE_TICK,
+                                event.line, event.device, 0, 0);
+                break;
+            }
+            case EV_DEVICE_RECV:
+                if (sim_now >= devices [event.device].restart)
+                    s_accrual_heartbeat (&devices [event.device].upstream, zclock_time (), 0);
+                break;
+
+            case EV_DEVICE_SAMPLE: {
+                sim_device_t *device = &devices [event.device];
+                if (sim_now >= device->restart && !device->down) {
+                    stats.samples++;
+                    s_suppress_sent (&device->suppress, zclock_time ());
+                    s_sim_send (EV_LINE_RECV, event.line, event.device, MSG_SAMPLE, 0);
+                }
+                s_sim_schedule (sim_now + s_sim_exponential (1e6 / config.samples), EV_DEVICE_SAMPLE,
+                                event.line, event.device, 0, 0);
+                break;
+            }
+            case EV_DEVICE_CRASH: {
+                int victim = (int) (s_sim_random () % config.devices);
+                sim_device_t *device = &devices [victim];
+                if (device->down)
+                    break;              //  Down already
+                stats.crashes++;
+                device->down = 1;
+                device->crashed = sim_now;
+                device->restart = sim_now + SIM_DOWNTIME * 1000000LL;
+                s_sim_schedule (device->restart, EV_DEVICE_TICK, victim % config.lines, victim, 0, 0);
+                break;
+            }
+            case EV_RECONFIGURE: {
+                //  Change random parameters of lines and devices
+                stats.reconfigurations++;
+                int changed;
+                for (changed = 0; changed < config.parameters; changed++) {
+                    int owner = (int) (s_sim_random () % (config.lines + config.devices));
+                    parameter = (int) (s_sim_random () % SIM_PARAMETERS);
+                    if (owner < config.lines)
+                        snprintf (name, sizeof (name), "line.%d.%d", owner, parameter);
+                    else {
+                        owner -= config.lines;
+                        snprintf (name, sizeof (name), "device.%d.%d", owner, parameter);
+                        owner %= config.lines;
+                    }
+                    s_payload_set_integer (sim_lines [owner].changes, name, (int64_t) s_sim_random ());
+                }
+                for (line_nbr = 0; line_nbr < config.lines; line_nbr++) {
+                    sim_line_t *target = &sim_lines [line_nbr];
+                    if (s_payload_size (target->changes))
+                        s_config_commit (target->view, target->changes);
+                    if (!config.deltas)
+                        s_sim_configure (target, line_nbr, 1);
+                    else
+                    if (s_payload_size (target->changes))
+                        s_sim_configure (target, line_nbr, 0);
+                    s_payload_reset (target->changes);
+                }
+                s_sim_schedule (sim_now + config.reconfigure, EV_RECONFIGURE, 0, 0, 0, 0);
+                break;
+            }
+            case EV_PLANT_CRASH:
+                plant_down = 1;
+                break;
+        }
+        //  Dispatch and purge after every event, as the Plant and lines do
+        //  after every poll
+        if ((event.type == EV_PLANT_RECV || event.type == EV_PLANT_TICK || event.type == EV_REQUEST)
+        &&  (!plant_down || stats.takeover)) {
+            size_t request;
+            while (zlist_size (lines) && s_queue_pop (&backlog, &request) == 0) {
+                zframe_t *identity = s_lines_next (lines);
+                int target;
+                memcpy (&target, zframe_data (identity), sizeof (target));
+                zframe_destroy (&identity);
+                s_sim_send (EV_LINE_RECV, target, 0, MSG_REQUEST, request);
+            }
+            size_t before = zlist_size (lines);
+            s_lines_purge (lines, tree, rtts);
+            stats.line_expiries += before - zlist_size (lines);
+        }
+        else
+        if (event.type == EV_LINE_RECV || event.type == EV_LINE_TICK) {
+            size_t before = zlist_size (line->devices);
+            s_backend_resources_purge (line->devices, line->status);
+            if (zlist_size (line->devices) < before)
+                s_sim_purged (line, event.line, devices);
+        }
+    }
+    double elapsed = (double) (clock () - started) / CLOCKS_PER_SEC;
+
+    //  Report
+    qsort (stats.latencies, stats.completed, sizeof (int64_t), s_compare_latency);
+    printf ("I: %zu events in %.2f secs, %.0fx real time\n", stats.events, elapsed,
+            elapsed > 0? config.duration / 1e6 / elapsed: 0);
+    printf ("I: all lines up after %" PRId64 " msecs\n", stats.startup / 1000);
+    printf ("I: %zu messages sent, %zu lost\n", stats.sent, stats.lost);
+    printf ("I: %zu requests, %zu completed (%.1f/sec), %zu retries, %zu abandoned\n",
+            stats.requests, stats.completed, stats.completed / (config.duration / 1e6),
+            stats.retries, stats.abandoned);
+    if (stats.completed)
+        printf ("I: request latency p50 %.1f p99 %.1f max %.1f msecs\n",
+                stats.latencies [stats.completed / 2] / 1e3,
+                stats.latencies [stats.completed * 99 / 100] / 1e3,
+                stats.latencies [stats.completed - 1] / 1e3);
+    printf ("I: false expiries: %zu lines, %zu devices; %zu line failovers\n",
+            stats.line_expiries, stats.device_expiries, stats.line_failovers);
+    printf ("I: %zu device heartbeats (%.3f/sec per device), threshold %.1f, backoff %s\n",
+            stats.heartbeats, config.devices? stats.heartbeats / (config.duration / 1e6) / config.devices: 0,
+            config.threshold, config.backoff? "on": "off");
+    size_t heartbeats = stats.heartbeats + stats.line_heartbeats + stats.down_heartbeats;
+    printf ("I: %zu heartbeats, %zu up from devices and %zu from lines, %zu down; %zu left out, "
+            "suppression %s\n", heartbeats, stats.heartbeats, stats.line_heartbeats, stats.down_heartbeats,
+            stats.suppressed, config.suppress? "on": "off");
+    printf ("I: %zu samples (%.1f/sec per device), heartbeats %.1f%% of messages sent\n",
+            stats.samples, config.samples, stats.sent? 100.0 * heartbeats / stats.sent: 0);
+    if (stats.crashes) {
+        qsort (stats.detections, stats.detected, sizeof (int64_t), s_compare_latency);
+        printf ("I: %zu device crashes, %zu detected", stats.crashes, stats.detected);
+        if (stats.detected)
+            printf (" after p50 %.2f p99 %.2f max %.2f secs",
+                    stats.detections [stats.detected / 2] / 1e6,
+                    stats.detections [stats.detected * 99 / 100] / 1e6,
+                    stats.detections [stats.detected - 1] / 1e6);
+        printf ("\n");
+    }
+    if (config.crash) {
+        qsort (stats.failovers, stats.lines_back, sizeof (int64_t), s_compare_latency);
+        printf ("I: Plant crashed at %.0f secs, ", config.crash / 1e6);
+        if (stats.takeover)
+            printf ("backup took over after %.2f secs, first reply after %.2f secs, ",
+                    (stats.takeover - config.crash) / 1e6,
+                    stats.first_reply? (stats.first_reply - config.crash) / 1e6: 0);
+        else
+            printf ("backup did not take over, ");
+        printf ("%zu of %d lines back", stats.lines_back, config.lines);
+        if (stats.lines_back)
+            printf (" after p50 %.2f max %.2f secs", stats.failovers [stats.lines_back / 2] / 1e6,
+                    stats.failovers [stats.lines_back - 1] / 1e6);
+        printf ("\n");
+    }
+    if (stats.reconfigurations) {
+        printf ("I: %zu reconfigurations %s deltas, %zu KB of configuration sent, %zu stale\n",
+                stats.reconfigurations, config.deltas? "with": "without", stats.config_bytes / 1024, stats.stale);
+        printf ("I: %zu lines reconfigured, %zu skipped, %zu devices reconfigured\n",
+                stats.line_configurings, stats.line_skips, stats.device_configurings);
+        printf ("I: downtime per reconfiguration %.1f line secs, %.1f device secs\n",
+                stats.line_downtime / 1e6 / stats.reconfigurations,
+                stats.device_configurings * (reconfiguring / 1e6) / stats.reconfigurations);
+    }
+
+    //  When we're done, clean up properly
+    while (zlist_size (lines)) {
+        line_t *ready = (line_t *) zlist_pop (lines);
+        s_line_destroy (&ready);
+    }
+    zlist_destroy (&lines);
+    for (line_nbr = 0; line_nbr < config.lines; line_nbr++) {
+        while (zlist_size (sim_lines [line_nbr].devices)) {
+            backend_resource_t *device = (backend_resource_t *) zlist_pop (sim_lines [line_nbr].devices);
+            s_backend_resource_destroy (&device);
+        }
+        zlist_destroy (&sim_lines [line_nbr].devices);
+        s_status_destroy (&sim_lines [line_nbr].status);
+        s_config_destroy (&sim_lines [line_nbr].config);
+        s_config_destroy (&sim_lines [line_nbr].view);
+        s_payload_destroy (&sim_lines [line_nbr].changes);
+        free (sim_lines [line_nbr].queue.items);
+    }
+    free (sim_lines);
+    s_status_destroy (&tree);
+    zhash_destroy (&rtts);
+    free (backlog.items);
+    free (requests);
+    free (stats.latencies);
+    free (devices_configuring);
+    free (devices);
+    free (stats.detections);
+    free (stats.failovers);
+    //  Configurations still on their way
+    size_t event_nbr;
+    for (event_nbr = 0; event_nbr < heap_size; event_nbr++)
+        if (heap [event_nbr].msg == MSG_CONFIGURE) {
+            zmsg_t *msg = (zmsg_t *) heap [event_nbr].request;
+            zmsg_destroy (&msg);
+        }
+    free (heap);
+    return 0;
+}
@@ -0,0 +1,305 @@
+#ifndef PNP_SNAPSHOT
+#define PNP_SNAPSHOT "Pick-n-Pack Warm Restart Snapshot"
+
+//  A resource keeps what it needs to resume after a restart in a small
+//  memory-mapped file: its identity, the last state it reached, its
+//  configuration and its backend resources. Snapshots are written straight
+//  into the mapping, so they survive a crash of the process without any
+//  write () in the work loop. A resource that restarts with a valid snapshot
+//  comes back under the same identity, with its configuration and backend
+//  resources, and resumes at CONFIGURING instead of going through
+//  INITIALIZING again; its parent and its backend resources only see a gap
+//  in its heartbeats. Without a snapshot, or with one older than
+//  SNAPSHOT_MAX_AGE, after which its parent has long forgotten it, the
+//  resource starts cold under a new identity.
+//
+//  The snapshot file is locked while a process uses it, so two resources of
+//  the same name in one directory never share an identity; the second one
+//  runs without a snapshot.
+//
+//  Body: IDENTITY SIZE (byte), IDENTITY, CONFIG VERSION (uint32), CONFIG
+//  DIGEST (uint64), VALUES SIZE (uint32), VALUES as encoded by payload.h,
+//  CHILDREN (uint32), then per backend resource TYPE, CONFIG VERSION (uint32)
+//  it acknowledged, IDENTITY SIZE (byte), IDENTITY. The header holds the
+//  checksum of the body, written last, so a snapshot torn by a crash is
+//  never resumed.
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+#define SNAPSHOT_FILE       "pnp-%s.snapshot"   //  TODO: this should be configured
+#define SNAPSHOT_MAGIC      0x534e5050          //  "PPNS"
+#define SNAPSHOT_VERSION    1
+#define SNAPSHOT_SIZE_INIT  4096
+#define SNAPSHOT_INTERVAL   1000    //  msecs between snapshots while running
+#define SNAPSHOT_MAX_AGE    60000   //  msecs, older snapshots are not resumed
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t checksum;          //  Of the body
+    int64_t written;            //  Wall clock time of the snapshot, msecs
+    uint32_t size;              //  Body bytes
+    uint32_t state;             //  Last state the resource reached
+} snapshot_header_t;
+
+typedef struct {
+    char *filename;
+    int fd;
+    byte *data;                 //  Mapped snapshot file
+    size_t capacity;            //  Size of the mapping
+    snapshot_header_t *header;
+    char identity [16];         //  Our identity, kept across warm restarts
+    int valid;                  //  The snapshot found at start can be resumed
+    int64_t save_at;            //  Next periodic snapshot
+} snapshot_t;
+
+//  FNV-1a over <size> bytes at <data>
+static uint64_t
+s_snapshot_checksum (const byte *data, size_t size)
+{
+    uint64_t checksum = 0xcbf29ce484222325ULL;
+    while (size--) {
+        checksum ^= *data++;
+        checksum *= 0x100000001b3ULL;
+    }
+    return checksum;
+}
+
+//  Map at least <capacity> bytes of the snapshot file, growing it if needed
+static int
+s_snapshot_map (snapshot_t *self, size_t capacity)
+{
+    struct stat st;
+    if (fstat (self->fd, &st) == -1)
+        return -1;
+    if ((size_t) st.st_size < capacity && ftruncate (self->fd, capacity) == -1)
+        return -1;
+    if ((size_t) st.st_size > capacity)
+        capacity = st.st_size;
+    if (self->data)
+        munmap (self->data, self->capacity);
+    self->data = mmap (NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (self->data == MAP_FAILED) {
+        self->data = NULL;
+        self->header = NULL;
+        return -1;
+    }
+    self->header = (snapshot_header_t *) self->data;
+    self->capacity = capacity;
+    return 0;
+}
+
+//  Returns 1 if the mapped snapshot can be resumed, and takes our identity
+//  from it
+static int
+s_snapshot_check (snapshot_t *self)
+{
+    snapshot_header_t *header = self->header;
+    if (header->magic != SNAPSHOT_MAGIC
+    ||  header->version != SNAPSHOT_VERSION
+    ||  header->size < 1
+    ||  header->size > self->capacity - sizeof (snapshot_header_t))
+        return 0;
+    byte *body = self->data + sizeof (snapshot_header_t);
+    if (s_snapshot_checksum (body, header->size) != header->checksum
+    ||  body [0] == 0 || body [0] >= sizeof (self->identity) || body [0] >= header->size)
+        return 0;
+    int64_t age = zclock_time () - header->written;
+    if (age < 0 || age > SNAPSHOT_MAX_AGE
+    || (header->state != STATE_CONFIGURING && header->state != STATE_RUNNING))
+        return 0;
+    memcpy (self->identity, body + 1, body [0]);
+    self->identity [body [0]] = 0;
+    return 1;
+}
+
+//  Construct new snapshot of the resource <name>, and tell whether the one
+//  it left behind can be resumed. Returns NULL if the snapshot file cannot
+//  be used, e.g. as another resource of that name holds it.
+static snapshot_t *
+s_snapshot_new (const char *name)
+{
+    snapshot_t *self = (snapshot_t *) zmalloc (sizeof (snapshot_t));
+    self->filename = (char *) zmalloc (strlen (SNAPSHOT_FILE) + strlen (name) + 1);
+    sprintf (self->filename, SNAPSHOT_FILE, name);
+    self->fd = open (self->filename, O_RDWR | O_CREAT, 0644);
+    if (self->fd == -1
+    ||  flock (self->fd, LOCK_EX | LOCK_NB) == -1
+    ||  s_snapshot_map (self, SNAPSHOT_SIZE_INIT) == -1) {
+        printf ("W: cannot use snapshot %s: %s, no warm restarts\n", self->filename, strerror (errno));
+        if (self->fd != -1)
+            close (self->fd);
+        free (self->filename);
+        free (self);
+        return NULL;
+    }
+    self->valid = s_snapshot_check (self);
+    if (!self->valid) {
+        //  A new identity, unique among the processes on this host
+        uint32_t seed = (uint32_t) zclock_usecs () ^ ((uint32_t) getpid () << 16);
+        snprintf (self->identity, sizeof (self->identity), "%08x", seed);
+        self->header->magic = 0;
+    }
+    return self;
+}
+
+//  Destroy specified snapshot, the file itself is kept for the next start
+static void
+s_snapshot_destroy (snapshot_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        snapshot_t *self = *self_p;
+        if (self->data) {
+            msync (self->data, self->capacity, MS_ASYNC);
+            munmap (self->data, self->capacity);
+        }
+        close (self->fd);
+        free (self->filename);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Returns our identity, or NULL without a snapshot, in which case our
+//  parent picks one
+static const char *
+s_snapshot_identity (snapshot_t *self)
+{
+    return self? self->identity: NULL;
+}
+
+//  The invalidate method makes sure the next start is cold, e.g. after a
+//  STOP command. Does nothing if <self> is NULL.
+static void
+s_snapshot_invalidate (snapshot_t *self)
+{
+    if (self) {
+        self->header->magic = 0;
+        self->valid = 0;
+    }
+}
+
+//  The save method writes the snapshot of a resource that reached <state>,
+//  with its <config>, which may be NULL, and its <backend_resources>
+static int
+s_snapshot_save (snapshot_t *self, state state, config_t *config, zlist_t *backend_resources)
+{
+    //  The full encoding is kept by the configuration, for CONFIGURE commands
+    if (config && !config->encoded_full)
+        config->encoded_full = s_payload_encode (config->values);
+    size_t identity_size = strlen (self->identity);
+    size_t values_size = config? zframe_size (config->encoded_full): 0;
+    size_t size = 1 + identity_size + 2 * sizeof (uint32_t) + sizeof (uint64_t) + values_size + sizeof (uint32_t);
+    uint32_t children = 0;
+    backend_resource_t *backend_resource = (backend_resource_t *) zlist_first (backend_resources);
+    while (backend_resource) {
+        size += 1 + sizeof (uint32_t) + 1 + zframe_size (backend_resource->identity);
+        children++;
+        backend_resource = (backend_resource_t *) zlist_next (backend_resources);
+    }
+    if (sizeof (snapshot_header_t) + size > self->capacity
+    &&  s_snapshot_map (self, 2 * (sizeof (snapshot_header_t) + size)) == -1) {
+        printf ("E: cannot grow snapshot %s: %s\n", self->filename, strerror (errno));
+        return -1;
+    }
+    byte *body = self->data + sizeof (snapshot_header_t);
+    byte *data = body;
+    *data++ = (byte) identity_size;
+    memcpy (data, self->identity, identity_size);
+    data += identity_size;
+    uint32_t version = config? config->version: 0;
+    uint64_t digest = config? config->digest: 0;
+    uint32_t values = (uint32_t) values_size;
+    memcpy (data, &version, sizeof (version));
+    data += sizeof (version);
+    memcpy (data, &digest, sizeof (digest));
+    data += sizeof (digest);
+    memcpy (data, &values, sizeof (values));
+    data += sizeof (values);
+    if (values_size)
+        memcpy (data, zframe_data (config->encoded_full), values_size);
+    data += values_size;
+    memcpy (data, &children, sizeof (children));
+    data += sizeof (children);
+    backend_resource = (backend_resource_t *) zlist_first (backend_resources);
+    while (backend_resource) {
+        *data++ = backend_resource->type;
+        memcpy (data, &backend_resource->config, sizeof (backend_resource->config));
+        data += sizeof (backend_resource->config);
+        *data++ = (byte) zframe_size (backend_resource->identity);
+        memcpy (data, zframe_data (backend_resource->identity), zframe_size (backend_resource->identity));
+        data += zframe_size (backend_resource->identity);
+        backend_resource = (backend_resource_t *) zlist_next (backend_resources);
+    }
+    self->header->magic = SNAPSHOT_MAGIC;
+    self->header->version = SNAPSHOT_VERSION;
+    self->header->written = zclock_time ();
+    self->header->size = (uint32_t) size;
+    self->header->state = state;
+    self->header->checksum = s_snapshot_checksum (body, size);
+    return 0;
+}
+
+//  The restore method takes the configuration into <config_p>, replacing
+//  any, and the backend resources into <backend_resources> from a snapshot
+//  that can be resumed. Backend resources expire as usual unless they
+//  heartbeat again. Returns -1 if the body is malformed.
+static int
+s_snapshot_restore (snapshot_t *self, config_t **config_p, zlist_t *backend_resources)
+{
+    assert (self->valid);
+    byte *data = self->data + sizeof (snapshot_header_t);
+    byte *end = data + self->header->size;
+    data += 1 + data [0];
+    uint32_t version, values, children;
+    uint64_t digest;
+    if (data + 3 * sizeof (uint32_t) + sizeof (digest) > end)
+        return -1;
+    memcpy (&version, data, sizeof (version));
+    data += sizeof (version);
+    memcpy (&digest, data, sizeof (digest));
+    data += sizeof (digest);
+    memcpy (&values, data, sizeof (values));
+    data += sizeof (values);
+    if (data + values + sizeof (children) > end)
+        return -1;
+    if (version) {
+        config_t *config = s_config_new ();
+        zframe_t *frame = zframe_new (data, values);
+        int64_t rc = s_payload_decode (config->values, frame);
+        zframe_destroy (&frame);
+        config->version = version;
+        config->base = version;
+        config->digest = s_payload_digest (config->values);
+        if (rc == -1 || config->digest != digest) {
+            s_config_destroy (&config);
+            return -1;
+        }
+        s_config_destroy (config_p);
+        *config_p = config;
+    }
+    data += values;
+    memcpy (&children, data, sizeof (children));
+    data += sizeof (children);
+    while (children--) {
+        if (data + 2 + sizeof (uint32_t) > end
+        ||  data + 2 + sizeof (uint32_t) + data [1 + sizeof (uint32_t)] > end)
+            return -1;
+        byte type = *data++;
+        uint32_t acknowledged;
+        memcpy (&acknowledged, data, sizeof (acknowledged));
+        data += sizeof (acknowledged);
+        size_t identity_size = *data++;
+        backend_resource_t *backend_resource = s_backend_resource_new (zframe_new (data, identity_size), type);
+        backend_resource->config = acknowledged;
+        s_backend_resource_ready (backend_resource, backend_resources);
+        data += identity_size;
+    }
+    return 0;
+}
+
+#endif
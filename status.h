@@ -0,0 +1,262 @@
+#ifndef PNP_STATUS_TABLE
+#define PNP_STATUS_TABLE "Pick-n-Pack Subtree Status"
+
+//  The status table holds the latest type, state, signal and error of every
+//  descendant of a resource, keyed by path, i.e. the identities of the
+//  resources on the way down joined by '/'. Each heartbeat carries only the
+//  entries that changed since the previous one, in a single status frame, so
+//  the Plant gets a view of the whole tree at one message per line per
+//  interval. A full snapshot is sent every STATUS_SNAPSHOT_INTERVAL
+//  heartbeats, so a parent that restarted or missed a frame catches up.
+//
+//  Status frame: TAG, FLAGS, SEQUENCE (uint32), then per entry KEY SIZE, KEY,
+//  TYPE, STATE, SIGNAL, ERROR, RTT50, RTT99, OFFSET. A STATE of 0 removes the
+//  entry. The RTT and OFFSET bytes are log2 buckets as kept by rtt.h, so they
+//  only change when a link gets noticeably faster or slower.
+
+#include "protocol.h"
+
+#define STATUS_SNAPSHOT_INTERVAL 30     //  Heartbeats between full snapshots
+#define STATUS_FULL     0x01            //  Frame holds all entries, not only changes
+#define STATUS_REMOVED  0               //  State of a removed entry
+#define STATUS_HEADER   (1 + 1 + sizeof (uint32_t))
+#define STATUS_FIELDS   7               //  Bytes per entry after the key
+
+typedef struct {
+    byte type;                  //  Resource type, i.e. the ID byte
+    byte state;                 //  Latest state
+    byte signal;                //  Latest signal/command
+    byte error;                 //  Latest error code, or 0
+    byte rtt50;                 //  Median round-trip time bucket from its parent
+    byte rtt99;                 //  99th percentile round-trip time bucket
+    byte offset;                //  Clock offset bucket, sign in high bit
+    int changed;                //  Changed since last status frame
+    int stale;                  //  Not confirmed by current full snapshot
+} status_entry_t;
+
+typedef struct {
+    zhash_t *entries;           //  Entries by path
+    uint32_t sequence;          //  Sequence of last status frame sent
+    size_t heartbeats;          //  Status frames since last full snapshot
+} status_t;
+
+static status_t *
+s_status_new (void)
+{
+    status_t *self = (status_t *) zmalloc (sizeof (status_t));
+    self->entries = zhash_new ();
+    //  The first frame is always a full snapshot
+    self->heartbeats = STATUS_SNAPSHOT_INTERVAL;
+    return self;
+}
+
+static void
+s_status_destroy (status_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        status_t *self = *self_p;
+        zhash_destroy (&self->entries);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The update method stores the latest status of the resource at <key>, and
+//  the round-trip times to it if we measured them. Entries are only marked as
+//  changed when something actually changed.
+static void
+s_status_update (status_t *self, const char *key, byte type, byte state, byte signal, byte error,
+                 rtt_t *rtt)
+{
+    status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, key);
+    if (!entry) {
+        entry = (status_entry_t *) zmalloc (sizeof (status_entry_t));
+        zhash_insert (self->entries, key, entry);
+        zhash_freefn (self->entries, key, free);
+        entry->changed = 1;
+    }
+    if (rtt && rtt->samples) {
+        byte rtt50 = s_rtt_percentile (rtt, 50);
+        byte rtt99 = s_rtt_percentile (rtt, 99);
+        byte offset = s_rtt_offset_byte (rtt);
+        if (entry->rtt50 != rtt50 || entry->rtt99 != rtt99 || entry->offset != offset)
+            entry->changed = 1;
+        entry->rtt50 = rtt50;
+        entry->rtt99 = rtt99;
+        entry->offset = offset;
+    }
+    if (entry->type != type || entry->state != state
+    ||  entry->signal != signal || entry->error != error)
+        entry->changed = 1;
+    entry->stale = 0;
+    entry->type = type;
+    entry->state = state;
+    entry->signal = signal;
+    entry->error = error;
+}
+
+//  The remove method marks the entry at <key> and everything below it as
+//  removed; removed entries are reported once and then dropped.
+static void
+s_status_remove (status_t *self, const char *key)
+{
+    size_t key_size = strlen (key);
+    zlist_t *keys = zhash_keys (self->entries);
+    char *path = (char *) zlist_first (keys);
+    while (path) {
+        if (strncmp (path, key, key_size) == 0
+        && (path [key_size] == 0 || path [key_size] == '/')) {
+            status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, path);
+            entry->state = STATUS_REMOVED;
+            entry->changed = 1;
+        }
+        path = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+}
+
+//  The commit method clears the change flags once changes have been
+//  reported, and drops removed entries
+static void
+s_status_commit (status_t *self)
+{
+    zlist_t *keys = zhash_keys (self->entries);
+    char *key = (char *) zlist_first (keys);
+    while (key) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, key);
+        entry->changed = 0;
+        if (entry->state == STATUS_REMOVED)
+            zhash_delete (self->entries, key);
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+}
+
+//  The frame method returns a status frame with <sequence> holding the entries
+//  that changed, or all entries if <full>, or NULL if nothing changed. It does
+//  not commit the changes.
+static zframe_t *
+s_status_frame (status_t *self, int full, uint32_t sequence)
+{
+    zlist_t *keys = zhash_keys (self->entries);
+    size_t size = STATUS_HEADER;
+    size_t count = 0;
+    char *key = (char *) zlist_first (keys);
+    while (key) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, key);
+        //  Paths longer than a key size byte cannot be reported
+        if (strlen (key) <= 255
+        && (entry->changed || (full && entry->state != STATUS_REMOVED))) {
+            size += 1 + strlen (key) + STATUS_FIELDS;
+            count++;
+        }
+        key = (char *) zlist_next (keys);
+    }
+    if (!count && !full) {
+        zlist_destroy (&keys);
+        return NULL;
+    }
+    zframe_t *frame = zframe_new (NULL, size);
+    byte *data = zframe_data (frame);
+    *data++ = PNP_STATUS [0];
+    *data++ = full? STATUS_FULL: 0;
+    memcpy (data, &sequence, sizeof (sequence));
+    data += sizeof (sequence);
+    key = (char *) zlist_first (keys);
+    while (key) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, key);
+        size_t key_size = strlen (key);
+        if (key_size <= 255
+        && (entry->changed || (full && entry->state != STATUS_REMOVED))) {
+            *data++ = (byte) key_size;
+            memcpy (data, key, key_size);
+            data += key_size;
+            *data++ = entry->type;
+            *data++ = entry->state;
+            *data++ = entry->signal;
+            *data++ = entry->error;
+            *data++ = entry->rtt50;
+            *data++ = entry->rtt99;
+            *data++ = entry->offset;
+        }
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    return frame;
+}
+
+//  The encode method returns the status frame for the next heartbeat, or NULL
+//  if nothing changed, and commits the changes.
+static zframe_t *
+s_status_encode (status_t *self)
+{
+    int full = ++self->heartbeats >= STATUS_SNAPSHOT_INTERVAL;
+    zframe_t *frame = s_status_frame (self, full, self->sequence + 1);
+    if (!frame)
+        return NULL;
+    self->sequence++;
+    s_status_commit (self);
+    if (full)
+        self->heartbeats = 0;
+    return frame;
+}
+
+//  The merge method applies a status frame received from the backend
+//  resource at <prefix>, e.g. a module, to our table, or from the status
+//  cache of the Plant if <prefix> is empty. Returns -1 if the frame is
+//  malformed.
+static int
+s_status_merge (status_t *self, const char *prefix, zframe_t *frame)
+{
+    byte *data = zframe_data (frame);
+    byte *end = data + zframe_size (frame);
+    if (zframe_size (frame) < STATUS_HEADER || data [0] != (byte) PNP_STATUS [0])
+        return -1;
+    //  A full snapshot replaces everything we know below the sender, entries
+    //  it does not confirm are removed afterwards
+    int full = data [1] & STATUS_FULL;
+    char below [strlen (prefix) + 2];
+    snprintf (below, sizeof (below), "%s%s", prefix, *prefix? "/": "");
+    zlist_t *keys = zhash_keys (self->entries);
+    char *key = (char *) zlist_first (keys);
+    while (full && key) {
+        if (strncmp (key, below, strlen (below)) == 0)
+            ((status_entry_t *) zhash_lookup (self->entries, key))->stale = 1;
+        key = (char *) zlist_next (keys);
+    }
+    data += STATUS_HEADER;
+    while (data < end) {
+        size_t key_size = *data++;
+        if (data + key_size + STATUS_FIELDS > end) {
+            zlist_destroy (&keys);
+            return -1;
+        }
+        char path [strlen (prefix) + key_size + 2];
+        snprintf (path, sizeof (path), "%s%s%.*s", prefix, *prefix? "/": "", (int) key_size, (char *) data);
+        data += key_size;
+        if (data [1] == STATUS_REMOVED)
+            s_status_remove (self, path);
+        else {
+            s_status_update (self, path, data [0], data [1], data [2], data [3], NULL);
+            status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, path);
+            if (entry->rtt50 != data [4] || entry->rtt99 != data [5] || entry->offset != data [6])
+                entry->changed = 1;
+            entry->rtt50 = data [4];
+            entry->rtt99 = data [5];
+            entry->offset = data [6];
+        }
+        data += STATUS_FIELDS;
+    }
+    key = (char *) zlist_first (keys);
+    while (full && key) {
+        status_entry_t *entry = (status_entry_t *) zhash_lookup (self->entries, key);
+        if (entry && entry->stale)
+            s_status_remove (self, key);
+        key = (char *) zlist_next (keys);
+    }
+    zlist_destroy (&keys);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,81 @@
+//  Pick-n-Pack status test
+//
+//  Checks that status frames (status.h) merge into a parent table under the
+//  path of the sender, that full snapshots remove entries they no longer
+//  carry, and that frames without the status tag are refused. The tag is
+//  above 0x7F, so merging must work where char is signed, as on x86.
+//
+//  Usage: statustest
+
+#include "czmq.h"
+#include "rtt.h"
+#include "status.h"
+
+static status_entry_t *
+s_test_entry (status_t *self, const char *key)
+{
+    return (status_entry_t *) zhash_lookup (self->entries, key);
+}
+
+int main (void)
+{
+    //  A module with two devices reports to its line
+    status_t *module = s_status_new ();
+    s_status_update (module, "dev1", 0x03, 2, 0x40, 0, NULL);
+    s_status_update (module, "dev2", 0x03, 2, 0x40, 0, NULL);
+    zframe_t *frame = s_status_encode (module);
+    assert (frame);
+    assert (zframe_data (frame) [0] == (byte) PNP_STATUS [0]);
+
+    status_t *line = s_status_new ();
+    assert (s_status_merge (line, "mod1", frame) == 0);
+    assert (zhash_size (line->entries) == 2);
+    status_entry_t *entry = s_test_entry (line, "mod1/dev1");
+    assert (entry && entry->type == 0x03 && entry->state == 2 && entry->signal == 0x40);
+    assert (entry->changed);
+    zframe_destroy (&frame);
+
+    //  Changes only carry what changed
+    s_status_commit (line);
+    s_status_update (module, "dev2", 0x03, 5, 0x40, 7, NULL);
+    frame = s_status_encode (module);
+    assert (frame);
+    assert (s_status_merge (line, "mod1", frame) == 0);
+    assert (!s_test_entry (line, "mod1/dev1")->changed);
+    entry = s_test_entry (line, "mod1/dev2");
+    assert (entry->changed && entry->state == 5 && entry->error == 7);
+    zframe_destroy (&frame);
+
+    //  A full snapshot without dev1 removes it from the line
+    s_status_commit (line);
+    zhash_delete (module->entries, "dev1");
+    frame = s_status_frame (module, 1, module->sequence + 1);
+    assert (frame);
+    assert (s_status_merge (line, "mod1", frame) == 0);
+    assert (s_test_entry (line, "mod1/dev1")->state == STATUS_REMOVED);
+    s_status_commit (line);
+    assert (!s_test_entry (line, "mod1/dev1"));
+    assert (s_test_entry (line, "mod1/dev2"));
+    zframe_destroy (&frame);
+
+    //  A client merges the status cache of the Plant with an empty prefix
+    status_t *client = s_status_new ();
+    frame = s_status_frame (line, 1, 1);
+    assert (s_status_merge (client, "", frame) == 0);
+    assert (s_test_entry (client, "mod1/dev2"));
+
+    //  Frames without the tag, or with a torn entry, are refused
+    zframe_data (frame) [0] = PNP_STATUS [0] ^ 0x01;
+    assert (s_status_merge (client, "", frame) == -1);
+    zframe_t *torn = zframe_new (zframe_data (frame), zframe_size (frame) - 1);
+    zframe_data (torn) [0] = PNP_STATUS [0];
+    assert (s_status_merge (client, "", torn) == -1);
+    zframe_destroy (&torn);
+    zframe_destroy (&frame);
+
+    s_status_destroy (&client);
+    s_status_destroy (&line);
+    s_status_destroy (&module);
+    printf ("statustest: OK\n");
+    return 0;
+}
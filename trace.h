@@ -0,0 +1,162 @@
+#ifndef PNP_TRACE_CONTEXT
+#define PNP_TRACE_CONTEXT "Pick-n-Pack Request Tracing"
+
+//  A sampled request carries a trace frame as its last frame, from the
+//  client through the Plant down to the line and back with the reply. Every
+//  process that handles the request appends a hop, i.e. its tier, what it
+//  did and when, so the trace shows which hop cost the time. Requests that
+//  are not sampled carry no trace frame, and stamping them costs a single
+//  look at their last frame.
+//
+//  The process where a trace ends appends it to TRACE_FILE in the Chrome
+//  trace event format, which chrome://tracing and Perfetto open as is. Each
+//  tier shows up as a process, each trace as a thread, and each hop as a
+//  span lasting until the next hop. Hops are stamped with the wall clock of
+//  the host that handled them; the offsets measured by rtt.h tell how far
+//  apart those clocks are.
+//
+//  Trace frame: TAG, TRACE ID (uint64), then per hop TIER, EVENT, TIME
+//  (int64 usecs).
+
+#include <inttypes.h>
+#include "types.h"
+#include "rtt.h"
+#include "protocol.h"
+
+//  Clients trace one in TRACE_SAMPLE requests, 0 disables tracing
+#ifndef TRACE_SAMPLE
+#define TRACE_SAMPLE 0
+#endif
+
+#define TRACE_FILE      "pnp-trace.json"    //  TODO: this should be configured
+#define TRACE_HEADER    (1 + sizeof (uint64_t))
+#define TRACE_HOP       (1 + 1 + sizeof (int64_t))
+#define TRACE_HOPS_MAX  32                  //  Further hops are not recorded
+
+//  Tiers, resources use their ID byte and are named by the type registry
+#define TRACE_CLIENT    0
+#define TRACE_PLANT     7
+
+//  Events
+#define TRACE_SEND      'S'     //  Client sent the request
+#define TRACE_ENQUEUE   'E'     //  Request waits for a line
+#define TRACE_DEQUEUE   'D'     //  Request taken from the queue
+#define TRACE_FORWARD   'F'     //  Message passed on to the next tier
+#define TRACE_RECEIVE   'R'     //  Message arrived at the tier
+
+static const char *
+s_trace_tier_name (byte tier)
+{
+    switch (tier) {
+        case TRACE_CLIENT:  return "Client";
+        case TRACE_PLANT:   return "Plant";
+    }
+    return s_type_name (tier);
+}
+
+static const char *
+s_trace_event_name (byte event)
+{
+    switch (event) {
+        case TRACE_SEND:    return "send";
+        case TRACE_ENQUEUE: return "enqueue";
+        case TRACE_DEQUEUE: return "dequeue";
+        case TRACE_FORWARD: return "forward";
+        case TRACE_RECEIVE: return "receive";
+    }
+    return "unknown";
+}
+
+//  The find method returns the trace frame of <msg>, or NULL if the message
+//  is not traced
+static zframe_t *
+s_trace_find (zmsg_t *msg)
+{
+    zframe_t *frame = zmsg_last (msg);
+    if (!frame
+    ||  zframe_size (frame) < TRACE_HEADER
+    ||  (zframe_size (frame) - TRACE_HEADER) % TRACE_HOP
+    ||  zframe_data (frame) [0] != (byte) PNP_TRACE [0])
+        return NULL;
+    return frame;
+}
+
+//  The start method appends a new trace frame to one in TRACE_SAMPLE
+//  requests. Returns 1 if the request is traced.
+static int
+s_trace_start (zmsg_t *msg)
+{
+    if (TRACE_SAMPLE == 0 || random () % (TRACE_SAMPLE? TRACE_SAMPLE: 1))
+        return 0;
+    uint64_t id = ((uint64_t) random () << 32) | (uint64_t) random ();
+    zframe_t *frame = zframe_new (NULL, TRACE_HEADER);
+    zframe_data (frame) [0] = PNP_TRACE [0];
+    memcpy (zframe_data (frame) + 1, &id, sizeof (id));
+    zmsg_append (msg, &frame);
+    return 1;
+}
+
+//  The stamp method appends a hop to the trace frame of <msg>, if any
+static void
+s_trace_stamp (zmsg_t *msg, byte tier, byte event)
+{
+    zframe_t *frame = s_trace_find (msg);
+    if (!frame)
+        return;
+    size_t size = zframe_size (frame);
+    if (size >= TRACE_HEADER + TRACE_HOPS_MAX * TRACE_HOP)
+        return;
+    int64_t now = s_rtt_clock ();
+    zframe_t *stamped = zframe_new (NULL, size + TRACE_HOP);
+    byte *hop = zframe_data (stamped);
+    memcpy (hop, zframe_data (frame), size);
+    hop += size;
+    hop [0] = tier;
+    hop [1] = event;
+    memcpy (hop + 2, &now, sizeof (now));
+    zmsg_remove (msg, frame);
+    zframe_destroy (&frame);
+    zmsg_append (msg, &stamped);
+}
+
+//  The write method appends the trace of <msg>, if any, to TRACE_FILE and
+//  removes the trace frame. The closing bracket of the event array is left
+//  out, which the trace viewers accept, so every process can append.
+static void
+s_trace_write (zmsg_t *msg)
+{
+    zframe_t *frame = s_trace_find (msg);
+    if (!frame)
+        return;
+    byte *data = zframe_data (frame);
+    size_t hops = (zframe_size (frame) - TRACE_HEADER) / TRACE_HOP;
+    uint64_t id;
+    memcpy (&id, data + 1, sizeof (id));
+    FILE *file = fopen (TRACE_FILE, "a");
+    if (file) {
+        if (ftell (file) == 0)
+            fputs ("[\n", file);
+        size_t hop_nbr;
+        for (hop_nbr = 0; hop_nbr < hops; hop_nbr++) {
+            byte *hop = data + TRACE_HEADER + hop_nbr * TRACE_HOP;
+            int64_t start, end;
+            memcpy (&start, hop + 2, sizeof (start));
+            end = start;
+            if (hop_nbr + 1 < hops)
+                memcpy (&end, hop + TRACE_HOP + 2, sizeof (end));
+            fprintf (file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+                     "\"args\":{\"name\":\"%s\"}},\n", hop [0], s_trace_tier_name (hop [0]));
+            fprintf (file, "{\"name\":\"%s %s\",\"cat\":\"pnp\",\"ph\":\"X\",\"ts\":%" PRId64
+                     ",\"dur\":%" PRId64 ",\"pid\":%d,\"tid\":%" PRIu32 ",\"args\":{\"trace\":\"%016" PRIx64 "\"}},\n",
+                     s_trace_tier_name (hop [0]), s_trace_event_name (hop [1]), start,
+                     end > start? end - start: 0, hop [0], (uint32_t) id, id);
+        }
+        fclose (file);
+    }
+    else
+        printf ("E: cannot write trace to %s: %s\n", TRACE_FILE, strerror (errno));
+    zmsg_remove (msg, frame);
+    zframe_destroy (&frame);
+}
+
+#endif
@@ -0,0 +1,292 @@
+#ifndef PNP_TRAY_TRACKING
+#define PNP_TRAY_TRACKING "Pick-n-Pack Tray Tracking"
+
+//  The tracker follows each tray through the stations of the line, in the
+//  order of the tracking sequence. Stations report a tray entering and
+//  leaving with TRAY messages; a tray entering a station also leaves every
+//  station before it in the sequence, so stations that only report entry,
+//  and trays that skip a station, are tracked too. A tray that stays longer
+//  than TRACKING_TIMEOUT in a station, e.g. one taken off the line or the
+//  last station reporting no exits, is dropped as lost. Per station the
+//  tracker keeps the trays inside, their dwell time and the trays per minute
+//  that left, and it names the station with the longest dwell time as the
+//  bottleneck.
+//
+//  Each station has a fixed ring of trays, written only by the line thread,
+//  so tracking a tray takes no allocation and no lock. Counters are atomics,
+//  so the query methods can be called from any thread.
+//
+//  Tray message: ID, TRAY, EVENT, where EVENT is TRAY (uint32) and KIND
+//  (TRACKING_ENTER or TRACKING_LEAVE). The station is the type of ID.
+
+#define TRACKING_STATIONS   8       //  Stations in the sequence at most
+#define TRACKING_SLOTS      1024    //  Trays inside one station at most, a power of two
+#define TRACKING_SECONDS    60      //  Window of the throughput, secs
+#define TRACKING_EVENT      (sizeof (uint32_t) + 1)
+#define TRACKING_ENTER      1
+#define TRACKING_LEAVE      2
+#define TRACKING_ALPHA      8       //  Dwell time average weighs a new tray 1/8
+#define TRACKING_TIMEOUT    300     //  Trays inside a station longer are lost, secs
+
+//  Tracking sequence, by type
+#define TRACKING_SEQUENCE   PNP_THERMOFORMER_ID PNP_ROBOT_CELL_ID PNP_QAS_ID PNP_PRINTING_ID  //  TODO: this should be configured
+
+typedef struct {
+    uint32_t tray;
+    int64_t entered;                        //  usecs
+} tracking_slot_t;
+
+typedef struct {
+    byte type;
+    tracking_slot_t slots [TRACKING_SLOTS];
+    _Alignas (64) atomic_uint_fast64_t head;    //  Trays entered
+    atomic_uint_fast64_t tail;                  //  Trays left
+    atomic_int_fast64_t dwell;                  //  Average dwell time, usecs
+    atomic_uint_fast64_t seconds [TRACKING_SECONDS];  //  Second << 24 | trays left in that second
+} tracking_station_t;
+
+typedef struct {
+    tracking_station_t stations [TRACKING_STATIONS];
+    size_t station_count;
+    byte index [256];               //  Station of each type, plus 1, 0 if not in the sequence
+    atomic_size_t unmatched;        //  Trays that left a station they were not seen entering
+    atomic_size_t overflows;        //  Trays not tracked, their station was full
+    atomic_size_t lost;             //  Trays dropped after TRACKING_TIMEOUT
+} tracking_t;
+
+//  Construct new tracker for the <count> stations of types <sequence>
+static tracking_t *
+s_tracking_new (const byte *sequence, size_t count)
+{
+    tracking_t *self = (tracking_t *) zmalloc (sizeof (tracking_t));
+    size_t station_nbr;
+    for (station_nbr = 0; station_nbr < count && station_nbr < TRACKING_STATIONS; station_nbr++) {
+        tracking_station_t *station = &self->stations [station_nbr];
+        station->type = sequence [station_nbr];
+        atomic_init (&station->head, 0);
+        atomic_init (&station->tail, 0);
+        atomic_init (&station->dwell, 0);
+        self->index [station->type] = (byte) (station_nbr + 1);
+    }
+    self->station_count = station_nbr;
+    return self;
+}
+
+static void
+s_tracking_destroy (tracking_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+static tracking_station_t *
+s_tracking_station (tracking_t *self, byte type)
+{
+    return self->index [type]? &self->stations [self->index [type] - 1]: NULL;
+}
+
+//  Count a tray that left <station> at <now>, after <dwell> usecs
+static void
+s_tracking_left (tracking_station_t *station, int64_t dwell, int64_t now)
+{
+    int64_t average = atomic_load_explicit (&station->dwell, memory_order_relaxed);
+    average = average? average + (dwell - average) / TRACKING_ALPHA: dwell;
+    atomic_store_explicit (&station->dwell, average, memory_order_relaxed);
+    uint64_t second = (uint64_t) (now / 1000000);
+    atomic_uint_fast64_t *bucket = &station->seconds [second % TRACKING_SECONDS];
+    uint64_t value = atomic_load_explicit (bucket, memory_order_relaxed);
+    value = value >> 24 == second? value + 1: second << 24 | 1;
+    atomic_store_explicit (bucket, value, memory_order_relaxed);
+}
+
+//  The find method returns the position of <tray> in <station>, or its head if the
+//  tray is not inside. Trays mostly leave in the order they entered, i.e. from the tail.
+static uint64_t
+s_tracking_find (tracking_station_t *station, uint32_t tray)
+{
+    uint64_t head = atomic_load_explicit (&station->head, memory_order_relaxed);
+    uint64_t position = atomic_load_explicit (&station->tail, memory_order_relaxed);
+    for (; position < head; position++)
+        if (station->slots [position & (TRACKING_SLOTS - 1)].tray == tray)
+            break;
+    return position;
+}
+
+//  Remove the tray at <position> from <station>, which it left at <now>
+static void
+s_tracking_remove (tracking_station_t *station, uint64_t position, int64_t now)
+{
+    uint64_t tail = atomic_load_explicit (&station->tail, memory_order_relaxed);
+    int64_t entered = station->slots [position & (TRACKING_SLOTS - 1)].entered;
+    //  A tray overtaken by another, e.g. a rejected one, closes its gap
+    for (; position > tail; position--)
+        station->slots [position & (TRACKING_SLOTS - 1)] = station->slots [(position - 1) & (TRACKING_SLOTS - 1)];
+    atomic_store_explicit (&station->tail, tail + 1, memory_order_release);
+    s_tracking_left (station, now - entered, now);
+}
+
+//  The leave method records <tray> leaving the station of type <type> at <now>, usecs.
+//  Returns 0, or -1 if the tray was not seen entering the station.
+static int
+s_tracking_leave (tracking_t *self, byte type, uint32_t tray, int64_t now)
+{
+    tracking_station_t *station = s_tracking_station (self, type);
+    if (!station)
+        return -1;
+    uint64_t position = s_tracking_find (station, tray);
+    if (position == atomic_load_explicit (&station->head, memory_order_relaxed)) {
+        atomic_fetch_add (&self->unmatched, 1);
+        return -1;
+    }
+    s_tracking_remove (station, position, now);
+    return 0;
+}
+
+//  The enter method records <tray> entering the station of type <type> at <now>, usecs,
+//  and leaving any station before it in the sequence it is still in. Returns 0, or -1 if
+//  the station is not tracked or full.
+static int
+s_tracking_enter (tracking_t *self, byte type, uint32_t tray, int64_t now)
+{
+    tracking_station_t *station = s_tracking_station (self, type);
+    if (!station)
+        return -1;
+    tracking_station_t *previous;
+    for (previous = self->stations; previous < station; previous++) {
+        uint64_t position = s_tracking_find (previous, tray);
+        if (position < atomic_load_explicit (&previous->head, memory_order_relaxed))
+            s_tracking_remove (previous, position, now);
+    }
+    uint64_t head = atomic_load_explicit (&station->head, memory_order_relaxed);
+    if (head - atomic_load_explicit (&station->tail, memory_order_relaxed) >= TRACKING_SLOTS) {
+        atomic_fetch_add (&self->overflows, 1);
+        return -1;
+    }
+    station->slots [head & (TRACKING_SLOTS - 1)].tray = tray;
+    station->slots [head & (TRACKING_SLOTS - 1)].entered = now;
+    atomic_store_explicit (&station->head, head + 1, memory_order_release);
+    return 0;
+}
+
+//  The expire method drops trays that entered a station more than TRACKING_TIMEOUT
+//  before <now>, usecs, without counting them as left. Trays enter in order, so the
+//  oldest tray of a station is at its tail.
+static void
+s_tracking_expire (tracking_t *self, int64_t now)
+{
+    size_t station_nbr;
+    for (station_nbr = 0; station_nbr < self->station_count; station_nbr++) {
+        tracking_station_t *station = &self->stations [station_nbr];
+        uint64_t head = atomic_load_explicit (&station->head, memory_order_relaxed);
+        uint64_t tail = atomic_load_explicit (&station->tail, memory_order_relaxed);
+        while (tail < head
+        &&  now - station->slots [tail & (TRACKING_SLOTS - 1)].entered > TRACKING_TIMEOUT * 1000000LL) {
+            tail++;
+            atomic_fetch_add (&self->lost, 1);
+        }
+        atomic_store_explicit (&station->tail, tail, memory_order_release);
+    }
+}
+
+//  The event method applies a TRAY message, i.e. ID, TRAY, EVENT. Returns 0, or -1 if
+//  the message is malformed or the tray could not be tracked.
+static int
+s_tracking_event (tracking_t *self, zmsg_t *msg)
+{
+    zframe_t *id = zmsg_first (msg);
+    zmsg_next (msg);
+    zframe_t *frame = zmsg_next (msg);
+    if (!frame || zframe_size (frame) != TRACKING_EVENT)
+        return -1;
+    uint32_t tray;
+    memcpy (&tray, zframe_data (frame), sizeof (tray));
+    byte kind = zframe_data (frame) [sizeof (tray)];
+    if (kind == TRACKING_ENTER)
+        return s_tracking_enter (self, s_type_of (id), tray, zclock_usecs ());
+    if (kind == TRACKING_LEAVE)
+        return s_tracking_leave (self, s_type_of (id), tray, zclock_usecs ());
+    return -1;
+}
+
+//  The WIP method returns the number of trays inside the station of type <type>
+static size_t
+s_tracking_wip (tracking_t *self, byte type)
+{
+    tracking_station_t *station = s_tracking_station (self, type);
+    if (!station)
+        return 0;
+    uint64_t tail = atomic_load_explicit (&station->tail, memory_order_acquire);
+    return (size_t) (atomic_load_explicit (&station->head, memory_order_acquire) - tail);
+}
+
+//  The throughput method returns the trays per minute that left the station of type
+//  <type> over the last TRACKING_SECONDS
+static double
+s_tracking_throughput (tracking_t *self, byte type)
+{
+    tracking_station_t *station = s_tracking_station (self, type);
+    if (!station)
+        return 0;
+    uint64_t now = (uint64_t) (zclock_usecs () / 1000000);
+    uint64_t trays = 0;
+    size_t second_nbr;
+    for (second_nbr = 0; second_nbr < TRACKING_SECONDS; second_nbr++) {
+        uint64_t value = atomic_load_explicit (&station->seconds [second_nbr], memory_order_relaxed);
+        if ((value >> 24) + TRACKING_SECONDS > now)
+            trays += value & 0xffffff;
+    }
+    return trays * 60.0 / TRACKING_SECONDS;
+}
+
+//  The dwell method returns the average usecs a tray spends in the station of type <type>
+static int64_t
+s_tracking_dwell (tracking_t *self, byte type)
+{
+    tracking_station_t *station = s_tracking_station (self, type);
+    return station? atomic_load_explicit (&station->dwell, memory_order_relaxed): 0;
+}
+
+//  The bottleneck method returns the type of the station with the longest average dwell
+//  time, or 0 if no tray has left any station yet
+static byte
+s_tracking_bottleneck (tracking_t *self)
+{
+    byte bottleneck = 0;
+    int64_t longest = 0;
+    size_t station_nbr;
+    for (station_nbr = 0; station_nbr < self->station_count; station_nbr++) {
+        tracking_station_t *station = &self->stations [station_nbr];
+        int64_t dwell = atomic_load_explicit (&station->dwell, memory_order_relaxed);
+        if (dwell > longest) {
+            longest = dwell;
+            bottleneck = station->type;
+        }
+    }
+    return bottleneck;
+}
+
+//  The report method prints WIP, throughput and dwell time of every station, once
+//  trays are reported
+static void
+s_tracking_report (tracking_t *self, const char *name)
+{
+    if (!self || !atomic_load (&self->stations [0].head))
+        return;
+    size_t station_nbr;
+    for (station_nbr = 0; station_nbr < self->station_count; station_nbr++) {
+        byte type = self->stations [station_nbr].type;
+        printf ("[%s] TRAYS %-12s %4zu wip %8.1f/min dwell %8.3f secs\n", name, s_type_name (type),
+                s_tracking_wip (self, type), s_tracking_throughput (self, type),
+                s_tracking_dwell (self, type) / 1e6);
+    }
+    byte bottleneck = s_tracking_bottleneck (self);
+    if (bottleneck)
+        printf ("[%s] TRAYS bottleneck %s, %zu unmatched, %zu overflows, %zu lost\n", name,
+                s_type_name (bottleneck), atomic_load (&self->unmatched), atomic_load (&self->overflows),
+                atomic_load (&self->lost));
+}
+
+#endif
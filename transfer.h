@@ -0,0 +1,500 @@
+#ifndef PNP_BULK_TRANSFER
+#define PNP_BULK_TRANSFER "Pick-n-Pack Bulk Transfer"
+
+//  A transfer pushes a named blob, e.g. a recipe or firmware image, from a
+//  tier down to all its backend resources at once, in chunks. Receivers pace
+//  the sender with credit: the sender has at most TRANSFER_WINDOW bytes in
+//  flight to each receiver, and sends at most TRANSFER_BURST chunks per turn
+//  of its work loop, round robin over its receivers. So a heartbeat never
+//  queues behind more than a window of data, and the loop never stalls.
+//
+//  The sender offers each blob to each backend resource. The receiver
+//  answers with the offset it already has, so a transfer broken off by a
+//  reconnect resumes where it stopped: the new connection gets a new offer,
+//  and the sender rewinds to that offset. Every chunk carries a CRC-32, and
+//  the offer the CRC-32 of the whole blob; a chunk that fails its check is
+//  asked for again, a blob that fails its check is transferred again.
+//
+//  Offer:  TRANSFER, NAME, SIZE (uint64) DIGEST (uint32)
+//  Chunk:  TRANSFER, NAME, OFFSET (uint64) CRC (uint32), DATA
+//  Credit: ID, TRANSFER, NAME, OFFSET (uint64) WINDOW (uint32) FLAGS (byte)
+//
+//  The credit says the receiver has OFFSET bytes and takes WINDOW more. With
+//  TRANSFER_REWIND the sender continues from OFFSET, otherwise it keeps on
+//  sending what is in flight.
+
+#define TRANSFER_CHUNK      (64 * 1024)         //  Bytes per chunk
+#define TRANSFER_WINDOW     (4 * TRANSFER_CHUNK) //  Bytes in flight per receiver
+#define TRANSFER_BURST      16                  //  Chunks per turn of the work loop
+#define TRANSFER_MAX        (256 * 1024 * 1024) //  Bytes per blob at most
+#define TRANSFER_NAME_MAX   64
+#define TRANSFER_TIMEOUT    3000                //  msecs without credit before offering again
+#define TRANSFER_HEADER     (sizeof (uint64_t) + sizeof (uint32_t))
+#define TRANSFER_CREDIT     (sizeof (uint64_t) + sizeof (uint32_t) + 1)
+#define TRANSFER_REWIND     1
+#define TRANSFER_DIR        "transfers"         //  TODO: this should be configured
+
+//  Sends a transfer message on the socket of the caller
+typedef void (transfer_send_fn) (void *args, zmsg_t **msg_p);
+
+typedef struct {
+    char name [TRANSFER_NAME_MAX];
+    byte *data;
+    size_t size;
+    uint32_t digest;            //  CRC-32 of data
+} transfer_blob_t;
+
+//  A session is one blob going to one receiver
+typedef struct {
+    transfer_blob_t *blob;
+    zframe_t *identity;
+    uint64_t offset;            //  Next byte to send
+    uint64_t limit;             //  Bytes we may send up to
+    int64_t heard;              //  Last offer or credit, msecs
+    size_t generation;          //  Last offer round the receiver was there
+    int done;
+} transfer_session_t;
+
+//  An incoming blob, kept when complete so a repeated offer is answered at once
+typedef struct {
+    char name [TRANSFER_NAME_MAX];
+    byte *data;
+    uint64_t size;
+    uint64_t received;
+    uint32_t digest;            //  CRC-32 of the whole blob, from the offer
+    uint32_t crc;               //  CRC-32 of the bytes received
+    int complete;
+} transfer_incoming_t;
+
+typedef struct {
+    zlist_t *blobs;             //  Blobs we send
+    zlist_t *sessions;          //  Blobs going to receivers, in round robin order
+    size_t generation;
+    zhash_t *incoming;          //  Blobs we receive, by name
+    size_t failures;            //  Chunks and blobs that failed their check
+} transfer_t;
+
+static uint32_t s_crc_table [256];
+
+//  The CRC method continues the CRC-32 <crc> over <size> bytes of <data>
+static uint32_t
+s_crc32 (uint32_t crc, const byte *data, size_t size)
+{
+    if (!s_crc_table [1]) {
+        uint32_t value;
+        for (value = 0; value < 256; value++) {
+            uint32_t entry = value;
+            int bit;
+            for (bit = 0; bit < 8; bit++)
+                entry = entry & 1? 0xEDB88320 ^ (entry >> 1): entry >> 1;
+            s_crc_table [value] = entry;
+        }
+    }
+    crc = ~crc;
+    while (size--)
+        crc = s_crc_table [(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static transfer_t *
+s_transfer_new (void)
+{
+    transfer_t *self = (transfer_t *) zmalloc (sizeof (transfer_t));
+    self->blobs = zlist_new ();
+    self->sessions = zlist_new ();
+    self->incoming = zhash_new ();
+    return self;
+}
+
+static void
+s_transfer_incoming_free (void *data)
+{
+    transfer_incoming_t *incoming = (transfer_incoming_t *) data;
+    free (incoming->data);
+    free (incoming);
+}
+
+static void
+s_transfer_session_destroy (transfer_session_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        zframe_destroy (&(*self_p)->identity);
+        free (*self_p);
+        *self_p = NULL;
+    }
+}
+
+static void
+s_transfer_destroy (transfer_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        transfer_t *self = *self_p;
+        while (zlist_size (self->sessions)) {
+            transfer_session_t *session = (transfer_session_t *) zlist_pop (self->sessions);
+            s_transfer_session_destroy (&session);
+        }
+        zlist_destroy (&self->sessions);
+        while (zlist_size (self->blobs)) {
+            transfer_blob_t *blob = (transfer_blob_t *) zlist_pop (self->blobs);
+            free (blob->data);
+            free (blob);
+        }
+        zlist_destroy (&self->blobs);
+        zhash_destroy (&self->incoming);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  Names are file names in TRANSFER_DIR, so they cannot hold a path
+static int
+s_transfer_name_valid (const char *name, size_t size)
+{
+    if (size == 0 || size >= TRANSFER_NAME_MAX || name [0] == '.')
+        return 0;
+    size_t index;
+    for (index = 0; index < size; index++)
+        if (name [index] == '/' || name [index] == '\\' || name [index] == 0)
+            return 0;
+    return 1;
+}
+
+//  The add method copies <data> as blob <name> to send to every receiver. A blob
+//  of the same name is replaced, and sent again. Returns 0, or -1 if the name or
+//  size is not valid.
+static int
+s_transfer_add (transfer_t *self, const char *name, const byte *data, size_t size)
+{
+    if (!s_transfer_name_valid (name, strlen (name)) || size > TRANSFER_MAX)
+        return -1;
+    transfer_blob_t *blob = (transfer_blob_t *) zlist_first (self->blobs);
+    while (blob && strcmp (blob->name, name))
+        blob = (transfer_blob_t *) zlist_next (self->blobs);
+    if (blob) {
+        transfer_session_t *session = (transfer_session_t *) zlist_first (self->sessions);
+        while (session) {
+            transfer_session_t *next = (transfer_session_t *) zlist_next (self->sessions);
+            if (session->blob == blob) {
+                zlist_remove (self->sessions, session);
+                s_transfer_session_destroy (&session);
+            }
+            session = next;
+        }
+        free (blob->data);
+    }
+    else {
+        blob = (transfer_blob_t *) zmalloc (sizeof (transfer_blob_t));
+        snprintf (blob->name, sizeof (blob->name), "%s", name);
+        zlist_append (self->blobs, blob);
+    }
+    blob->data = (byte *) malloc (size? size: 1);
+    memcpy (blob->data, data, size);
+    blob->size = size;
+    blob->digest = s_crc32 (0, data, size);
+    return 0;
+}
+
+//  The load method adds the file <filename> as blob, named after the file. Returns 0,
+//  or -1 if the file cannot be read or is not valid as blob.
+static int
+s_transfer_load (transfer_t *self, const char *filename)
+{
+    const char *name = strrchr (filename, '/');
+    name = name? name + 1: filename;
+    FILE *file = fopen (filename, "rb");
+    if (!file) {
+        printf ("E: cannot read %s: %s\n", filename, strerror (errno));
+        return -1;
+    }
+    fseek (file, 0, SEEK_END);
+    long size = ftell (file);
+    fseek (file, 0, SEEK_SET);
+    byte *data = (byte *) malloc (size > 0? size: 1);
+    int rc = size >= 0 && fread (data, 1, size, file) == (size_t) size? 0: -1;
+    fclose (file);
+    if (rc == 0)
+        rc = s_transfer_add (self, name, data, size);
+    if (rc == -1)
+        printf ("E: cannot transfer %s\n", filename);
+    free (data);
+    return rc;
+}
+
+static void
+s_transfer_offer_send (transfer_session_t *session, transfer_send_fn *send, void *args)
+{
+    transfer_blob_t *blob = session->blob;
+    byte header [TRANSFER_HEADER];
+    uint64_t size = blob->size;
+    memcpy (header, &size, sizeof (size));
+    memcpy (header + sizeof (size), &blob->digest, sizeof (blob->digest));
+    zmsg_t *msg = zmsg_new ();
+    zframe_t *frame = zframe_dup (session->identity);
+    zmsg_append (msg, &frame);
+    zmsg_addmem (msg, PNP_TRANSFER, 1);
+    zmsg_addstr (msg, blob->name);
+    zmsg_addmem (msg, header, sizeof (header));
+    send (args, &msg);
+    session->heard = zclock_time ();
+}
+
+//  The offer method offers every blob to the receiver with <identity> that it has not
+//  been offered yet, and offers again the blobs whose receiver went quiet. Call it
+//  for every receiver, then s_transfer_sweep, in each offer round.
+static void
+s_transfer_offer (transfer_t *self, zframe_t *identity, transfer_send_fn *send, void *args)
+{
+    transfer_blob_t *blob = (transfer_blob_t *) zlist_first (self->blobs);
+    while (blob) {
+        transfer_session_t *session = (transfer_session_t *) zlist_first (self->sessions);
+        while (session && (session->blob != blob || !zframe_eq (session->identity, identity)))
+            session = (transfer_session_t *) zlist_next (self->sessions);
+        if (!session) {
+            session = (transfer_session_t *) zmalloc (sizeof (transfer_session_t));
+            session->blob = blob;
+            session->identity = zframe_dup (identity);
+            zlist_append (self->sessions, session);
+            s_transfer_offer_send (session, send, args);
+        }
+        else
+        if (!session->done && zclock_time () - session->heard > TRANSFER_TIMEOUT)
+            s_transfer_offer_send (session, send, args);
+        session->generation = self->generation;
+        blob = (transfer_blob_t *) zlist_next (self->blobs);
+    }
+}
+
+//  The sweep method ends the sessions of receivers that were not offered anything in
+//  this offer round, i.e. are gone, and starts the next round
+static void
+s_transfer_sweep (transfer_t *self)
+{
+    transfer_session_t *session = (transfer_session_t *) zlist_first (self->sessions);
+    while (session) {
+        transfer_session_t *next = (transfer_session_t *) zlist_next (self->sessions);
+        if (session->generation != self->generation) {
+            zlist_remove (self->sessions, session);
+            s_transfer_session_destroy (&session);
+        }
+        session = next;
+    }
+    self->generation++;
+}
+
+//  The credit method applies a credit message from the receiver with <identity>, i.e.
+//  ID, TRANSFER, NAME, CREDIT
+static void
+s_transfer_credit (transfer_t *self, zframe_t *identity, zmsg_t *msg)
+{
+    zmsg_first (msg);
+    zmsg_next (msg);
+    zframe_t *name = zmsg_next (msg);
+    zframe_t *frame = zmsg_next (msg);
+    if (!name || !frame || zframe_size (frame) != TRANSFER_CREDIT)
+        return;
+    transfer_session_t *session = (transfer_session_t *) zlist_first (self->sessions);
+    while (session && (!zframe_streq (name, session->blob->name) || !zframe_eq (session->identity, identity)))
+        session = (transfer_session_t *) zlist_next (self->sessions);
+    if (!session)
+        return;
+    uint64_t offset;
+    uint32_t window;
+    byte *data = zframe_data (frame);
+    memcpy (&offset, data, sizeof (offset));
+    memcpy (&window, data + sizeof (offset), sizeof (window));
+    if (offset > session->blob->size)
+        return;
+    if (data [sizeof (offset) + sizeof (window)] & TRANSFER_REWIND)
+        session->offset = offset;
+    else
+    if (offset > session->offset)
+        session->offset = offset;     //  Got ahead of us after a rewind
+    session->limit = offset + window;
+    session->heard = zclock_time ();
+    if (offset == session->blob->size && !session->done) {
+        session->done = 1;
+        char *receiver = zframe_strhex (identity);
+        printf ("I: transfer of %s to %s complete\n", session->blob->name, receiver);
+        free (receiver);
+    }
+}
+
+static int
+s_transfer_sendable (transfer_session_t *session)
+{
+    return !session->done && session->offset < session->limit && session->offset < session->blob->size;
+}
+
+//  The pump method sends up to TRANSFER_BURST chunks, one per receiver with credit at a
+//  time. Returns the number of chunks sent.
+static size_t
+s_transfer_pump (transfer_t *self, transfer_send_fn *send, void *args)
+{
+    size_t sent = 0;
+    size_t idle = 0;
+    while (sent < TRANSFER_BURST && idle < zlist_size (self->sessions)) {
+        transfer_session_t *session = (transfer_session_t *) zlist_pop (self->sessions);
+        zlist_append (self->sessions, session);
+        if (!s_transfer_sendable (session)) {
+            idle++;
+            continue;
+        }
+        idle = 0;
+        transfer_blob_t *blob = session->blob;
+        uint64_t size = blob->size - session->offset;
+        if (size > session->limit - session->offset)
+            size = session->limit - session->offset;
+        if (size > TRANSFER_CHUNK)
+            size = TRANSFER_CHUNK;
+        byte header [TRANSFER_HEADER];
+        uint32_t crc = s_crc32 (0, blob->data + session->offset, size);
+        memcpy (header, &session->offset, sizeof (session->offset));
+        memcpy (header + sizeof (session->offset), &crc, sizeof (crc));
+        zmsg_t *msg = zmsg_new ();
+        zframe_t *frame = zframe_dup (session->identity);
+        zmsg_append (msg, &frame);
+        zmsg_addmem (msg, PNP_TRANSFER, 1);
+        zmsg_addstr (msg, blob->name);
+        zmsg_addmem (msg, header, sizeof (header));
+        zmsg_addmem (msg, blob->data + session->offset, size);
+        send (args, &msg);
+        session->offset += size;
+        sent++;
+    }
+    return sent;
+}
+
+//  The timeout method returns how many msecs a poll may wait, at most <timeout>: none
+//  while a receiver has credit we did not use
+static int64_t
+s_transfer_timeout (transfer_t *self, int64_t timeout)
+{
+    if (!self)
+        return timeout;
+    transfer_session_t *session = (transfer_session_t *) zlist_first (self->sessions);
+    while (session && !s_transfer_sendable (session))
+        session = (transfer_session_t *) zlist_next (self->sessions);
+    return session? 0: timeout;
+}
+
+static void
+s_transfer_credit_send (transfer_incoming_t *incoming, const char *uuid, uint32_t window, byte flags,
+                        transfer_send_fn *send, void *args)
+{
+    byte credit [TRANSFER_CREDIT];
+    memcpy (credit, &incoming->received, sizeof (incoming->received));
+    memcpy (credit + sizeof (incoming->received), &window, sizeof (window));
+    credit [sizeof (incoming->received) + sizeof (window)] = flags;
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, uuid, strlen (uuid) + 1);
+    zmsg_addmem (msg, PNP_TRANSFER, 1);
+    zmsg_addstr (msg, incoming->name);
+    zmsg_addmem (msg, credit, sizeof (credit));
+    send (args, &msg);
+}
+
+//  The receive method handles an offer or chunk from our frontend, and answers with
+//  credit as <uuid>. Returns the incoming blob once it is complete and checked, else
+//  NULL.
+static transfer_incoming_t *
+s_transfer_receive (transfer_t *self, zmsg_t *msg, const char *uuid, transfer_send_fn *send, void *args)
+{
+    zmsg_first (msg);
+    zframe_t *frame = zmsg_next (msg);
+    if (!frame || !s_transfer_name_valid ((char *) zframe_data (frame), zframe_size (frame)))
+        return NULL;
+    char *name = zframe_strdup (frame);
+    transfer_incoming_t *incoming = (transfer_incoming_t *) zhash_lookup (self->incoming, name);
+    frame = zmsg_next (msg);
+    zframe_t *data = zmsg_next (msg);
+    if (!frame || zframe_size (frame) != TRANSFER_HEADER) {
+        free (name);
+        return NULL;
+    }
+    uint64_t value;
+    uint32_t crc;
+    memcpy (&value, zframe_data (frame), sizeof (value));
+    memcpy (&crc, zframe_data (frame) + sizeof (value), sizeof (crc));
+    if (!data) {
+        //  Offer of VALUE bytes with digest CRC, resumed if we have the start of it
+        if (incoming && (incoming->size != value || incoming->digest != crc)) {
+            zhash_delete (self->incoming, name);
+            incoming = NULL;
+        }
+        if (!incoming) {
+            if (value > TRANSFER_MAX) {
+                printf ("E: transfer of %s is too large\n", name);
+                free (name);
+                return NULL;
+            }
+            incoming = (transfer_incoming_t *) zmalloc (sizeof (transfer_incoming_t));
+            snprintf (incoming->name, sizeof (incoming->name), "%s", name);
+            incoming->data = (byte *) malloc (value? value: 1);
+            incoming->size = value;
+            incoming->digest = crc;
+            zhash_insert (self->incoming, name, incoming);
+            zhash_freefn (self->incoming, name, s_transfer_incoming_free);
+        }
+        free (name);
+        if (incoming->complete) {
+            s_transfer_credit_send (incoming, uuid, 0, TRANSFER_REWIND, send, args);
+            return NULL;
+        }
+        if (incoming->size == 0 && crc == 0) {
+            incoming->complete = 1;
+            s_transfer_credit_send (incoming, uuid, 0, TRANSFER_REWIND, send, args);
+            return incoming;
+        }
+        s_transfer_credit_send (incoming, uuid, TRANSFER_WINDOW, TRANSFER_REWIND, send, args);
+        return NULL;
+    }
+    free (name);
+    //  Chunk at offset VALUE, chunks still in flight from before a rewind are dropped
+    if (!incoming || incoming->complete || value != incoming->received)
+        return NULL;
+    size_t size = zframe_size (data);
+    if (size > incoming->size - incoming->received || s_crc32 (0, zframe_data (data), size) != crc) {
+        self->failures++;
+        s_transfer_credit_send (incoming, uuid, TRANSFER_WINDOW, TRANSFER_REWIND, send, args);
+        return NULL;
+    }
+    memcpy (incoming->data + incoming->received, zframe_data (data), size);
+    incoming->received += size;
+    incoming->crc = s_crc32 (incoming->crc, zframe_data (data), size);
+    if (incoming->received < incoming->size) {
+        s_transfer_credit_send (incoming, uuid, TRANSFER_WINDOW, 0, send, args);
+        return NULL;
+    }
+    if (incoming->crc != incoming->digest) {
+        printf ("E: transfer of %s failed its check, starting again\n", incoming->name);
+        self->failures++;
+        incoming->received = 0;
+        incoming->crc = 0;
+        s_transfer_credit_send (incoming, uuid, TRANSFER_WINDOW, TRANSFER_REWIND, send, args);
+        return NULL;
+    }
+    incoming->complete = 1;
+    s_transfer_credit_send (incoming, uuid, 0, 0, send, args);
+    return incoming;
+}
+
+//  The save method writes a complete incoming blob to TRANSFER_DIR. Returns 0, or -1
+//  if the file cannot be written.
+static int
+s_transfer_save (transfer_incoming_t *incoming)
+{
+    zsys_dir_create (TRANSFER_DIR);
+    char filename [sizeof (TRANSFER_DIR) + TRANSFER_NAME_MAX + 1];
+    snprintf (filename, sizeof (filename), "%s/%s", TRANSFER_DIR, incoming->name);
+    FILE *file = fopen (filename, "wb");
+    int rc = file && fwrite (incoming->data, 1, incoming->size, file) == incoming->size? 0: -1;
+    if (file && fclose (file))
+        rc = -1;
+    if (rc == -1)
+        printf ("E: cannot write %s: %s\n", filename, strerror (errno));
+    return rc;
+}
+
+#endif
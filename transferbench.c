@@ -0,0 +1,190 @@
+//  Pick-n-Pack transfer benchmark
+//
+//  Measures the aggregate rate of a bulk transfer (transfer.h) from one
+//  sender to many receivers, as a line or module pushes a blob to its
+//  backend resources. The sender plays the tier: a ROUTER that heartbeats
+//  every receiver every BENCH_HEARTBEAT msecs on the same socket, offers the
+//  blob and pumps chunks between polls. Each receiver plays a device in a
+//  thread of its own, and records how late heartbeats arrive while the
+//  transfer runs.
+//
+//  Usage: transferbench [-n receivers] [-s size in KB]
+
+#include "czmq.h"
+#include "defs.h"
+
+#define BENCH_RECEIVERS 100
+#define BENCH_SIZE      (4 * 1024)      //  KB
+#define BENCH_HEARTBEAT 100             //  msecs
+#define BENCH_TCP       "tcp://127.0.0.1:9097"
+
+//  The bench does not run the state machine
+resource_t *creating (resource_t *self, zsock_t *pipe, char *name) { (void) pipe; (void) name; return self; }
+int initializing (resource_t *self) { (void) self; return 0; }
+int configuring (resource_t *self) { (void) self; return 0; }
+int running (resource_t *self) { (void) self; return 0; }
+int pausing (resource_t *self) { (void) self; return 0; }
+int finalizing (resource_t *self) { (void) self; return 0; }
+int deleting (resource_t *self) { (void) self; return 0; }
+
+typedef struct {
+    int64_t late;               //  Latest heartbeat arrival after it was sent, usecs
+    int complete;
+} receiver_t;
+
+static void
+s_send (void *args, zmsg_t **msg_p)
+{
+    zmsg_send (msg_p, (zsock_t *) args);
+}
+
+//  The receiver thread plays a device
+static void
+s_receiver (zsock_t *pipe, void *args)
+{
+    receiver_t *self = (receiver_t *) args;
+    zsock_t *socket = zsock_new_dealer (BENCH_TCP);
+    assert (socket);
+    transfer_t *transfer = s_transfer_new ();
+    zsock_signal (pipe, 0);
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, PNP_QAS_ID, sizeof (PNP_QAS_ID));
+    zmsg_addmem (msg, PNP_READY, sizeof (PNP_READY));
+    zmsg_send (&msg, socket);
+
+    zpoller_t *poller = zpoller_new (pipe, socket, NULL);
+    while (!zsys_interrupted) {
+        void *which = zpoller_wait (poller, -1);
+        if (which != socket)
+            break;              //  $TERM or interrupted
+        msg = zmsg_recv (socket);
+        if (!msg)
+            break;
+        zframe_t *frame = zmsg_first (msg);
+        if (memcmp (zframe_data (frame), PNP_HEARTBEAT, 1) == 0) {
+            int64_t sent;
+            memcpy (&sent, zframe_data (zmsg_next (msg)), sizeof (sent));
+            int64_t late = zclock_usecs () - sent;
+            if (late > self->late)
+                self->late = late;
+        }
+        else
+        if (memcmp (zframe_data (frame), PNP_TRANSFER, 1) == 0
+        &&  s_transfer_receive (transfer, msg, PNP_QAS_ID, s_send, socket))
+            self->complete = 1;
+        zmsg_destroy (&msg);
+    }
+    zpoller_destroy (&poller);
+    s_transfer_destroy (&transfer);
+    zsock_destroy (&socket);
+}
+
+int main (int argc, char *argv [])
+{
+    size_t receiver_count = BENCH_RECEIVERS;
+    size_t size = BENCH_SIZE;
+    int argn;
+    for (argn = 1; argn < argc; argn++) {
+        if (streq (argv [argn], "-n") && argn + 1 < argc)
+            receiver_count = atol (argv [++argn]);
+        else
+        if (streq (argv [argn], "-s") && argn + 1 < argc)
+            size = atol (argv [++argn]);
+        else {
+            printf ("usage: transferbench [-n receivers] [-s size in KB]\n");
+            return 1;
+        }
+    }
+    size *= 1024;
+    byte *blob = (byte *) malloc (size? size: 1);
+    size_t index;
+    for (index = 0; index < size; index++)
+        blob [index] = (byte) random ();
+
+    zsock_t *socket = zsock_new_router (BENCH_TCP);
+    assert (socket);
+    transfer_t *transfer = s_transfer_new ();
+    s_transfer_add (transfer, "bench.bin", blob, size);
+    receiver_t *receivers = (receiver_t *) zmalloc (receiver_count * sizeof (receiver_t));
+    zactor_t **actors = (zactor_t **) zmalloc (receiver_count * sizeof (zactor_t *));
+    for (index = 0; index < receiver_count; index++)
+        actors [index] = zactor_new (s_receiver, &receivers [index]);
+
+    //  Wait for all receivers, then start the transfer and the heartbeats
+    zlist_t *identities = zlist_new ();
+    while (zlist_size (identities) < receiver_count && !zsys_interrupted) {
+        zmsg_t *msg = zmsg_recv (socket);
+        if (!msg)
+            break;
+        zlist_append (identities, zmsg_pop (msg));
+        zmsg_destroy (&msg);
+    }
+    printf ("%zu receivers, %zu KB each\n", receiver_count, size / 1024);
+    int64_t started = zclock_usecs ();
+    int64_t heartbeat_at = 0;
+    size_t done = 0;
+    size_t chunks = 0;
+    while (done < receiver_count && !zsys_interrupted) {
+        if (zclock_time () >= heartbeat_at) {
+            zframe_t *identity = (zframe_t *) zlist_first (identities);
+            while (identity) {
+                zmsg_t *msg = zmsg_new ();
+                zframe_t *frame = zframe_dup (identity);
+                zmsg_append (msg, &frame);
+                zmsg_addmem (msg, PNP_HEARTBEAT, 1);
+                int64_t now = zclock_usecs ();
+                zmsg_addmem (msg, &now, sizeof (now));
+                zmsg_send (&msg, socket);
+                s_transfer_offer (transfer, identity, s_send, socket);
+                identity = (zframe_t *) zlist_next (identities);
+            }
+            s_transfer_sweep (transfer);
+            heartbeat_at = zclock_time () + BENCH_HEARTBEAT;
+        }
+        zmq_pollitem_t items [] = { { zsock_resolve (socket), 0, ZMQ_POLLIN, 0 } };
+        if (zmq_poll (items, 1, s_transfer_timeout (transfer, BENCH_HEARTBEAT) * ZMQ_POLL_MSEC) == -1)
+            break;
+        while (zsock_events (socket) & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (socket);
+            if (!msg)
+                break;
+            zframe_t *identity = zmsg_pop (msg);
+            s_transfer_credit (transfer, identity, msg);
+            zframe_destroy (&identity);
+            zmsg_destroy (&msg);
+        }
+        chunks += s_transfer_pump (transfer, s_send, socket);
+        done = 0;
+        transfer_session_t *session = (transfer_session_t *) zlist_first (transfer->sessions);
+        while (session) {
+            done += session->done;
+            session = (transfer_session_t *) zlist_next (transfer->sessions);
+        }
+    }
+    int64_t elapsed = zclock_usecs () - started;
+    for (index = 0; index < receiver_count; index++)
+        zactor_destroy (&actors [index]);
+
+    size_t complete = 0;
+    int64_t late = 0;
+    for (index = 0; index < receiver_count; index++) {
+        complete += receivers [index].complete;
+        if (receivers [index].late > late)
+            late = receivers [index].late;
+    }
+    printf ("%zu of %zu complete in %.3f secs, %zu chunks\n", complete, receiver_count, elapsed / 1e6, chunks);
+    printf ("aggregate %.1f MB/sec, latest heartbeat %.3f msecs after it was sent\n",
+            elapsed > 0? (double) size * done / (1024 * 1024) / (elapsed / 1e6): 0, late / 1e3);
+
+    while (zlist_size (identities)) {
+        zframe_t *identity = (zframe_t *) zlist_pop (identities);
+        zframe_destroy (&identity);
+    }
+    zlist_destroy (&identities);
+    free (actors);
+    free (receivers);
+    s_transfer_destroy (&transfer);
+    zsock_destroy (&socket);
+    free (blob);
+    return 0;
+}
@@ -0,0 +1,171 @@
+#ifndef PNP_TYPES
+#define PNP_TYPES "Pick-n-Pack Resource Types"
+
+//  The type registry describes every kind of equipment by its ID byte, i.e.
+//  the first byte of READY and heartbeat messages, so looking a type up is a
+//  single array index. Each type has a name, capabilities, heartbeat
+//  parameters and the types of backend resources it expects. The built-in
+//  types below can be changed and new types added from TYPES_CONFIG at
+//  startup, so new equipment needs no code changes:
+//
+//  types
+//      line
+//          id = 010                #   ID byte, numbers may be octal or hex
+//          name = Line
+//          capabilities = 0x01
+//          interval = 1000         #   Heartbeat interval, msecs
+//          liveness = 3
+//          threshold = 8           #   Suspicion at which it expires, see accrual.h,
+//                                  #   negative to expire after liveness heartbeats
+//          children = 013, 015     #   Expected backend resource types
+//
+//  Resources expire once the suspicion of the accrual detector reaches the
+//  threshold of their type, 8 unless it sets another. On a jittery link that
+//  saves the false expiries of a fixed liveness of 3, at the price of a
+//  fraction of a second on a clean one; a threshold low enough to be faster
+//  there expires live resources too. A type that wants the fixed liveness
+//  sets a negative threshold. In the simulator, 20 minutes of 5000 devices
+//  with 80 crashes:
+//
+//      link                detector        false expiries  detection p50/p99
+//      0.5 msecs           liveness 3            0           2.42/3.00 secs
+//                          threshold 6           8           1.94/2.92 secs
+//                          threshold 8           0           2.68/3.18 secs
+//      +400 msecs jitter   liveness 3          865           2.83/3.94 secs
+//                          threshold 7           0           5.35/7.29 secs
+//                          threshold 8           0           6.37/9.89 secs
+//
+//  With other seeds threshold 7 expired a live device on the jittery link,
+//  threshold 8 none.
+
+#define TYPES_CONFIG        "pnp-types.cfg"     //  TODO: this should be configured
+#define TYPE_NAME_MAX       32
+#define TYPE_CHILDREN_MAX   8
+#ifndef TYPE_THRESHOLD
+#define TYPE_THRESHOLD      8.0     //  Suspicion at which a resource expires, < 0 after liveness heartbeats
+#endif
+
+//  Capabilities
+#define TYPE_BROKER         0x01    //  Routes messages to backend resources
+#define TYPE_FORMING        0x02
+#define TYPE_INSPECTION     0x04
+#define TYPE_HANDLING       0x08
+#define TYPE_PRINTING       0x10
+
+typedef struct {
+    char name [TYPE_NAME_MAX];          //  Empty if the type is unknown
+    uint32_t capabilities;
+    size_t interval;                    //  Heartbeat interval, msecs
+    size_t liveness;                    //  Heartbeats missed before expiry
+    byte children [TYPE_CHILDREN_MAX];  //  Expected backend resource types, 0 terminated
+    double threshold;                   //  Suspicion at which it expires, < 0 after liveness heartbeats
+} type_t;
+
+static type_t s_types [256] = {
+    [010] = { "Line",           TYPE_BROKER,        1000, 3, { 013, 015 } },
+    [011] = { "Thermoformer",   TYPE_FORMING,       1000, 3 },
+    [012] = { "Robot Cell",     TYPE_HANDLING,      1000, 3 },
+    [013] = { "QAS",            TYPE_INSPECTION,    1000, 3 },
+    [014] = { "Ceiling",        TYPE_HANDLING,      1000, 3 },
+    [015] = { "Printing",       TYPE_PRINTING,      1000, 3 },
+};
+
+//  The init method gives every type the default heartbeat parameters it does
+//  not set. It runs from s_types_load, before a resource starts its threads,
+//  so looking a type up never writes to the registry; the watchdog and QAS
+//  threads look types up while the work loop does.
+static void
+s_types_init (void)
+{
+    int id;
+    for (id = 0; id < 256; id++) {
+        type_t *self = &s_types [id];
+        if (!self->interval)
+            self->interval = 1000;
+        if (!self->liveness)
+            self->liveness = 3;
+        if (!self->threshold)
+            self->threshold = TYPE_THRESHOLD;
+    }
+}
+
+//  The type method returns the registry entry of type <id>. Unknown types have
+//  an entry with an empty name and default heartbeat parameters.
+static type_t *
+s_type (byte id)
+{
+    return &s_types [id];
+}
+
+static const char *
+s_type_name (byte id)
+{
+    return s_types [id].name [0]? s_types [id].name: "unknown";
+}
+
+//  The of method returns the type of the resource that sent the ID <frame>, or 0
+//  for an empty frame
+static byte
+s_type_of (zframe_t *frame)
+{
+    return frame && zframe_size (frame) > 0? zframe_data (frame) [0]: 0;
+}
+
+//  The load method initialises the registry and applies the types in <filename>,
+//  if it exists. Returns the number of types loaded, or -1 if the file is
+//  malformed. Call it before starting any threads.
+static int
+s_types_load (const char *filename)
+{
+    s_types_init ();
+    if (!zsys_file_exists (filename))
+        return 0;
+    zconfig_t *root = zconfig_load (filename);
+    if (!root) {
+        printf ("E: cannot load types from %s\n", filename);
+        return -1;
+    }
+    int count = 0;
+    zconfig_t *section = zconfig_locate (root, "types");
+    zconfig_t *entry = section? zconfig_child (section): NULL;
+    for (; entry; entry = zconfig_next (entry)) {
+        long id = strtol (zconfig_get (entry, "id", "0"), NULL, 0);
+        if (id <= 0 || id > 255) {
+            printf ("E: type %s in %s has no valid id\n", zconfig_name (entry), filename);
+            continue;
+        }
+        type_t *type = s_type ((byte) id);
+        const char *value = zconfig_get (entry, "name", NULL);
+        if (value || !type->name [0])
+            snprintf (type->name, TYPE_NAME_MAX, "%s", value? value: zconfig_name (entry));
+        value = zconfig_get (entry, "capabilities", NULL);
+        if (value)
+            type->capabilities = strtoul (value, NULL, 0);
+        if (atoi (zconfig_get (entry, "interval", "0")) > 0)
+            type->interval = atoi (zconfig_get (entry, "interval", "0"));
+        if (atoi (zconfig_get (entry, "liveness", "0")) > 0)
+            type->liveness = atoi (zconfig_get (entry, "liveness", "0"));
+        if (atof (zconfig_get (entry, "threshold", "0")) != 0)
+            type->threshold = atof (zconfig_get (entry, "threshold", "0"));
+        const char *children = zconfig_get (entry, "children", NULL);
+        if (children) {
+            memset (type->children, 0, TYPE_CHILDREN_MAX);
+            char *next = (char *) children;
+            size_t child_nbr;
+            for (child_nbr = 0; child_nbr < TYPE_CHILDREN_MAX - 1 && *next; child_nbr++) {
+                long child = strtol (next, &next, 0);
+                if (child <= 0 || child > 255)
+                    break;
+                type->children [child_nbr] = (byte) child;
+                while (*next == ' ' || *next == ',')
+                    next++;
+            }
+        }
+        count++;
+    }
+    zconfig_destroy (&root);
+    printf ("I: loaded %d resource types from %s\n", count, filename);
+    return count;
+}
+
+#endif
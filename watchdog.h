@@ -0,0 +1,254 @@
+#ifndef PNP_WATCHDOG_THREAD
+#define PNP_WATCHDOG_THREAD "Pick-n-Pack Liveness Thread"
+
+//  The watchdog sends the heartbeats of a resource from a thread of its own,
+//  so a long operation in the work loop, e.g. an FPGA or camera call or a
+//  robot move, no longer delays heartbeats until the parent declares the
+//  resource dead and it reconnects. The watchdog thread owns the socket to
+//  the parent; the work loop uses an inproc PAIR socket as its frontend,
+//  which the watchdog forwards both ways, so the work loop code is the same
+//  with or without a watchdog.
+//
+//  The work loop shares its state and signal, and the time it last made
+//  progress, through atomics. Heartbeats report PNP_BUSY while the work loop
+//  runs an operation it announced with s_watchdog_busy. A work loop that
+//  made no progress for a heartbeat expiry and is not busy, or overran its
+//  announced operation, is stuck; heartbeats then carry PNP_ERR_HEARTBEAT
+//  in an ERROR frame, so the parent can tell a stuck resource from a busy
+//  or a dead one. The watchdog backs off its heartbeats while those of the
+//  parent come in steady, see accrual.h, and leaves them out while the work
+//  loop sends other messages and nothing changed.
+
+#include <stdatomic.h>
+
+#define WATCHDOG_BUSY_CONFIGURE 30000   //  msecs configuring may take at most, e.g. homing a robot
+#define WATCHDOG_BUSY_SAVE_RATE 10000   //  Bytes per msec a received blob is saved at least
+
+typedef struct {
+    zactor_t *actor;
+    char *endpoint;             //  Parent endpoint, used by the watchdog thread only
+    char *identity;             //  Our identity at the parent, NULL if the parent picks one
+    char pipe [64];             //  Endpoint for the PAIR socket of the work loop
+    byte type;                  //  Resource type, i.e. our ID byte
+    atomic_int state;           //  Latest state of the work loop
+    atomic_int signal;          //  Latest signal/command of the work loop
+    atomic_llong progress;      //  Time of last work loop iteration, msecs
+    atomic_llong busy_until;    //  Announced end of a long operation, 0 if none
+} watchdog_t;
+
+//  The heartbeat method of the watchdog thread sends ID, STATE, SIGNAL, an ERROR
+//  frame if the work loop is stuck, the status frame of the work loop if any, a
+//  CLOCK frame echoing the last heartbeat from the parent and, if we back off after
+//  <upstream>, an INTERVAL frame with the interval to our next heartbeat; <backoff> is NULL if
+//  we do not. A heartbeat without news is left out if <suppress> shows other messages to the
+//  parent just before; the interval only changes with a heartbeat that announces it.
+//  Returns the msecs to our next heartbeat.
+static size_t
+s_watchdog_send_heartbeat (watchdog_t *self, zsock_t *frontend, rtt_echo_t *echo, zframe_t **status_p,
+                           int *stuck, backoff_t *backoff, accrual_t *upstream, suppress_t *suppress)
+{
+    size_t interval = backoff? backoff->interval: s_type (self->type)->interval;
+    if (!atomic_load (&self->state))
+        return interval;        //  Work loop is not running yet
+    int64_t now = zclock_time ();
+    int64_t busy_until = atomic_load (&self->busy_until);
+    int64_t expiry = s_type (self->type)->interval * s_type (self->type)->liveness;
+    int was_stuck = *stuck;
+    *stuck = busy_until? now > busy_until: now - atomic_load (&self->progress) > expiry;
+    if (*stuck && !was_stuck)
+        printf ("E: work loop of %s is stuck\n", s_type_name (self->type));
+
+    char id [] = { (char) self->type, 0 };
+    char state [] = { (char) (busy_until? PNP_BUSY [0]: atomic_load (&self->state)), 0 };
+    char signal [] = { (char) atomic_load (&self->signal), 0 };
+    if (PNP_HEARTBEAT_SUPPRESSION
+    &&  !s_suppress_due (suppress, now, interval,
+                         (byte) state [0] << 16 | (byte) signal [0] << 8 | *stuck, status_p && *status_p))
+        return interval;
+    zmsg_t *msg = zmsg_new ();
+    zmsg_addmem (msg, id, sizeof (id));
+    zmsg_addmem (msg, state, sizeof (state));
+    zmsg_addmem (msg, signal, sizeof (signal));
+    if (*stuck) {
+        char error [] = { PNP_ERROR [0], PNP_ERR_HEARTBEAT [0] };
+        zmsg_addmem (msg, error, sizeof (error));
+    }
+    if (status_p && *status_p)
+        zmsg_append (msg, status_p);
+    zframe_t *frame = s_rtt_clock_frame (echo);
+    zmsg_append (msg, &frame);
+    if (backoff) {
+        interval = s_backoff_next (backoff, upstream, now);
+        frame = s_interval_frame (interval);
+        zmsg_append (msg, &frame);
+    }
+    zmsg_send (&msg, frontend);
+    return interval;
+}
+
+//  The watchdog thread forwards messages between the work loop and the parent
+//  and heartbeats at the interval of our type, backed off if PNP_HEARTBEAT_BACKOFF.
+//  Commands on its pipe:
+//  STATUS + frame sends a heartbeat with the status frame right away,
+//  RECONNECT reconnects to the parent.
+static void
+s_watchdog_actor (zsock_t *pipe, void *args)
+{
+    watchdog_t *self = (watchdog_t *) args;
+    s_affinity_pin (AFFINITY_WATCHDOG);
+    zsock_t *work = zsock_new_pair (self->pipe);
+    zsock_t *frontend = s_dealer_new (self->endpoint, self->identity);
+    assert (work && frontend);
+    //  The work loop connects to its end of the pair once we are running
+    snprintf (self->pipe, sizeof (self->pipe), ">inproc://watchdog-%p", (void *) self);
+    zsock_signal (pipe, 0);
+
+    rtt_echo_t echo = { 0 };
+    int stuck = 0;
+    suppress_t suppress = { 0 };
+    accrual_t upstream;
+    backoff_t backoff;
+    s_accrual_init (&upstream, s_type (self->type)->interval, zclock_time ());
+    s_backoff_init (&backoff, s_type (self->type)->interval);
+    int64_t heartbeat_at = zclock_time () + s_type (self->type)->interval;
+    while (!zsys_interrupted) {
+        zmq_pollitem_t items [] = {
+            { zsock_resolve (pipe), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (work), 0, ZMQ_POLLIN, 0 },
+            { zsock_resolve (frontend), 0, ZMQ_POLLIN, 0 }
+        };
+        int64_t timeout = heartbeat_at - zclock_time ();
+        if (zmq_poll (items, 3, (timeout > 0? timeout: 0) * ZMQ_POLL_MSEC) == -1)
+            break;              //  Interrupted
+        if (items [0].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (pipe);
+            if (!msg)
+                break;
+            char *command = zmsg_popstr (msg);
+            if (streq (command, "$TERM")) {
+                free (command);
+                zmsg_destroy (&msg);
+                break;
+            }
+            if (streq (command, "STATUS")) {
+                zframe_t *status = zmsg_pop (msg);
+                heartbeat_at = zclock_time () + s_watchdog_send_heartbeat (self, frontend, &echo, &status, &stuck,
+                                                                           PNP_HEARTBEAT_BACKOFF? &backoff: NULL,
+                                                                           &upstream, &suppress);
+            }
+            else
+            if (streq (command, "RECONNECT")) {
+                zsock_destroy (&frontend);
+                frontend = s_dealer_new (self->endpoint, self->identity);
+                s_accrual_init (&upstream, s_type (self->type)->interval, zclock_time ());
+                s_backoff_init (&backoff, s_type (self->type)->interval);
+                suppress = (suppress_t) { 0 };
+            }
+            free (command);
+            zmsg_destroy (&msg);
+        }
+        if (items [1].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (work);
+            if (msg) {
+                zmsg_send (&msg, frontend);
+                s_suppress_sent (&suppress, zclock_time ());
+            }
+        }
+        if (items [2].revents & ZMQ_POLLIN) {
+            zmsg_t *msg = zmsg_recv (frontend);
+            if (!msg)
+                break;
+            s_accrual_alive (&upstream, zclock_time ());
+            //  Keep the parent timestamp, to echo it in our next heartbeat
+            zframe_t *frame = zmsg_first (msg);
+            if (frame && zframe_size (frame) > 0
+            && (zframe_data (frame) [0] == PNP_READY [0] || zframe_data (frame) [0] == PNP_HEARTBEAT [0])) {
+                frame = s_msg_extension (msg, PNP_CLOCK);
+                if (frame)
+                    s_rtt_stamp (&echo, frame);
+                s_accrual_heartbeat (&upstream, zclock_time (), 0);
+            }
+            zmsg_send (&msg, work);
+        }
+        if (zclock_time () >= heartbeat_at) {
+            heartbeat_at = zclock_time () + s_watchdog_send_heartbeat (self, frontend, &echo, NULL, &stuck,
+                                                                       PNP_HEARTBEAT_BACKOFF? &backoff: NULL,
+                                                                       &upstream, &suppress);
+        }
+    }
+    zsock_destroy (&frontend);
+    zsock_destroy (&work);
+}
+
+//  Construct new watchdog for a resource of <type> connected to its parent at
+//  <endpoint> under <identity>, or NULL to let the parent pick one. The work loop connects a PAIR socket to its pipe endpoint and uses
+//  that as frontend.
+static watchdog_t *
+s_watchdog_new (byte type, const char *endpoint, const char *identity)
+{
+    watchdog_t *self = (watchdog_t *) zmalloc (sizeof (watchdog_t));
+    self->type = type;
+    self->endpoint = strdup (endpoint);
+    self->identity = identity? strdup (identity): NULL;
+    snprintf (self->pipe, sizeof (self->pipe), "@inproc://watchdog-%p", (void *) self);
+    atomic_store (&self->progress, zclock_time ());
+    self->actor = zactor_new (s_watchdog_actor, self);
+    assert (self->actor);
+    return self;
+}
+
+static void
+s_watchdog_destroy (watchdog_t **self_p)
+{
+    assert (self_p);
+    if (*self_p) {
+        watchdog_t *self = *self_p;
+        zactor_destroy (&self->actor);
+        free (self->endpoint);
+        free (self->identity);
+        free (self);
+        *self_p = NULL;
+    }
+}
+
+//  The progress method tells the watchdog the work loop is alive, it is called
+//  once per iteration. Does nothing if <self> is NULL.
+static void
+s_watchdog_progress (watchdog_t *self)
+{
+    if (self)
+        atomic_store (&self->progress, zclock_time ());
+}
+
+//  The busy method announces a long operation that takes up to <msecs>, or its
+//  end if <msecs> is 0. Heartbeats report PNP_BUSY meanwhile.
+static void
+s_watchdog_busy (watchdog_t *self, int64_t msecs)
+{
+    if (!self)
+        return;
+    atomic_store (&self->busy_until, msecs? zclock_time () + msecs: 0);
+    atomic_store (&self->progress, zclock_time ());
+}
+
+//  The heartbeat method hands the state and signal of the work loop to the
+//  watchdog, and a status frame if any, which goes out right away
+static void
+s_watchdog_heartbeat (watchdog_t *self, byte state, byte signal, zframe_t **status_p)
+{
+    atomic_store (&self->state, state);
+    atomic_store (&self->signal, signal);
+    if (status_p && *status_p) {
+        zstr_sendm (self->actor, "STATUS");
+        zframe_send (status_p, self->actor, 0);
+    }
+}
+
+//  The reconnect method makes the watchdog reconnect to the parent
+static void
+s_watchdog_reconnect (watchdog_t *self)
+{
+    zstr_send (self->actor, "RECONNECT");
+}
+
+#endif